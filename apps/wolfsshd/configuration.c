@@ -82,6 +82,8 @@ struct WOLFSSHD_CONFIG {
     char* pidFile;
     WOLFSSHD_CONFIG* next; /* next config in list */
     long  loginTimer;
+    word32 sessionRate;   /* bytes per second each way, 0 for no limit */
+    word32 channelRate;   /* bytes per second each way, 0 for no limit */
     word16 port;
     byte usePrivilegeSeparation:2;
     byte passwordAuth:1;
@@ -279,6 +281,8 @@ static WOLFSSHD_CONFIG* wolfSSHD_ConfigCopy(WOLFSSHD_CONFIG* conf)
 
         if (ret == WS_SUCCESS) {
             newConf->loginTimer   = conf->loginTimer;
+            newConf->sessionRate  = conf->sessionRate;
+            newConf->channelRate  = conf->channelRate;
             newConf->port         = conf->port;
             newConf->passwordAuth = conf->passwordAuth;
             newConf->pubKeyAuth   = conf->pubKeyAuth;
@@ -350,9 +354,11 @@ enum {
     OPT_TRUSTED_USER_CA_KEYS    = 21,
     OPT_PIDFILE                 = 22,
     OPT_BANNER                  = 23,
+    OPT_SESSION_RATE_LIMIT      = 24,
+    OPT_CHANNEL_RATE_LIMIT      = 25,
 };
 enum {
-    NUM_OPTIONS = 24
+    NUM_OPTIONS = 26
 };
 
 static const CONFIG_OPTION options[NUM_OPTIONS] = {
@@ -380,6 +386,8 @@ static const CONFIG_OPTION options[NUM_OPTIONS] = {
     {OPT_TRUSTED_USER_CA_KEYS,    "TrustedUserCAKeys"},
     {OPT_PIDFILE,                 "PidFile"},
     {OPT_BANNER,                  "Banner"},
+    {OPT_SESSION_RATE_LIMIT,      "SessionRateLimit"},
+    {OPT_CHANNEL_RATE_LIMIT,      "ChannelRateLimit"},
 };
 
 /* returns WS_SUCCESS on success */
@@ -578,6 +586,35 @@ static int HandlePort(WOLFSSHD_CONFIG* conf, const char* value)
     return ret;
 }
 
+/* returns WS_SUCCESS on success, the rate is in bytes per second and 0 turns
+ * the limit off */
+static int HandleRateLimit(WOLFSSHD_CONFIG* conf, const char* value,
+        word32* rate)
+{
+    int ret = WS_SUCCESS;
+    long num;
+
+    if (conf == NULL || value == NULL) {
+        ret = WS_BAD_ARGUMENT;
+    }
+
+    if (ret == WS_SUCCESS) {
+        num = GetConfigInt(value, (int)WSTRLEN(value), 0, conf->heap);
+        if (num < 0 || (word64)num > 0xFFFFFFFFUL) {
+            wolfSSH_Log(WS_LOG_ERROR, "[SSHD] Invalid rate limit: %s.",
+                        value);
+            ret = WS_BAD_ARGUMENT;
+        }
+        else {
+            *rate = (word32)num;
+            wolfSSH_Log(WS_LOG_INFO, "[SSHD] Setting rate limit to %ld "
+                        "bytes per second", num);
+        }
+    }
+
+    return ret;
+}
+
 static int HandleInclude(WOLFSSHD_CONFIG *conf, const char *value)
 {
     const char *ptr;
@@ -1027,6 +1064,12 @@ static int HandleConfigOption(WOLFSSHD_CONFIG** conf, int opt,
         case OPT_BANNER:
             ret = SetFileString(&(*conf)->banner, value, (*conf)->heap);
             break;
+        case OPT_SESSION_RATE_LIMIT:
+            ret = HandleRateLimit(*conf, value, &(*conf)->sessionRate);
+            break;
+        case OPT_CHANNEL_RATE_LIMIT:
+            ret = HandleRateLimit(*conf, value, &(*conf)->channelRate);
+            break;
         default:
             break;
     }
@@ -1453,6 +1496,28 @@ long wolfSSHD_ConfigGetGraceTime(const WOLFSSHD_CONFIG* conf)
     return ret;
 }
 
+word32 wolfSSHD_ConfigGetSessionRate(const WOLFSSHD_CONFIG* conf)
+{
+    word32 ret = 0;
+
+    if (conf != NULL) {
+        ret = conf->sessionRate;
+    }
+
+    return ret;
+}
+
+word32 wolfSSHD_ConfigGetChannelRate(const WOLFSSHD_CONFIG* conf)
+{
+    word32 ret = 0;
+
+    if (conf != NULL) {
+        ret = conf->channelRate;
+    }
+
+    return ret;
+}
+
 
 /* Used to save out the PID of SSHD to a file */
 void wolfSSHD_ConfigSavePID(const WOLFSSHD_CONFIG* conf)
@@ -180,6 +180,14 @@ static int test_ParseConfigLine(void)
         {"Valid login grace time hours", "LoginGraceTime 1h", 0},
         {"Invalid login grace time", "LoginGraceTime wolfsshd", 1},
 
+        /* Rate limit tests. */
+        {"Valid session rate limit", "SessionRateLimit 1048576", 0},
+        {"Session rate limit off", "SessionRateLimit 0", 0},
+        {"Negative session rate limit", "SessionRateLimit -1", 1},
+        {"Invalid session rate limit", "SessionRateLimit wolfsshd", 1},
+        {"Valid channel rate limit", "ChannelRateLimit 65536", 0},
+        {"Invalid channel rate limit", "ChannelRateLimit wolfsshd", 1},
+
         /* Permit empty password tests. */
         {"Permit empty password no", "PermitEmptyPasswords no", 0},
         {"Permit empty password yes", "PermitEmptyPasswords yes", 0},
@@ -518,6 +518,27 @@ static int SetupChroot(WOLFSSHD_CONFIG* usrConf)
 }
 #endif
 
+#if defined(WOLFSSH_SCP) || defined(WOLFSSH_SFTP)
+/* Waits on the socket for up to toSec seconds, but no longer than the
+ * rate limits hold data back. rateWake is set when the wait ended because
+ * they let the data move, the caller then retries the read or send. */
+static int RateLimitSelect(WOLFSSH* ssh, WS_SOCKET_T fd, int toSec,
+        int* rateWake)
+{
+    word32 toMs = (toSec > 0) ? (word32)toSec * 1000 : 0;
+    word32 rateWait;
+    int rateDue;
+    int ret;
+
+    rateWait = wolfSSH_GetRateLimitWait(ssh);
+    rateDue = (rateWait <= toMs);
+    ret = tcp_select_ms(fd, (int)(rateDue ? rateWait : toMs));
+    *rateWake = (rateDue && ret == WS_SELECT_TIMEOUT);
+
+    return ret;
+}
+#endif
+
 #ifdef WOLFSSH_SCP
 static int SCP_Subsystem(WOLFSSHD_CONNECTION* conn, WOLFSSH* ssh,
     WPASSWD* pPasswd, WOLFSSHD_CONFIG* usrConf)
@@ -525,6 +546,7 @@ static int SCP_Subsystem(WOLFSSHD_CONNECTION* conn, WOLFSSH* ssh,
     int ret   = WS_SUCCESS;
     int error = WS_SUCCESS;
     int select_ret = 0;
+    int rateWake = 0;
 
 #ifndef _WIN32
     /* temporarily elevate permissions to get users information */
@@ -573,10 +595,12 @@ static int SCP_Subsystem(WOLFSSHD_CONNECTION* conn, WOLFSSH* ssh,
         while (ret != WS_SUCCESS && ret != WS_SCP_COMPLETE
                 && (error == WS_WANT_READ || error == WS_WANT_WRITE)) {
 
-            select_ret = tcp_select(conn->fd, 1);
+            /* Window or data held back by the rate limits moves when
+             * the wait for them is over, not when the socket is ready. */
+            select_ret = RateLimitSelect(ssh, conn->fd, 1, &rateWake);
             if (select_ret == WS_SELECT_RECV_READY  ||
                 select_ret == WS_SELECT_ERROR_READY ||
-                error      == WS_WANT_WRITE)
+                error      == WS_WANT_WRITE || rateWake)
             {
                 ret = wolfSSH_accept(ssh);
                 error = wolfSSH_get_error(ssh);
@@ -617,6 +641,7 @@ static int SFTP_Subsystem(WOLFSSHD_CONNECTION* conn, WOLFSSH* ssh,
     int error = WS_SUCCESS;
     WS_SOCKET_T sockfd;
     int select_ret = 0;
+    int rateWake = 0;
     int timeout = TEST_SFTP_TIMEOUT_NONE;
     byte peek_buf[1];
 
@@ -731,12 +756,12 @@ static int SFTP_Subsystem(WOLFSSHD_CONNECTION* conn, WOLFSSH* ssh,
                 }
             }
 
-            select_ret = tcp_select(sockfd, timeout);
+            select_ret = RateLimitSelect(ssh, sockfd, timeout, &rateWake);
             if (select_ret == WS_SELECT_ERROR_READY) {
                 break;
             }
 
-            if (ret == WS_WANT_READ || ret == WS_WANT_WRITE ||
+            if (ret == WS_WANT_READ || ret == WS_WANT_WRITE || rateWake ||
                     select_ret == WS_SELECT_RECV_READY) {
                 ret = wolfSSH_worker(ssh, NULL);
                 error = wolfSSH_get_error(ssh);
@@ -1457,19 +1482,27 @@ static int SHELL_Subsystem(WOLFSSHD_CONNECTION* conn, WOLFSSH* ssh,
         int cnt_r;
         int cnt_w;
         int pending = 0;
+        int rateWake = 0;
+        word32 rateWait;
+        struct timeval rateTimeout;
 
         FD_ZERO(&readFds);
         FD_SET(sshFd, &readFds);
         maxFd = sshFd;
 
+        /* Data held back by the rate limits moves after a timeout, not
+         * when the socket is writable. */
+        rateWait = wolfSSH_GetRateLimitWait(ssh);
+
         FD_ZERO(&writeFds);
-        if (windowFull || wantWrite) {
+        if (wantWrite || (windowFull && rateWait == WOLFSSH_RATE_NO_WAIT)) {
             FD_SET(sshFd, &writeFds);
         }
 
         if (wolfSSH_stream_peek(ssh, tmp, 1) <= 0) {
-            /* select on stdout/stderr pipes with forced commands */
-            if (forcedCmd) {
+            /* select on stdout/stderr pipes with forced commands, no more
+             * output is taken until the held back data is sent */
+            if (forcedCmd && !windowFull) {
                 FD_SET(stdoutPipe[0], &readFds);
                 if (stdoutPipe[0] > maxFd)
                     maxFd = stdoutPipe[0];
@@ -1478,21 +1511,28 @@ static int SHELL_Subsystem(WOLFSSHD_CONNECTION* conn, WOLFSSH* ssh,
                 if (stderrPipe[0] > maxFd)
                     maxFd = stderrPipe[0];
             }
-            else {
+            else if (!windowFull) {
                 FD_SET(childFd, &readFds);
                 if (childFd > maxFd)
                     maxFd = childFd;
             }
 
-            rc = select((int)maxFd + 1, &readFds, &writeFds, NULL, NULL);
+            if (rateWait != WOLFSSH_RATE_NO_WAIT) {
+                rateTimeout.tv_sec = rateWait / 1000;
+                rateTimeout.tv_usec = (rateWait % 1000) * 1000;
+            }
+            rc = select((int)maxFd + 1, &readFds, &writeFds, NULL,
+                    (rateWait != WOLFSSH_RATE_NO_WAIT) ? &rateTimeout : NULL);
             if (rc == -1)
                 break;
+            rateWake = (rc == 0);
         }
         else {
             pending = 1; /* found some pending SSH data */
         }
 
-        if (wantWrite || windowFull || pending || FD_ISSET(sshFd, &readFds)) {
+        if (wantWrite || windowFull || pending || rateWake ||
+                FD_ISSET(sshFd, &readFds)) {
             word32 lastChannel = 0;
 
             wantWrite = 0;
@@ -1782,6 +1822,41 @@ static int UserAuthResult(byte result,
     return WS_SUCCESS;
 }
 
+/* applies the user's SessionRateLimit and ChannelRateLimit, the same rate
+ * both ways, to the session and to the channels it already has open */
+static int SetUserRateLimit(WOLFSSH* ssh, const WOLFSSHD_CONFIG* usrConf)
+{
+    WS_RateLimit session;
+    WS_RateLimit channel;
+    WOLFSSH_CHANNEL* current;
+    int ret;
+
+    WMEMSET(&session, 0, sizeof(session));
+    session.txRate = wolfSSHD_ConfigGetSessionRate(usrConf);
+    session.rxRate = session.txRate;
+    WMEMSET(&channel, 0, sizeof(channel));
+    channel.txRate = wolfSSHD_ConfigGetChannelRate(usrConf);
+    channel.rxRate = channel.txRate;
+
+    if (session.txRate == 0 && channel.txRate == 0) {
+        return WS_SUCCESS;
+    }
+
+    ret = wolfSSH_SetRateLimit(ssh, &session, &channel);
+    current = wolfSSH_ChannelNext(ssh, NULL);
+    while (ret == WS_SUCCESS && current != NULL) {
+        ret = wolfSSH_ChannelSetRateLimit(current, &channel);
+        current = wolfSSH_ChannelNext(ssh, current);
+    }
+
+    if (ret == WS_SUCCESS) {
+        wolfSSH_Log(WS_LOG_INFO, "[SSHD] Rate limits session %u, channel %u "
+                    "bytes per second", session.txRate, channel.txRate);
+    }
+
+    return ret;
+}
+
 /* handle wolfSSH accept and directing to correct subsystem */
 #ifdef _WIN32
 static DWORD HandleConnection(void* arg)
@@ -1884,6 +1959,11 @@ static void* HandleConnection(void* arg)
                 "[SSHD] Error getting user configuration");
             ret = WS_FATAL_ERROR;
         }
+        else if (SetUserRateLimit(ssh, usrConf) != WS_SUCCESS) {
+            wolfSSH_Log(WS_LOG_ERROR,
+                "[SSHD] Error setting user rate limits");
+            ret = WS_FATAL_ERROR;
+        }
 
     #ifndef WIN32
         if (ret == WS_SUCCESS || ret == WS_SFTP_COMPLETE ||
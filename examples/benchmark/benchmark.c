@@ -0,0 +1,366 @@
+/* benchmark.c
+ *
+ * Copyright (C) 2025 wolfSSL Inc.
+ *
+ * This file is part of wolfSSH.
+ *
+ * wolfSSH is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfSSH is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wolfSSH.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Handshake benchmark. Runs complete client/server handshakes, through
+ * user authentication and opening a session channel, over an in-memory
+ * connection in a single thread and reports handshakes per second. There
+ * is no network I/O, so the result is the cost of the protocol and crypto.
+ * Besides the rate, it reports the time per handshake the server spent in
+ * wolfSSH_accept(), which is what offloading the signature takes off the
+ * session's thread.
+ *
+ * Run it from the wolfSSH root directory so it can find ./keys. Building
+ * wolfSSH with WOLFSSH_NO_HOST_KEY_CACHE defined gives the baseline where
+ * each handshake decodes the server's host key.
+ *
+ *     benchmark [-n count] [-e] [-o] [-x kexList]
+ *         -n  number of handshakes, default 100
+ *         -e  use the ECDSA host key instead of RSA
+ *         -o  also run with the host key signature offloaded, the loop
+ *             plays the worker, and compare with signing in line
+ *         -x  server's key exchange algorithm list
+ */
+
+#ifdef HAVE_CONFIG_H
+    #include <config.h>
+#endif
+
+#ifdef WOLFSSL_USER_SETTINGS
+    #include <wolfssl/wolfcrypt/settings.h>
+#else
+    #include <wolfssl/options.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <wolfssh/ssh.h>
+#include <wolfssh/port.h>
+
+
+#define BENCH_PIPE_SZ (256 * 1024)
+#define BENCH_DEFAULT_COUNT 100
+#define BENCH_MAX_ROUNDS 10000
+#define BENCH_KEY_SZ 4096
+
+
+typedef struct BenchPipe {
+    byte buf[BENCH_PIPE_SZ];
+    word32 sz;
+} BenchPipe;
+
+typedef struct BenchLink {
+    BenchPipe* in;
+    BenchPipe* out;
+} BenchLink;
+
+
+static BenchPipe clientToServer;
+static BenchPipe serverToClient;
+static WOLFSSH* signPending;
+
+
+static int BenchRecv(WOLFSSH* ssh, void* data, word32 sz, void* ctx)
+{
+    BenchPipe* pipe = ((BenchLink*)ctx)->in;
+
+    (void)ssh;
+
+    if (pipe->sz == 0)
+        return WS_CBIO_ERR_WANT_READ;
+
+    if (sz > pipe->sz)
+        sz = pipe->sz;
+    WMEMCPY(data, pipe->buf, sz);
+    pipe->sz -= sz;
+    WMEMMOVE(pipe->buf, pipe->buf + sz, pipe->sz);
+
+    return (int)sz;
+}
+
+
+static int BenchSend(WOLFSSH* ssh, void* data, word32 sz, void* ctx)
+{
+    BenchPipe* pipe = ((BenchLink*)ctx)->out;
+
+    (void)ssh;
+
+    if (pipe->sz == BENCH_PIPE_SZ)
+        return WS_CBIO_ERR_WANT_WRITE;
+
+    if (sz > BENCH_PIPE_SZ - pipe->sz)
+        sz = BENCH_PIPE_SZ - pipe->sz;
+    WMEMCPY(pipe->buf + pipe->sz, data, sz);
+    pipe->sz += sz;
+
+    return (int)sz;
+}
+
+
+static int BenchUserAuth(byte authType, WS_UserAuthData* authData, void* ctx)
+{
+    static char password[] = "upthehill";
+
+    (void)ctx;
+
+    if (authType != WOLFSSH_USERAUTH_PASSWORD)
+        return WOLFSSH_USERAUTH_INVALID_AUTHTYPE;
+
+    /* The client fills in the password; the server accepts anyone. */
+    if (authData->sf.password.password == NULL) {
+        authData->sf.password.password = (byte*)password;
+        authData->sf.password.passwordSz = (word32)WSTRLEN(password);
+    }
+
+    return WOLFSSH_USERAUTH_SUCCESS;
+}
+
+
+/* Queues the session's signature for the handshake loop to run. A real
+ * server would hand the session to a worker thread here. */
+static int BenchSignOffload(WOLFSSH* ssh, void* ctx)
+{
+    (void)ctx;
+
+    signPending = ssh;
+
+    return WS_SUCCESS;
+}
+
+
+static word32 LoadKey(const char* fileName, byte* buf, word32 bufSz)
+{
+    FILE* file;
+    size_t readSz;
+
+    file = fopen(fileName, "rb");
+    if (file == NULL)
+        return 0;
+    readSz = fread(buf, 1, bufSz, file);
+    fclose(file);
+
+    return (readSz < bufSz) ? (word32)readSz : 0;
+}
+
+
+static double CurrentTime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+
+static int IsPending(WOLFSSH* ssh, int ret)
+{
+    if (ret == WS_SUCCESS)
+        return 0;
+    ret = wolfSSH_get_error(ssh);
+
+    return ret == WS_WANT_READ || ret == WS_WANT_WRITE
+        || ret == WS_WANT_CRYPTO;
+}
+
+
+/* Runs one handshake, alternating between the two sides until both are
+ * done. Adds the time spent in wolfSSH_accept() to acceptTime. Returns
+ * WS_SUCCESS or the first failing side's error. */
+static int Handshake(WOLFSSH_CTX* serverCtx, WOLFSSH_CTX* clientCtx,
+        double* acceptTime)
+{
+    WOLFSSH* server;
+    WOLFSSH* client;
+    BenchLink serverLink = { &clientToServer, &serverToClient };
+    BenchLink clientLink = { &serverToClient, &clientToServer };
+    int serverRet = WS_FATAL_ERROR;
+    int clientRet = WS_FATAL_ERROR;
+    int rounds = 0;
+    int ret = WS_SUCCESS;
+    double start;
+
+    clientToServer.sz = 0;
+    serverToClient.sz = 0;
+
+    server = wolfSSH_new(serverCtx);
+    client = wolfSSH_new(clientCtx);
+    if (server == NULL || client == NULL)
+        ret = WS_MEMORY_E;
+
+    if (ret == WS_SUCCESS) {
+        wolfSSH_SetIOReadCtx(server, &serverLink);
+        wolfSSH_SetIOWriteCtx(server, &serverLink);
+        wolfSSH_SetIOReadCtx(client, &clientLink);
+        wolfSSH_SetIOWriteCtx(client, &clientLink);
+        ret = wolfSSH_SetUsername(client, "jill");
+    }
+
+    while (ret == WS_SUCCESS
+            && (serverRet != WS_SUCCESS || clientRet != WS_SUCCESS)) {
+        if (clientRet != WS_SUCCESS) {
+            clientRet = wolfSSH_connect(client);
+            if (!IsPending(client, clientRet) && clientRet != WS_SUCCESS)
+                ret = wolfSSH_get_error(client);
+        }
+        if (ret == WS_SUCCESS && signPending != NULL) {
+            ret = wolfSSH_SignOffload(signPending);
+            signPending = NULL;
+        }
+        if (ret == WS_SUCCESS && serverRet != WS_SUCCESS) {
+            start = CurrentTime();
+            serverRet = wolfSSH_accept(server);
+            *acceptTime += CurrentTime() - start;
+            if (!IsPending(server, serverRet) && serverRet != WS_SUCCESS)
+                ret = wolfSSH_get_error(server);
+        }
+        if (++rounds > BENCH_MAX_ROUNDS)
+            ret = WS_FATAL_ERROR;
+    }
+
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+
+    return ret;
+}
+
+
+/* Times count handshakes, with the signature offloaded or not, and
+ * prints the results. */
+static int RunPass(WOLFSSH_CTX* serverCtx, WOLFSSH_CTX* clientCtx,
+        int count, int offload, const char* keyName)
+{
+    double start, elapsed;
+    double acceptTime = 0.0;
+    int ret;
+    int i;
+
+    wolfSSH_CTX_SetSignOffloadCb(serverCtx,
+            offload ? BenchSignOffload : NULL);
+
+    /* One untimed handshake to warm up. */
+    ret = Handshake(serverCtx, clientCtx, &acceptTime);
+    acceptTime = 0.0;
+
+    start = CurrentTime();
+    for (i = 0; ret == WS_SUCCESS && i < count; i++) {
+        ret = Handshake(serverCtx, clientCtx, &acceptTime);
+    }
+    elapsed = CurrentTime() - start;
+
+    if (ret == WS_SUCCESS) {
+        printf("%d handshakes, %s host key, host key cache %s, "
+                "signature %s\n", count,
+                (WSTRSTR(keyName, "ecc") != NULL) ? "ECDSA" : "RSA",
+            #ifndef WOLFSSH_NO_HOST_KEY_CACHE
+                "on",
+            #else
+                "off",
+            #endif
+                offload ? "offloaded" : "in line");
+        printf("%.3f seconds, %.1f handshakes/sec, "
+                "%.3f ms in accept per handshake\n",
+                elapsed, (elapsed > 0.0) ? count / elapsed : 0.0,
+                acceptTime * 1000.0 / count);
+    }
+
+    return ret;
+}
+
+
+int main(int argc, char** argv)
+{
+    WOLFSSH_CTX* serverCtx = NULL;
+    WOLFSSH_CTX* clientCtx = NULL;
+    const char* keyName = "./keys/server-key-rsa.der";
+    const char* kexList = NULL;
+    byte key[BENCH_KEY_SZ];
+    word32 keySz;
+    int count = BENCH_DEFAULT_COUNT;
+    int offload = 0;
+    int ret = WS_SUCCESS;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (WSTRCMP(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        }
+        else if (WSTRCMP(argv[i], "-e") == 0) {
+            keyName = "./keys/server-key-ecc.der";
+        }
+        else if (WSTRCMP(argv[i], "-o") == 0) {
+            offload = 1;
+        }
+        else if (WSTRCMP(argv[i], "-x") == 0 && i + 1 < argc) {
+            kexList = argv[++i];
+        }
+        else {
+            printf("usage: %s [-n count] [-e] [-o] [-x kexList]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (count <= 0)
+        count = BENCH_DEFAULT_COUNT;
+
+    keySz = LoadKey(keyName, key, sizeof(key));
+    if (keySz == 0) {
+        printf("Couldn't load %s, run from the wolfSSH root.\n", keyName);
+        return EXIT_FAILURE;
+    }
+
+    wolfSSH_Init();
+
+    serverCtx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_SERVER, NULL);
+    clientCtx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_CLIENT, NULL);
+    if (serverCtx == NULL || clientCtx == NULL)
+        ret = WS_MEMORY_E;
+
+    if (ret == WS_SUCCESS)
+        ret = wolfSSH_CTX_UsePrivateKey_buffer(serverCtx, key, keySz,
+                WOLFSSH_FORMAT_ASN1);
+    if (ret == WS_SUCCESS && kexList != NULL)
+        ret = wolfSSH_CTX_SetAlgoListKex(serverCtx, kexList);
+    if (ret == WS_SUCCESS) {
+        wolfSSH_SetIORecv(serverCtx, BenchRecv);
+        wolfSSH_SetIOSend(serverCtx, BenchSend);
+        wolfSSH_SetIORecv(clientCtx, BenchRecv);
+        wolfSSH_SetIOSend(clientCtx, BenchSend);
+        wolfSSH_SetUserAuth(serverCtx, BenchUserAuth);
+        wolfSSH_SetUserAuth(clientCtx, BenchUserAuth);
+    }
+
+    /* The in line pass is the baseline for the offloaded one. */
+    if (ret == WS_SUCCESS)
+        ret = RunPass(serverCtx, clientCtx, count, 0, keyName);
+    if (ret == WS_SUCCESS && offload)
+        ret = RunPass(serverCtx, clientCtx, count, 1, keyName);
+
+    if (ret != WS_SUCCESS) {
+        printf("Handshake failed: %d (%s)\n", ret, wolfSSH_ErrorToName(ret));
+    }
+
+    wolfSSH_CTX_free(clientCtx);
+    wolfSSH_CTX_free(serverCtx);
+    wolfSSH_Cleanup();
+
+    return (ret == WS_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
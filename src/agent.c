@@ -425,7 +425,7 @@ static int PostAddRsaId(WOLFSSH_AGENT_CTX* agent,
         ret = WS_MEMORY_E;
 
     if (ret == WS_SUCCESS) {
-        ret = wc_InitSha256(&sha);
+        ret = wc_InitSha256_ex(&sha, agent->heap, agent->devId);
         if (ret == 0)
             ret = wc_Sha256Update(&sha, key, nSz + eSz + (LENGTH_SZ * 2));
         if (ret == 0)
@@ -506,7 +506,7 @@ static int PostAddEcdsaId(WOLFSSH_AGENT_CTX* agent,
         ret = WS_MEMORY_E;
 
     if (ret == WS_SUCCESS) {
-        ret = wc_InitSha256(&sha);
+        ret = wc_InitSha256_ex(&sha, agent->heap, agent->devId);
         if (ret == 0)
             ret = wc_Sha256Update(&sha, key,
                     curveNameSz + qSz + (LENGTH_SZ * 2));
@@ -573,7 +573,7 @@ static int PostRemoveId(WOLFSSH_AGENT_CTX* agent,
     if (ret == WS_SUCCESS) {
         wc_Sha256 sha;
 
-        ret = wc_InitSha256(&sha);
+        ret = wc_InitSha256_ex(&sha, agent->heap, agent->devId);
         if (ret == 0)
             ret = wc_Sha256Update(&sha, keyBlob, keyBlobSz);
         if (ret == 0)
@@ -641,14 +641,15 @@ static int PostRequestIds(WOLFSSH_AGENT_CTX* agent)
 }
 
 
-static WOLFSSH_AGENT_ID* FindKeyId(WOLFSSH_AGENT_ID* id,
+static WOLFSSH_AGENT_ID* FindKeyId(WOLFSSH_AGENT_CTX* agent,
         const byte* keyBlob, word32 keyBlobSz)
 {
+    WOLFSSH_AGENT_ID* id = agent->idList;
     int ret;
     wc_Sha256 sha;
     byte digest[WC_SHA256_DIGEST_SIZE];
 
-    ret = wc_InitSha256(&sha);
+    ret = wc_InitSha256_ex(&sha, agent->heap, agent->devId);
     if (ret == 0)
         ret = wc_Sha256Update(&sha, keyBlob, keyBlobSz);
     if (ret == 0) {
@@ -673,14 +674,14 @@ static WOLFSSH_AGENT_ID* FindKeyId(WOLFSSH_AGENT_ID* id,
 
 static int SignHashRsa(WOLFSSH_AGENT_KEY_RSA* rawKey, enum wc_HashType hashType,
         const byte* digest, word32 digestSz, byte* sig, word32* sigSz,
-        WC_RNG* rng, void* heap)
+        WC_RNG* rng, void* heap, int devId)
 {
     RsaKey key;
     byte encSig[MAX_ENCODED_SIG_SZ];
     int encSigSz;
     int ret = 0;
 
-    wc_InitRsaKey(&key, heap);
+    wc_InitRsaKey_ex(&key, heap, devId);
     mp_read_unsigned_bin(&key.n, rawKey->n, rawKey->nSz);
     mp_read_unsigned_bin(&key.e, rawKey->e, rawKey->eSz);
     mp_read_unsigned_bin(&key.d, rawKey->d, rawKey->dSz);
@@ -723,13 +724,15 @@ static int SignHashRsa(WOLFSSH_AGENT_KEY_RSA* rawKey, enum wc_HashType hashType,
 
 static int SignHashEcc(WOLFSSH_AGENT_KEY_ECDSA* rawKey, int curveId,
         const byte* digest, word32 digestSz,
-        byte* sig, word32* sigSz, WC_RNG* rng)
+        byte* sig, word32* sigSz, WC_RNG* rng, void* heap, int devId)
 {
     ecc_key key;
     int ret;
 
-    ret = wc_ecc_import_private_key_ex(rawKey->d, rawKey->dSz,
-            rawKey->q, rawKey->qSz, &key, curveId);
+    ret = wc_ecc_init_ex(&key, heap, devId);
+    if (ret == 0)
+        ret = wc_ecc_import_private_key_ex(rawKey->d, rawKey->dSz,
+                rawKey->q, rawKey->qSz, &key, curveId);
 
     if (ret == 0) {
         ret = wc_ecc_sign_hash(digest, digestSz, sig, sigSz, rng, &key);
@@ -800,7 +803,7 @@ static int PostSignRequest(WOLFSSH_AGENT_CTX* agent,
         ret = WS_BAD_ARGUMENT;
 
     if (ret == WS_SUCCESS) {
-        if ((id = FindKeyId(agent->idList, keyBlob, keyBlobSz)) == NULL) {
+        if ((id = FindKeyId(agent, keyBlob, keyBlobSz)) == NULL) {
             WLOG(WS_LOG_AGENT, "Sign: Key not found.");
             ret = WS_AGENT_NO_KEY_E;
         }
@@ -852,7 +855,8 @@ static int PostSignRequest(WOLFSSH_AGENT_CTX* agent,
     }
 
     if (ret == WS_SUCCESS) {
-        ret = wc_Hash(hashType, data, dataSz, digest, digestSz);
+        ret = wc_Hash_ex(hashType, data, dataSz, digest, digestSz,
+                agent->heap, agent->devId);
         if (ret != 0)
             ret = WS_CRYPTO_FAILED;
     }
@@ -862,7 +866,8 @@ static int PostSignRequest(WOLFSSH_AGENT_CTX* agent,
     !defined(WOLFSSH_NO_RSA_SHA2_512)
         if (signRsa)
             ret = SignHashRsa(&id->key.rsa, hashType,
-                    digest, digestSz, sig, &sigSz, &agent->rng, agent->heap);
+                    digest, digestSz, sig, &sigSz, &agent->rng, agent->heap,
+                    agent->devId);
 #else
     WOLFSSH_UNUSED(signRsa);
 #endif
@@ -871,7 +876,7 @@ static int PostSignRequest(WOLFSSH_AGENT_CTX* agent,
     !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP521)
         if (signEcc)
             ret = SignHashEcc(&id->key.ecdsa, curveId, digest, digestSz,
-                    sig, &sigSz, &agent->rng);
+                    sig, &sigSz, &agent->rng, agent->heap, agent->devId);
 #else
     WOLFSSH_UNUSED(signEcc);
 #endif
@@ -1470,6 +1475,7 @@ static WOLFSSH_AGENT_CTX* AgentInit(WOLFSSH_AGENT_CTX* agent, void* heap)
 
         WMEMSET(agent, 0, sizeof(WOLFSSH_AGENT_CTX));
         agent->heap = heap;
+        agent->devId = INVALID_DEVID;
         agent->state = AGENT_STATE_INIT;
 
         ret = wc_InitRng(&agent->rng);
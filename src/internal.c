@@ -161,9 +161,13 @@ Flags:
   WOLFSSH_NO_AES_GCM
     Set when AES or AES-GCM are disabled. Set to disable use of AES-GCM
     encryption.
+  WOLFSSH_NO_CHACHA20_POLY1305
+    Set when ChaCha20 or Poly1305 are disabled. Set to disable use of the
+    chacha20-poly1305@openssh.com cipher.
   WOLFSSH_NO_AEAD
-    Set when AES-GCM is disabled. Set to disable use of AEAD ciphers for
-    encryption. Setting this will force all AEAD ciphers off.
+    Set when AES-GCM and ChaCha20-Poly1305 are disabled. Set to disable use
+    of AEAD ciphers for encryption. Setting this will force all AEAD ciphers
+    off.
   WOLFSSH_NO_DH
     Set when all DH algorithms are disabled. Set to disable use of all DH
     algorithms for key agreement. Setting this will force all DH key agreement
@@ -177,6 +181,22 @@ Flags:
   WOLFSSH_NO_CURVE25519_SHA256
     Set when Curve25519 or SHA2-256 are disabled in wolfSSL. Set to disable use
     of Curve25519 key exchange.
+  WOLFSSH_BUFFER_RETAIN_SZ
+    The input and output buffers are kept allocated between packets. A
+    drained buffer that has grown larger than this size is released, trading
+    allocations for memory on idle connections. This is the default for new
+    CTXs, see wolfSSH_CTX_SetBufferRetain(); 0 keeps the buffers until the
+    session is freed.
+    default: 64KB
+  WOLFSSH_NO_HOST_KEY_CACHE
+    Set to decode the server's host private key on every handshake instead of
+    keeping decoded copies in the CTX. The CTX keeps one copy per handshake
+    that ran at the same time; this saves that memory.
+  WOLFSSH_PAD_POOL_SZ
+    Random bytes each session draws from its RNG at once for packet padding,
+    at least 256. Set to 0 to draw each packet's padding on its own and save
+    the pool's memory in every session.
+    default: 1024
 */
 
 static const char sshProtoIdStr[] = "SSH-2.0-wolfSSHv"
@@ -483,6 +503,9 @@ const char* GetErrorString(int err)
         case WS_KDF_E:
             return "KDF error";
 
+        case WS_WANT_CRYPTO:
+            return "offloaded crypto operation is still pending";
+
         default:
             return "Unknown error code";
     }
@@ -526,16 +549,70 @@ static int HashUpdate(wc_HashAlg* hash, enum wc_HashType type,
 }
 
 
+/* Returns the number of bytes a cipher may protect with one key. Block
+ * ciphers in CBC and CTR modes are held to RFC 4344 section 3.2, 2^(L/4)
+ * blocks of L bits. The AEAD ciphers are only limited by the packet
+ * count. Returns 0 for no limit. */
+static word64 CipherByteLimit(byte encryptId)
+{
+    switch (encryptId) {
+    #ifndef WOLFSSH_NO_AES_CBC
+        case ID_AES128_CBC:
+        case ID_AES192_CBC:
+        case ID_AES256_CBC:
+    #endif
+    #ifndef WOLFSSH_NO_AES_CTR
+        case ID_AES128_CTR:
+        case ID_AES192_CTR:
+        case ID_AES256_CTR:
+    #endif
+            return ((word64)1 << (AES_BLOCK_SIZE * 8 / 4)) * AES_BLOCK_SIZE;
+
+        default:
+            return 0;
+    }
+}
+
+
+/* Checks the counters for the current keys against the rekey policy. */
+static INLINE int RekeyDue(WOLFSSH* ssh)
+{
+    word64 limit;
+
+    if (ssh->highwaterMark != 0 &&
+            (ssh->txCount >= ssh->highwaterMark ||
+             ssh->rxCount >= ssh->highwaterMark))
+        return 1;
+
+    limit = CipherByteLimit(ssh->encryptId);
+    if (limit != 0 && ssh->txCount >= limit)
+        return 1;
+    limit = CipherByteLimit(ssh->peerEncryptId);
+    if (limit != 0 && ssh->rxCount >= limit)
+        return 1;
+
+    limit = ssh->rekeyPackets ? ssh->rekeyPackets : DEFAULT_REKEY_PACKETS;
+    if (ssh->txPacketCount >= limit || ssh->rxPacketCount >= limit)
+        return 1;
+
+    /* This runs for every packet, so the clock is only read when there
+     * is a lifetime to check. */
+    if (ssh->rekeySeconds != 0 && ssh->keyTime != 0 &&
+            (word64)WTIME(NULL) - ssh->keyTime >= ssh->rekeySeconds)
+        return 1;
+
+    return 0;
+}
+
+
 /* returns WS_SUCCESS on success */
 static INLINE int HighwaterCheck(WOLFSSH* ssh, byte side)
 {
     int ret = WS_SUCCESS;
 
-    if (!ssh->highwaterFlag && ssh->highwaterMark &&
-        (ssh->txCount >= ssh->highwaterMark ||
-         ssh->rxCount >= ssh->highwaterMark)) {
+    if (!ssh->highwaterFlag && RekeyDue(ssh)) {
 
-        WLOG(WS_LOG_DEBUG, "%s over high water mark",
+        WLOG(WS_LOG_DEBUG, "%s over rekey limit",
              (side == WOLFSSH_HWSIDE_TRANSMIT) ? "Transmit" : "Receive");
 
         ssh->highwaterFlag = 1;
@@ -589,6 +666,7 @@ static void HandshakeInfoFree(HandshakeInfo* hs, void* heap)
         if (hs->kexHashId != WC_HASH_TYPE_NONE)  {
             wc_HashFree(&hs->kexHash, (enum wc_HashType)hs->kexHashId);
         }
+        KexReplyFree(hs->kexReply, heap);
         ForceZero(hs, sizeof(HandshakeInfo));
         WFREE(hs, heap, DYNTYPE_HS);
     }
@@ -803,6 +881,9 @@ static const char cannedEncAlgoNames[] =
     "aes192-gcm@openssh.com,"
     "aes128-gcm@openssh.com,"
 #endif
+#if !defined(WOLFSSH_NO_CHACHA20_POLY1305)
+    "chacha20-poly1305@openssh.com,"
+#endif
 #if !defined(WOLFSSH_NO_AES_CTR)
     "aes256-ctr,"
     "aes192-ctr,"
@@ -816,6 +897,12 @@ static const char cannedEncAlgoNames[] =
     "";
 
 static const char cannedMacAlgoNames[] =
+#if !defined(WOLFSSH_NO_HMAC_SHA2_256)
+    "hmac-sha2-256-etm@openssh.com,"
+#endif
+#if !defined(WOLFSSH_NO_HMAC_SHA2_512)
+    "hmac-sha2-512-etm@openssh.com,"
+#endif
 #if !defined(WOLFSSH_NO_HMAC_SHA2_256)
     "hmac-sha2-256,"
 #endif
@@ -869,6 +956,10 @@ WOLFSSH_CTX* CtxInit(WOLFSSH_CTX* ctx, byte side, void* heap)
 #endif /* WOLFSSH_CERTS */
     ctx->windowSz = DEFAULT_WINDOW_SZ;
     ctx->maxPacketSz = DEFAULT_MAX_PACKET_SZ;
+    ctx->windowBudgetSz = DEFAULT_WINDOW_BUDGET_SZ;
+    ctx->readAheadSz = DEFAULT_READ_AHEAD_SZ;
+    ctx->bufferRetainSz = WOLFSSH_BUFFER_RETAIN_SZ;
+    ctx->devId = INVALID_DEVID;
     ctx->sshProtoIdStr = sshProtoIdStr;
     ctx->algoListKex = cannedKexAlgoNames;
     if (side == WOLFSSH_ENDPOINT_CLIENT) {
@@ -889,6 +980,37 @@ WOLFSSH_CTX* CtxInit(WOLFSSH_CTX* ctx, byte side, void* heap)
         ctx->publicKeyAlgo[idx] = ID_NONE;
     }
 
+#ifndef SINGLE_THREADED
+    if (wc_InitMutex(&ctx->kexKeyPoolMutex) != 0) {
+        WLOG(WS_LOG_DEBUG, "Couldn't initialize KEX key pool mutex");
+    #ifdef WOLFSSH_CERTS
+        wolfSSH_CERTMAN_free(ctx->certMan);
+        ctx->certMan = NULL;
+    #endif
+        return NULL;
+    }
+    if (wc_InitMutex(&ctx->hostKeyMutex) != 0) {
+        WLOG(WS_LOG_DEBUG, "Couldn't initialize host key mutex");
+        wc_FreeMutex(&ctx->kexKeyPoolMutex);
+    #ifdef WOLFSSH_CERTS
+        wolfSSH_CERTMAN_free(ctx->certMan);
+        ctx->certMan = NULL;
+    #endif
+        return NULL;
+    }
+    if (wc_InitMutex(&ctx->windowMutex) != 0) {
+        WLOG(WS_LOG_DEBUG, "Couldn't initialize window budget mutex");
+        wc_FreeMutex(&ctx->hostKeyMutex);
+        wc_FreeMutex(&ctx->kexKeyPoolMutex);
+    #ifdef WOLFSSH_CERTS
+        wolfSSH_CERTMAN_free(ctx->certMan);
+        ctx->certMan = NULL;
+    #endif
+        return NULL;
+    }
+#endif
+    CtxKexInitRefresh(ctx);
+
     return ctx;
 }
 
@@ -907,6 +1029,8 @@ void CtxResourceFree(WOLFSSH_CTX* ctx)
                 ctx->privateKey[i].key = NULL;
                 ctx->privateKey[i].keySz = 0;
             }
+            HostKeyFree(ctx->privateKey[i].hostKeys, ctx->heap);
+            ctx->privateKey[i].hostKeys = NULL;
             #ifdef WOLFSSH_CERTS
             if (ctx->privateKey[i].cert != NULL) {
                 WFREE(ctx->privateKey[i].cert, ctx->heap, DYNTYPE_CERT);
@@ -924,6 +1048,97 @@ void CtxResourceFree(WOLFSSH_CTX* ctx)
     }
     ctx->certMan = NULL;
 #endif
+    CtxKexKeyPoolFree(ctx);
+#ifndef SINGLE_THREADED
+    wc_FreeMutex(&ctx->kexKeyPoolMutex);
+    wc_FreeMutex(&ctx->hostKeyMutex);
+    wc_FreeMutex(&ctx->windowMutex);
+#endif
+    if (ctx->kexInitBody != NULL) {
+        WFREE(ctx->kexInitBody, ctx->heap, DYNTYPE_STRING);
+        ctx->kexInitBody = NULL;
+        ctx->kexInitBodySz = 0;
+    }
+}
+
+
+static int CtxWindowLock(WOLFSSH_CTX* ctx)
+{
+#ifndef SINGLE_THREADED
+    if (wc_LockMutex(&ctx->windowMutex) != 0) {
+        WLOG(WS_LOG_DEBUG, "Couldn't lock window budget");
+        return WS_ERROR;
+    }
+#else
+    WOLFSSH_UNUSED(ctx);
+#endif
+    return WS_SUCCESS;
+}
+
+
+static void CtxWindowUnlock(WOLFSSH_CTX* ctx)
+{
+#ifndef SINGLE_THREADED
+    wc_UnLockMutex(&ctx->windowMutex);
+#else
+    WOLFSSH_UNUSED(ctx);
+#endif
+}
+
+
+/* Takes up to growSz bytes of window growth from the context's budget,
+ * which is shared by all of its sessions. Returns the size granted. */
+static word32 CtxWindowTake(WOLFSSH_CTX* ctx, word32 growSz)
+{
+    if (CtxWindowLock(ctx) != WS_SUCCESS)
+        return 0;
+
+    if (ctx->windowGrownSz >= ctx->windowBudgetSz)
+        growSz = 0;
+    else if (growSz > ctx->windowBudgetSz - ctx->windowGrownSz)
+        growSz = ctx->windowBudgetSz - ctx->windowGrownSz;
+    ctx->windowGrownSz += growSz;
+
+    CtxWindowUnlock(ctx);
+    return growSz;
+}
+
+
+/* Gives window growth back to the context's budget. */
+static void CtxWindowGive(WOLFSSH_CTX* ctx, word32 growSz)
+{
+    if (growSz == 0 || CtxWindowLock(ctx) != WS_SUCCESS)
+        return;
+
+    ctx->windowGrownSz -= min(growSz, ctx->windowGrownSz);
+
+    CtxWindowUnlock(ctx);
+}
+
+
+int CtxWindowSetBudget(WOLFSSH_CTX* ctx, word32 budgetSz)
+{
+    int ret = CtxWindowLock(ctx);
+
+    if (ret == WS_SUCCESS) {
+        ctx->windowBudgetSz = budgetSz;
+        CtxWindowUnlock(ctx);
+    }
+
+    return ret;
+}
+
+
+word32 CtxWindowGrown(WOLFSSH_CTX* ctx)
+{
+    word32 grownSz = 0;
+
+    if (CtxWindowLock(ctx) == WS_SUCCESS) {
+        grownSz = ctx->windowGrownSz;
+        CtxWindowUnlock(ctx);
+    }
+
+    return grownSz;
 }
 
 
@@ -1028,7 +1243,7 @@ WOLFSSH* SshInit(WOLFSSH* ssh, WOLFSSH_CTX* ctx)
     rng = (WC_RNG*)WMALLOC(sizeof(WC_RNG), heap, DYNTYPE_RNG);
 
     if (handshake == NULL || rng == NULL ||
-            wc_InitRng_ex(rng, heap, INVALID_DEVID) != 0) {
+            wc_InitRng_ex(rng, heap, ctx->devId) != 0) {
 
         WLOG(WS_LOG_DEBUG, "SshInit: Cannot allocate memory.\n");
         WFREE(handshake, heap, DYNTYPE_HS);
@@ -1051,6 +1266,21 @@ WOLFSSH* SshInit(WOLFSSH* ssh, WOLFSSH_CTX* ctx)
     ssh->ioReadCtx   = &ssh->rfd;  /* prevent invalid access if not correctly */
     ssh->ioWriteCtx  = &ssh->wfd;  /* set */
     ssh->highwaterMark = ctx->highwaterMark;
+    ssh->rekeyPackets  = ctx->rekeyPackets;
+    ssh->rekeySeconds  = ctx->rekeySeconds;
+    ssh->readAheadSz   = ctx->readAheadSz;
+    ssh->corkSz        = DEFAULT_CORK_SZ;
+#if WOLFSSH_PAD_POOL_SZ > 0
+    ssh->padPoolIdx    = WOLFSSH_PAD_POOL_SZ;
+#endif
+    ssh->devId         = ctx->devId;
+    ssh->kexGuess      = ctx->kexGuess;
+    ssh->connectPipeline = ctx->connectPipeline;
+    ssh->channelSched  = ctx->channelSched;
+    ssh->channelRate   = ctx->channelRate;
+    ssh->rateLimited   = ctx->sessionRate.txRate || ctx->sessionRate.rxRate ||
+            ctx->channelRate.txRate || ctx->channelRate.rxRate;
+    RateLimitInit(&ssh->txRate, &ssh->rxRate, &ctx->sessionRate);
     ssh->highwaterCtx  = (void*)ssh;
     ssh->reqSuccessCtx = (void*)ssh;
     ssh->fs            = NULL;
@@ -1122,11 +1352,18 @@ WOLFSSH* SshInit(WOLFSSH* ssh, WOLFSSH_CTX* ctx)
 
     if (BufferInit(&ssh->inputBuffer, 0, ctx->heap) != WS_SUCCESS  ||
         BufferInit(&ssh->outputBuffer, 0, ctx->heap) != WS_SUCCESS ||
-        BufferInit(&ssh->extDataBuffer, 0, ctx->heap) != WS_SUCCESS) {
+        BufferInit(&ssh->extDataBuffer, 0, ctx->heap) != WS_SUCCESS ||
+        BufferInit(&ssh->rekeyQueue, 0, ctx->heap) != WS_SUCCESS ||
+        wc_HmacInit(&ssh->encryptCipher.hmac, heap, ctx->devId) != 0 ||
+        wc_HmacInit(&ssh->decryptCipher.hmac, heap, ctx->devId) != 0) {
 
         wolfSSH_free(ssh);
         ssh = NULL;
     }
+    else {
+        ssh->inputBuffer.retainSz = ctx->bufferRetainSz;
+        ssh->outputBuffer.retainSz = ctx->bufferRetainSz;
+    }
 
     return ssh;
 }
@@ -1142,6 +1379,10 @@ void SshResourceFree(WOLFSSH* ssh, void* heap)
     ShrinkBuffer(&ssh->inputBuffer, 1);
     ShrinkBuffer(&ssh->outputBuffer, 1);
     ShrinkBuffer(&ssh->extDataBuffer, 1);
+    ShrinkBuffer(&ssh->rekeyQueue, 1);
+#if WOLFSSH_PAD_POOL_SZ > 0
+    ForceZero(ssh->padPool, sizeof(ssh->padPool));
+#endif
     ForceZero(ssh->k, ssh->kSz);
     HandshakeInfoFree(ssh->handshake, heap);
     ForceZero(&ssh->keys, sizeof(Keys));
@@ -1156,6 +1397,8 @@ void SshResourceFree(WOLFSSH* ssh, void* heap)
     if (ssh->peerProtoId) {
         WFREE(ssh->peerProtoId, heap, DYNTYPE_STRING);
     }
+    if (ssh->ctx != NULL)
+        CtxWindowGive(ssh->ctx, ssh->windowGrownSz);
     if (ssh->channelList) {
         WOLFSSH_CHANNEL* cur = ssh->channelList;
         WOLFSSH_CHANNEL* next;
@@ -1165,8 +1408,15 @@ void SshResourceFree(WOLFSSH* ssh, void* heap)
             cur = next;
         }
     }
+    if (ssh->channelHash) {
+        WFREE(ssh->channelHash, heap, DYNTYPE_CHANNEL);
+    }
     wc_AesFree(&ssh->encryptCipher.aes);
     wc_AesFree(&ssh->decryptCipher.aes);
+    wc_HmacFree(&ssh->encryptCipher.hmac);
+    wc_HmacFree(&ssh->decryptCipher.hmac);
+    ForceZero(&ssh->encryptCipher, sizeof(Ciphers));
+    ForceZero(&ssh->decryptCipher, sizeof(Ciphers));
     if (ssh->peerSigId) {
         WFREE(ssh->peerSigId, heap, DYNTYPE_ID);
     }
@@ -1956,6 +2206,248 @@ static void RefreshPublicKeyAlgo(WOLFSSH_CTX* ctx)
         }
     }
     ctx->publicKeyAlgoCount = publicKeyAlgoCount;
+    CtxKexInitRefresh(ctx);
+}
+
+
+static int HostKeyLock(WOLFSSH_CTX* ctx)
+{
+#ifndef SINGLE_THREADED
+    if (wc_LockMutex(&ctx->hostKeyMutex) != 0) {
+        WLOG(WS_LOG_DEBUG, "Couldn't lock host keys");
+        return WS_ERROR;
+    }
+#else
+    WOLFSSH_UNUSED(ctx);
+#endif
+    return WS_SUCCESS;
+}
+
+
+static void HostKeyUnlock(WOLFSSH_CTX* ctx)
+{
+#ifndef SINGLE_THREADED
+    wc_UnLockMutex(&ctx->hostKeyMutex);
+#else
+    WOLFSSH_UNUSED(ctx);
+#endif
+}
+
+
+/* Frees hostKey and the keys chained after it. */
+void HostKeyFree(WOLFSSH_HOST_KEY* hostKey, void* heap)
+{
+    WOLFSSH_HOST_KEY* next;
+
+    for (; hostKey != NULL; hostKey = next) {
+        next = hostKey->next;
+        switch (hostKey->keyId) {
+            #ifndef WOLFSSH_NO_RSA
+            case ID_SSH_RSA:
+                wc_FreeRsaKey(&hostKey->sk.rsa);
+                break;
+            #endif
+            #ifndef WOLFSSH_NO_ECDSA
+            case ID_ECDSA_SHA2_NISTP256:
+                wc_ecc_free(&hostKey->sk.ecc);
+                break;
+            #endif
+            #ifndef WOLFSSH_NO_ED25519
+            case ID_ED25519:
+                wc_ed25519_free(&hostKey->sk.ed);
+                break;
+            #endif
+            default:
+                break;
+        }
+        ForceZero(hostKey, sizeof(WOLFSSH_HOST_KEY));
+        WFREE(hostKey, heap, DYNTYPE_PRIVKEY);
+    }
+}
+
+
+/* Decodes the CTX's private key at keyIdx into a new key object. The
+ * keyId field holds the key's family: ID_SSH_RSA, ID_ECDSA_SHA2_NISTP256
+ * for any ECDSA curve, or ID_ED25519. Returns NULL if the key can't be
+ * decoded here, handshakes decode it themselves then. */
+static WOLFSSH_HOST_KEY* HostKeyDecode(WOLFSSH_CTX* ctx, word32 keyIdx)
+{
+    WOLFSSH_HOST_KEY* hostKey = NULL;
+#ifndef WOLFSSH_NO_HOST_KEY_CACHE
+    WOLFSSH_PVT_KEY* pvtKey = ctx->privateKey + keyIdx;
+    word32 idx = 0;
+    int ret = WS_INVALID_ALGO_ID;
+
+    if (pvtKey->key == NULL)
+        return NULL;
+
+    hostKey = (WOLFSSH_HOST_KEY*)WMALLOC(sizeof(WOLFSSH_HOST_KEY),
+            ctx->heap, DYNTYPE_PRIVKEY);
+    if (hostKey == NULL)
+        return NULL;
+    WMEMSET(hostKey, 0, sizeof(WOLFSSH_HOST_KEY));
+    hostKey->keyId = ID_NONE;
+    hostKey->devId = ctx->devId;
+    hostKey->ctx = ctx;
+    hostKey->keyIdx = keyIdx;
+    hostKey->gen = pvtKey->hostKeyGen;
+
+    switch (pvtKey->publicKeyFmt) {
+        #ifndef WOLFSSH_NO_RSA
+        case ID_SSH_RSA:
+        case ID_X509V3_SSH_RSA:
+            ret = wc_InitRsaKey_ex(&hostKey->sk.rsa, ctx->heap, ctx->devId);
+            if (ret == 0) {
+                hostKey->keyId = ID_SSH_RSA;
+                ret = wc_RsaPrivateKeyDecode(pvtKey->key, &idx,
+                        &hostKey->sk.rsa, pvtKey->keySz);
+            }
+            break;
+        #endif
+        #ifndef WOLFSSH_NO_ECDSA
+        case ID_ECDSA_SHA2_NISTP256:
+        case ID_ECDSA_SHA2_NISTP384:
+        case ID_ECDSA_SHA2_NISTP521:
+        case ID_X509V3_ECDSA_SHA2_NISTP256:
+        case ID_X509V3_ECDSA_SHA2_NISTP384:
+        case ID_X509V3_ECDSA_SHA2_NISTP521:
+            ret = wc_ecc_init_ex(&hostKey->sk.ecc, ctx->heap, ctx->devId);
+            if (ret == 0) {
+                hostKey->keyId = ID_ECDSA_SHA2_NISTP256;
+                ret = wc_EccPrivateKeyDecode(pvtKey->key, &idx,
+                        &hostKey->sk.ecc, pvtKey->keySz);
+            }
+            break;
+        #endif
+        #ifndef WOLFSSH_NO_ED25519
+        case ID_ED25519:
+            ret = wc_ed25519_init_ex(&hostKey->sk.ed, ctx->heap,
+                    ctx->devId);
+            if (ret == 0) {
+                hostKey->keyId = ID_ED25519;
+                ret = wc_Ed25519PrivateKeyDecode(pvtKey->key, &idx,
+                        &hostKey->sk.ed, pvtKey->keySz);
+            }
+            break;
+        #endif
+        default:
+            break;
+    }
+
+    if (ret != 0) {
+        WLOG(WS_LOG_DEBUG, "Host key not decoded, ret = %d", ret);
+        HostKeyFree(hostKey, ctx->heap);
+        hostKey = NULL;
+    }
+#else
+    WOLFSSH_UNUSED(ctx);
+    WOLFSSH_UNUSED(keyIdx);
+#endif /* WOLFSSH_NO_HOST_KEY_CACHE */
+
+    return hostKey;
+}
+
+
+/* Drops the decoded copies of the private key in pvtKey, which has just
+ * been set, and decodes a first one. Copies still in use by handshakes
+ * are freed when they come back. */
+static void HostKeyCache(WOLFSSH_CTX* ctx, WOLFSSH_PVT_KEY* pvtKey)
+{
+    WOLFSSH_HOST_KEY* stale = NULL;
+    WOLFSSH_HOST_KEY* hostKey;
+
+    if (HostKeyLock(ctx) != WS_SUCCESS)
+        return;
+    stale = pvtKey->hostKeys;
+    pvtKey->hostKeys = NULL;
+    pvtKey->hostKeyGen++;
+    HostKeyUnlock(ctx);
+    HostKeyFree(stale, ctx->heap);
+
+    hostKey = HostKeyDecode(ctx, (word32)(pvtKey - ctx->privateKey));
+    if (hostKey != NULL) {
+        if (HostKeyLock(ctx) == WS_SUCCESS) {
+            hostKey->next = pvtKey->hostKeys;
+            pvtKey->hostKeys = hostKey;
+            HostKeyUnlock(ctx);
+        }
+        else
+            HostKeyFree(hostKey, ctx->heap);
+    }
+}
+
+
+/* Sets the CTX's crypto device and decodes its host keys again so the
+ * cached copies are bound to the new device. */
+void CtxSetDevId(WOLFSSH_CTX* ctx, int devId)
+{
+    word32 idx;
+
+    ctx->devId = devId;
+    for (idx = 0; idx < ctx->privateKeyCount; idx++) {
+        HostKeyCache(ctx, ctx->privateKey + idx);
+    }
+}
+
+
+/* Gives a copy taken with HostKeyGet() back to the CTX for the next
+ * handshake. A copy of a key that has since been replaced is freed. */
+static void HostKeyPut(WOLFSSH_HOST_KEY* hostKey)
+{
+    WOLFSSH_CTX* ctx;
+    WOLFSSH_PVT_KEY* pvtKey;
+
+    if (hostKey == NULL)
+        return;
+
+    ctx = hostKey->ctx;
+    pvtKey = ctx->privateKey + hostKey->keyIdx;
+    if (HostKeyLock(ctx) == WS_SUCCESS) {
+        if (hostKey->gen == pvtKey->hostKeyGen
+                && hostKey->devId == ctx->devId) {
+            hostKey->next = pvtKey->hostKeys;
+            pvtKey->hostKeys = hostKey;
+            hostKey = NULL;
+        }
+        HostKeyUnlock(ctx);
+    }
+    HostKeyFree(hostKey, ctx->heap);
+}
+
+
+/* Hands a decoded copy of the CTX's host key at keyIdx to the calling
+ * session, reusing one another handshake gave back or decoding a new one.
+ * Each session signs with a key object of its own, so no lock is held
+ * while signing. Returns NULL if the key isn't of the family keyId or the
+ * session uses a different crypto device; the caller decodes the key
+ * itself then. */
+static WOLFSSH_HOST_KEY* HostKeyGet(WOLFSSH* ssh, word32 keyIdx, byte keyId)
+{
+    WOLFSSH_CTX* ctx = ssh->ctx;
+    WOLFSSH_PVT_KEY* pvtKey = ctx->privateKey + keyIdx;
+    WOLFSSH_HOST_KEY* hostKey = NULL;
+
+    if (ssh->devId != ctx->devId)
+        return NULL;
+
+    if (HostKeyLock(ctx) == WS_SUCCESS) {
+        hostKey = pvtKey->hostKeys;
+        if (hostKey != NULL) {
+            pvtKey->hostKeys = hostKey->next;
+            hostKey->next = NULL;
+        }
+        HostKeyUnlock(ctx);
+    }
+
+    if (hostKey == NULL)
+        hostKey = HostKeyDecode(ctx, keyIdx);
+
+    if (hostKey != NULL && hostKey->keyId != keyId) {
+        HostKeyPut(hostKey);
+        hostKey = NULL;
+    }
+
+    return hostKey;
 }
 
 
@@ -2049,6 +2541,7 @@ static int UpdateHostCertificates(WOLFSSH_CTX* ctx,
             }
             ctx->privateKey[certHint].key = key;
             ctx->privateKey[certHint].keySz = keySz;
+            HostKeyCache(ctx, ctx->privateKey + certHint);
         }
     }
 
@@ -2152,6 +2645,7 @@ static int SetHostPrivateKey(WOLFSSH_CTX* ctx,
 
         pvtKey->key = der;
         pvtKey->keySz = derSz;
+        HostKeyCache(ctx, pvtKey);
 
         #ifdef WOLFSSH_CERTS
         if (ret == WS_SUCCESS) {
@@ -2516,166 +3010,255 @@ typedef struct {
     byte id;
     byte type;
     const char* name;
+    word32 nameSz;
 } NameIdPair;
 
+/* Stores a name with its length so NameToId doesn't need WSTRLEN. */
+#define NAME_STR(name) name, (word32)(sizeof(name) - 1)
+
 
 static const NameIdPair NameIdMap[] = {
-    { ID_NONE, TYPE_OTHER, "none" },
+    { ID_NONE, TYPE_OTHER, NAME_STR("none") },
 
     /* Encryption IDs */
 #ifndef WOLFSSH_NO_AES_CBC
-    { ID_AES128_CBC, TYPE_CIPHER, "aes128-cbc" },
-    { ID_AES192_CBC, TYPE_CIPHER, "aes192-cbc" },
-    { ID_AES256_CBC, TYPE_CIPHER, "aes256-cbc" },
+    { ID_AES128_CBC, TYPE_CIPHER, NAME_STR("aes128-cbc") },
+    { ID_AES192_CBC, TYPE_CIPHER, NAME_STR("aes192-cbc") },
+    { ID_AES256_CBC, TYPE_CIPHER, NAME_STR("aes256-cbc") },
 #endif
 #ifndef WOLFSSH_NO_AES_CTR
-    { ID_AES128_CTR, TYPE_CIPHER, "aes128-ctr" },
-    { ID_AES192_CTR, TYPE_CIPHER, "aes192-ctr" },
-    { ID_AES256_CTR, TYPE_CIPHER, "aes256-ctr" },
+    { ID_AES128_CTR, TYPE_CIPHER, NAME_STR("aes128-ctr") },
+    { ID_AES192_CTR, TYPE_CIPHER, NAME_STR("aes192-ctr") },
+    { ID_AES256_CTR, TYPE_CIPHER, NAME_STR("aes256-ctr") },
 #endif
 #ifndef WOLFSSH_NO_AES_GCM
-    { ID_AES128_GCM, TYPE_CIPHER, "aes128-gcm@openssh.com" },
-    { ID_AES192_GCM, TYPE_CIPHER, "aes192-gcm@openssh.com" },
-    { ID_AES256_GCM, TYPE_CIPHER, "aes256-gcm@openssh.com" },
+    { ID_AES128_GCM, TYPE_CIPHER, NAME_STR("aes128-gcm@openssh.com") },
+    { ID_AES192_GCM, TYPE_CIPHER, NAME_STR("aes192-gcm@openssh.com") },
+    { ID_AES256_GCM, TYPE_CIPHER, NAME_STR("aes256-gcm@openssh.com") },
+#endif
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+    { ID_CHACHA20_POLY1305, TYPE_CIPHER,
+        NAME_STR("chacha20-poly1305@openssh.com") },
 #endif
 
     /* Integrity IDs */
 #ifndef WOLFSSH_NO_HMAC_SHA1
-    { ID_HMAC_SHA1, TYPE_MAC, "hmac-sha1" },
+    { ID_HMAC_SHA1, TYPE_MAC, NAME_STR("hmac-sha1") },
 #endif
 #ifndef WOLFSSH_NO_HMAC_SHA1_96
-    { ID_HMAC_SHA1_96, TYPE_MAC, "hmac-sha1-96" },
+    { ID_HMAC_SHA1_96, TYPE_MAC, NAME_STR("hmac-sha1-96") },
 #endif
 #ifndef WOLFSSH_NO_HMAC_SHA2_256
-    { ID_HMAC_SHA2_256, TYPE_MAC, "hmac-sha2-256" },
+    { ID_HMAC_SHA2_256, TYPE_MAC, NAME_STR("hmac-sha2-256") },
 #endif
 #ifndef WOLFSSH_NO_HMAC_SHA2_512
-    { ID_HMAC_SHA2_512, TYPE_MAC, "hmac-sha2-512" },
+    { ID_HMAC_SHA2_512, TYPE_MAC, NAME_STR("hmac-sha2-512") },
+#endif
+#ifndef WOLFSSH_NO_HMAC_SHA2_256
+    { ID_HMAC_SHA2_256_ETM, TYPE_MAC,
+        NAME_STR("hmac-sha2-256-etm@openssh.com") },
+#endif
+#ifndef WOLFSSH_NO_HMAC_SHA2_512
+    { ID_HMAC_SHA2_512_ETM, TYPE_MAC,
+        NAME_STR("hmac-sha2-512-etm@openssh.com") },
 #endif
 
     /* Key Exchange IDs */
 #ifndef WOLFSSH_NO_DH_GROUP1_SHA1
-    { ID_DH_GROUP1_SHA1, TYPE_KEX, "diffie-hellman-group1-sha1" },
+    { ID_DH_GROUP1_SHA1, TYPE_KEX, NAME_STR("diffie-hellman-group1-sha1") },
 #endif
 #ifndef WOLFSSH_NO_DH_GROUP14_SHA1
-    { ID_DH_GROUP14_SHA1, TYPE_KEX, "diffie-hellman-group14-sha1" },
+    { ID_DH_GROUP14_SHA1, TYPE_KEX, NAME_STR("diffie-hellman-group14-sha1") },
 #endif
 #ifndef WOLFSSH_NO_DH_GROUP14_SHA256
-    { ID_DH_GROUP14_SHA256, TYPE_KEX, "diffie-hellman-group14-sha256" },
+    { ID_DH_GROUP14_SHA256, TYPE_KEX,
+        NAME_STR("diffie-hellman-group14-sha256") },
 #endif
 #ifndef WOLFSSH_NO_DH_GROUP16_SHA512
-    { ID_DH_GROUP16_SHA512, TYPE_KEX, "diffie-hellman-group16-sha512" },
+    { ID_DH_GROUP16_SHA512, TYPE_KEX,
+        NAME_STR("diffie-hellman-group16-sha512") },
 #endif
 #ifndef WOLFSSH_NO_DH_GEX_SHA256
-    { ID_DH_GEX_SHA256, TYPE_KEX, "diffie-hellman-group-exchange-sha256" },
+    { ID_DH_GEX_SHA256, TYPE_KEX,
+        NAME_STR("diffie-hellman-group-exchange-sha256") },
 #endif
 #ifndef WOLFSSH_NO_ECDH_SHA2_NISTP256
-    { ID_ECDH_SHA2_NISTP256, TYPE_KEX, "ecdh-sha2-nistp256" },
+    { ID_ECDH_SHA2_NISTP256, TYPE_KEX, NAME_STR("ecdh-sha2-nistp256") },
 #endif
 #ifndef WOLFSSH_NO_ECDH_SHA2_NISTP384
-    { ID_ECDH_SHA2_NISTP384, TYPE_KEX, "ecdh-sha2-nistp384" },
+    { ID_ECDH_SHA2_NISTP384, TYPE_KEX, NAME_STR("ecdh-sha2-nistp384") },
 #endif
 #ifndef WOLFSSH_NO_ECDH_SHA2_NISTP521
-    { ID_ECDH_SHA2_NISTP521, TYPE_KEX, "ecdh-sha2-nistp521" },
+    { ID_ECDH_SHA2_NISTP521, TYPE_KEX, NAME_STR("ecdh-sha2-nistp521") },
 #endif
 #ifndef WOLFSSH_NO_NISTP256_MLKEM768_SHA256
     { ID_NISTP256_MLKEM768_SHA256, TYPE_KEX,
-        "mlkem768nistp256-sha256" },
+        NAME_STR("mlkem768nistp256-sha256") },
 #endif
 #ifndef WOLFSSH_NO_CURVE25519_SHA256
     /* See RFC 8731 */
-    { ID_CURVE25519_SHA256, TYPE_KEX, "curve25519-sha256" },
-    { ID_CURVE25519_SHA256_LIBSSH, TYPE_KEX, "curve25519-sha256@libssh.org" },
+    { ID_CURVE25519_SHA256, TYPE_KEX, NAME_STR("curve25519-sha256") },
+    { ID_CURVE25519_SHA256_LIBSSH, TYPE_KEX,
+        NAME_STR("curve25519-sha256@libssh.org") },
 #endif
-    { ID_EXTINFO_S, TYPE_OTHER, "ext-info-s" },
-    { ID_EXTINFO_C, TYPE_OTHER, "ext-info-c" },
+    { ID_EXTINFO_S, TYPE_OTHER, NAME_STR("ext-info-s") },
+    { ID_EXTINFO_C, TYPE_OTHER, NAME_STR("ext-info-c") },
 
     /* Public Key IDs */
 #ifndef WOLFSSH_NO_RSA
-    { ID_SSH_RSA, TYPE_KEY, "ssh-rsa" },
+    { ID_SSH_RSA, TYPE_KEY, NAME_STR("ssh-rsa") },
 #ifndef WOLFSSH_NO_RSA_SHA2_256
-    { ID_RSA_SHA2_256, TYPE_KEY, "rsa-sha2-256" },
+    { ID_RSA_SHA2_256, TYPE_KEY, NAME_STR("rsa-sha2-256") },
 #endif
 #ifndef WOLFSSH_NO_RSA_SHA2_512
-    { ID_RSA_SHA2_512, TYPE_KEY, "rsa-sha2-512" },
+    { ID_RSA_SHA2_512, TYPE_KEY, NAME_STR("rsa-sha2-512") },
 #endif
 #endif /* WOLFSSH_NO_RSA */
 #ifndef WOLFSSH_NO_ECDSA_SHA2_NISTP256
-    { ID_ECDSA_SHA2_NISTP256, TYPE_KEY, "ecdsa-sha2-nistp256" },
+    { ID_ECDSA_SHA2_NISTP256, TYPE_KEY, NAME_STR("ecdsa-sha2-nistp256") },
 #endif
 #ifndef WOLFSSH_NO_ECDSA_SHA2_NISTP384
-    { ID_ECDSA_SHA2_NISTP384, TYPE_KEY, "ecdsa-sha2-nistp384" },
+    { ID_ECDSA_SHA2_NISTP384, TYPE_KEY, NAME_STR("ecdsa-sha2-nistp384") },
 #endif
 #ifndef WOLFSSH_NO_ECDSA_SHA2_NISTP521
-    { ID_ECDSA_SHA2_NISTP521, TYPE_KEY, "ecdsa-sha2-nistp521" },
+    { ID_ECDSA_SHA2_NISTP521, TYPE_KEY, NAME_STR("ecdsa-sha2-nistp521") },
 #endif
 #ifndef WOLFSSH_NO_ED25519
-    { ID_ED25519, TYPE_KEY, "ssh-ed25519" },
+    { ID_ED25519, TYPE_KEY, NAME_STR("ssh-ed25519") },
 #endif
 #ifdef WOLFSSH_CERTS
 #ifndef WOLFSSH_NO_SSH_RSA_SHA1
-    { ID_X509V3_SSH_RSA, TYPE_KEY, "x509v3-ssh-rsa" },
+    { ID_X509V3_SSH_RSA, TYPE_KEY, NAME_STR("x509v3-ssh-rsa") },
 #endif
 #ifndef WOLFSSH_NO_ECDSA_SHA2_NISTP256
-    { ID_X509V3_ECDSA_SHA2_NISTP256, TYPE_KEY, "x509v3-ecdsa-sha2-nistp256" },
+    { ID_X509V3_ECDSA_SHA2_NISTP256, TYPE_KEY,
+        NAME_STR("x509v3-ecdsa-sha2-nistp256") },
 #endif
 #ifndef WOLFSSH_NO_ECDSA_SHA2_NISTP384
-    { ID_X509V3_ECDSA_SHA2_NISTP384, TYPE_KEY, "x509v3-ecdsa-sha2-nistp384" },
+    { ID_X509V3_ECDSA_SHA2_NISTP384, TYPE_KEY,
+        NAME_STR("x509v3-ecdsa-sha2-nistp384") },
 #endif
 #ifndef WOLFSSH_NO_ECDSA_SHA2_NISTP521
-    { ID_X509V3_ECDSA_SHA2_NISTP521, TYPE_KEY, "x509v3-ecdsa-sha2-nistp521" },
+    { ID_X509V3_ECDSA_SHA2_NISTP521, TYPE_KEY,
+        NAME_STR("x509v3-ecdsa-sha2-nistp521") },
 #endif
 #endif /* WOLFSSH_CERTS */
 
     /* Service IDs */
-    { ID_SERVICE_USERAUTH, TYPE_OTHER, "ssh-userauth" },
-    { ID_SERVICE_CONNECTION, TYPE_OTHER, "ssh-connection" },
+    { ID_SERVICE_USERAUTH, TYPE_OTHER, NAME_STR("ssh-userauth") },
+    { ID_SERVICE_CONNECTION, TYPE_OTHER, NAME_STR("ssh-connection") },
 
     /* UserAuth IDs */
-    { ID_USERAUTH_PASSWORD, TYPE_OTHER, "password" },
-    { ID_USERAUTH_PUBLICKEY, TYPE_OTHER, "publickey" },
+    { ID_USERAUTH_PASSWORD, TYPE_OTHER, NAME_STR("password") },
+    { ID_USERAUTH_PUBLICKEY, TYPE_OTHER, NAME_STR("publickey") },
 #ifdef WOLFSSH_KEYBOARD_INTERACTIVE
-    { ID_USERAUTH_KEYBOARD, TYPE_OTHER, "keyboard-interactive" },
+    { ID_USERAUTH_KEYBOARD, TYPE_OTHER, NAME_STR("keyboard-interactive") },
 #endif
 
     /* Channel Type IDs */
-    { ID_CHANTYPE_SESSION, TYPE_OTHER, "session" },
+    { ID_CHANTYPE_SESSION, TYPE_OTHER, NAME_STR("session") },
 #ifdef WOLFSSH_FWD
-    { ID_CHANTYPE_TCPIP_FORWARD, TYPE_OTHER, "forwarded-tcpip" },
-    { ID_CHANTYPE_TCPIP_DIRECT, TYPE_OTHER, "direct-tcpip" },
+    { ID_CHANTYPE_TCPIP_FORWARD, TYPE_OTHER, NAME_STR("forwarded-tcpip") },
+    { ID_CHANTYPE_TCPIP_DIRECT, TYPE_OTHER, NAME_STR("direct-tcpip") },
 #endif /* WOLFSSH_FWD */
 #ifdef WOLFSSH_AGENT
-    { ID_CHANTYPE_AUTH_AGENT, TYPE_OTHER, "auth-agent@openssh.com" },
+    { ID_CHANTYPE_AUTH_AGENT, TYPE_OTHER, NAME_STR("auth-agent@openssh.com") },
 #endif /* WOLFSSH_AGENT */
 
     /* Global Request IDs */
 #ifdef WOLFSSH_FWD
-    { ID_GLOBREQ_TCPIP_FWD, TYPE_OTHER, "tcpip-forward" },
-    { ID_GLOBREQ_TCPIP_FWD_CANCEL, TYPE_OTHER, "cancel-tcpip-forward" },
+    { ID_GLOBREQ_TCPIP_FWD, TYPE_OTHER, NAME_STR("tcpip-forward") },
+    { ID_GLOBREQ_TCPIP_FWD_CANCEL, TYPE_OTHER,
+        NAME_STR("cancel-tcpip-forward") },
 #endif /* WOLFSSH_FWD */
 
     /* Ext Info IDs */
-    { ID_EXTINFO_SERVER_SIG_ALGS, TYPE_OTHER, "server-sig-algs" },
+    { ID_EXTINFO_SERVER_SIG_ALGS, TYPE_OTHER, NAME_STR("server-sig-algs") },
 
     /* Curve Name IDs */
-    { ID_CURVE_NISTP256, TYPE_OTHER, "nistp256" },
-    { ID_CURVE_NISTP384, TYPE_OTHER, "nistp384" },
-    { ID_CURVE_NISTP521, TYPE_OTHER, "nistp521" },
+    { ID_CURVE_NISTP256, TYPE_OTHER, NAME_STR("nistp256") },
+    { ID_CURVE_NISTP384, TYPE_OTHER, NAME_STR("nistp384") },
+    { ID_CURVE_NISTP521, TYPE_OTHER, NAME_STR("nistp521") },
 };
 
 
+#define NAME_ID_MAP_SZ (word32)(sizeof(NameIdMap)/sizeof(NameIdPair))
+
+/* NameIdMap's entries ordered by name length, then by name, for the binary
+ * search in NameToId. The map itself keeps its order for NameByIndexType.
+ * Which entries exist depends on the build, so it is sorted at run time by
+ * NameIdIndexInit(). */
+static word16 NameIdIndex[NAME_ID_MAP_SZ];
+static byte nameIdIndexReady = 0;
+
+
+static int NameIdCompare(const char* name, word32 nameSz,
+        const NameIdPair* pair)
+{
+    if (nameSz != pair->nameSz)
+        return (nameSz < pair->nameSz) ? -1 : 1;
+
+    return XMEMCMP(name, pair->name, nameSz);
+}
+
+
+/* Sorts the index. Called once from wolfSSH_Init(). */
+void NameIdIndexInit(void)
+{
+    word32 i, j;
+    const NameIdPair* pair;
+
+    if (nameIdIndexReady)
+        return;
+
+    /* Insertion sort, the map is small and this runs once. */
+    for (i = 0; i < NAME_ID_MAP_SZ; i++) {
+        pair = &NameIdMap[i];
+        for (j = i; j > 0; j--) {
+            if (NameIdCompare(pair->name, pair->nameSz,
+                        &NameIdMap[NameIdIndex[j - 1]]) >= 0)
+                break;
+            NameIdIndex[j] = NameIdIndex[j - 1];
+        }
+        NameIdIndex[j] = (word16)i;
+    }
+    nameIdIndexReady = 1;
+}
+
+
 byte NameToId(const char* name, word32 nameSz)
 {
     byte id = ID_UNKNOWN;
-    word32 i;
+    word32 i, lo, hi;
+    int cmp;
 
-    for (i = 0; i < (sizeof(NameIdMap)/sizeof(NameIdPair)); i++) {
-        if (nameSz == (word32)WSTRLEN(NameIdMap[i].name) &&
-            XMEMCMP(name, NameIdMap[i].name, nameSz) == 0) {
+    if (name == NULL || nameSz == 0)
+        return id;
 
-            id = NameIdMap[i].id;
+    /* Without wolfSSH_Init() there's no index, scan the map. */
+    if (!nameIdIndexReady) {
+        for (i = 0; i < NAME_ID_MAP_SZ; i++) {
+            if (NameIdCompare(name, nameSz, &NameIdMap[i]) == 0) {
+                id = NameIdMap[i].id;
+                break;
+            }
+        }
+        return id;
+    }
+
+    lo = 0;
+    hi = NAME_ID_MAP_SZ;
+    while (lo < hi) {
+        i = lo + (hi - lo) / 2;
+        cmp = NameIdCompare(name, nameSz, &NameIdMap[NameIdIndex[i]]);
+        if (cmp == 0) {
+            id = NameIdMap[NameIdIndex[i]].id;
             break;
         }
+        if (cmp < 0)
+            hi = i;
+        else
+            lo = i + 1;
     }
 
     return id;
@@ -2737,33 +3320,27 @@ WOLFSSH_CHANNEL* ChannelNew(WOLFSSH* ssh, byte channelType,
                                                heap, DYNTYPE_CHANNEL);
         if (newChannel != NULL)
         {
-            byte* buffer;
-
-            buffer = (byte*)WMALLOC(initialWindowSz, heap, DYNTYPE_BUFFER);
-            if (buffer != NULL) {
-                WMEMSET(newChannel, 0, sizeof(WOLFSSH_CHANNEL));
-                newChannel->ssh = ssh;
-                newChannel->channelType = channelType;
-                newChannel->channel = ssh->nextChannel++;
-                WLOG(WS_LOG_DEBUG, "New channel id = %u", newChannel->channel);
-                newChannel->windowSz = initialWindowSz;
-                newChannel->maxPacketSz = maxPacketSz;
-                /*
-                 * In the context of the channel input buffer, the buffer is
-                 * a fixed size. The property length will be the insert point
-                 * for new received data. The property idx will be the pull
-                 * point for the data.
-                 */
-                newChannel->inputBuffer.heap = heap;
-                newChannel->inputBuffer.buffer = buffer;
-                newChannel->inputBuffer.bufferSz = initialWindowSz;
-                newChannel->inputBuffer.dynamicFlag = 1;
-            }
-            else {
-                WLOG(WS_LOG_DEBUG, "Unable to allocate new channel's buffer");
-                WFREE(newChannel, heap, DYNTYPE_CHANNEL);
-                newChannel = NULL;
-            }
+            WMEMSET(newChannel, 0, sizeof(WOLFSSH_CHANNEL));
+            newChannel->ssh = ssh;
+            newChannel->channelType = channelType;
+            newChannel->channel = ssh->nextChannel++;
+            WLOG(WS_LOG_DEBUG, "New channel id = %u", newChannel->channel);
+            newChannel->windowSz = initialWindowSz;
+            newChannel->windowFullSz = initialWindowSz;
+            newChannel->maxPacketSz = maxPacketSz;
+            /*
+             * In the context of the channel input buffer, the property
+             * length will be the insert point for new received data. The
+             * property idx will be the pull point for the data. The buffer
+             * starts with the small static space and is only allocated
+             * when more data arrives, see ChannelPutData(). Once drained,
+             * a buffer grown past the first allocation is released.
+             */
+            BufferInit(&newChannel->inputBuffer, 0, heap);
+            newChannel->inputBuffer.retainSz = WOLFSSH_CHANNEL_BUFFER_MIN;
+            BufferInit(&newChannel->txQueue, 0, heap);
+            RateLimitInit(&newChannel->txRate, &newChannel->rxRate,
+                    &ssh->channelRate);
         }
         else {
             WLOG(WS_LOG_DEBUG, "Unable to allocate new channel");
@@ -2787,8 +3364,8 @@ void ChannelDelete(WOLFSSH_CHANNEL* channel, void* heap)
         if (channel->origin)
             WFREE(channel->origin, heap, DYNTYPE_STRING);
     #endif /* WOLFSSH_FWD */
-        WFREE(channel->inputBuffer.buffer,
-              channel->inputBuffer.heap, DYNTYPE_BUFFER);
+        ShrinkBuffer(&channel->inputBuffer, 1);
+        ShrinkBuffer(&channel->txQueue, 1);
         if (channel->command)
             WFREE(channel->command, heap, DYNTYPE_STRING);
         WFREE(channel, heap, DYNTYPE_CHANNEL);
@@ -2796,21 +3373,141 @@ void ChannelDelete(WOLFSSH_CHANNEL* channel, void* heap)
 }
 
 
-WOLFSSH_CHANNEL* ChannelFind(WOLFSSH* ssh, word32 channel, byte peer)
+/*
+ * The channels are kept in ssh->channelList in the order they were added,
+ * for wolfSSH_ChannelNext(), and in two chained hash tables, by our ID and
+ * by the peer's ID, so the packet handlers find them in constant time.
+ * A channel is only in the peer ID table once its peer ID is known. If
+ * the tables can't be allocated, the lookups walk the list.
+ */
+static INLINE word32 ChannelHashIdx(WOLFSSH* ssh, word32 id)
 {
-    WOLFSSH_CHANNEL* findChannel = NULL;
+    return (id ^ (id >> 16)) & (ssh->channelHashSz - 1);
+}
 
-    WLOG(WS_LOG_DEBUG, "Entering ChannelFind(): %s %u",
-         peer ? "peer" : "self", channel);
 
-    if (ssh == NULL) {
-        WLOG(WS_LOG_DEBUG, "Null ssh, not looking for channel");
-    }
-    else {
-        WOLFSSH_CHANNEL* list = ssh->channelList;
-        word32 listSz = ssh->channelListSz;
+static void ChannelHashAdd(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel)
+{
+    WOLFSSH_CHANNEL** bucket;
 
-        while (list && listSz) {
+    bucket = &ssh->channelHash[ChannelHashIdx(ssh, channel->channel)];
+    channel->selfHashNext = *bucket;
+    *bucket = channel;
+
+    if (channel->openConfirmed) {
+        bucket = &ssh->channelHash[ssh->channelHashSz
+                + ChannelHashIdx(ssh, channel->peerChannel)];
+        channel->peerHashNext = *bucket;
+        *bucket = channel;
+        channel->peerHashed = 1;
+    }
+}
+
+
+static void ChannelHashDelPeer(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel)
+{
+    WOLFSSH_CHANNEL** cur;
+
+    if (ssh->channelHash == NULL || !channel->peerHashed)
+        return;
+
+    cur = &ssh->channelHash[ssh->channelHashSz
+            + ChannelHashIdx(ssh, channel->peerChannel)];
+    while (*cur != NULL && *cur != channel)
+        cur = &(*cur)->peerHashNext;
+    if (*cur != NULL)
+        *cur = channel->peerHashNext;
+    channel->peerHashNext = NULL;
+    channel->peerHashed = 0;
+}
+
+
+static void ChannelHashDel(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel)
+{
+    WOLFSSH_CHANNEL** cur;
+
+    if (ssh->channelHash == NULL)
+        return;
+
+    cur = &ssh->channelHash[ChannelHashIdx(ssh, channel->channel)];
+    while (*cur != NULL && *cur != channel)
+        cur = &(*cur)->selfHashNext;
+    if (*cur != NULL)
+        *cur = channel->selfHashNext;
+    channel->selfHashNext = NULL;
+
+    ChannelHashDelPeer(ssh, channel);
+}
+
+
+/* Makes room for one more channel, doubling the tables when the number of
+ * channels reaches the number of buckets. On failure the old tables, or
+ * the plain list, stay in use. */
+static void ChannelHashGrow(WOLFSSH* ssh)
+{
+    WOLFSSH_CHANNEL** newHash;
+    WOLFSSH_CHANNEL* cur;
+    word32 newSz;
+
+    if (ssh->channelHash != NULL && ssh->channelListSz < ssh->channelHashSz)
+        return;
+
+    newSz = (ssh->channelHash == NULL) ?
+            WOLFSSH_CHANNEL_HASH_SZ : ssh->channelHashSz * 2;
+    if (newSz > ((word32)-1 / 2) / sizeof(WOLFSSH_CHANNEL*))
+        return;
+
+    newHash = (WOLFSSH_CHANNEL**)WMALLOC(2 * newSz * sizeof(WOLFSSH_CHANNEL*),
+            ssh->ctx->heap, DYNTYPE_CHANNEL);
+    if (newHash == NULL) {
+        WLOG(WS_LOG_DEBUG, "Unable to grow the channel tables");
+        return;
+    }
+    WMEMSET(newHash, 0, 2 * newSz * sizeof(WOLFSSH_CHANNEL*));
+
+    if (ssh->channelHash != NULL)
+        WFREE(ssh->channelHash, ssh->ctx->heap, DYNTYPE_CHANNEL);
+    ssh->channelHash = newHash;
+    ssh->channelHashSz = newSz;
+
+    for (cur = ssh->channelList; cur != NULL; cur = cur->next) {
+        cur->peerHashed = 0;
+        ChannelHashAdd(ssh, cur);
+    }
+}
+
+
+WOLFSSH_CHANNEL* ChannelFind(WOLFSSH* ssh, word32 channel, byte peer)
+{
+    WOLFSSH_CHANNEL* findChannel = NULL;
+
+    WLOG(WS_LOG_DEBUG, "Entering ChannelFind(): %s %u",
+         peer ? "peer" : "self", channel);
+
+    if (ssh == NULL) {
+        WLOG(WS_LOG_DEBUG, "Null ssh, not looking for channel");
+    }
+    else if (ssh->channelHash != NULL) {
+        WOLFSSH_CHANNEL* list;
+
+        if (peer == WS_CHANNEL_ID_PEER) {
+            list = ssh->channelHash[ssh->channelHashSz
+                    + ChannelHashIdx(ssh, channel)];
+            while (list != NULL && list->peerChannel != channel)
+                list = list->peerHashNext;
+        }
+        else {
+            list = ssh->channelHash[ChannelHashIdx(ssh, channel)];
+            while (list != NULL && list->channel != channel)
+                list = list->selfHashNext;
+        }
+        findChannel = list;
+    }
+    else {
+        WOLFSSH_CHANNEL* list = ssh->channelList;
+        word32 listSz = ssh->channelListSz;
+
+        while (list && listSz) {
             if (channel == ((peer == WS_CHANNEL_ID_PEER) ?
                             list->peerChannel : list->channel)) {
                 findChannel = list;
@@ -2835,10 +3532,22 @@ int ChannelUpdatePeer(WOLFSSH_CHANNEL* channel, word32 peerChannelId,
     if (channel == NULL)
         ret = WS_BAD_ARGUMENT;
     else {
+        WOLFSSH* ssh = channel->ssh;
+
+        /* The peer's ID is now known, file the channel under it. */
+        if (channel->inList)
+            ChannelHashDelPeer(ssh, channel);
         channel->peerChannel = peerChannelId;
         channel->peerWindowSz = peerInitialWindowSz;
         channel->peerMaxPacketSz = peerMaxPacketSz;
         channel->openConfirmed = 1;
+        if (channel->inList && ssh->channelHash != NULL) {
+            WOLFSSH_CHANNEL** bucket = &ssh->channelHash[ssh->channelHashSz
+                    + ChannelHashIdx(ssh, peerChannelId)];
+            channel->peerHashNext = *bucket;
+            *bucket = channel;
+            channel->peerHashed = 1;
+        }
     }
 
     return ret;
@@ -2909,23 +3618,331 @@ int ChannelAppend(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel)
         return ret;
     }
 
-    if (ssh->channelList == NULL) {
+    ChannelHashGrow(ssh);
+
+    channel->next = NULL;
+    channel->prev = ssh->channelListTail;
+    if (ssh->channelList == NULL)
         ssh->channelList = channel;
-        ssh->channelListSz = 1;
+    else
+        ssh->channelListTail->next = channel;
+    ssh->channelListTail = channel;
+    ssh->channelListSz++;
+    channel->inList = 1;
+
+    if (ssh->channelHash != NULL) {
+        channel->peerHashed = 0;
+        ChannelHashAdd(ssh, channel);
     }
+
+    WLOG(WS_LOG_DEBUG, "Leaving ChannelAppend(), ret = %d", ret);
+    return ret;
+}
+
+
+/*
+ * The channels with data in their txQueue are kept in one of two rings,
+ * ssh->schedLatency or ssh->schedBulk. Each points at the last channel in
+ * its ring, whose schedNext is the first, so taking the first channel,
+ * moving it to the back, and adding a channel are all O(1).
+ */
+static int ChannelSchedIsLatency(const WOLFSSH_CHANNEL* channel)
+{
+    if (channel->schedPrio == WOLFSSH_CHANNEL_PRIO_AUTO)
+        return channel->sessionType == WOLFSSH_SESSION_SHELL ||
+                channel->sessionType == WOLFSSH_SESSION_TERMINAL;
+
+    return channel->schedPrio == WOLFSSH_CHANNEL_PRIO_LATENCY;
+}
+
+
+static void ChannelSchedLink(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel)
+{
+    WOLFSSH_CHANNEL** ring;
+
+    if (channel->schedLinked)
+        return;
+
+    ring = ChannelSchedIsLatency(channel) ?
+            &ssh->schedLatency : &ssh->schedBulk;
+    if (*ring == NULL)
+        channel->schedNext = channel;
     else {
-        WOLFSSH_CHANNEL* cur = ssh->channelList;
-        while (cur->next != NULL)
-            cur = cur->next;
-        cur->next = channel;
-        ssh->channelListSz++;
+        channel->schedNext = (*ring)->schedNext;
+        (*ring)->schedNext = channel;
+    }
+    *ring = channel;
+    channel->schedLinked = 1;
+    channel->schedTurn = 0;
+    channel->schedDeficit = 0;
+}
+
+
+static int ChannelSchedRingDel(WOLFSSH_CHANNEL** ring,
+        WOLFSSH_CHANNEL* channel)
+{
+    WOLFSSH_CHANNEL* prev = *ring;
+
+    if (prev == NULL)
+        return 0;
+
+    do {
+        if (prev->schedNext == channel) {
+            if (prev == channel)
+                *ring = NULL;
+            else {
+                prev->schedNext = channel->schedNext;
+                if (*ring == channel)
+                    *ring = prev;
+            }
+            channel->schedNext = NULL;
+            return 1;
+        }
+        prev = prev->schedNext;
+    } while (prev != *ring);
+
+    return 0;
+}
+
+
+static void ChannelSchedUnlink(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel)
+{
+    if (!channel->schedLinked)
+        return;
+
+    if (!ChannelSchedRingDel(&ssh->schedLatency, channel))
+        ChannelSchedRingDel(&ssh->schedBulk, channel);
+    channel->schedLinked = 0;
+    channel->schedTurn = 0;
+    channel->schedDeficit = 0;
+}
+
+
+/*
+ * Rate limits are a token bucket for the session and one for each channel,
+ * in each direction. Channel data passes as far as both buckets have
+ * tokens. The buckets refill by the milliseconds elapsed, from WTIME_MS(),
+ * up to their burst size.
+ */
+static void TokenBucketInit(TokenBucket* bucket, word32 rate, word32 burst)
+{
+    bucket->rate = rate;
+    bucket->burst = (burst == 0) ? rate : burst;
+    bucket->tokens = bucket->burst;
+    bucket->last = WTIME_MS();
+}
+
+
+static word32 TokenBucketAvail(TokenBucket* bucket)
+{
+    word64 now;
+    word64 elapsed;
+    word64 tokens;
+
+    if (bucket->rate == 0)
+        return (word32)-1;
+
+    now = WTIME_MS();
+    if (now > bucket->last) {
+        elapsed = now - bucket->last;
+        if (elapsed >= (word64)-1 / bucket->rate)
+            tokens = bucket->burst;
+        else
+            tokens = (word64)bucket->rate * elapsed / 1000;
+
+        /* Under a byte's worth of time keeps counting from the last
+         * refill. */
+        if (tokens > 0) {
+            tokens += bucket->tokens;
+            bucket->tokens = (tokens > bucket->burst) ?
+                    bucket->burst : (word32)tokens;
+            bucket->last = now;
+        }
+    }
+
+    return bucket->tokens;
+}
+
+
+/* Returns the milliseconds until the bucket has a token, 0 if it has one
+ * now. */
+static word32 TokenBucketWait(TokenBucket* bucket)
+{
+    word64 elapsed;
+    word64 due;
+
+    if (TokenBucketAvail(bucket) > 0)
+        return 0;
+
+    due = (1000 + (word64)bucket->rate - 1) / bucket->rate;
+    elapsed = WTIME_MS() - bucket->last;
+
+    return (elapsed < due) ? (word32)(due - elapsed) : 0;
+}
+
+
+static void TokenBucketTake(TokenBucket* bucket, word32 sz)
+{
+    if (bucket->rate != 0)
+        bucket->tokens -= min(sz, bucket->tokens);
+}
+
+
+void RateLimitInit(TokenBucket* tx, TokenBucket* rx,
+        const WS_RateLimit* limit)
+{
+    TokenBucketInit(tx, limit->txRate, limit->burst);
+    TokenBucketInit(rx, limit->rxRate, limit->burst);
+}
+
+
+/* Returns how many bytes may pass both the session's and the channel's
+ * bucket now. */
+static word32 RateAvail(TokenBucket* session, TokenBucket* channel)
+{
+    return min(TokenBucketAvail(session), TokenBucketAvail(channel));
+}
+
+
+/* Returns the milliseconds until a byte may pass both buckets. */
+static word32 RateWait(TokenBucket* session, TokenBucket* channel)
+{
+    word32 sessionWait = TokenBucketWait(session);
+    word32 channelWait = TokenBucketWait(channel);
+
+    return (sessionWait > channelWait) ? sessionWait : channelWait;
+}
+
+
+static void RateTake(TokenBucket* session, TokenBucket* channel, word32 sz)
+{
+    TokenBucketTake(session, sz);
+    TokenBucketTake(channel, sz);
+}
+
+
+/* Returns how much of the sz bytes of window the channel may give back to
+ * the peer now, and takes them from the receive buckets. */
+word32 ChannelRateGrant(WOLFSSH_CHANNEL* channel, word32 sz)
+{
+    WOLFSSH* ssh = channel->ssh;
+
+    sz = min(sz, RateAvail(&ssh->rxRate, &channel->rxRate));
+    RateTake(&ssh->rxRate, &channel->rxRate, sz);
+
+    return sz;
+}
+
+
+/* Returns 1 when the receive limits hold back window the peer is waiting
+ * on: half the window or more, or all of what the peer has left. */
+static int ChannelRateHeld(WOLFSSH_CHANNEL* channel)
+{
+    WOLFSSH* ssh = channel->ssh;
+
+    if (channel->windowConsumed == 0 || (ssh->rxRate.rate == 0 &&
+                channel->rxRate.rate == 0))
+        return 0;
+
+    return channel->windowConsumed >= channel->windowFullSz / 2 ||
+            channel->windowSz == 0;
+}
+
+
+/* Gives back the window the receive limits held back, as far as they
+ * allow now. Called from the worker, so a channel the peer can no longer
+ * send on gets going again without the application reading, and from
+ * wolfSSH_stream_read() before it waits on the peer. */
+int ChannelRateRelease(WOLFSSH* ssh)
+{
+    WOLFSSH_CHANNEL* channel;
+    word32 grant;
+    int ret = WS_SUCCESS;
+
+    if (ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    if (!ssh->rateLimited)
+        return WS_SUCCESS;
+
+    for (channel = ssh->channelList; channel != NULL && ret == WS_SUCCESS;
+            channel = channel->next) {
+        if (!ChannelRateHeld(channel))
+            continue;
+
+        grant = ChannelRateGrant(channel, channel->windowConsumed);
+        if (grant > 0) {
+            ret = SendChannelWindowAdjust(ssh, channel->channel, grant);
+            if (ret == WS_SUCCESS || ret == WS_WANT_WRITE) {
+                channel->windowSz += grant;
+                channel->windowConsumed -= grant;
+                ret = WS_SUCCESS;
+            }
+        }
     }
 
-    WLOG(WS_LOG_DEBUG, "Leaving ChannelAppend(), ret = %d", ret);
     return ret;
 }
 
 
+/* Returns the milliseconds until the rate limits let something they hold
+ * back move: window withheld from the peer, or a send refused with
+ * WS_WINDOW_FULL. WOLFSSH_RATE_NO_WAIT when nothing is held back. A send
+ * whose wait is over is reported once, as 0, and then left to the
+ * application to retry. */
+word32 RateLimitWait(WOLFSSH* ssh)
+{
+    WOLFSSH_CHANNEL* channel;
+    word32 wait = WOLFSSH_RATE_NO_WAIT;
+    word32 due;
+
+    if (!ssh->rateLimited)
+        return wait;
+
+    for (channel = ssh->channelList; channel != NULL && wait > 0;
+            channel = channel->next) {
+        if (ChannelRateHeld(channel)) {
+            due = RateWait(&ssh->rxRate, &channel->rxRate);
+            wait = min(wait, due);
+        }
+        if (channel->txRateHeld) {
+            due = RateWait(&ssh->txRate, &channel->txRate);
+            if (due == 0)
+                channel->txRateHeld = 0;
+            wait = min(wait, due);
+        }
+    }
+
+    return wait;
+}
+
+
+/* Drops the messages for the peer's channel peerId held in the rekey
+ * queue. Their recipient is the channel ID right after the message ID. */
+static void RekeyQueueDrop(WOLFSSH* ssh, word32 peerId)
+{
+    WOLFSSH_BUFFER* queue = &ssh->rekeyQueue;
+    word32 readIdx = queue->idx;
+    word32 writeIdx = queue->idx;
+    word32 entrySz;
+    word32 entryId;
+
+    while (readIdx < queue->length) {
+        ato32(queue->buffer + readIdx, &entrySz);
+        entrySz += LENGTH_SZ;
+        ato32(queue->buffer + readIdx + LENGTH_SZ + MSG_ID_SZ, &entryId);
+        if (entryId != peerId) {
+            if (writeIdx != readIdx)
+                WMEMMOVE(queue->buffer + writeIdx,
+                        queue->buffer + readIdx, entrySz);
+            writeIdx += entrySz;
+        }
+        readIdx += entrySz;
+    }
+    queue->length = writeIdx;
+}
+
+
 int ChannelRemove(WOLFSSH* ssh, word32 channel, byte peer)
 {
     int ret = WS_SUCCESS;
@@ -2937,44 +3954,88 @@ int ChannelRemove(WOLFSSH* ssh, word32 channel, byte peer)
         ret = WS_BAD_ARGUMENT;
 
     if (ret == WS_SUCCESS) {
-        list = ssh->channelList;
+        list = ChannelFind(ssh, channel, peer);
         if (list == NULL)
             ret = WS_INVALID_CHANID;
     }
 
     if (ret == WS_SUCCESS) {
-        WOLFSSH_CHANNEL* prev = NULL;
-        word32 listSz = ssh->channelListSz;
+        /* Data the channel still had queued is dropped with it. */
+        ssh->schedQueuedSz -= list->txQueue.length - list->txQueue.idx;
+        ssh->windowGrownSz -= list->windowGrownSz;
+        CtxWindowGive(ssh->ctx, list->windowGrownSz);
+        /* Messages held for the new keys name the channel by the peer's
+         * ID. With our CLOSE queued behind them, the peer still has the
+         * channel when they arrive. Without it, the channel is going away
+         * unannounced and nothing more is sent for it. */
+        if (!list->closeTxd)
+            RekeyQueueDrop(ssh, list->peerChannel);
+        ChannelSchedUnlink(ssh, list);
+        ChannelHashDel(ssh, list);
+        if (list->prev == NULL)
+            ssh->channelList = list->next;
+        else
+            list->prev->next = list->next;
+        if (list->next == NULL)
+            ssh->channelListTail = list->prev;
+        else
+            list->next->prev = list->prev;
+        ssh->channelListSz--;
+        ChannelDelete(list, ssh->ctx->heap);
+    }
 
-        while (list && listSz) {
-            if (channel == ((peer == WS_CHANNEL_ID_PEER) ?
-                            list->peerChannel : list->channel)) {
-                if (prev == NULL)
-                    ssh->channelList = list->next;
-                else
-                    prev->next = list->next;
-                ChannelDelete(list, ssh->ctx->heap);
-                ssh->channelListSz--;
+    WLOG(WS_LOG_DEBUG, "Leaving ChannelRemove(), ret = %d", ret);
+    return ret;
+}
 
-                break;
-            }
-            prev = list;
-            list = list->next;
-            listSz--;
-        }
 
-        if (listSz == 0)
-            ret = WS_INVALID_CHANID;
+/* Makes room in the channel's input buffer for needSz bytes from the start
+ * of the buffer, doubling it from WOLFSSH_CHANNEL_BUFFER_MIN up to the
+ * channel's window. The bytes before idx stay counted until the next
+ * window adjust, so the data keeps its place in the new buffer. */
+static int ChannelBufferGrow(WOLFSSH_CHANNEL* channel, word32 needSz)
+{
+    WOLFSSH_BUFFER* inBuf = &channel->inputBuffer;
+    byte* newBuffer;
+    word32 newSz;
+
+    if (needSz > channel->windowFullSz)
+        return WS_RECV_OVERFLOW_E;
+
+    newSz = WOLFSSH_CHANNEL_BUFFER_MIN;
+    if (inBuf->dynamicFlag)
+        newSz = (inBuf->bufferSz > channel->windowFullSz / 2) ?
+                channel->windowFullSz : inBuf->bufferSz * 2;
+    if (newSz < needSz)
+        newSz = needSz;
+    if (newSz > channel->windowFullSz)
+        newSz = channel->windowFullSz;
+
+    newBuffer = (byte*)WMALLOC(newSz, inBuf->heap, DYNTYPE_BUFFER);
+    if (newBuffer == NULL) {
+        WLOG(WS_LOG_ERROR, "Not enough memory to grow channel buffer");
+        return WS_MEMORY_E;
     }
 
-    WLOG(WS_LOG_DEBUG, "Leaving ChannelRemove(), ret = %d", ret);
-    return ret;
+    if (inBuf->length > inBuf->idx)
+        WMEMCPY(newBuffer + inBuf->idx, inBuf->buffer + inBuf->idx,
+                inBuf->length - inBuf->idx);
+    if (inBuf->dynamicFlag)
+        WFREE(inBuf->buffer, inBuf->heap, DYNTYPE_BUFFER);
+
+    inBuf->buffer = newBuffer;
+    inBuf->bufferSz = newSz;
+    inBuf->dynamicFlag = 1;
+
+    WLOG(WS_LOG_INFO, "  channel buffer grown to %u", newSz);
+    return WS_SUCCESS;
 }
 
 
 int ChannelPutData(WOLFSSH_CHANNEL* channel, byte* data, word32 dataSz)
 {
     WOLFSSH_BUFFER* inBuf;
+    int ret;
 
     WLOG(WS_LOG_DEBUG, "Entering ChannelPutData()");
 
@@ -2989,19 +4050,48 @@ int ChannelPutData(WOLFSSH_CHANNEL* channel, byte* data, word32 dataSz)
         return WS_FATAL_ERROR;
     }
 
-    if (inBuf->length < inBuf->bufferSz &&
-        inBuf->length + dataSz <= inBuf->bufferSz) {
+    if (inBuf->length > inBuf->bufferSz ||
+            dataSz > inBuf->bufferSz - inBuf->length) {
+        if (inBuf->length > (word32)-1 - dataSz)
+            return WS_RECV_OVERFLOW_E;
+        ret = ChannelBufferGrow(channel, inBuf->length + dataSz);
+        if (ret != WS_SUCCESS)
+            return ret;
+    }
+
+    WMEMCPY(inBuf->buffer + inBuf->length, data, dataSz);
+    inBuf->length += dataSz;
 
-        WMEMCPY(inBuf->buffer + inBuf->length, data, dataSz);
-        inBuf->length += dataSz;
+    WLOG(WS_LOG_INFO, "  dataSz = %u", dataSz);
+    WLOG(WS_LOG_INFO, "  windowSz = %u", channel->windowSz);
+    channel->windowSz -= dataSz;
+    WLOG(WS_LOG_INFO, "  update windowSz = %u", channel->windowSz);
 
-        WLOG(WS_LOG_INFO, "  dataSz = %u", dataSz);
-        WLOG(WS_LOG_INFO, "  windowSz = %u", channel->windowSz);
-        channel->windowSz -= dataSz;
-        WLOG(WS_LOG_INFO, "  update windowSz = %u", channel->windowSz);
-    }
-    else {
-        return WS_RECV_OVERFLOW_E;
+    return WS_SUCCESS;
+}
+
+
+/* Enlarges the channel's window to newSz bytes, or as far toward it as
+ * the context's window budget allows. The input buffer grows into it as
+ * data arrives. The caller advertises the added space to the peer. The
+ * growth is counted against the session's window total and the context's
+ * budget. */
+int ChannelGrowWindow(WOLFSSH_CHANNEL* channel, word32 newSz)
+{
+    WLOG(WS_LOG_DEBUG, "Entering ChannelGrowWindow()");
+
+    if (channel == NULL || channel->ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    if (newSz > channel->windowFullSz) {
+        word32 growSz = CtxWindowTake(channel->ssh->ctx,
+                newSz - channel->windowFullSz);
+
+        channel->windowFullSz += growSz;
+        channel->windowGrownSz += growSz;
+        channel->ssh->windowGrownSz += growSz;
+        WLOG(WS_LOG_INFO, "  channel window grown to %u",
+                channel->windowFullSz);
     }
 
     return WS_SUCCESS;
@@ -3031,6 +4121,10 @@ int BufferInit(WOLFSSH_BUFFER* buffer, word32 size, void* heap)
     return WS_SUCCESS;
 }
 
+/* Makes room for sz more bytes after buf->length. The allocation is only
+ * ever grown, geometrically, so a buffer settles at the size the
+ * connection needs. Unread data is moved down to the head of the buffer
+ * only when the free space at the tail is too small. */
 int GrowBuffer(WOLFSSH_BUFFER* buf, word32 sz)
 {
 #if 0
@@ -3038,21 +4132,32 @@ int GrowBuffer(WOLFSSH_BUFFER* buf, word32 sz)
     WLOG(WS_LOG_DEBUG, "GB: sz = %d", sz);
     WLOG(WS_LOG_DEBUG, "GB: usedSz = %d", buf->length - buf->idx);
 #endif
-    /* New buffer will end up being sz+ssh->length-ssh->idx long
-     * empty space at the head of the buffer will be compressed */
     if (buf != NULL) {
-        word32 newSz = sz + buf->length - buf->idx;
+        word32 usedSz = buf->length - buf->idx;
+        word32 newSz = sz + usedSz;
+
+        if (newSz < sz) {
+            WLOG(WS_LOG_ERROR, "Buffer size overflow");
+            return WS_OVERFLOW_E;
+        }
+
+        if (buf->length <= buf->bufferSz && sz <= buf->bufferSz - buf->length) {
+            /* Enough room at the tail already. */
+        }
+        else if (newSz > buf->bufferSz) {
+            byte* newBuffer;
 
-        if (newSz > buf->bufferSz) {
-            byte* newBuffer = (byte*)WMALLOC(newSz, buf->heap, DYNTYPE_BUFFER);
+            if (buf->bufferSz <= (word32)-1 / 2 && newSz < buf->bufferSz * 2)
+                newSz = buf->bufferSz * 2;
 
+            newBuffer = (byte*)WMALLOC(newSz, buf->heap, DYNTYPE_BUFFER);
             if (newBuffer == NULL) {
                 WLOG(WS_LOG_ERROR, "Not enough memory left to grow buffer");
                 return WS_MEMORY_E;
             }
 
-            if (buf->length > 0) {
-                WMEMCPY(newBuffer, buf->buffer + buf->idx, buf->length - buf->idx);
+            if (usedSz > 0) {
+                WMEMCPY(newBuffer, buf->buffer + buf->idx, usedSz);
             }
 
             if (!buf->dynamicFlag) {
@@ -3064,15 +4169,15 @@ int GrowBuffer(WOLFSSH_BUFFER* buf, word32 sz)
 
             buf->buffer = newBuffer;
             buf->bufferSz = newSz;
-            buf->length -= buf->idx;
+            buf->length = usedSz;
             buf->idx = 0;
         }
         else {
-            if (buf->length > 0) {
-                WMEMMOVE(buf->buffer, buf->buffer + buf->idx, buf->length - buf->idx);
-                buf->length -= buf->idx;
-                buf->idx = 0;
+            if (usedSz > 0) {
+                WMEMMOVE(buf->buffer, buf->buffer + buf->idx, usedSz);
             }
+            buf->length = usedSz;
+            buf->idx = 0;
         }
     }
 
@@ -3080,6 +4185,11 @@ int GrowBuffer(WOLFSSH_BUFFER* buf, word32 sz)
 }
 
 
+/* Called when a packet has been consumed from or flushed out of buf. The
+ * allocation is kept for the next packet; when the buffer is drained the
+ * indexes are reset so the next packet starts at the head. A drained buffer
+ * larger than a non-zero buf->retainSz is released. forcedFree drops any
+ * data and always releases the buffer. */
 void ShrinkBuffer(WOLFSSH_BUFFER* buf, int forcedFree)
 {
     WLOG(WS_LOG_DEBUG, "Entering ShrinkBuffer()");
@@ -3093,12 +4203,16 @@ void ShrinkBuffer(WOLFSSH_BUFFER* buf, int forcedFree)
         WLOG(WS_LOG_DEBUG, "SB: usedSz = %u, forcedFree = %u",
              usedSz, forcedFree);
 
-        if (!forcedFree && usedSz > STATIC_BUFFER_LEN)
-            return;
+        if (!forcedFree) {
+            if (usedSz > 0) {
+                /* GrowBuffer() moves the data down when it needs the room. */
+                return;
+            }
 
-        if (!forcedFree && usedSz) {
-            WLOG(WS_LOG_DEBUG, "SB: shifting down");
-            WMEMCPY(buf->staticBuffer, buf->buffer + buf->idx, usedSz);
+            buf->length = 0;
+            buf->idx = 0;
+            if (buf->retainSz == 0 || buf->bufferSz <= buf->retainSz)
+                return;
         }
 
         if (buf->dynamicFlag) {
@@ -3108,7 +4222,7 @@ void ShrinkBuffer(WOLFSSH_BUFFER* buf, int forcedFree)
         buf->dynamicFlag = 0;
         buf->buffer = buf->staticBuffer;
         buf->bufferSz = STATIC_BUFFER_LEN;
-        buf->length = forcedFree ? 0 : usedSz;
+        buf->length = 0;
         buf->idx = 0;
     }
 
@@ -3224,6 +4338,22 @@ int wolfSSH_SendPacket(WOLFSSH* ssh)
         return WS_SOCKET_ERROR_E;
     }
 
+    /* The connect pipeline writes its requests with the NEWKEYS. */
+    if (ssh->isQueueing) {
+        WLOG(WS_LOG_DEBUG, "Queueing, holding %u bytes",
+                ssh->outputBuffer.length - ssh->outputBuffer.idx);
+        return WS_SUCCESS;
+    }
+
+    /* While corked, leave the packets in the buffer until enough are
+     * pending. Key exchange messages are never held back. */
+    if (ssh->isCorked && !ssh->isKeying &&
+            ssh->outputBuffer.length - ssh->outputBuffer.idx < ssh->corkSz) {
+        WLOG(WS_LOG_DEBUG, "Corked, holding %u bytes",
+                ssh->outputBuffer.length - ssh->outputBuffer.idx);
+        return WS_SUCCESS;
+    }
+
     while (ssh->outputBuffer.length > ssh->outputBuffer.idx) {
         int sent;
 
@@ -3275,6 +4405,10 @@ int wolfSSH_SendPacket(WOLFSSH* ssh)
 }
 
 
+/* Makes sure at least size bytes are in the input buffer. When read-ahead
+ * is enabled, asks the I/O callback for up to readAheadSz bytes so later
+ * packets can be served from the buffer, but only waits for the bytes
+ * actually needed. */
 static int GetInputData(WOLFSSH* ssh, word32 size)
 {
     int in;
@@ -3282,6 +4416,7 @@ static int GetInputData(WOLFSSH* ssh, word32 size)
     /* Take into account the data already in the buffer. Update size
      * for what is missing in the request. */
     word32 haveDataSz;
+    word32 readSz;
 
     /* reset want read state before attempting to read */
     if (ssh->error == WS_WANT_READ) {
@@ -3298,7 +4433,13 @@ static int GetInputData(WOLFSSH* ssh, word32 size)
         size -= haveDataSz;
     }
 
-    if (GrowBuffer(&ssh->inputBuffer, size) < 0) {
+    /* Read ahead so that up to readAheadSz bytes are buffered in total. */
+    readSz = size;
+    if (ssh->readAheadSz > haveDataSz + size) {
+        readSz = ssh->readAheadSz - haveDataSz;
+    }
+
+    if (GrowBuffer(&ssh->inputBuffer, readSz) < 0) {
         ssh->error = WS_MEMORY_E;
         return WS_FATAL_ERROR;
     }
@@ -3307,7 +4448,7 @@ static int GetInputData(WOLFSSH* ssh, word32 size)
     do {
         in = ReceiveData(ssh,
                      ssh->inputBuffer.buffer + ssh->inputBuffer.length,
-                     size);
+                     readSz);
         if (in == -1) {
             ssh->error = WS_SOCKET_ERROR_E;
             return WS_FATAL_ERROR;
@@ -3318,9 +4459,15 @@ static int GetInputData(WOLFSSH* ssh, word32 size)
             return WS_FATAL_ERROR;
         }
 
+        if (in > (int)readSz) {
+            ssh->error = WS_RECV_OVERFLOW_E;
+            return WS_FATAL_ERROR;
+        }
+
         if (in >= 0) {
             ssh->inputBuffer.length += in;
-            size -= in;
+            readSz -= in;
+            size = ((word32)in < size) ? size - in : 0;
         }
         else {
             /* all other unexpected negative values is a failure case */
@@ -3719,6 +4866,10 @@ static INLINE byte BlockSzForId(byte id)
         case ID_AES192_GCM:
         case ID_AES256_GCM:
             return AES_BLOCK_SIZE;
+#endif
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+        case ID_CHACHA20_POLY1305:
+            return CHACHA_POLY_BLOCK_SZ;
 #endif
         default:
             return 0;
@@ -3739,10 +4890,12 @@ static INLINE byte MacSzForId(byte id)
 #endif
 #ifndef WOLFSSH_NO_HMAC_SHA2_256
         case ID_HMAC_SHA2_256:
+        case ID_HMAC_SHA2_256_ETM:
             return WC_SHA256_DIGEST_SIZE;
 #endif
 #ifndef WOLFSSH_NO_HMAC_SHA2_512
         case ID_HMAC_SHA2_512:
+        case ID_HMAC_SHA2_512_ETM:
             return WC_SHA512_DIGEST_SIZE;
 #endif
         default:
@@ -3764,10 +4917,12 @@ static INLINE byte KeySzForId(byte id)
 #endif
 #ifndef WOLFSSH_NO_HMAC_SHA2_256
         case ID_HMAC_SHA2_256:
+        case ID_HMAC_SHA2_256_ETM:
             return WC_SHA256_DIGEST_SIZE;
 #endif
 #ifndef WOLFSSH_NO_HMAC_SHA2_512
         case ID_HMAC_SHA2_512:
+        case ID_HMAC_SHA2_512_ETM:
             return WC_SHA512_DIGEST_SIZE;
 #endif
 #ifndef WOLFSSH_NO_AES_CBC
@@ -3793,24 +4948,55 @@ static INLINE byte KeySzForId(byte id)
             return AES_192_KEY_SIZE;
         case ID_AES256_GCM:
             return AES_256_KEY_SIZE;
+#endif
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+        case ID_CHACHA20_POLY1305:
+            return CHACHA_POLY_KEY_SZ;
 #endif
         default:
             return 0;
     }
 }
 
-enum wc_HashType HashForId(byte id)
+
+static INLINE int MacHashForId(byte id)
 {
     switch (id) {
-
-        /* SHA1 */
-#ifndef WOLFSSH_NO_DH_GROUP1_SHA1
-        case ID_DH_GROUP1_SHA1:
-            return WC_HASH_TYPE_SHA;
+#ifndef WOLFSSH_NO_HMAC_SHA1
+        case ID_HMAC_SHA1:
+            return WC_SHA;
 #endif
-#ifndef WOLFSSH_NO_DH_GROUP14_SHA1
-        case ID_DH_GROUP14_SHA1:
-            return WC_HASH_TYPE_SHA;
+#ifndef WOLFSSH_NO_HMAC_SHA1_96
+        case ID_HMAC_SHA1_96:
+            return WC_SHA;
+#endif
+#ifndef WOLFSSH_NO_HMAC_SHA2_256
+        case ID_HMAC_SHA2_256:
+        case ID_HMAC_SHA2_256_ETM:
+            return WC_SHA256;
+#endif
+#ifndef WOLFSSH_NO_HMAC_SHA2_512
+        case ID_HMAC_SHA2_512:
+        case ID_HMAC_SHA2_512_ETM:
+            return WC_SHA512;
+#endif
+        default:
+            return WC_HASH_TYPE_NONE;
+    }
+}
+
+enum wc_HashType HashForId(byte id)
+{
+    switch (id) {
+
+        /* SHA1 */
+#ifndef WOLFSSH_NO_DH_GROUP1_SHA1
+        case ID_DH_GROUP1_SHA1:
+            return WC_HASH_TYPE_SHA;
+#endif
+#ifndef WOLFSSH_NO_DH_GROUP14_SHA1
+        case ID_DH_GROUP14_SHA1:
+            return WC_HASH_TYPE_SHA;
 #endif
 #ifndef WOLFSSH_NO_SSH_RSA_SHA1
         case ID_SSH_RSA:
@@ -3974,6 +5160,27 @@ static INLINE byte AeadModeForId(byte id)
         case ID_AES192_GCM:
         case ID_AES256_GCM:
             return 1;
+#endif
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+        case ID_CHACHA20_POLY1305:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+
+static INLINE byte EtmModeForId(byte id)
+{
+    switch (id) {
+#ifndef WOLFSSH_NO_HMAC_SHA2_256
+        case ID_HMAC_SHA2_256_ETM:
+            return 1;
+#endif
+#ifndef WOLFSSH_NO_HMAC_SHA2_512
+        case ID_HMAC_SHA2_512_ETM:
+            return 1;
 #endif
         default:
             return 0;
@@ -3997,6 +5204,47 @@ static word32 AlgoListSz(const char* algoList)
 }
 
 
+/* Frees the key pair made for a KEX init guessed with the KEXINIT, so the
+ * KEX init for the negotiated algorithm can be made. */
+static void KexGuessFree(HandshakeInfo* hs)
+{
+#ifndef WOLFSSH_NO_DH
+    if (hs->useDh)
+        wc_FreeDhKey(&hs->privKey.dh);
+#endif
+#ifndef WOLFSSH_NO_ECDH
+    if (hs->useEcc || hs->useEccMlKem)
+        wc_ecc_free(&hs->privKey.ecc);
+#endif
+#ifndef WOLFSSH_NO_CURVE25519_SHA256
+    if (hs->useCurve25519)
+        wc_curve25519_free(&hs->privKey.curve25519);
+#endif
+    hs->useDh = 0;
+    hs->useEcc = 0;
+    hs->useEccMlKem = 0;
+    hs->useCurve25519 = 0;
+    ForceZero(hs->x, sizeof(hs->x));
+    hs->xSz = 0;
+    hs->eSz = 0;
+    hs->kexGuess = 0;
+}
+
+
+/* Returns 1 and consumes the message if it is the peer's guessed KEX packet
+ * for an algorithm that wasn't negotiated. RFC 4253 section 7. */
+static int SkipKexGuess(WOLFSSH* ssh, word32 len, word32* idx)
+{
+    if (!ssh->handshake->kexPacketSkip)
+        return 0;
+
+    WLOG(WS_LOG_DEBUG, "Skipping the peer's guessed KEX packet");
+    ssh->handshake->kexPacketSkip = 0;
+    *idx += len;
+    return 1;
+}
+
+
 static int DoKexInit(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
 {
     int ret = WS_SUCCESS;
@@ -4064,7 +5312,11 @@ static int DoKexInit(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
                 (const byte*)ssh->algoListKex, cannedAlgoNamesSz);
     }
     if (ret == WS_SUCCESS) {
-        ssh->handshake->kexIdGuess = list[0];
+        /* A guessed KEX packet is only right if both sides list the same
+         * KEX algorithm and host key algorithm first. Unknown names are
+         * kept at the front of the list for this. */
+        ssh->handshake->kexGuessMatch = listSz > 0 && cannedListSz > 0
+            && list[0] != ID_UNKNOWN && list[0] == cannedList[0];
         algoId = MatchIdLists(side, list, listSz,
                 cannedList, cannedListSz);
         if (algoId == ID_UNKNOWN) {
@@ -4109,6 +5361,10 @@ static int DoKexInit(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
         }
     }
     if (ret == WS_SUCCESS) {
+        if (listSz == 0 || cannedListSz == 0
+                || list[0] == ID_UNKNOWN || list[0] != cannedList[0]) {
+            ssh->handshake->kexGuessMatch = 0;
+        }
         algoId = MatchIdLists(side, list, listSz, cannedList, cannedListSz);
         if (algoId == ID_UNKNOWN) {
             WLOG(WS_LOG_DEBUG, "Unable to negotiate Server Host Key Algo");
@@ -4169,7 +5425,10 @@ static int DoKexInit(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
             ssh->handshake->keys.ivSz =
                 ssh->handshake->peerKeys.ivSz =
                 AEAD_NONCE_SZ;
-            ssh->handshake->macSz = ssh->handshake->blockSz;
+            if (algoId == ID_CHACHA20_POLY1305)
+                ssh->handshake->macSz = CHACHA_POLY_TAG_SZ;
+            else
+                ssh->handshake->macSz = ssh->handshake->blockSz;
 #endif
         }
     }
@@ -4210,6 +5469,7 @@ static int DoKexInit(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
         else {
             ssh->handshake->macId = algoId;
             ssh->handshake->macSz = MacSzForId(algoId);
+            ssh->handshake->etmMode = EtmModeForId(algoId);
             ssh->handshake->keys.macKeySz =
                 ssh->handshake->peerKeys.macKeySz =
                 KeySzForId(algoId);
@@ -4272,6 +5532,16 @@ static int DoKexInit(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
                     ssh->handshake->kexPacketFollows ? "yes" : "no");
         }
     }
+    if (ret == WS_SUCCESS && !ssh->handshake->kexGuessMatch) {
+        if (ssh->handshake->kexPacketFollows) {
+            WLOG(WS_LOG_DEBUG, "Peer's guessed KEX packet will be skipped");
+            ssh->handshake->kexPacketSkip = 1;
+        }
+        if (ssh->handshake->kexGuess) {
+            WLOG(WS_LOG_DEBUG, "KEX guess was wrong, will send it again");
+            KexGuessFree(ssh->handshake);
+        }
+    }
 
     /* Skip the "for future use" length. */
     if (ret == WS_SUCCESS) {
@@ -4294,7 +5564,7 @@ static int DoKexInit(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
 
         /* account for possible want write case from SendKexInit */
         if (ret == WS_SUCCESS || ret == WS_WANT_WRITE)
-            ret = wc_HashInit(hash, hashId);
+            ret = wc_HashInit_ex(hash, hashId, ssh->ctx->heap, ssh->devId);
 
         if (ret == WS_SUCCESS) {
             if (ssh->ctx->side == WOLFSSH_ENDPOINT_SERVER) {
@@ -4572,18 +5842,18 @@ static int DoKexDhInit(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
             idx == NULL)
         ret = WS_BAD_ARGUMENT;
 
-    if (ret == WS_SUCCESS) {
-        if (ssh->handshake->kexPacketFollows
-                && ssh->handshake->kexIdGuess != ssh->handshake->kexId) {
-
-            /* skip this message. */
-            WLOG(WS_LOG_DEBUG, "Skipping the client's KEX init function.");
-            ssh->handshake->kexPacketFollows = 0;
-            *idx += len;
-            return WS_SUCCESS;
-        }
+    /* The packet is kept while the signature is offloaded. It was parsed,
+     * and e stored, on the first pass, only the reply is left. */
+    if (ret == WS_SUCCESS && ssh->handshake->kexReply != NULL) {
+        ret = SendKexDhReply(ssh);
+        if (ret != WS_WANT_CRYPTO)
+            *idx = len;
+        return ret;
     }
 
+    if (ret == WS_SUCCESS && SkipKexGuess(ssh, len, idx))
+        return WS_SUCCESS;
+
     if (ret == WS_SUCCESS) {
         begin = *idx;
         ret = GetUint32(&eSz, buf, len, &begin);
@@ -4654,7 +5924,8 @@ static int ParseRSAPubKey(WOLFSSH *ssh,
     word32 pubKeyIdx = 0;
     word32 scratch;
 
-    ret = wc_InitRsaKey(&sigKeyBlock_ptr->sk.rsa.key, ssh->ctx->heap);
+    ret = wc_InitRsaKey_ex(&sigKeyBlock_ptr->sk.rsa.key, ssh->ctx->heap,
+            ssh->devId);
     if (ret != 0)
         ret = WS_RSA_E;
     if (ret == 0)
@@ -4707,7 +5978,7 @@ static int ParseECCPubKey(WOLFSSH *ssh,
     word32 scratch;
 
     ret = wc_ecc_init_ex(&sigKeyBlock_ptr->sk.ecc.key, ssh->ctx->heap,
-                                 INVALID_DEVID);
+                                 ssh->devId);
 #ifdef HAVE_WC_ECC_SET_RNG
     if (ret == 0)
         ret = wc_ecc_set_rng(&sigKeyBlock_ptr->sk.ecc.key, ssh->rng);
@@ -4770,7 +6041,7 @@ static int ParseEd25519PubKey(WOLFSSH *ssh,
     word32 encASz, pubKeyIdx = 0;
 
     ret = wc_ed25519_init_ex(&sigKeyBlock_ptr->sk.ed25519.key,
-            ssh->ctx->heap, INVALID_DEVID);
+            ssh->ctx->heap, ssh->devId);
     if (ret != 0)
         ret = WS_ED25519_E;
 
@@ -4969,7 +6240,7 @@ static int ParseECCPubKeyCert(WOLFSSH *ssh,
     ret = ParsePubKeyCert(ssh, pubKey, pubKeySz, &der, &derSz);
     if (ret == WS_SUCCESS) {
         error = wc_ecc_init_ex(&sigKeyBlock_ptr->sk.ecc.key, ssh->ctx->heap,
-                                 INVALID_DEVID);
+                                 ssh->devId);
     #ifdef HAVE_WC_ECC_SET_RNG
         if (error == 0)
             error = wc_ecc_set_rng(&sigKeyBlock_ptr->sk.ecc.key, ssh->rng);
@@ -5010,7 +6281,8 @@ static int ParseRSAPubKeyCert(WOLFSSH *ssh,
 
     ret = ParsePubKeyCert(ssh, pubKey, pubKeySz, &der, &derSz);
     if (ret == WS_SUCCESS) {
-        error = wc_InitRsaKey(&sigKeyBlock_ptr->sk.rsa.key, ssh->ctx->heap);
+        error = wc_InitRsaKey_ex(&sigKeyBlock_ptr->sk.rsa.key,
+                ssh->ctx->heap, ssh->devId);
         if (error == 0)
             error = wc_RsaPublicKeyDecode(der, &idx,
                                           &sigKeyBlock_ptr->sk.rsa.key, derSz);
@@ -5174,7 +6446,7 @@ static int KeyAgreeEcdh_client(WOLFSSH* ssh, byte hashId,
     #else /* ! WOLFSSH_SMALL_STACK */
         key_ptr = &key_s;
     #endif /* WOLFSSH_SMALL_STACK */
-    ret = wc_ecc_init(key_ptr);
+    ret = wc_ecc_init_ex(key_ptr, ssh->ctx->heap, ssh->devId);
     #ifdef HAVE_WC_ECC_SET_RNG
     if (ret == 0)
         ret = wc_ecc_set_rng(key_ptr, ssh->rng);
@@ -5229,7 +6501,7 @@ static int KeyAgreeCurve25519_client(WOLFSSH* ssh, byte hashId,
     WLOG(WS_LOG_DEBUG, "Entering KeyAgreeCurve25519_client()");
     WOLFSSH_UNUSED(hashId);
 
-    ret = wc_curve25519_init(&pub);
+    ret = wc_curve25519_init_ex(&pub, ssh->ctx->heap, ssh->devId);
     if (ret == 0) {
         ret = wc_curve25519_check_public(f, fSz,
                 EC25519_LITTLE_ENDIAN);
@@ -5308,7 +6580,8 @@ static int KeyAgreeEcdhMlKem_client(WOLFSSH* ssh, byte hashId,
      * decapsulate the ciphertext of the post-quantum KEM. */
 
     if (ret == 0) {
-        ret = wc_MlKemKey_Init(&kem, WC_ML_KEM_768, ssh->ctx->heap, INVALID_DEVID);
+        ret = wc_MlKemKey_Init(&kem, WC_ML_KEM_768, ssh->ctx->heap,
+                ssh->devId);
     }
 
     if (ret == 0) {
@@ -5332,7 +6605,7 @@ static int KeyAgreeEcdhMlKem_client(WOLFSSH* ssh, byte hashId,
     }
 
     if (ret == 0) {
-        ret = wc_ecc_init(key_ptr);
+        ret = wc_ecc_init_ex(key_ptr, ssh->ctx->heap, ssh->devId);
     }
     #ifdef HAVE_WC_ECC_SET_RNG
     if (ret == 0) {
@@ -5392,8 +6665,8 @@ static int KeyAgreeEcdhMlKem_client(WOLFSSH* ssh, byte hashId,
     }
 
     if (ret == 0) {
-        ret = wc_Hash(hashId, ssh->k, ssh->kSz, sharedSecretHash,
-                      sharedSecretHashSz);
+        ret = wc_Hash_ex(hashId, ssh->k, ssh->kSz, sharedSecretHash,
+                      sharedSecretHashSz, ssh->ctx->heap, ssh->devId);
     }
 
     if (ret == 0) {
@@ -5453,6 +6726,46 @@ static int KeyAgree_client(WOLFSSH* ssh, byte hashId, const byte* f, word32 fSz)
 }
 
 
+#ifndef NO_WOLFSSH_CLIENT
+/*
+ * Sends the client's NEWKEYS followed by the userauth service request and
+ * the first userauth request, in one write, without waiting for the
+ * server's NEWKEYS or SERVICE_ACCEPT. wolfSSH_connect() then only waits
+ * for the replies.
+ */
+static int SendNewKeysPipelined(WOLFSSH* ssh)
+{
+    byte authType = ID_NONE;
+    int ret;
+
+    WLOG(WS_LOG_DEBUG, "Entering SendNewKeysPipelined()");
+
+    if (ssh->connectPipeline != WOLFSSH_USERAUTH_NONE)
+        authType = ssh->connectPipeline;
+
+    ssh->isQueueing = 1;
+    ret = SendNewKeys(ssh);
+    if (ret == WS_SUCCESS)
+        ret = SendServiceRequest(ssh, ID_SERVICE_USERAUTH);
+    if (ret == WS_SUCCESS) {
+    #ifdef WOLFSSH_AGENT
+        ClientAgentNew(ssh);
+    #endif
+        ret = SendUserAuthRequest(ssh, authType, 0);
+    }
+    ssh->isQueueing = 0;
+
+    if (ret == WS_SUCCESS) {
+        ssh->connectPipelined = 1;
+        ret = wolfSSH_SendPacket(ssh);
+    }
+
+    WLOG(WS_LOG_DEBUG, "Leaving SendNewKeysPipelined(), ret = %d", ret);
+    return ret;
+}
+#endif /* NO_WOLFSSH_CLIENT */
+
+
 static int DoKexDhReply(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
 {
     struct wolfSSH_sigKeyBlock *sigKeyBlock_ptr = NULL;
@@ -5820,8 +7133,14 @@ static int DoKexDhReply(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
         ret = GenerateKeys(ssh, hashId, !ssh->handshake->useEccMlKem);
     }
 
-    if (ret == WS_SUCCESS)
-        ret = SendNewKeys(ssh);
+    if (ret == WS_SUCCESS) {
+    #ifndef NO_WOLFSSH_CLIENT
+        if (ssh->connectPipeline && ssh->connectState < CONNECT_KEYED)
+            ret = SendNewKeysPipelined(ssh);
+        else
+    #endif
+            ret = SendNewKeys(ssh);
+    }
 
     if (sigKeyBlock_ptr)
         WFREE(sigKeyBlock_ptr, ssh->ctx->heap, DYNTYPE_PRIVKEY);
@@ -5830,6 +7149,41 @@ static int DoKexDhReply(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
 }
 
 
+#if !defined(WOLFSSH_NO_AES_CBC) || !defined(WOLFSSH_NO_AES_CTR) || \
+    !defined(WOLFSSH_NO_AES_GCM)
+/* Readies the AES context for one direction of the transport on the
+ * session's crypto device before it is keyed. */
+static int InitCipherAes(Aes* aes, void* heap, int devId)
+{
+    wc_AesFree(aes);
+    return wc_AesInit(aes, heap, devId);
+}
+#endif
+
+
+/*
+ * Keys the HMAC context for one direction of the transport. The keyed
+ * context lives as long as the keys do. wc_HmacFinal() leaves the context
+ * ready for the next message, so the pads are only derived once per NEWKEYS
+ * instead of on every packet.
+ */
+static int SetMacKey(Hmac* hmac, byte macId,
+        const byte* key, word32 keySz, void* heap, int devId)
+{
+    int hashId;
+    int ret;
+
+    hashId = MacHashForId(macId);
+
+    wc_HmacFree(hmac);
+    ret = wc_HmacInit(hmac, heap, devId);
+    if (ret == 0 && hashId != WC_HASH_TYPE_NONE)
+        ret = wc_HmacSetKey(hmac, hashId, key, keySz);
+
+    return ret;
+}
+
+
 static int DoNewKeys(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
 {
     int ret = WS_SUCCESS;
@@ -5847,6 +7201,7 @@ static int DoNewKeys(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
         ssh->peerBlockSz = ssh->handshake->blockSz;
         ssh->peerMacSz = ssh->handshake->macSz;
         ssh->peerAeadMode = ssh->handshake->aeadMode;
+        ssh->peerEtmMode = ssh->handshake->etmMode;
         WMEMCPY(&ssh->peerKeys, &ssh->handshake->peerKeys, sizeof(Keys));
 
         switch (ssh->peerEncryptId) {
@@ -5859,9 +7214,12 @@ static int DoNewKeys(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
             case ID_AES192_CBC:
             case ID_AES256_CBC:
                 WLOG(WS_LOG_DEBUG, "DNK: peer using cipher aes-cbc");
-                ret = wc_AesSetKey(&ssh->decryptCipher.aes,
-                                   ssh->peerKeys.encKey, ssh->peerKeys.encKeySz,
-                                   ssh->peerKeys.iv, AES_DECRYPTION);
+                ret = InitCipherAes(&ssh->decryptCipher.aes, ssh->ctx->heap,
+                        ssh->devId);
+                if (ret == 0)
+                    ret = wc_AesSetKey(&ssh->decryptCipher.aes,
+                            ssh->peerKeys.encKey, ssh->peerKeys.encKeySz,
+                            ssh->peerKeys.iv, AES_DECRYPTION);
                 break;
 #endif
 
@@ -5870,9 +7228,12 @@ static int DoNewKeys(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
             case ID_AES192_CTR:
             case ID_AES256_CTR:
                 WLOG(WS_LOG_DEBUG, "DNK: peer using cipher aes-ctr");
-                ret = wc_AesSetKey(&ssh->decryptCipher.aes,
-                                   ssh->peerKeys.encKey, ssh->peerKeys.encKeySz,
-                                   ssh->peerKeys.iv, AES_ENCRYPTION);
+                ret = InitCipherAes(&ssh->decryptCipher.aes, ssh->ctx->heap,
+                        ssh->devId);
+                if (ret == 0)
+                    ret = wc_AesSetKey(&ssh->decryptCipher.aes,
+                            ssh->peerKeys.encKey, ssh->peerKeys.encKeySz,
+                            ssh->peerKeys.iv, AES_ENCRYPTION);
                 break;
 #endif
 
@@ -5881,9 +7242,26 @@ static int DoNewKeys(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
             case ID_AES192_GCM:
             case ID_AES256_GCM:
                 WLOG(WS_LOG_DEBUG, "DNK: peer using cipher aes-gcm");
-                ret = wc_AesGcmSetKey(&ssh->decryptCipher.aes,
-                                      ssh->peerKeys.encKey,
-                                      ssh->peerKeys.encKeySz);
+                ret = InitCipherAes(&ssh->decryptCipher.aes, ssh->ctx->heap,
+                        ssh->devId);
+                if (ret == 0)
+                    ret = wc_AesGcmSetKey(&ssh->decryptCipher.aes,
+                            ssh->peerKeys.encKey,
+                            ssh->peerKeys.encKeySz);
+                break;
+#endif
+
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+            case ID_CHACHA20_POLY1305:
+                WLOG(WS_LOG_DEBUG, "DNK: peer using cipher chacha20-poly1305");
+                ret = wc_Chacha_SetKey(&ssh->decryptCipher.chacha,
+                                       ssh->peerKeys.encKey,
+                                       CHACHA_MAX_KEY_SZ);
+                if (ret == 0)
+                    ret = wc_Chacha_SetKey(&ssh->decryptCipher.chachaHeader,
+                                           ssh->peerKeys.encKey
+                                               + CHACHA_MAX_KEY_SZ,
+                                           CHACHA_MAX_KEY_SZ);
                 break;
 #endif
 
@@ -5892,6 +7270,12 @@ static int DoNewKeys(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
                 break;
         }
 
+        if (ret == 0) {
+            ret = SetMacKey(&ssh->decryptCipher.hmac, ssh->peerMacId,
+                    ssh->peerKeys.macKey, ssh->peerKeys.macKeySz,
+                    ssh->ctx->heap, ssh->devId);
+        }
+
         if (ret == 0)
             ret = WS_SUCCESS;
         else
@@ -5900,6 +7284,8 @@ static int DoNewKeys(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
 
     if (ret == WS_SUCCESS) {
         ssh->rxCount = 0;
+        ssh->rxPacketCount = 0;
+        ssh->keyTime = (word64)WTIME(NULL);
         ssh->highwaterFlag = 0;
         ssh->isKeying = 0;
         HandshakeInfoFree(ssh->handshake, ssh->ctx->heap);
@@ -5908,6 +7294,10 @@ static int DoNewKeys(WOLFSSH* ssh, byte* buf, word32 len, word32* idx)
 
         if (ssh->ctx->keyingCompletionCb)
             ssh->ctx->keyingCompletionCb(ssh->keyingCompletionCtx);
+
+        ret = SendQueuedChannelData(ssh);
+        if (ret == WS_SUCCESS)
+            ret = SendScheduledChannelData(ssh);
     }
 
     return ret;
@@ -5925,6 +7315,9 @@ static int DoKexDhGexRequest(WOLFSSH* ssh,
             idx == NULL)
         ret = WS_BAD_ARGUMENT;
 
+    if (ret == WS_SUCCESS && SkipKexGuess(ssh, len, idx))
+        return WS_SUCCESS;
+
     if (ret == WS_SUCCESS) {
         begin = *idx;
         ret = GetUint32(&ssh->handshake->dhGexMinSz, buf, len, &begin);
@@ -6703,7 +8096,7 @@ static int DoUserAuthRequestRsa(WOLFSSH* ssh, WS_UserAuthData_PublicKey* pk,
 #endif
 
     if (ret == WS_SUCCESS) {
-        ret = wc_InitRsaKey(key, ssh->ctx->heap);
+        ret = wc_InitRsaKey_ex(key, ssh->ctx->heap, ssh->devId);
         if (ret == 0) {
             ret = WS_SUCCESS;
         }
@@ -6834,7 +8227,7 @@ static int DoUserAuthRequestRsaCert(WOLFSSH* ssh, WS_UserAuthData_PublicKey* pk,
 #endif
 
     if (ret == WS_SUCCESS) {
-        ret = wc_InitRsaKey(key, ssh->ctx->heap);
+        ret = wc_InitRsaKey_ex(key, ssh->ctx->heap, ssh->devId);
         if (ret == 0) {
             ret = WS_SUCCESS;
         }
@@ -6978,7 +8371,7 @@ static int DoUserAuthRequestEcc(WOLFSSH* ssh, WS_UserAuthData_PublicKey* pk,
     }
 
     if (ret == WS_SUCCESS) {
-        if (wc_ecc_init_ex(key_ptr, ssh->ctx->heap, INVALID_DEVID) != 0) {
+        if (wc_ecc_init_ex(key_ptr, ssh->ctx->heap, ssh->devId) != 0) {
             ret = WS_MEMORY_E;
         }
     }
@@ -7141,7 +8534,7 @@ static int DoUserAuthRequestEccCert(WOLFSSH* ssh, WS_UserAuthData_PublicKey* pk,
     }
 
     if (ret == WS_SUCCESS) {
-        if (wc_ecc_init_ex(key_ptr, ssh->ctx->heap, INVALID_DEVID) != 0) {
+        if (wc_ecc_init_ex(key_ptr, ssh->ctx->heap, ssh->devId) != 0) {
             ret = WS_MEMORY_E;
         }
     }
@@ -7287,7 +8680,7 @@ static int DoUserAuthRequestEd25519(WOLFSSH* ssh,
     }
 
     if (ret == WS_SUCCESS) {
-        ret = wc_ed25519_init_ex(key_ptr, ssh->ctx->heap, INVALID_DEVID);
+        ret = wc_ed25519_init_ex(key_ptr, ssh->ctx->heap, ssh->devId);
         if (ret == 0) {
             ret = WS_SUCCESS;
         }
@@ -7638,7 +9031,8 @@ static int DoUserAuthRequestPublicKey(WOLFSSH* ssh, WS_UserAuthData* authData,
                 }
 
                 if (ret == 0)
-                    ret = wc_HashInit(&hash, hashId);
+                    ret = wc_HashInit_ex(&hash, hashId, ssh->ctx->heap,
+                            ssh->devId);
 
                 if (ret == 0) {
                     c32toa(ssh->sessionIdSz, digest);
@@ -8925,7 +10319,9 @@ static int DoChannelRequest(WOLFSSH* ssh,
         else if (WSTRNCMP(type, "exec", typeSz) == 0) {
             ret = GetStringAlloc(ssh->ctx->heap, &channel->command,
                     buf, len, &begin);
-            channel->sessionType = WOLFSSH_SESSION_EXEC;
+            ChannelSetCommand(channel, WOLFSSH_SESSION_EXEC,
+                    channel->command, (ret == WS_SUCCESS) ?
+                        (word32)WSTRLEN(channel->command) : 0);
             if (ssh->ctx->channelReqExecCb) {
                 rej = ssh->ctx->channelReqExecCb(channel, ssh->channelReqCtx);
             }
@@ -8936,7 +10332,9 @@ static int DoChannelRequest(WOLFSSH* ssh,
         else if (WSTRNCMP(type, "subsystem", typeSz) == 0) {
             ret = GetStringAlloc(ssh->ctx->heap, &channel->command,
                     buf, len, &begin);
-            channel->sessionType = WOLFSSH_SESSION_SUBSYSTEM;
+            ChannelSetCommand(channel, WOLFSSH_SESSION_SUBSYSTEM,
+                    channel->command, (ret == WS_SUCCESS) ?
+                        (word32)WSTRLEN(channel->command) : 0);
             if (ssh->ctx->channelReqSubsysCb) {
                 rej = ssh->ctx->channelReqSubsysCb(channel, ssh->channelReqCtx);
             }
@@ -9162,6 +10560,94 @@ static int DoChannelWindowAdjust(WOLFSSH* ssh,
 }
 
 
+/* Records the session type requested on a channel, and marks the channel
+ * when the command is one whose data wolfSSH's own SFTP or SCP code reads,
+ * so the application's data callback doesn't take it. That is the "sftp"
+ * subsystem, or an exec command whose first word is "scp". The command
+ * need not be NUL terminated, commandSz is its length. */
+void ChannelSetCommand(WOLFSSH_CHANNEL* channel, byte sessionType,
+        const char* command, word32 commandSz)
+{
+    if (channel == NULL)
+        return;
+
+    channel->sessionType = sessionType;
+    channel->internalData = 0;
+
+    if (command == NULL)
+        return;
+
+#ifdef WOLFSSH_SFTP
+    if (sessionType == WOLFSSH_SESSION_SUBSYSTEM && commandSz == 4
+            && WMEMCMP(command, "sftp", 4) == 0)
+        channel->internalData = 1;
+#endif
+#ifdef WOLFSSH_SCP
+    if (sessionType == WOLFSSH_SESSION_EXEC && commandSz >= 3
+            && WMEMCMP(command, "scp", 3) == 0
+            && (commandSz == 3 || command[3] == ' ' || command[3] == '\t'))
+        channel->internalData = 1;
+#endif
+    (void)commandSz;
+}
+
+
+/* Hands channel data to the application's data callback straight from the
+ * decrypted packet. The callback returns how many bytes it took; anything
+ * left is stored in the channel's input buffer as usual. The window for
+ * the bytes taken is given back to the peer once half the channel's window
+ * has been consumed. */
+static int ChannelDeliverData(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel,
+        byte* data, word32 dataSz)
+{
+    int ret = WS_SUCCESS;
+    int cbRet;
+    word32 usedSz = 0;
+
+    if (dataSz > channel->windowSz) {
+        WLOG(WS_LOG_ERROR, "Internal state error, too much data");
+        ret = WS_FATAL_ERROR;
+    }
+
+    if (ret == WS_SUCCESS) {
+        cbRet = ssh->ctx->channelDataCb(channel, data, dataSz,
+                ssh->channelDataCtx);
+        if (cbRet < 0) {
+            WLOG(WS_LOG_DEBUG, "Channel data callback failed, %d", cbRet);
+            ret = cbRet;
+        }
+        else {
+            usedSz = min((word32)cbRet, dataSz);
+        }
+    }
+
+    if (ret == WS_SUCCESS && usedSz < dataSz) {
+        ret = ChannelPutData(channel, data + usedSz, dataSz - usedSz);
+    }
+
+    if (ret == WS_SUCCESS && usedSz > 0) {
+        channel->windowSz -= usedSz;
+        channel->windowConsumed += usedSz;
+
+        if (channel->windowConsumed >= channel->windowFullSz / 2 ||
+                channel->windowSz == 0) {
+            /* The receive limits may hold some of it back for later. */
+            word32 grant = ChannelRateGrant(channel, channel->windowConsumed);
+
+            if (grant > 0) {
+                ret = SendChannelWindowAdjust(ssh, channel->channel, grant);
+                if (ret == WS_SUCCESS || ret == WS_WANT_WRITE) {
+                    channel->windowSz += grant;
+                    channel->windowConsumed -= grant;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+
 static int DoChannelData(WOLFSSH* ssh,
                          byte* buf, word32 len, word32* idx)
 {
@@ -9169,6 +10655,7 @@ static int DoChannelData(WOLFSSH* ssh,
     word32 begin = *idx;
     word32 dataSz = 0;
     word32 channelId;
+    byte useCb = 0;
     int ret;
 
     WLOG(WS_LOG_DEBUG, "Entering DoChannelData()");
@@ -9188,15 +10675,27 @@ static int DoChannelData(WOLFSSH* ssh,
         *idx = begin + dataSz;
 
         channel = ChannelFind(ssh, channelId, WS_CHANNEL_ID_SELF);
-        if (channel == NULL)
+        if (channel == NULL) {
             ret = WS_INVALID_CHANID;
-        else
-            ret = ChannelPutData(channel, buf + begin, dataSz);
+        }
+        else {
+            /* SFTP, SCP and agent channels are read by wolfSSH itself. */
+            useCb = (ssh->ctx->channelDataCb != NULL
+                    && !channel->internalData
+                    && channel->channelType != ID_CHANTYPE_AUTH_AGENT);
+            if (useCb)
+                ret = ChannelDeliverData(ssh, channel, buf + begin, dataSz);
+            else
+                ret = ChannelPutData(channel, buf + begin, dataSz);
+        }
     }
 
     if (ret == WS_SUCCESS) {
         ssh->lastRxId = channelId;
         ret = WS_CHAN_RXD;
+        /* With the data callback, only report data left in the channel. */
+        if (useCb && channel->inputBuffer.length == channel->inputBuffer.idx)
+            ret = WS_SUCCESS;
     }
 
     WLOG(WS_LOG_DEBUG, "Leaving DoChannelData(), ret = %d", ret);
@@ -9520,8 +11019,9 @@ static int DoPacket(WOLFSSH* ssh, byte* bufferConsumed)
             ret = SendUnimplemented(ssh);
     }
 
-    /* if the auth is still pending, don't discard the packet data */
-    if (ret != WS_AUTH_PENDING) {
+    /* if the auth or the offloaded signature is still pending, don't discard
+     * the packet data, it is processed again on the next call */
+    if (ret != WS_AUTH_PENDING && ret != WS_WANT_CRYPTO) {
         if (payloadSz > 0) {
             idx += payloadIdx;
             if (idx + padSz > len) {
@@ -9533,6 +11033,7 @@ static int DoPacket(WOLFSSH* ssh, byte* bufferConsumed)
         idx += padSz;
         ssh->inputBuffer.idx = idx;
         ssh->peerSeq++;
+        ssh->rxPacketCount++;
         *bufferConsumed = 1;
     }
 
@@ -9579,7 +11080,7 @@ static int DoPacket(WOLFSSH* ssh, byte* bufferConsumed)
 
 
 static INLINE int Encrypt(WOLFSSH* ssh, byte* cipher, const byte* input,
-                          word16 sz)
+                          word32 sz)
 {
     int ret = WS_SUCCESS;
 
@@ -9627,7 +11128,7 @@ static INLINE int Encrypt(WOLFSSH* ssh, byte* cipher, const byte* input,
 
 
 static INLINE int Decrypt(WOLFSSH* ssh, byte* plain, const byte* input,
-                          word16 sz)
+                          word32 sz)
 {
     int ret = WS_SUCCESS;
 
@@ -9678,6 +11179,8 @@ static INLINE int CreateMac(WOLFSSH* ssh, const byte* in, word32 inSz,
                             byte* mac)
 {
     byte flatSeq[LENGTH_SZ];
+    byte digest[MAX_HMAC_SZ];
+    Hmac* hmac = &ssh->encryptCipher.hmac;
     int ret;
 
     WMEMSET(flatSeq, 0, LENGTH_SZ);
@@ -9685,7 +11188,8 @@ static INLINE int CreateMac(WOLFSSH* ssh, const byte* in, word32 inSz,
 
     WLOG(WS_LOG_DEBUG, "CreateMac %s", IdToName(ssh->macId));
 
-    /* Need to MAC the sequence number and the unencrypted packet */
+    /* Need to MAC the sequence number and the unencrypted packet. The
+     * HMAC was keyed when the keys were installed. */
     switch (ssh->macId) {
         case ID_NONE:
             ret = WS_SUCCESS;
@@ -9693,86 +11197,27 @@ static INLINE int CreateMac(WOLFSSH* ssh, const byte* in, word32 inSz,
 
 #ifndef WOLFSSH_NO_HMAC_SHA1_96
         case ID_HMAC_SHA1_96:
-            {
-                Hmac hmac;
-                byte digest[WC_SHA_DIGEST_SIZE];
-
-                ret = wc_HmacInit(&hmac, ssh->ctx->heap, INVALID_DEVID);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacSetKey(&hmac, WC_SHA,
-                                    ssh->keys.macKey, ssh->keys.macKeySz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, flatSeq, sizeof(flatSeq));
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, in, inSz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacFinal(&hmac, digest);
-                if (ret == WS_SUCCESS)
-                    WMEMCPY(mac, digest, SHA1_96_SZ);
-                wc_HmacFree(&hmac);
-            }
-            break;
 #endif
-
 #ifndef WOLFSSH_NO_HMAC_SHA1
         case ID_HMAC_SHA1:
-            {
-                Hmac hmac;
-
-                ret = wc_HmacInit(&hmac, ssh->ctx->heap, INVALID_DEVID);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacSetKey(&hmac, WC_SHA,
-                                    ssh->keys.macKey, ssh->keys.macKeySz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, flatSeq, sizeof(flatSeq));
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, in, inSz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacFinal(&hmac, mac);
-                wc_HmacFree(&hmac);
-            }
-            break;
 #endif
-
+#ifndef WOLFSSH_NO_HMAC_SHA2_256
         case ID_HMAC_SHA2_256:
-            {
-                Hmac hmac;
-
-                ret = wc_HmacInit(&hmac, ssh->ctx->heap, INVALID_DEVID);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacSetKey(&hmac, WC_SHA256,
-                                    ssh->keys.macKey,
-                                    ssh->keys.macKeySz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, flatSeq, sizeof(flatSeq));
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, in, inSz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacFinal(&hmac, mac);
-                wc_HmacFree(&hmac);
-            }
-            break;
-
+        case ID_HMAC_SHA2_256_ETM:
+#endif
 #ifndef WOLFSSH_NO_HMAC_SHA2_512
         case ID_HMAC_SHA2_512:
-            {
-                Hmac hmac;
-
-                ret = wc_HmacInit(&hmac, ssh->ctx->heap, INVALID_DEVID);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacSetKey(&hmac, WC_SHA512,
-                                    ssh->keys.macKey,
-                                    ssh->keys.macKeySz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, flatSeq, sizeof(flatSeq));
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, in, inSz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacFinal(&hmac, mac);
-                wc_HmacFree(&hmac);
-            }
-            break;
+        case ID_HMAC_SHA2_512_ETM:
 #endif
+            ret = wc_HmacUpdate(hmac, flatSeq, sizeof(flatSeq));
+            if (ret == WS_SUCCESS)
+                ret = wc_HmacUpdate(hmac, in, inSz);
+            if (ret == WS_SUCCESS)
+                ret = wc_HmacFinal(hmac, digest);
+            if (ret == WS_SUCCESS)
+                WMEMCPY(mac, digest, ssh->macSz);
+            ForceZero(digest, sizeof(digest));
+            break;
 
         default:
             WLOG(WS_LOG_DEBUG, "Invalid Mac ID");
@@ -9789,7 +11234,7 @@ static INLINE int VerifyMac(WOLFSSH* ssh, const byte* in, word32 inSz,
     int ret;
     byte flatSeq[LENGTH_SZ];
     byte checkMac[MAX_HMAC_SZ];
-    Hmac hmac;
+    Hmac* hmac = &ssh->decryptCipher.hmac;
 
     c32toa(ssh->peerSeq, flatSeq);
 
@@ -9799,60 +11244,37 @@ static INLINE int VerifyMac(WOLFSSH* ssh, const byte* in, word32 inSz,
     WLOG(WS_LOG_DEBUG, "VM: keyLen = %u", ssh->peerKeys.macKeySz);
 
     WMEMSET(checkMac, 0, sizeof(checkMac));
-    ret = wc_HmacInit(&hmac, ssh->ctx->heap, INVALID_DEVID);
-    if (ret != WS_SUCCESS) {
-        WLOG(WS_LOG_ERROR, "VM: Error initializing hmac structure");
-    }
-    else {
-        switch (ssh->peerMacId) {
-            case ID_NONE:
-                ret = WS_SUCCESS;
-                break;
 
-            case ID_HMAC_SHA1:
-            case ID_HMAC_SHA1_96:
-                ret = wc_HmacSetKey(&hmac, WC_SHA, ssh->peerKeys.macKey,
-                        ssh->peerKeys.macKeySz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, flatSeq, sizeof(flatSeq));
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, in, inSz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacFinal(&hmac, checkMac);
-                if (ConstantCompare(checkMac, mac, ssh->peerMacSz) != 0)
-                    ret = WS_VERIFY_MAC_E;
-                break;
+    switch (ssh->peerMacId) {
+        case ID_NONE:
+            ret = WS_SUCCESS;
+            break;
 
-            case ID_HMAC_SHA2_256:
-                ret = wc_HmacSetKey(&hmac, WC_SHA256, ssh->peerKeys.macKey,
-                        ssh->peerKeys.macKeySz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, flatSeq, sizeof(flatSeq));
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, in, inSz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacFinal(&hmac, checkMac);
-                if (ConstantCompare(checkMac, mac, ssh->peerMacSz) != 0)
-                    ret = WS_VERIFY_MAC_E;
-                break;
+#ifndef WOLFSSH_NO_HMAC_SHA1_96
+        case ID_HMAC_SHA1_96:
+#endif
+#ifndef WOLFSSH_NO_HMAC_SHA1
+        case ID_HMAC_SHA1:
+#endif
+#ifndef WOLFSSH_NO_HMAC_SHA2_256
+        case ID_HMAC_SHA2_256:
+        case ID_HMAC_SHA2_256_ETM:
+#endif
+#ifndef WOLFSSH_NO_HMAC_SHA2_512
+        case ID_HMAC_SHA2_512:
+        case ID_HMAC_SHA2_512_ETM:
+#endif
+            ret = wc_HmacUpdate(hmac, flatSeq, sizeof(flatSeq));
+            if (ret == WS_SUCCESS)
+                ret = wc_HmacUpdate(hmac, in, inSz);
+            if (ret == WS_SUCCESS)
+                ret = wc_HmacFinal(hmac, checkMac);
+            if (ConstantCompare(checkMac, mac, ssh->peerMacSz) != 0)
+                ret = WS_VERIFY_MAC_E;
+            break;
 
-            case ID_HMAC_SHA2_512:
-                ret = wc_HmacSetKey(&hmac, WC_SHA512, ssh->peerKeys.macKey,
-                        ssh->peerKeys.macKeySz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, flatSeq, sizeof(flatSeq));
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacUpdate(&hmac, in, inSz);
-                if (ret == WS_SUCCESS)
-                    ret = wc_HmacFinal(&hmac, checkMac);
-                if (ConstantCompare(checkMac, mac, ssh->peerMacSz) != 0)
-                    ret = WS_VERIFY_MAC_E;
-                break;
-
-            default:
-                ret = WS_INVALID_ALGO_ID;
-        }
-        wc_HmacFree(&hmac);
+        default:
+            ret = WS_INVALID_ALGO_ID;
     }
 
     return ret;
@@ -9872,9 +11294,75 @@ static INLINE void AeadIncrementExpIv(byte* iv)
 }
 
 
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+/*
+ * chacha20-poly1305@openssh.com uses the original ChaCha20 with a 64-bit
+ * block counter and a 64-bit nonce, the nonce being the packet sequence
+ * number. wolfCrypt's ChaCha20 takes a 32-bit counter and a 96-bit IV, so
+ * the high word of the counter is carried as the leading zeros of the IV.
+ */
+static INLINE int ChachaPolySetIv(ChaCha* chacha, word32 seq, word32 counter)
+{
+    byte iv[CHACHA_IV_BYTES];
+
+    WMEMSET(iv, 0, sizeof(iv));
+    c32toa(seq, iv + CHACHA_IV_BYTES - UINT32_SZ);
+
+    return wc_Chacha_SetIV(chacha, iv, counter);
+}
+
+
+/* Encrypts or decrypts the packet length field with K_1. */
+static int ChachaPolyLength(ChaCha* header, word32 seq,
+                            byte* out, const byte* in)
+{
+    int ret;
+
+    ret = ChachaPolySetIv(header, seq, 0);
+    if (ret == 0)
+        ret = wc_Chacha_Process(header, out, in, LENGTH_SZ);
+
+    return ret;
+}
+
+
+/* Calculates the Poly1305 tag over the encrypted length and payload. The
+ * Poly1305 key is the first 32 bytes of the K_2 keystream block 0. */
+static int ChachaPolyTag(ChaCha* chacha, word32 seq,
+                         const byte* auth, word32 authSz,
+                         const byte* cipher, word32 cipherSz,
+                         byte* tag)
+{
+    Poly1305 poly;
+    byte polyKey[CHACHA_MAX_KEY_SZ];
+    int ret;
+
+    WMEMSET(polyKey, 0, sizeof(polyKey));
+    ret = ChachaPolySetIv(chacha, seq, 0);
+    if (ret == 0)
+        ret = wc_Chacha_Process(chacha, polyKey, polyKey, sizeof(polyKey));
+    if (ret == 0)
+        ret = wc_Poly1305SetKey(&poly, polyKey, sizeof(polyKey));
+    if (ret == 0)
+        ret = wc_Poly1305Update(&poly, auth, authSz);
+    if (ret == 0)
+        ret = wc_Poly1305Update(&poly, cipher, cipherSz);
+    if (ret == 0)
+        ret = wc_Poly1305Final(&poly, tag);
+
+    ForceZero(polyKey, sizeof(polyKey));
+    ForceZero(&poly, sizeof(poly));
+
+    return ret;
+}
+#endif /* WOLFSSH_NO_CHACHA20_POLY1305 */
+
+
+/* For chacha20-poly1305 the length field passed in auth is encrypted in
+ * place, as it isn't sent in the clear. */
 static INLINE int EncryptAead(WOLFSSH* ssh, byte* cipher,
-                              const byte* input, word16 sz,
-                              byte* authTag, const byte* auth,
+                              const byte* input, word32 sz,
+                              byte* authTag, byte* auth,
                               word16 authSz)
 {
     int ret = WS_SUCCESS;
@@ -9893,6 +11381,24 @@ static INLINE int EncryptAead(WOLFSSH* ssh, byte* cipher,
             ret = wc_AesGcmEncrypt(&ssh->encryptCipher.aes, cipher, input, sz,
                     ssh->keys.iv, ssh->keys.ivSz,
                     authTag, ssh->macSz, auth, authSz);
+            AeadIncrementExpIv(ssh->keys.iv);
+            break;
+#endif
+
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+        case ID_CHACHA20_POLY1305:
+            ret = ChachaPolyLength(&ssh->encryptCipher.chachaHeader,
+                    ssh->seq, auth, auth);
+            if (ret == 0)
+                ret = ChachaPolySetIv(&ssh->encryptCipher.chacha, ssh->seq, 1);
+            if (ret == 0)
+                ret = wc_Chacha_Process(&ssh->encryptCipher.chacha,
+                        cipher, input, sz);
+            if (ret == 0)
+                ret = ChachaPolyTag(&ssh->encryptCipher.chacha, ssh->seq,
+                        auth, authSz, cipher, sz, authTag);
+            if (ret != 0)
+                ret = WS_ENCRYPT_E;
             break;
 #endif
 
@@ -9900,7 +11406,6 @@ static INLINE int EncryptAead(WOLFSSH* ssh, byte* cipher,
             ret = WS_INVALID_ALGO_ID;
     }
 
-    AeadIncrementExpIv(ssh->keys.iv);
     ssh->txCount += sz;
 
     return ret;
@@ -9908,7 +11413,7 @@ static INLINE int EncryptAead(WOLFSSH* ssh, byte* cipher,
 
 
 static INLINE int DecryptAead(WOLFSSH* ssh, byte* plain,
-                              const byte* input, word16 sz,
+                              const byte* input, word32 sz,
                               const byte* authTag, const byte* auth,
                               word16 authSz)
 {
@@ -9928,6 +11433,36 @@ static INLINE int DecryptAead(WOLFSSH* ssh, byte* plain,
             ret = wc_AesGcmDecrypt(&ssh->decryptCipher.aes, plain, input, sz,
                     ssh->peerKeys.iv, ssh->peerKeys.ivSz,
                     authTag, ssh->peerMacSz, auth, authSz);
+            AeadIncrementExpIv(ssh->peerKeys.iv);
+            break;
+#endif
+
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+        case ID_CHACHA20_POLY1305:
+            {
+                byte checkTag[CHACHA_POLY_TAG_SZ];
+
+                /* Check the tag over the ciphertext before decrypting. */
+                ret = ChachaPolyTag(&ssh->decryptCipher.chacha, ssh->peerSeq,
+                        auth, authSz, input, sz, checkTag);
+                if (ret == 0) {
+                    if (ConstantCompare(checkTag, authTag,
+                                CHACHA_POLY_TAG_SZ) != 0) {
+                        ret = WS_VERIFY_MAC_E;
+                    }
+                }
+                else
+                    ret = WS_DECRYPT_E;
+                if (ret == 0)
+                    ret = ChachaPolySetIv(&ssh->decryptCipher.chacha,
+                            ssh->peerSeq, 1);
+                if (ret == 0) {
+                    ret = wc_Chacha_Process(&ssh->decryptCipher.chacha,
+                            plain, input, sz);
+                    if (ret != 0)
+                        ret = WS_DECRYPT_E;
+                }
+            }
             break;
 #endif
 
@@ -9935,7 +11470,6 @@ static INLINE int DecryptAead(WOLFSSH* ssh, byte* plain,
             ret = WS_INVALID_ALGO_ID;
     }
 
-    AeadIncrementExpIv(ssh->peerKeys.iv);
     ssh->rxCount += sz;
 
     return ret;
@@ -9943,6 +11477,47 @@ static INLINE int DecryptAead(WOLFSSH* ssh, byte* plain,
 #endif /* WOLFSSH_NO_AEAD */
 
 
+/* Largest packet_length accepted from the peer. It follows the channel
+ * maximum packet size set on the context, never going below the
+ * MAX_PACKET_SZ required by RFC 4253. */
+static INLINE word32 MaxPacketLength(WOLFSSH* ssh)
+{
+    word32 maxSz = ssh->ctx->maxPacketSz + PACKET_OVERHEAD_SZ;
+
+    return (maxSz > MAX_PACKET_SZ) ? maxSz : MAX_PACKET_SZ;
+}
+
+
+/* Decrypts the first block of the current packet in place so its length
+ * can be read, and moves on to PROCESS_PACKET_LENGTH. Only used when the
+ * length isn't sent in the clear. */
+static int DecryptFirstBlock(WOLFSSH* ssh)
+{
+    int ret;
+
+    ssh->processReplyState = PROCESS_PACKET_LENGTH;
+
+    ret = Decrypt(ssh,
+            ssh->inputBuffer.buffer + ssh->inputBuffer.idx,
+            ssh->inputBuffer.buffer + ssh->inputBuffer.idx,
+            ssh->peerBlockSz);
+    if (ret != WS_SUCCESS) {
+        WLOG(WS_LOG_DEBUG, "PR: First decrypt fail");
+        ssh->error = ret;
+        return WS_FATAL_ERROR;
+    }
+
+    ret = HighwaterCheck(ssh, WOLFSSH_HWSIDE_RECEIVE);
+    if (ret != WS_SUCCESS) {
+        WLOG(WS_LOG_DEBUG, "PR: First HighwaterCheck fail");
+        ssh->error = ret;
+        return WS_FATAL_ERROR;
+    }
+
+    return WS_SUCCESS;
+}
+
+
 int DoReceive(WOLFSSH* ssh)
 {
     int ret = WS_SUCCESS;
@@ -9951,6 +11526,7 @@ int DoReceive(WOLFSSH* ssh)
     byte peerBlockSz = ssh->peerBlockSz;
     byte peerMacSz = ssh->peerMacSz;
     byte aeadMode = ssh->peerAeadMode;
+    byte etmMode = ssh->peerEtmMode;
     byte bufferConsumed = 0;
 
     switch (ssh->processReplyState) {
@@ -9962,25 +11538,11 @@ int DoReceive(WOLFSSH* ssh)
             }
             ssh->processReplyState = PROCESS_PACKET_LENGTH;
 
-            if (!aeadMode) {
+            if (!aeadMode && !etmMode) {
                 /* Decrypt first block if encrypted */
-                ret = Decrypt(ssh,
-                        ssh->inputBuffer.buffer + ssh->inputBuffer.idx,
-                        ssh->inputBuffer.buffer + ssh->inputBuffer.idx,
-                        readSz);
-                if (ret != WS_SUCCESS) {
-                    WLOG(WS_LOG_DEBUG, "PR: First decrypt fail");
-                    ssh->error = ret;
-                    return WS_FATAL_ERROR;
-                }
-
-                ret = HighwaterCheck(ssh, WOLFSSH_HWSIDE_RECEIVE);
-                if (ret != WS_SUCCESS) {
-                    WLOG(WS_LOG_DEBUG, "PR: First HighwaterCheck fail");
-                    ssh->error = ret;
-                    ret = WS_FATAL_ERROR;
+                ret = DecryptFirstBlock(ssh);
+                if (ret != WS_SUCCESS)
                     break;
-                }
             }
             FALL_THROUGH;
 
@@ -9991,8 +11553,27 @@ int DoReceive(WOLFSSH* ssh)
             }
 
             /* Peek at the packet_length field. */
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+            if (ssh->peerEncryptId == ID_CHACHA20_POLY1305) {
+                byte flatLen[LENGTH_SZ];
+
+                /* The length is encrypted with its own key. Leave the
+                 * ciphertext in the buffer, it is covered by the tag. */
+                ret = ChachaPolyLength(&ssh->decryptCipher.chachaHeader,
+                        ssh->peerSeq, flatLen,
+                        ssh->inputBuffer.buffer + ssh->inputBuffer.idx);
+                if (ret != 0) {
+                    WLOG(WS_LOG_DEBUG, "PR: Length decrypt fail");
+                    ssh->error = WS_DECRYPT_E;
+                    return WS_FATAL_ERROR;
+                }
+                ato32(flatLen, &ssh->curSz);
+            }
+            else
+#endif
             ato32(ssh->inputBuffer.buffer + ssh->inputBuffer.idx, &ssh->curSz);
-            if (ssh->curSz > MAX_PACKET_SZ - (word32)peerMacSz - UINT32_SZ) {
+            if (ssh->curSz >
+                    MaxPacketLength(ssh) - (word32)peerMacSz - UINT32_SZ) {
                 WLOG(WS_LOG_DEBUG, "Packet length overflow: size = %u",
                         ssh->curSz);
                 ssh->error = WS_OVERFLOW_E;
@@ -10010,7 +11591,33 @@ int DoReceive(WOLFSSH* ssh)
                     return ret;
                 }
 
-                if (!aeadMode) {
+                if (etmMode) {
+                    /* The MAC covers the clear length and the ciphertext.
+                     * Check it before spending any time decrypting. */
+                    ret = VerifyMac(ssh,
+                            ssh->inputBuffer.buffer + ssh->inputBuffer.idx,
+                            UINT32_SZ + ssh->curSz,
+                            ssh->inputBuffer.buffer + ssh->inputBuffer.idx
+                                + UINT32_SZ + ssh->curSz);
+                    if (ret != WS_SUCCESS) {
+                        WLOG(WS_LOG_DEBUG, "PR: VerifyMac fail");
+                        ssh->error = ret;
+                        return WS_FATAL_ERROR;
+                    }
+
+                    ret = Decrypt(ssh,
+                            ssh->inputBuffer.buffer + ssh->inputBuffer.idx
+                                + UINT32_SZ,
+                            ssh->inputBuffer.buffer + ssh->inputBuffer.idx
+                                + UINT32_SZ,
+                            ssh->curSz);
+                    if (ret != WS_SUCCESS) {
+                        WLOG(WS_LOG_DEBUG, "PR: Decrypt fail");
+                        ssh->error = ret;
+                        return WS_FATAL_ERROR;
+                    }
+                }
+                else if (!aeadMode) {
                     if (ssh->curSz + UINT32_SZ > peerBlockSz) {
                         ret = Decrypt(ssh,
                                 ssh->inputBuffer.buffer + ssh->inputBuffer.idx
@@ -10061,6 +11668,10 @@ int DoReceive(WOLFSSH* ssh)
                         ssh->error = ret;
                         return WS_FATAL_ERROR;
                     }
+
+                    /* Leave the plaintext length in the buffer. */
+                    c32toa(ssh->curSz,
+                            ssh->inputBuffer.buffer + ssh->inputBuffer.idx);
 #endif
                 }
             }
@@ -10080,7 +11691,8 @@ int DoReceive(WOLFSSH* ssh)
             ssh->error = ret;
             if (ret < 0 && !(ret == WS_CHAN_RXD || ret == WS_EXTDATA ||
                     ret == WS_CHANNEL_CLOSED || ret == WS_WANT_WRITE ||
-                    ret == WS_REKEYING || ret == WS_WANT_READ)) {
+                    ret == WS_REKEYING || ret == WS_WANT_READ ||
+                    ret == WS_WANT_CRYPTO)) {
                 ret = WS_FATAL_ERROR;
             }
             break;
@@ -10096,17 +11708,86 @@ int DoReceive(WOLFSSH* ssh)
         ssh->inputBuffer.idx += peerMacSz;
 
         WLOG(WS_LOG_DEBUG, "PR4: Shrinking input buffer");
-        ShrinkBuffer(&ssh->inputBuffer, 1);
+        /* Don't force the free, the buffer may hold read-ahead data. */
+        ShrinkBuffer(&ssh->inputBuffer, 0);
         ssh->processReplyState = PROCESS_INIT;
     }
 
-    WLOG(WS_LOG_DEBUG, "PR5: txCount = %u, rxCount = %u",
-         ssh->txCount, ssh->rxCount);
+    WLOG(WS_LOG_DEBUG, "PR5: txCount = 0x%08x%08x, "
+            "rxCount = 0x%08x%08x",
+            WLOG_W64(ssh->txCount), WLOG_W64(ssh->rxCount));
 
     return ret;
 }
 
 
+/* Returns 1 if the input buffer holds the whole current packet, so
+ * DoReceive() can process it without reading from the peer, or 0 if it
+ * doesn't. When the packet length is encrypted with the payload, the first
+ * block is decrypted here once it has arrived and kept for DoReceive(), so
+ * this may also return WS_FATAL_ERROR with ssh->error set. */
+int HaveInputPacket(WOLFSSH* ssh)
+{
+    word32 haveSz;
+    word32 needSz;
+    word32 curSz;
+    int ret;
+
+    if (ssh == NULL)
+        return 0;
+
+    haveSz = ssh->inputBuffer.length - ssh->inputBuffer.idx;
+    if (haveSz == 0)
+        return 0;
+
+    if (ssh->processReplyState == PROCESS_INIT) {
+        if (haveSz < ssh->peerBlockSz)
+            return 0;
+
+        if (!ssh->peerAeadMode && !ssh->peerEtmMode) {
+            ret = DecryptFirstBlock(ssh);
+            if (ret != WS_SUCCESS)
+                return ret;
+        }
+    }
+
+    switch (ssh->processReplyState) {
+        case PROCESS_INIT:
+        case PROCESS_PACKET_LENGTH:
+            if (haveSz < UINT32_SZ)
+                return 0;
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+            if (ssh->peerEncryptId == ID_CHACHA20_POLY1305) {
+                byte flatLen[LENGTH_SZ];
+
+                /* Only peeks, DoReceive() decrypts the length again. */
+                if (ChachaPolyLength(&ssh->decryptCipher.chachaHeader,
+                        ssh->peerSeq, flatLen,
+                        ssh->inputBuffer.buffer + ssh->inputBuffer.idx) != 0)
+                    return 1; /* let DoReceive() report the error */
+                ato32(flatLen, &curSz);
+            }
+            else
+#endif
+            ato32(ssh->inputBuffer.buffer + ssh->inputBuffer.idx, &curSz);
+            if (curSz > MaxPacketLength(ssh)
+                    - (word32)ssh->peerMacSz - UINT32_SZ)
+                return 1; /* let DoReceive() report the error */
+            needSz = UINT32_SZ + curSz + ssh->peerMacSz;
+            break;
+
+        case PROCESS_PACKET_FINISH:
+            needSz = UINT32_SZ + ssh->curSz + ssh->peerMacSz;
+            break;
+
+        default:
+            return 1;
+    }
+
+    return (haveSz >= needSz);
+}
+
+
 int DoProtoId(WOLFSSH* ssh)
 {
     int ret;
@@ -10226,6 +11907,30 @@ static int PreparePacket(WOLFSSH* ssh, word32 payloadSz)
 }
 
 
+/* Copies padSz random bytes for the packet padding from the session's
+ * pool, refilling the whole pool from the RNG when it runs short. Without
+ * a pool, each packet's padding is drawn from the RNG. */
+static int GetPadding(WOLFSSH* ssh, byte* pad, byte padSz)
+{
+#if WOLFSSH_PAD_POOL_SZ == 0
+    if (wc_RNG_GenerateBlock(ssh->rng, pad, padSz) < 0)
+        return WS_CRYPTO_FAILED;
+#else
+    if (WOLFSSH_PAD_POOL_SZ - ssh->padPoolIdx < padSz) {
+        if (wc_RNG_GenerateBlock(ssh->rng,
+                    ssh->padPool, sizeof(ssh->padPool)) < 0)
+            return WS_CRYPTO_FAILED;
+        ssh->padPoolIdx = 0;
+    }
+
+    WMEMCPY(pad, ssh->padPool + ssh->padPoolIdx, padSz);
+    ssh->padPoolIdx += padSz;
+#endif
+
+    return WS_SUCCESS;
+}
+
+
 static int BundlePacket(WOLFSSH* ssh)
 {
     byte* output = NULL;
@@ -10247,9 +11952,10 @@ static int BundlePacket(WOLFSSH* ssh)
          * LENGTH and PAD_LENGTH, subtract those out, as well. */
         payloadSz = idx - ssh->packetStartIdx - LENGTH_SZ - PAD_LENGTH_SZ;
 
-        /* Minimum value for paddingSz is 4. */
+        /* Minimum value for paddingSz is 4. The length field isn't
+         * encrypted in AEAD or EtM modes, so it isn't padded. */
         paddingSz = ssh->blockSz -
-                    ((ssh->aeadMode ? 0 : LENGTH_SZ) +
+                    ((ssh->aeadMode || ssh->etmMode ? 0 : LENGTH_SZ) +
                      PAD_LENGTH_SZ + payloadSz) % ssh->blockSz;
         if (paddingSz < MIN_PAD_LENGTH)
             paddingSz += ssh->blockSz;
@@ -10269,14 +11975,47 @@ static int BundlePacket(WOLFSSH* ssh)
         else if (ssh->encryptId == ID_NONE) {
             WMEMSET(output + idx, 0, paddingSz);
         }
-        else if (wc_RNG_GenerateBlock(ssh->rng, output + idx, paddingSz) < 0) {
+        else if (GetPadding(ssh, output + idx, paddingSz) != WS_SUCCESS) {
             ret = WS_CRYPTO_FAILED;
             WLOG(WS_LOG_DEBUG, "BP: failed to add padding");
         }
     }
 
     if (ret == WS_SUCCESS) {
-        if (!ssh->aeadMode) {
+        if (ssh->etmMode) {
+            byte macSz = MacSzForId(ssh->macId);
+
+            idx += paddingSz;
+
+            /* Encrypt everything after the length field, then MAC the
+             * length and ciphertext. */
+            if (idx + macSz > ssh->outputBuffer.bufferSz) {
+                ret = WS_BUFFER_E;
+            }
+            else {
+                ret = Encrypt(ssh,
+                        ssh->outputBuffer.buffer + ssh->packetStartIdx
+                            + LENGTH_SZ,
+                        ssh->outputBuffer.buffer + ssh->packetStartIdx
+                            + LENGTH_SZ,
+                        ssh->outputBuffer.length - ssh->packetStartIdx
+                            + paddingSz - LENGTH_SZ);
+            }
+
+            if (ret == WS_SUCCESS) {
+                ret = CreateMac(ssh, ssh->outputBuffer.buffer +
+                        ssh->packetStartIdx, ssh->outputBuffer.length -
+                        ssh->packetStartIdx + paddingSz, output + idx);
+                if (ret != WS_SUCCESS) {
+                    WLOG(WS_LOG_DEBUG, "BP: failed to generate mac");
+                }
+            }
+
+            if (ret == WS_SUCCESS) {
+                idx += ssh->macSz;
+            }
+        }
+        else if (!ssh->aeadMode) {
             byte macSz = MacSzForId(ssh->macId);
 
             idx += paddingSz;
@@ -10323,6 +12062,7 @@ static int BundlePacket(WOLFSSH* ssh)
 
     if (ret == WS_SUCCESS) {
         ssh->seq++;
+        ssh->txPacketCount++;
         ssh->outputBuffer.length = idx;
     }
     else {
@@ -10424,16 +12164,182 @@ static int BuildNameList(char* buf, word32 bufSz,
 }
 
 
+/*
+ * Builds the server's host key algorithm name list from the CTX's loaded
+ * keys. The caller frees the list.
+ */
+static int BuildKeyAlgoNames(WOLFSSH_CTX* ctx, char** keyAlgoNames)
+{
+    char* names;
+    word32 namesSz;
+    int ret = WS_SUCCESS;
+
+    namesSz = BuildNameList(NULL, 0,
+            ctx->publicKeyAlgo, ctx->publicKeyAlgoCount) + 1;
+    names = (char*)WMALLOC(namesSz, ctx->heap, DYNTYPE_STRING);
+    if (names) {
+        ret = BuildNameList(names, namesSz,
+                ctx->publicKeyAlgo, ctx->publicKeyAlgoCount);
+        if (ret > 0) {
+            ret = WS_SUCCESS;
+        }
+        else {
+            WFREE(names, ctx->heap, DYNTYPE_STRING);
+            names = NULL;
+        }
+    }
+    else {
+        ret = WS_MEMORY_E;
+    }
+
+    *keyAlgoNames = names;
+    return ret;
+}
+
+
+/*
+ * Writes the fields of the KEXINIT message that follow the cookie: the
+ * name lists, the first KEX packet follows flag, and the reserved value.
+ *
+ * @param buf       buffer to write the fields, or NULL to get the size
+ * @param kexList   KEX algorithm list
+ * @param kexPlus   string appended to the KEX algorithm list, or NULL
+ * @param keyList   host key algorithm list
+ * @param encList   cipher list, used for both directions
+ * @param macList   MAC list, used for both directions
+ * @return          size of the fields
+ */
+static word32 KexInitBodyCopy(byte* buf, const char* kexList,
+        const char* kexPlus, const char* keyList,
+        const char* encList, const char* macList)
+{
+    word32 idx = 0, kexSz, kexPlusSz, keySz, encSz, macSz, noneSz;
+
+    kexSz = AlgoListSz(kexList);
+    kexPlusSz = (kexPlus != NULL) ? (word32)WSTRLEN(kexPlus) : 0;
+    keySz = AlgoListSz(keyList);
+    encSz = AlgoListSz(encList);
+    macSz = AlgoListSz(macList);
+    noneSz = AlgoListSz(cannedNoneNames);
+
+    if (buf == NULL) {
+        return (LENGTH_SZ * 11) + BOOLEAN_SZ + kexSz + kexPlusSz + keySz
+            + (encSz * 2) + (macSz * 2) + (noneSz * 2);
+    }
+
+    CopyNameListPlus(buf, &idx, kexList, kexSz, kexPlus, kexPlusSz);
+    CopyNameList(buf, &idx, keyList, keySz);
+    CopyNameList(buf, &idx, encList, encSz);
+    CopyNameList(buf, &idx, encList, encSz);
+    CopyNameList(buf, &idx, macList, macSz);
+    CopyNameList(buf, &idx, macList, macSz);
+    CopyNameList(buf, &idx, cannedNoneNames, noneSz);
+    CopyNameList(buf, &idx, cannedNoneNames, noneSz);
+    c32toa(0, buf + idx); /* Languages - Client To Server (0) */
+    idx += LENGTH_SZ;
+    c32toa(0, buf + idx); /* Languages - Server To Client (0) */
+    idx += LENGTH_SZ;
+    buf[idx++] = 0;       /* First KEX packet follows (false) */
+    c32toa(0, buf + idx); /* Reserved (0) */
+    idx += LENGTH_SZ;
+
+    return idx;
+}
+
+
+/*
+ * Serializes the KEXINIT message after the cookie from the CTX's algorithm
+ * lists and host keys. SendKexInit copies it for any session still using
+ * the CTX's lists. Called whenever one of those inputs changes. If the
+ * cache can't be built, sessions build the message themselves.
+ */
+int CtxKexInitRefresh(WOLFSSH_CTX* ctx)
+{
+    char* keyAlgoNames = NULL;
+    const char* kexAlgoNamesPlus = NULL;
+    byte* body;
+    word32 bodySz;
+    int ret = WS_SUCCESS;
+
+    if (ctx == NULL)
+        return WS_BAD_ARGUMENT;
+
+    if (ctx->kexInitBody != NULL) {
+        WFREE(ctx->kexInitBody, ctx->heap, DYNTYPE_STRING);
+        ctx->kexInitBody = NULL;
+        ctx->kexInitBodySz = 0;
+    }
+
+    if (!ctx->algoListKey && ctx->side == WOLFSSH_ENDPOINT_SERVER) {
+        /* Nothing to offer until a host key is loaded. */
+        if (ctx->publicKeyAlgoCount == 0)
+            return WS_SUCCESS;
+        ret = BuildKeyAlgoNames(ctx, &keyAlgoNames);
+    }
+
+    if (ret == WS_SUCCESS) {
+        if (ctx->side == WOLFSSH_ENDPOINT_CLIENT)
+            kexAlgoNamesPlus = ",ext-info-c";
+
+        bodySz = KexInitBodyCopy(NULL, ctx->algoListKex, kexAlgoNamesPlus,
+                keyAlgoNames ? keyAlgoNames : ctx->algoListKey,
+                ctx->algoListCipher, ctx->algoListMac);
+        body = (byte*)WMALLOC(bodySz, ctx->heap, DYNTYPE_STRING);
+        if (body == NULL) {
+            ret = WS_MEMORY_E;
+        }
+        else {
+            KexInitBodyCopy(body, ctx->algoListKex, kexAlgoNamesPlus,
+                    keyAlgoNames ? keyAlgoNames : ctx->algoListKey,
+                    ctx->algoListCipher, ctx->algoListMac);
+            ctx->kexInitBody = body;
+            ctx->kexInitBodySz = bodySz;
+        }
+    }
+
+    if (keyAlgoNames) {
+        WFREE(keyAlgoNames, ctx->heap, DYNTYPE_STRING);
+    }
+
+    WLOG(WS_LOG_DEBUG, "Leaving CtxKexInitRefresh(), ret = %d", ret);
+    return ret;
+}
+
+
+/*
+ * Returns the KEX algorithm the client may send a guessed KEX init for,
+ * its first choice, or ID_NONE. DH-GEX starts with a group request rather
+ * than a KEX init, so it isn't guessed.
+ */
+static byte KexGuessId(WOLFSSH* ssh)
+{
+    const char* list = ssh->algoListKex;
+    word32 nameSz = 0;
+    byte id;
+
+    if (list == NULL)
+        return ID_NONE;
+
+    while (list[nameSz] != '\0' && list[nameSz] != ',')
+        nameSz++;
+
+    id = NameToId(list, nameSz);
+    if (id == ID_UNKNOWN || id == ID_DH_GEX_SHA256)
+        id = ID_NONE;
+
+    return id;
+}
+
+
 int SendKexInit(WOLFSSH* ssh)
 {
     byte* output = NULL;
     byte* payload = NULL;
     char* keyAlgoNames = NULL;
     const char* kexAlgoNamesPlus = NULL;
-    word32 idx = 0, payloadSz = 0,
-            kexAlgoNamesSz = 0, kexAlgoNamesPlusSz = 0,
-            keyAlgoNamesSz = 0, encAlgoNamesSz = 0,
-            macAlgoNamesSz = 0, noneNamesSz = 0;
+    word32 idx = 0, payloadSz = 0, bodySz = 0;
+    byte useCache = 0;
+    byte guessId = ID_NONE;
 
     int ret = WS_SUCCESS;
 
@@ -10460,47 +12366,40 @@ int SendKexInit(WOLFSSH* ssh)
     }
 
     if (ret == WS_SUCCESS) {
-        if (!ssh->algoListKey && ssh->ctx->side == WOLFSSH_ENDPOINT_SERVER) {
-            keyAlgoNamesSz = BuildNameList(NULL, 0,
-                    ssh->ctx->publicKeyAlgo,
-                    ssh->ctx->publicKeyAlgoCount)
-                + 1;
-            keyAlgoNames = (char*)WMALLOC(keyAlgoNamesSz,
-                    ssh->ctx->heap, DYNTYPE_STRING);
-            if (keyAlgoNames) {
-                ret = BuildNameList(keyAlgoNames, keyAlgoNamesSz,
-                    ssh->ctx->publicKeyAlgo,
-                    ssh->ctx->publicKeyAlgoCount);
-                if (ret > 0) {
-                    keyAlgoNamesSz = (word32)ret;
-                    ret = WS_SUCCESS;
-                }
-            }
-            else {
-                ret = WS_MEMORY_E;
-            }
+        /* The CTX's cached copy is only good if the session hasn't
+         * replaced any of the CTX's algorithm lists. */
+        useCache = ssh->ctx->kexInitBody != NULL
+            && ssh->algoListKex == ssh->ctx->algoListKex
+            && ssh->algoListKey == ssh->ctx->algoListKey
+            && ssh->algoListCipher == ssh->ctx->algoListCipher
+            && ssh->algoListMac == ssh->ctx->algoListMac;
+
+        if (!useCache && !ssh->algoListKey
+                && ssh->ctx->side == WOLFSSH_ENDPOINT_SERVER) {
+            ret = BuildKeyAlgoNames(ssh->ctx, &keyAlgoNames);
         }
-    }
 
-    if (ret == WS_SUCCESS) {
-        if (ssh->ctx->side == WOLFSSH_ENDPOINT_CLIENT) {
-            kexAlgoNamesPlus = ",ext-info-c";
-            kexAlgoNamesPlusSz = (word32)WSTRLEN(kexAlgoNamesPlus);
+        /* Only the first key exchange waits on the server's KEXINIT. */
+        if (ssh->kexGuess && ssh->ctx->side == WOLFSSH_ENDPOINT_CLIENT
+                && ssh->connectState < CONNECT_KEYED) {
+            guessId = KexGuessId(ssh);
         }
+    }
 
-        kexAlgoNamesSz = AlgoListSz(ssh->algoListKex);
-        encAlgoNamesSz = AlgoListSz(ssh->algoListCipher);
-        if (!keyAlgoNames) {
-            keyAlgoNamesSz = AlgoListSz(ssh->algoListKey);
+    if (ret == WS_SUCCESS) {
+        if (useCache) {
+            bodySz = ssh->ctx->kexInitBodySz;
         }
         else {
-            keyAlgoNamesSz = AlgoListSz(keyAlgoNames);
+            if (ssh->ctx->side == WOLFSSH_ENDPOINT_CLIENT) {
+                kexAlgoNamesPlus = ",ext-info-c";
+            }
+            bodySz = KexInitBodyCopy(NULL, ssh->algoListKex,
+                    kexAlgoNamesPlus,
+                    keyAlgoNames ? keyAlgoNames : ssh->algoListKey,
+                    ssh->algoListCipher, ssh->algoListMac);
         }
-        macAlgoNamesSz = AlgoListSz(ssh->algoListMac);
-        noneNamesSz = AlgoListSz(cannedNoneNames);
-        payloadSz = MSG_ID_SZ + COOKIE_SZ + (LENGTH_SZ * 11) + BOOLEAN_SZ +
-            + kexAlgoNamesSz + kexAlgoNamesPlusSz + keyAlgoNamesSz
-            + (encAlgoNamesSz * 2) + (macAlgoNamesSz * 2) + (noneNamesSz * 2);
+        payloadSz = MSG_ID_SZ + COOKIE_SZ + bodySz;
         ret = PreparePacket(ssh, payloadSz);
     }
 
@@ -10520,28 +12419,21 @@ int SendKexInit(WOLFSSH* ssh)
 
         idx += COOKIE_SZ;
 
-        CopyNameListPlus(output, &idx,
-                ssh->algoListKex, kexAlgoNamesSz,
-                kexAlgoNamesPlus, kexAlgoNamesPlusSz);
-        if (!keyAlgoNames) {
-            CopyNameList(output, &idx, ssh->algoListKey, keyAlgoNamesSz);
+        if (useCache) {
+            WMEMCPY(output + idx, ssh->ctx->kexInitBody, bodySz);
         }
         else {
-            CopyNameList(output, &idx, keyAlgoNames, keyAlgoNamesSz);
-        }
-        CopyNameList(output, &idx, ssh->algoListCipher, encAlgoNamesSz);
-        CopyNameList(output, &idx, ssh->algoListCipher, encAlgoNamesSz);
-        CopyNameList(output, &idx, ssh->algoListMac, macAlgoNamesSz);
-        CopyNameList(output, &idx, ssh->algoListMac, macAlgoNamesSz);
-        CopyNameList(output, &idx, cannedNoneNames, noneNamesSz);
-        CopyNameList(output, &idx, cannedNoneNames, noneNamesSz);
-        c32toa(0, output + idx); /* Languages - Client To Server (0) */
-        idx += LENGTH_SZ;
-        c32toa(0, output + idx); /* Languages - Server To Client (0) */
-        idx += LENGTH_SZ;
-        output[idx++] = 0;       /* First KEX packet follows (false) */
-        c32toa(0, output + idx); /* Reserved (0) */
-        idx += LENGTH_SZ;
+            KexInitBodyCopy(output + idx, ssh->algoListKex,
+                    kexAlgoNamesPlus,
+                    keyAlgoNames ? keyAlgoNames : ssh->algoListKey,
+                    ssh->algoListCipher, ssh->algoListMac);
+        }
+        idx += bodySz;
+
+        if (guessId != ID_NONE) {
+            /* First KEX packet follows, just before the reserved value. */
+            output[idx - LENGTH_SZ - BOOLEAN_SZ] = 1;
+        }
 
         if (ssh->handshake->kexInit != NULL) {
             WFREE(ssh->handshake->kexInit, ssh->ctx->heap, DYNTYPE_STRING);
@@ -10572,7 +12464,15 @@ int SendKexInit(WOLFSSH* ssh)
         ret = BundlePacket(ssh);
     }
 
-    if (ret == WS_SUCCESS)
+    if (ret == WS_SUCCESS && guessId != ID_NONE) {
+        /* Send the KEX init for our first choice in the same flight. If the
+         * server prefers the same algorithms, it answers it directly. */
+        WLOG(WS_LOG_DEBUG, "Guessing KEX algo %s", IdToName(guessId));
+        ssh->handshake->kexId = guessId;
+        ssh->handshake->kexGuess = 1;
+        ret = SendKexDhInit(ssh);
+    }
+    else if (ret == WS_SUCCESS)
         ret = wolfSSH_SendPacket(ssh);
 
     if (ret != WS_WANT_WRITE && ret != WS_SUCCESS)
@@ -10591,6 +12491,8 @@ struct wolfSSH_sigKeyBlockFull {
         word32 pubKeyNameSz;
         const char *pubKeyFmtName;
         word32 pubKeyFmtNameSz;
+        WOLFSSH_HOST_KEY *hostKey; /* taken from the CTX, used instead of sk */
+        WC_RNG *rng; /* for signing, the session's or the offload's own */
         union {
 #ifndef WOLFSSH_NO_RSA
             struct {
@@ -10801,6 +12703,442 @@ static int GetDHPrimeGroup(int kexId, const byte** primeGroup,
 #endif /* !WOLFSSH_NO_DH */
 
 
+/* KEX key pool
+ *
+ * A server CTX may hold a pool of pre-generated, single-use ephemeral key
+ * pairs for each of its key exchange algorithms. CtxKexKeyPoolFill() tops
+ * the pool up and is meant to be called from idle time or an application
+ * thread. The KeyAgree*_server() functions take an entry when one is
+ * available, leaving only the shared secret to compute during the
+ * handshake, and fall back to generating a key pair themselves. */
+
+static int KexKeyPoolable(byte kexId)
+{
+    switch (kexId) {
+        #ifndef WOLFSSH_NO_DH_GROUP1_SHA1
+        case ID_DH_GROUP1_SHA1:
+        #endif
+        #ifndef WOLFSSH_NO_DH_GROUP14_SHA1
+        case ID_DH_GROUP14_SHA1:
+        #endif
+        #ifndef WOLFSSH_NO_DH_GROUP14_SHA256
+        case ID_DH_GROUP14_SHA256:
+        #endif
+        #ifndef WOLFSSH_NO_DH_GROUP16_SHA512
+        case ID_DH_GROUP16_SHA512:
+        #endif
+        #ifndef WOLFSSH_NO_ECDH_SHA2_NISTP256
+        case ID_ECDH_SHA2_NISTP256:
+        #endif
+        #ifndef WOLFSSH_NO_ECDH_SHA2_NISTP384
+        case ID_ECDH_SHA2_NISTP384:
+        #endif
+        #ifndef WOLFSSH_NO_ECDH_SHA2_NISTP521
+        case ID_ECDH_SHA2_NISTP521:
+        #endif
+        #ifndef WOLFSSH_NO_NISTP256_MLKEM768_SHA256
+        case ID_NISTP256_MLKEM768_SHA256:
+        #endif
+        #ifndef WOLFSSH_NO_CURVE25519_SHA256
+        case ID_CURVE25519_SHA256:
+        case ID_CURVE25519_SHA256_LIBSSH:
+        #endif
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+
+static int KexKeyPoolLock(WOLFSSH_CTX* ctx)
+{
+#ifndef SINGLE_THREADED
+    if (wc_LockMutex(&ctx->kexKeyPoolMutex) != 0) {
+        WLOG(WS_LOG_DEBUG, "Couldn't lock KEX key pool");
+        return WS_ERROR;
+    }
+#else
+    WOLFSSH_UNUSED(ctx);
+#endif
+    return WS_SUCCESS;
+}
+
+
+static void KexKeyPoolUnlock(WOLFSSH_CTX* ctx)
+{
+#ifndef SINGLE_THREADED
+    wc_UnLockMutex(&ctx->kexKeyPoolMutex);
+#else
+    WOLFSSH_UNUSED(ctx);
+#endif
+}
+
+
+static void KexKeyFree(WOLFSSH_KEX_KEY* entry, void* heap)
+{
+    if (entry != NULL) {
+        ForceZero(entry, sizeof(WOLFSSH_KEX_KEY));
+        WFREE(entry, heap, DYNTYPE_PRIVKEY);
+    }
+}
+
+
+/* Counts the pooled entries for kexId. Call with the pool locked. */
+static word32 KexKeyPoolCount(WOLFSSH_CTX* ctx, byte kexId)
+{
+    WOLFSSH_KEX_KEY* entry;
+    word32 count = 0;
+
+    for (entry = ctx->kexKeyPool; entry != NULL; entry = entry->next) {
+        if (entry->kexId == kexId)
+            count++;
+    }
+
+    return count;
+}
+
+
+/* Unlinks and returns a pooled key pair for kexId, or NULL if there
+ * isn't one. The caller owns the entry and releases it with KexKeyFree(). */
+static WOLFSSH_KEX_KEY* KexKeyPoolTake(WOLFSSH_CTX* ctx, byte kexId)
+{
+    WOLFSSH_KEX_KEY* entry = NULL;
+    WOLFSSH_KEX_KEY** prev;
+
+    /* A pool sized to 0 is emptied under the lock, so the list is all
+     * there is to check. */
+    if (KexKeyPoolLock(ctx) == WS_SUCCESS) {
+        for (prev = &ctx->kexKeyPool; *prev != NULL; prev = &(*prev)->next) {
+            if ((*prev)->kexId == kexId) {
+                entry = *prev;
+                *prev = entry->next;
+                entry->next = NULL;
+                break;
+            }
+        }
+        KexKeyPoolUnlock(ctx);
+    }
+
+    if (entry != NULL) {
+        WLOG(WS_LOG_DEBUG, "Using pooled KEX key pair for %s",
+                IdToName(kexId));
+    }
+
+    return entry;
+}
+
+
+#ifndef WOLFSSH_NO_DH
+static int KexKeyGenerateDh(WOLFSSH_CTX* ctx, WC_RNG* rng,
+        WOLFSSH_KEX_KEY* entry)
+{
+    int ret;
+    const byte* primeGroup = NULL;
+    const byte* generator = NULL;
+    word32 primeGroupSz = 0;
+    word32 generatorSz = 0;
+    #ifdef WOLFSSH_SMALL_STACK
+    DhKey* key = (DhKey*)WMALLOC(sizeof(DhKey), ctx->heap, DYNTYPE_PRIVKEY);
+    if (key == NULL)
+        return WS_MEMORY_E;
+    #else
+    DhKey key[1];
+    #endif
+
+    WOLFSSH_UNUSED(ctx);
+
+    ret = GetDHPrimeGroup(entry->kexId, &primeGroup, &primeGroupSz,
+            &generator, &generatorSz);
+    if (ret == WS_SUCCESS) {
+        ret = wc_InitDhKey_ex(key, ctx->heap, ctx->devId);
+        if (ret == 0)
+            ret = wc_DhSetKey(key, primeGroup, primeGroupSz,
+                    generator, generatorSz);
+        if (ret == 0)
+            ret = wc_DhGenerateKeyPair(key, rng,
+                    entry->priv, &entry->privSz, entry->pub, &entry->pubSz);
+        wc_FreeDhKey(key);
+    }
+    #ifdef WOLFSSH_SMALL_STACK
+    WFREE(key, ctx->heap, DYNTYPE_PRIVKEY);
+    #endif
+
+    return ret;
+}
+#endif /* WOLFSSH_NO_DH */
+
+
+#if !defined(WOLFSSH_NO_ECDH) \
+    || !defined(WOLFSSH_NO_NISTP256_MLKEM768_SHA256)
+static int KexKeyGenerateEcc(WOLFSSH_CTX* ctx, WC_RNG* rng,
+        WOLFSSH_KEX_KEY* entry)
+{
+    int ret = WS_SUCCESS;
+    int primeId;
+    #ifdef WOLFSSH_SMALL_STACK
+    ecc_key* key = (ecc_key*)WMALLOC(sizeof(ecc_key), ctx->heap,
+            DYNTYPE_PRIVKEY);
+    if (key == NULL)
+        return WS_MEMORY_E;
+    #else
+    ecc_key key[1];
+    #endif
+
+    primeId = wcPrimeForId(entry->kexId);
+    if (primeId == ECC_CURVE_INVALID)
+        ret = WS_INVALID_PRIME_CURVE;
+
+    if (ret == WS_SUCCESS) {
+        ret = wc_ecc_init_ex(key, ctx->heap, ctx->devId);
+        if (ret == 0)
+            ret = wc_ecc_make_key_ex(rng,
+                    wc_ecc_get_curve_size_from_id(primeId), key, primeId);
+        if (ret == 0) {
+            PRIVATE_KEY_UNLOCK();
+            ret = wc_ecc_export_private_only(key,
+                    entry->priv, &entry->privSz);
+            if (ret == 0)
+                ret = wc_ecc_export_x963(key, entry->pub, &entry->pubSz);
+            PRIVATE_KEY_LOCK();
+        }
+        wc_ecc_free(key);
+    }
+    #ifdef WOLFSSH_SMALL_STACK
+    WFREE(key, ctx->heap, DYNTYPE_PRIVKEY);
+    #endif
+
+    return ret;
+}
+#endif /* !WOLFSSH_NO_ECDH || !WOLFSSH_NO_NISTP256_MLKEM768_SHA256 */
+
+
+#ifndef WOLFSSH_NO_CURVE25519_SHA256
+static int KexKeyGenerateCurve25519(WOLFSSH_CTX* ctx, WC_RNG* rng,
+        WOLFSSH_KEX_KEY* entry)
+{
+    int ret;
+    #ifdef WOLFSSH_SMALL_STACK
+    curve25519_key* key = (curve25519_key*)WMALLOC(sizeof(curve25519_key),
+            ctx->heap, DYNTYPE_PRIVKEY);
+    if (key == NULL)
+        return WS_MEMORY_E;
+    #else
+    curve25519_key key[1];
+    #endif
+
+    ret = wc_curve25519_init_ex(key, ctx->heap, ctx->devId);
+    if (ret == 0)
+        ret = wc_curve25519_make_key(rng, CURVE25519_KEYSIZE, key);
+    if (ret == 0) {
+        PRIVATE_KEY_UNLOCK();
+        ret = wc_curve25519_export_private_raw_ex(key,
+                entry->priv, &entry->privSz, EC25519_LITTLE_ENDIAN);
+        if (ret == 0)
+            ret = wc_curve25519_export_public_ex(key,
+                    entry->pub, &entry->pubSz, EC25519_LITTLE_ENDIAN);
+        PRIVATE_KEY_LOCK();
+    }
+    wc_curve25519_free(key);
+    #ifdef WOLFSSH_SMALL_STACK
+    WFREE(key, ctx->heap, DYNTYPE_PRIVKEY);
+    #endif
+
+    return ret;
+}
+#endif /* WOLFSSH_NO_CURVE25519_SHA256 */
+
+
+static int KexKeyGenerate(WOLFSSH_CTX* ctx, WC_RNG* rng, byte kexId,
+        WOLFSSH_KEX_KEY* entry)
+{
+    int ret = WS_INVALID_ALGO_ID;
+
+    WMEMSET(entry, 0, sizeof(WOLFSSH_KEX_KEY));
+    entry->kexId = kexId;
+    entry->privSz = (word32)sizeof(entry->priv);
+    entry->pubSz = (word32)sizeof(entry->pub);
+
+    switch (kexId) {
+        #ifndef WOLFSSH_NO_DH
+        case ID_DH_GROUP1_SHA1:
+        case ID_DH_GROUP14_SHA1:
+        case ID_DH_GROUP14_SHA256:
+        case ID_DH_GROUP16_SHA512:
+            /* GetDHPrimeGroup() rejects the groups not compiled in. */
+            ret = KexKeyGenerateDh(ctx, rng, entry);
+            break;
+        #endif
+        #ifndef WOLFSSH_NO_ECDH
+        case ID_ECDH_SHA2_NISTP256:
+        case ID_ECDH_SHA2_NISTP384:
+        case ID_ECDH_SHA2_NISTP521:
+            ret = KexKeyGenerateEcc(ctx, rng, entry);
+            break;
+        #endif
+        #ifndef WOLFSSH_NO_NISTP256_MLKEM768_SHA256
+        case ID_NISTP256_MLKEM768_SHA256:
+            /* Only the ECDH half of the hybrid is pooled. The ML-KEM
+             * encapsulation depends on the client's public key. */
+            ret = KexKeyGenerateEcc(ctx, rng, entry);
+            break;
+        #endif
+        #ifndef WOLFSSH_NO_CURVE25519_SHA256
+        case ID_CURVE25519_SHA256:
+        case ID_CURVE25519_SHA256_LIBSSH:
+            ret = KexKeyGenerateCurve25519(ctx, rng, entry);
+            break;
+        #endif
+        default:
+            break;
+    }
+
+    if (ret != WS_SUCCESS) {
+        WLOG(WS_LOG_DEBUG, "KEX key pool generate failed, ret = %d", ret);
+    }
+
+    return ret;
+}
+
+
+/* Tops the pool up to kexKeyPoolSz key pairs for each poolable algorithm
+ * in the CTX's KEX algorithm list. Key pairs are generated without holding
+ * the pool lock, so handshakes can keep taking entries meanwhile. */
+int CtxKexKeyPoolFill(WOLFSSH_CTX* ctx)
+{
+    WC_RNG rng[1];
+    WOLFSSH_KEX_KEY* entry = NULL;
+    const char* list;
+    const char* name;
+    word32 nameSz;
+    word32 count = 0;
+    word32 poolSz = 0;
+    byte kexId;
+    int ret = WS_SUCCESS;
+
+    WLOG(WS_LOG_DEBUG, "Entering CtxKexKeyPoolFill()");
+
+    if (ctx == NULL)
+        return WS_BAD_ARGUMENT;
+
+    if (KexKeyPoolLock(ctx) != WS_SUCCESS)
+        return WS_ERROR;
+    poolSz = ctx->kexKeyPoolSz;
+    KexKeyPoolUnlock(ctx);
+
+    if (poolSz == 0 || ctx->algoListKex == NULL)
+        return WS_SUCCESS;
+
+    if (wc_InitRng_ex(rng, ctx->heap, ctx->devId) != 0)
+        return WS_CRYPTO_FAILED;
+
+    list = ctx->algoListKex;
+    while (ret == WS_SUCCESS && *list != 0) {
+        name = list;
+        list = WSTRCHR(name, ',');
+        if (list != NULL) {
+            nameSz = (word32)(list - name);
+            list++;
+        }
+        else {
+            nameSz = (word32)WSTRLEN(name);
+            list = name + nameSz;
+        }
+
+        kexId = NameToId(name, nameSz);
+        if (!KexKeyPoolable(kexId))
+            continue;
+
+        for (;;) {
+            ret = KexKeyPoolLock(ctx);
+            if (ret != WS_SUCCESS)
+                break;
+            poolSz = ctx->kexKeyPoolSz;
+            count = KexKeyPoolCount(ctx, kexId);
+            if (entry != NULL && count < poolSz) {
+                entry->next = ctx->kexKeyPool;
+                ctx->kexKeyPool = entry;
+                entry = NULL;
+                count++;
+            }
+            KexKeyPoolUnlock(ctx);
+
+            if (count >= poolSz)
+                break;
+
+            if (entry == NULL) {
+                entry = (WOLFSSH_KEX_KEY*)WMALLOC(sizeof(WOLFSSH_KEX_KEY),
+                        ctx->heap, DYNTYPE_PRIVKEY);
+                if (entry == NULL) {
+                    ret = WS_MEMORY_E;
+                    break;
+                }
+            }
+            ret = KexKeyGenerate(ctx, rng, kexId, entry);
+            if (ret != WS_SUCCESS)
+                break;
+        }
+    }
+
+    KexKeyFree(entry, ctx->heap);
+    wc_FreeRng(rng);
+
+    WLOG(WS_LOG_DEBUG, "Leaving CtxKexKeyPoolFill(), ret = %d", ret);
+    return ret;
+}
+
+
+/* Sets the pool depth. The size is changed under the pool lock, like
+ * every other use of it, so handshakes and fills on other threads see
+ * either the old or the new size. 0 also releases the pooled keys. */
+int CtxKexKeyPoolSetSize(WOLFSSH_CTX* ctx, word32 count)
+{
+    WOLFSSH_KEX_KEY* entry = NULL;
+    WOLFSSH_KEX_KEY* next;
+
+    if (ctx == NULL)
+        return WS_BAD_ARGUMENT;
+
+    if (KexKeyPoolLock(ctx) != WS_SUCCESS)
+        return WS_ERROR;
+    ctx->kexKeyPoolSz = count;
+    if (count == 0) {
+        entry = ctx->kexKeyPool;
+        ctx->kexKeyPool = NULL;
+    }
+    KexKeyPoolUnlock(ctx);
+
+    while (entry != NULL) {
+        next = entry->next;
+        KexKeyFree(entry, ctx->heap);
+        entry = next;
+    }
+
+    return WS_SUCCESS;
+}
+
+
+void CtxKexKeyPoolFree(WOLFSSH_CTX* ctx)
+{
+    WOLFSSH_KEX_KEY* entry = NULL;
+    WOLFSSH_KEX_KEY* next;
+
+    if (ctx == NULL)
+        return;
+
+    if (KexKeyPoolLock(ctx) == WS_SUCCESS) {
+        entry = ctx->kexKeyPool;
+        ctx->kexKeyPool = NULL;
+        KexKeyPoolUnlock(ctx);
+    }
+
+    while (entry != NULL) {
+        next = entry->next;
+        KexKeyFree(entry, ctx->heap);
+        entry = next;
+    }
+}
+
+
 /* Sets the signing key and hashes in the public key
  * returns WS_SUCCESS on success */
 static int SendKexGetSigningKey(WOLFSSH* ssh,
@@ -10812,6 +13150,16 @@ static int SendKexGetSigningKey(WOLFSSH* ssh,
     void* heap;
     byte scratchLen[LENGTH_SZ];
     word32 scratch = 0;
+    WOLFSSH_HOST_KEY* hostKey = NULL;
+#ifndef WOLFSSH_NO_RSA
+    RsaKey* rsaKey = NULL;
+#endif
+#ifndef WOLFSSH_NO_ECDSA
+    ecc_key* eccKey = NULL;
+#endif
+#ifndef WOLFSSH_NO_ED25519
+    ed25519_key* edKey = NULL;
+#endif
 #ifndef WOLFSSH_NO_DH_GEX_SHA256
     const byte* primeGroup = NULL;
     word32 primeGroupSz = 0;
@@ -10832,26 +13180,38 @@ static int SendKexGetSigningKey(WOLFSSH* ssh,
         case ID_SSH_RSA:
         case ID_RSA_SHA2_256:
         case ID_RSA_SHA2_512:
-            /* Decode the user-configured RSA private key. */
             sigKeyBlock_ptr->sk.rsa.eSz =
                     (word32)sizeof(sigKeyBlock_ptr->sk.rsa.e);
             sigKeyBlock_ptr->sk.rsa.nSz =
                     (word32)sizeof(sigKeyBlock_ptr->sk.rsa.n);
-            ret = wc_InitRsaKey(&sigKeyBlock_ptr->sk.rsa.key, heap);
-            if (ret == 0)
-                ret = wc_RsaPrivateKeyDecode(ssh->ctx->privateKey[keyIdx].key,
-                        &scratch, &sigKeyBlock_ptr->sk.rsa.key,
-                        (int)ssh->ctx->privateKey[keyIdx].keySz);
+            hostKey = HostKeyGet(ssh, keyIdx, ID_SSH_RSA);
+            if (hostKey != NULL) {
+                /* Sign with a decoded copy of the RSA key from the CTX. */
+                sigKeyBlock_ptr->hostKey = hostKey;
+                rsaKey = &hostKey->sk.rsa;
+            }
+            else {
+                /* Decode the user-configured RSA private key. */
+                hostKey = NULL;
+                rsaKey = &sigKeyBlock_ptr->sk.rsa.key;
+                ret = wc_InitRsaKey_ex(rsaKey, heap, ssh->devId);
+                if (ret == 0)
+                    ret = wc_RsaPrivateKeyDecode(
+                            ssh->ctx->privateKey[keyIdx].key,
+                            &scratch, rsaKey,
+                            (int)ssh->ctx->privateKey[keyIdx].keySz);
+            }
 
             /* hash in usual public key if not RFC6187 style cert use */
             if (!isCert) {
                 /* Flatten the public key into mpint values for the hash. */
-                if (ret == 0)
-                    ret = wc_RsaFlattenPublicKey(&sigKeyBlock_ptr->sk.rsa.key,
+                if (ret == 0) {
+                    ret = wc_RsaFlattenPublicKey(rsaKey,
                                                  sigKeyBlock_ptr->sk.rsa.e,
                                                  &sigKeyBlock_ptr->sk.rsa.eSz,
                                                  sigKeyBlock_ptr->sk.rsa.n,
                                                  &sigKeyBlock_ptr->sk.rsa.nSz);
+                }
                 if (ret == 0) {
                     /* Add a pad byte if the mpint has the MSB set. */
                     ret = CreateMpint(sigKeyBlock_ptr->sk.rsa.e,
@@ -10941,23 +13301,33 @@ static int SendKexGetSigningKey(WOLFSSH* ssh,
             sigKeyBlock_ptr->sk.ecc.primeNameSz =
                     (word32)WSTRLEN(sigKeyBlock_ptr->sk.ecc.primeName);
 
-            /* Decode the user-configured ECDSA private key. */
             sigKeyBlock_ptr->sk.ecc.qSz =
                     (word32)sizeof(sigKeyBlock_ptr->sk.ecc.q);
-            ret = wc_ecc_init_ex(&sigKeyBlock_ptr->sk.ecc.key, heap,
-                    INVALID_DEVID);
-            scratch = 0;
-            if (ret == 0)
-                ret = wc_EccPrivateKeyDecode(ssh->ctx->privateKey[keyIdx].key,
-                        &scratch, &sigKeyBlock_ptr->sk.ecc.key,
-                        ssh->ctx->privateKey[keyIdx].keySz);
+            hostKey = HostKeyGet(ssh, keyIdx, ID_ECDSA_SHA2_NISTP256);
+            if (hostKey != NULL) {
+                /* Sign with a decoded copy of the ECDSA key from the CTX. */
+                sigKeyBlock_ptr->hostKey = hostKey;
+                eccKey = &hostKey->sk.ecc;
+            }
+            else {
+                /* Decode the user-configured ECDSA private key. */
+                hostKey = NULL;
+                eccKey = &sigKeyBlock_ptr->sk.ecc.key;
+                ret = wc_ecc_init_ex(eccKey, heap, ssh->devId);
+                scratch = 0;
+                if (ret == 0)
+                    ret = wc_EccPrivateKeyDecode(
+                            ssh->ctx->privateKey[keyIdx].key,
+                            &scratch, eccKey,
+                            ssh->ctx->privateKey[keyIdx].keySz);
+            }
 
             /* hash in usual public key if not RFC6187 style cert use */
             if (!isCert) {
                 /* Flatten the public key into x963 value for hash. */
                 if (ret == 0) {
                     PRIVATE_KEY_UNLOCK();
-                    ret = wc_ecc_export_x963(&sigKeyBlock_ptr->sk.ecc.key,
+                    ret = wc_ecc_export_x963(eccKey,
                                              sigKeyBlock_ptr->sk.ecc.q,
                                              &sigKeyBlock_ptr->sk.ecc.qSz);
                     PRIVATE_KEY_LOCK();
@@ -11008,19 +13378,31 @@ static int SendKexGetSigningKey(WOLFSSH* ssh,
         case ID_ED25519:
             WLOG(WS_LOG_DEBUG, "Using Ed25519 Host key");
 
-            /* Decode the user-configured ED25519 private key. */
             sigKeyBlock_ptr->sk.ed.qSz = sizeof(sigKeyBlock_ptr->sk.ed.q);
+            hostKey = HostKeyGet(ssh, keyIdx, ID_ED25519);
+            if (hostKey != NULL) {
+                /* Sign with a decoded copy of the ED25519 key from the CTX. */
+                sigKeyBlock_ptr->hostKey = hostKey;
+                edKey = &hostKey->sk.ed;
+            }
+            else {
+                /* Decode the user-configured ED25519 private key. */
+                hostKey = NULL;
+                edKey = &sigKeyBlock_ptr->sk.ed.key;
+                ret = wc_ed25519_init_ex(edKey, heap, ssh->devId);
 
-            ret = wc_ed25519_init(&sigKeyBlock_ptr->sk.ed.key);
-
-            scratch = 0;
-            if (ret == 0)
-                ret = wc_Ed25519PrivateKeyDecode(ssh->ctx->privateKey[keyIdx].key, &scratch, &sigKeyBlock_ptr->sk.ed.key, ssh->ctx->privateKey[keyIdx].keySz);
+                scratch = 0;
+                if (ret == 0)
+                    ret = wc_Ed25519PrivateKeyDecode(
+                            ssh->ctx->privateKey[keyIdx].key, &scratch,
+                            edKey, ssh->ctx->privateKey[keyIdx].keySz);
+            }
 
-            if (ret == 0)
-                ret = wc_ed25519_export_public(&sigKeyBlock_ptr->sk.ed.key,
+            if (ret == 0) {
+                ret = wc_ed25519_export_public(edKey,
                                                 sigKeyBlock_ptr->sk.ed.q,
                                                 &sigKeyBlock_ptr->sk.ed.qSz );
+            }
 
             /* Hash in the length of the public key block. */
             if (ret == 0) {
@@ -11311,6 +13693,7 @@ static int KeyAgreeDh_server(WOLFSSH* ssh, byte hashId, byte* f, word32* fSz)
     word32 ySz = MAX_KEX_KEY_SZ;
     word32 primeGroupSz = 0;
     word32 generatorSz = 0;
+    WOLFSSH_KEX_KEY* pooled = NULL;
     #ifdef WOLFSSH_SMALL_STACK
     DhKey *privKey = (DhKey*)WMALLOC(sizeof(DhKey), ssh->ctx->heap,
             DYNTYPE_PRIVKEY);
@@ -11332,14 +13715,30 @@ static int KeyAgreeDh_server(WOLFSSH* ssh, byte hashId, byte* f, word32* fSz)
 
         if (ret == WS_SUCCESS) {
             ssh->primeGroupSz = primeGroupSz;
-            ret = wc_InitDhKey(privKey);
+            ret = wc_InitDhKey_ex(privKey, ssh->ctx->heap, ssh->devId);
         }
         if (ret == 0)
             ret = wc_DhSetKey(privKey, primeGroup, primeGroupSz,
                     generator, generatorSz);
-        if (ret == 0)
-            ret = wc_DhGenerateKeyPair(privKey, ssh->rng,
-                    y_ptr, &ySz, f, fSz);
+        if (ret == 0) {
+            if (ssh->handshake->kexId != ID_DH_GEX_SHA256)
+                pooled = KexKeyPoolTake(ssh->ctx, ssh->handshake->kexId);
+            if (pooled != NULL) {
+                if (pooled->pubSz > *fSz || pooled->privSz > ySz)
+                    ret = WS_BUFFER_E;
+                if (ret == 0) {
+                    WMEMCPY(y_ptr, pooled->priv, pooled->privSz);
+                    ySz = pooled->privSz;
+                    WMEMCPY(f, pooled->pub, pooled->pubSz);
+                    *fSz = pooled->pubSz;
+                }
+                KexKeyFree(pooled, ssh->ctx->heap);
+            }
+            else {
+                ret = wc_DhGenerateKeyPair(privKey, ssh->rng,
+                        y_ptr, &ySz, f, fSz);
+            }
+        }
         if (ret == 0) {
             PRIVATE_KEY_UNLOCK();
             ret = wc_DhAgree(privKey, ssh->k, &ssh->kSz, y_ptr, ySz,
@@ -11394,6 +13793,7 @@ static int KeyAgreeEcdh_server(WOLFSSH* ssh, byte hashId, byte* f, word32* fSz)
     ecc_key privKey[1];
 #endif
     int primeId;
+    WOLFSSH_KEX_KEY* pooled = NULL;
 
     WLOG(WS_LOG_DEBUG, "Entering KeyAgreeEcdh_server()");
     WOLFSSH_UNUSED(hashId);
@@ -11404,9 +13804,9 @@ static int KeyAgreeEcdh_server(WOLFSSH* ssh, byte hashId, byte* f, word32* fSz)
         ret = WS_INVALID_PRIME_CURVE;
 
     if (ret == 0)
-        ret = wc_ecc_init_ex(pubKey, heap, INVALID_DEVID);
+        ret = wc_ecc_init_ex(pubKey, heap, ssh->devId);
     if (ret == 0)
-        ret = wc_ecc_init_ex(privKey, heap, INVALID_DEVID);
+        ret = wc_ecc_init_ex(privKey, heap, ssh->devId);
 #ifdef HAVE_WC_ECC_SET_RNG
     if (ret == 0)
         ret = wc_ecc_set_rng(privKey, ssh->rng);
@@ -11418,13 +13818,31 @@ static int KeyAgreeEcdh_server(WOLFSSH* ssh, byte hashId, byte* f, word32* fSz)
                                     pubKey, primeId);
 
     if (ret == 0)
-        ret = wc_ecc_make_key_ex(ssh->rng,
-                             wc_ecc_get_curve_size_from_id(primeId),
-                             privKey, primeId);
-    if (ret == 0) {
-        PRIVATE_KEY_UNLOCK();
-        ret = wc_ecc_export_x963(privKey, f, fSz);
-        PRIVATE_KEY_LOCK();
+        pooled = KexKeyPoolTake(ssh->ctx, ssh->handshake->kexId);
+    if (pooled != NULL) {
+        ret = wc_ecc_import_private_key_ex(pooled->priv, pooled->privSz,
+                pooled->pub, pooled->pubSz, privKey, primeId);
+        if (ret == 0) {
+            if (pooled->pubSz > *fSz) {
+                ret = WS_BUFFER_E;
+            }
+            else {
+                WMEMCPY(f, pooled->pub, pooled->pubSz);
+                *fSz = pooled->pubSz;
+            }
+        }
+        KexKeyFree(pooled, heap);
+    }
+    else {
+        if (ret == 0)
+            ret = wc_ecc_make_key_ex(ssh->rng,
+                                 wc_ecc_get_curve_size_from_id(primeId),
+                                 privKey, primeId);
+        if (ret == 0) {
+            PRIVATE_KEY_UNLOCK();
+            ret = wc_ecc_export_x963(privKey, f, fSz);
+            PRIVATE_KEY_LOCK();
+        }
     }
     if (ret == 0) {
         PRIVATE_KEY_UNLOCK();
@@ -11477,14 +13895,15 @@ static int KeyAgreeCurve25519_server(WOLFSSH* ssh, byte hashId,
 #else
     curve25519_key pubKey[1], privKey[1];
 #endif
+    WOLFSSH_KEX_KEY* pooled = NULL;
 
     WLOG(WS_LOG_DEBUG, "Entering KeyAgreeCurve25519_server()");
     WOLFSSH_UNUSED(hashId);
 
     if (ret == 0)
-        ret = wc_curve25519_init_ex(pubKey, heap, INVALID_DEVID);
+        ret = wc_curve25519_init_ex(pubKey, heap, ssh->devId);
     if (ret == 0)
-        ret = wc_curve25519_init_ex(privKey, heap, INVALID_DEVID);
+        ret = wc_curve25519_init_ex(privKey, heap, ssh->devId);
     if (ret == 0)
         ret = wc_curve25519_check_public(ssh->handshake->e,
                 ssh->handshake->eSz, EC25519_LITTLE_ENDIAN);
@@ -11494,13 +13913,33 @@ static int KeyAgreeCurve25519_server(WOLFSSH* ssh, byte hashId,
                 pubKey, EC25519_LITTLE_ENDIAN);
 
     if (ret == 0)
-        ret = wc_curve25519_make_key(ssh->rng, CURVE25519_KEYSIZE, privKey);
+        pooled = KexKeyPoolTake(ssh->ctx, ssh->handshake->kexId);
+    if (pooled != NULL) {
+        ret = wc_curve25519_import_private_raw_ex(
+                pooled->priv, pooled->privSz, pooled->pub, pooled->pubSz,
+                privKey, EC25519_LITTLE_ENDIAN);
+        if (ret == 0) {
+            if (pooled->pubSz > *fSz) {
+                ret = WS_BUFFER_E;
+            }
+            else {
+                WMEMCPY(f, pooled->pub, pooled->pubSz);
+                *fSz = pooled->pubSz;
+            }
+        }
+        KexKeyFree(pooled, heap);
+    }
+    else {
+        if (ret == 0)
+            ret = wc_curve25519_make_key(ssh->rng,
+                    CURVE25519_KEYSIZE, privKey);
 
-    if (ret == 0) {
-        PRIVATE_KEY_UNLOCK();
-        ret = wc_curve25519_export_public_ex(privKey,
-                f, fSz, EC25519_LITTLE_ENDIAN);
-        PRIVATE_KEY_LOCK();
+        if (ret == 0) {
+            PRIVATE_KEY_UNLOCK();
+            ret = wc_curve25519_export_public_ex(privKey,
+                    f, fSz, EC25519_LITTLE_ENDIAN);
+            PRIVATE_KEY_LOCK();
+        }
     }
 
     if (ret == 0) {
@@ -11556,6 +13995,7 @@ static int KeyAgreeEcdhMlKem_server(WOLFSSH* ssh, byte hashId,
     ecc_key* pubKey = NULL;
     ecc_key* privKey = NULL;
     int primeId;
+    WOLFSSH_KEX_KEY* pooled = NULL;
 #ifndef WOLFSSH_SMALL_STACK
     ecc_key eccKeys[2];
 #endif
@@ -11586,7 +14026,7 @@ static int KeyAgreeEcdhMlKem_server(WOLFSSH* ssh, byte hashId,
 
     if (ret == 0) {
         ret = wc_MlKemKey_Init(&kem, WC_ML_KEM_768, ssh->ctx->heap,
-                               INVALID_DEVID);
+                               ssh->devId);
     }
 
     if (ret == 0) {
@@ -11629,10 +14069,10 @@ static int KeyAgreeEcdhMlKem_server(WOLFSSH* ssh, byte hashId,
     wc_MlKemKey_Free(&kem);
 
     if (ret == 0) {
-        ret = wc_ecc_init_ex(pubKey, ssh->ctx->heap, INVALID_DEVID);
+        ret = wc_ecc_init_ex(pubKey, ssh->ctx->heap, ssh->devId);
     }
     if (ret == 0) {
-        ret = wc_ecc_init_ex(privKey, ssh->ctx->heap, INVALID_DEVID);
+        ret = wc_ecc_init_ex(privKey, ssh->ctx->heap, ssh->devId);
     }
 #ifdef HAVE_WC_ECC_SET_RNG
     if (ret == 0) {
@@ -11646,15 +14086,34 @@ static int KeyAgreeEcdhMlKem_server(WOLFSSH* ssh, byte hashId,
             pubKey, primeId);
     }
     if (ret == 0) {
-        ret = wc_ecc_make_key_ex(ssh->rng,
-                  wc_ecc_get_curve_size_from_id(primeId),
-                  privKey, primeId);
+        pooled = KexKeyPoolTake(ssh->ctx, ssh->handshake->kexId);
     }
-    if (ret == 0) {
-        PRIVATE_KEY_UNLOCK();
-        ret = wc_ecc_export_x963(privKey, f + length_ciphertext, fSz);
-        PRIVATE_KEY_LOCK();
-        *fSz += length_ciphertext;
+    if (pooled != NULL) {
+        ret = wc_ecc_import_private_key_ex(pooled->priv, pooled->privSz,
+                pooled->pub, pooled->pubSz, privKey, primeId);
+        if (ret == 0) {
+            if (pooled->pubSz > *fSz) {
+                ret = WS_BUFFER_E;
+            }
+            else {
+                WMEMCPY(f + length_ciphertext, pooled->pub, pooled->pubSz);
+                *fSz = pooled->pubSz + length_ciphertext;
+            }
+        }
+        KexKeyFree(pooled, ssh->ctx->heap);
+    }
+    else {
+        if (ret == 0) {
+            ret = wc_ecc_make_key_ex(ssh->rng,
+                      wc_ecc_get_curve_size_from_id(primeId),
+                      privKey, primeId);
+        }
+        if (ret == 0) {
+            PRIVATE_KEY_UNLOCK();
+            ret = wc_ecc_export_x963(privKey, f + length_ciphertext, fSz);
+            PRIVATE_KEY_LOCK();
+            *fSz += length_ciphertext;
+        }
     }
     if (ret == 0) {
         word32 tmp_kSz = ssh->kSz;
@@ -11684,8 +14143,8 @@ static int KeyAgreeEcdhMlKem_server(WOLFSSH* ssh, byte hashId,
         }
     }
     if (ret == 0) {
-        ret = wc_Hash(hashId, ssh->k, ssh->kSz, sharedSecretHash,
-                      sharedSecretHashSz);
+        ret = wc_Hash_ex(hashId, ssh->k, ssh->kSz, sharedSecretHash,
+                      sharedSecretHashSz, ssh->ctx->heap, ssh->devId);
     }
     if (ret == 0) {
         XMEMCPY(ssh->k, sharedSecretHash, sharedSecretHashSz);
@@ -11722,12 +14181,16 @@ static int SignHRsa(WOLFSSH* ssh, byte* sig, word32* sigSz,
     word32 encSigSz;
     int ret = WS_SUCCESS;
     enum wc_HashType hashId;
+    RsaKey* rsaKey;
 #ifndef WOLFSSH_SMALL_STACK
     byte encSig_s[MAX_ENCODED_SIG_SZ];
 #endif
 
     WLOG(WS_LOG_DEBUG, "Entering SignHRsa()");
 
+    rsaKey = (sigKey->hostKey != NULL) ?
+            &sigKey->hostKey->sk.rsa : &sigKey->sk.rsa.key;
+
     heap = ssh->ctx->heap;
 #ifdef WOLFSSH_SMALL_STACK
     encSig = (byte*)WMALLOC(MAX_ENCODED_SIG_SZ, heap, DYNTYPE_TEMP);
@@ -11742,7 +14205,8 @@ static int SignHRsa(WOLFSSH* ssh, byte* sig, word32* sigSz,
         hashId = HashForId(ssh->handshake->pubKeyId);
         digestSz = wc_HashGetDigestSize(hashId);
 
-        ret = wc_Hash(hashId, ssh->h, ssh->hSz, digest, digestSz);
+        ret = wc_Hash_ex(hashId, ssh->h, ssh->hSz, digest, digestSz,
+                ssh->ctx->heap, ssh->devId);
         if (ret != 0) {
             ret = WS_CRYPTO_FAILED;
         }
@@ -11773,8 +14237,7 @@ static int SignHRsa(WOLFSSH* ssh, byte* sig, word32* sigSz,
         else
         #endif /* WOLFSSH_TPM */
         ret = wc_RsaSSL_Sign(encSig, encSigSz, sig,
-                KEX_SIG_SIZE, &sigKey->sk.rsa.key,
-                ssh->rng);
+                KEX_SIG_SIZE, rsaKey, sigKey->rng);
         if (ret <= 0) {
             WLOG(WS_LOG_DEBUG, "SignHRsa: Bad RSA Sign");
             ret = WS_RSA_E;
@@ -11787,7 +14250,7 @@ static int SignHRsa(WOLFSSH* ssh, byte* sig, word32* sigSz,
 
     if (ret == WS_SUCCESS) {
         ret = wolfSSH_RsaVerify(sig, *sigSz, encSig, encSigSz,
-                &sigKey->sk.rsa.key, heap, "SignHRsa");
+                rsaKey, heap, "SignHRsa");
     }
 
     #ifdef WOLFSSH_SMALL_STACK
@@ -11833,7 +14296,8 @@ static int SignHEcdsa(WOLFSSH* ssh, byte* sig, word32* sigSz,
     hashId = HashForId(ssh->handshake->pubKeyId);
     digestSz = wc_HashGetDigestSize(hashId);
 
-    ret = wc_Hash(hashId, ssh->h, ssh->hSz, digest, digestSz);
+    ret = wc_Hash_ex(hashId, ssh->h, ssh->hSz, digest, digestSz,
+            ssh->ctx->heap, ssh->devId);
     if (ret != 0) {
         ret = WS_CRYPTO_FAILED;
     }
@@ -11841,8 +14305,9 @@ static int SignHEcdsa(WOLFSSH* ssh, byte* sig, word32* sigSz,
     if (ret == WS_SUCCESS) {
         WLOG(WS_LOG_INFO, "Signing hash with %s.",
                 IdToName(ssh->handshake->pubKeyId));
-        ret = wc_ecc_sign_hash(digest, digestSz, sig, sigSz, ssh->rng,
-                &sigKey->sk.ecc.key);
+        ret = wc_ecc_sign_hash(digest, digestSz, sig, sigSz, sigKey->rng,
+                (sigKey->hostKey != NULL) ?
+                    &sigKey->hostKey->sk.ecc : &sigKey->sk.ecc.key);
         if (ret != MP_OKAY) {
             WLOG(WS_LOG_DEBUG, "SignHEcdsa: Bad ECDSA Sign");
             ret = WS_ECC_E;
@@ -11922,7 +14387,9 @@ static int SignHEd25519(WOLFSSH* ssh, byte* sig, word32* sigSz,
 
     WLOG(WS_LOG_DEBUG, "Entering SignHEd25519()");
 
-    ret = wc_ed25519_sign_msg(ssh->h, ssh->hSz, sig, sigSz, &sigKey->sk.ed.key);
+    ret = wc_ed25519_sign_msg(ssh->h, ssh->hSz, sig, sigSz,
+            (sigKey->hostKey != NULL) ?
+                &sigKey->hostKey->sk.ed : &sigKey->sk.ed.key);
     if (ret != 0) {
         WLOG(WS_LOG_DEBUG,
                 "SignHEd5519: Bad ED25519 Sign (error: %d)", ret);
@@ -11974,6 +14441,175 @@ static int SignH(WOLFSSH* ssh, byte* sig, word32* sigSz,
 }
 
 
+enum KexSignStates {
+    KEX_SIGN_NONE,
+    KEX_SIGN_PENDING,
+    KEX_SIGN_DONE
+};
+
+/* While the signature is offloaded, the worker owns sig, sigSz, signRet
+ * and rng, and the session's thread only reads signState, under signLock.
+ * Setting signState to done under the lock publishes the worker's writes
+ * to the session's thread. */
+struct WOLFSSH_KEX_REPLY {
+    struct wolfSSH_sigKeyBlockFull sigKeyBlock;
+    byte f[KEX_F_SIZE];
+    byte sig[KEX_SIG_SIZE];
+    word32 fSz;
+    word32 sigSz;
+    word32 keyIdx;
+    int signRet;
+    WC_RNG rng;
+#ifndef SINGLE_THREADED
+    wolfSSL_Mutex signLock;
+#endif
+    byte fPad;
+    byte msgId;
+    byte hashId;
+    byte useEccMlKem;
+    byte rngInit;
+    byte signState;
+};
+
+
+static byte KexReplyGetState(WOLFSSH_KEX_REPLY* reply)
+{
+    byte state;
+
+#ifndef SINGLE_THREADED
+    if (wc_LockMutex(&reply->signLock) != 0)
+        return KEX_SIGN_PENDING;
+#endif
+    state = reply->signState;
+#ifndef SINGLE_THREADED
+    wc_UnLockMutex(&reply->signLock);
+#endif
+
+    return state;
+}
+
+
+static void KexReplySetState(WOLFSSH_KEX_REPLY* reply, byte state)
+{
+#ifndef SINGLE_THREADED
+    wc_LockMutex(&reply->signLock);
+#endif
+    reply->signState = state;
+#ifndef SINGLE_THREADED
+    wc_UnLockMutex(&reply->signLock);
+#endif
+}
+
+
+static WOLFSSH_KEX_REPLY* KexReplyNew(void* heap)
+{
+    WOLFSSH_KEX_REPLY* reply;
+
+    reply = (WOLFSSH_KEX_REPLY*)WMALLOC(sizeof(WOLFSSH_KEX_REPLY),
+            heap, DYNTYPE_PRIVKEY);
+    if (reply != NULL) {
+        WMEMSET(reply, 0, sizeof(WOLFSSH_KEX_REPLY));
+    #ifndef SINGLE_THREADED
+        if (wc_InitMutex(&reply->signLock) != 0) {
+            WFREE(reply, heap, DYNTYPE_PRIVKEY);
+            reply = NULL;
+        }
+    #endif
+    }
+    WOLFSSH_UNUSED(heap);
+
+    return reply;
+}
+
+
+/* Releases the reply itself. Its signing key is released separately with
+ * SigKeyBlockFree(). */
+static void KexReplyDelete(WOLFSSH_KEX_REPLY* reply, void* heap)
+{
+    WOLFSSH_UNUSED(heap);
+
+    if (reply != NULL) {
+        if (reply->rngInit)
+            wc_FreeRng(&reply->rng);
+    #ifndef SINGLE_THREADED
+        wc_FreeMutex(&reply->signLock);
+    #endif
+        ForceZero(reply, sizeof(WOLFSSH_KEX_REPLY));
+        WFREE(reply, heap, DYNTYPE_PRIVKEY);
+    }
+}
+
+
+static void SigKeyBlockFree(struct wolfSSH_sigKeyBlockFull* sigKeyBlock)
+{
+    /* A key taken from the CTX goes back for the next handshake. */
+    if (sigKeyBlock->hostKey != NULL) {
+        HostKeyPut(sigKeyBlock->hostKey);
+        sigKeyBlock->hostKey = NULL;
+        return;
+    }
+
+    if (sigKeyBlock->pubKeyFmtId == ID_SSH_RSA) {
+#ifndef WOLFSSH_NO_RSA
+        wc_FreeRsaKey(&sigKeyBlock->sk.rsa.key);
+#endif
+    }
+    else if (sigKeyBlock->pubKeyFmtId == ID_ECDSA_SHA2_NISTP256
+            || sigKeyBlock->pubKeyFmtId == ID_ECDSA_SHA2_NISTP384
+            || sigKeyBlock->pubKeyFmtId == ID_ECDSA_SHA2_NISTP521) {
+#ifndef WOLFSSH_NO_ECDSA
+        wc_ecc_free(&sigKeyBlock->sk.ecc.key);
+#endif
+    }
+    else if (sigKeyBlock->pubKeyId == ID_ED25519) {
+#if !defined(WOLFSSH_NO_ED25519)
+        wc_ed25519_free(&sigKeyBlock->sk.ed.key);
+#endif
+    }
+}
+
+
+/* Releases a reply abandoned while its signature was offloaded, for
+ * example when the session is freed after the worker finished. */
+void KexReplyFree(WOLFSSH_KEX_REPLY* reply, void* heap)
+{
+    if (reply != NULL) {
+        SigKeyBlockFree(&reply->sigKeyBlock);
+        KexReplyDelete(reply, heap);
+    }
+}
+
+
+/* Signs H for the reply SendKexDhReply() left pending. Called from the
+ * application's worker thread through wolfSSH_SignOffload(). */
+int KexReplySign(WOLFSSH* ssh)
+{
+    WOLFSSH_KEX_REPLY* reply = NULL;
+    int ret = WS_SUCCESS;
+
+    WLOG(WS_LOG_DEBUG, "Entering KexReplySign()");
+
+    if (ssh == NULL || ssh->handshake == NULL)
+        ret = WS_BAD_ARGUMENT;
+
+    if (ret == WS_SUCCESS) {
+        reply = ssh->handshake->kexReply;
+        if (reply == NULL || KexReplyGetState(reply) != KEX_SIGN_PENDING)
+            ret = WS_INVALID_STATE_E;
+    }
+
+    if (ret == WS_SUCCESS) {
+        reply->sigSz = KEX_SIG_SIZE;
+        ret = SignH(ssh, reply->sig, &reply->sigSz, &reply->sigKeyBlock);
+        reply->signRet = ret;
+        KexReplySetState(reply, KEX_SIGN_DONE);
+    }
+
+    WLOG(WS_LOG_DEBUG, "Leaving KexReplySign(), ret = %d", ret);
+    return ret;
+}
+
+
 /* SendKexDhReply()
  * It is also the funciton used for MSGID_KEXECDH_REPLY. The parameters
  * are analogous between the two messages. Where MSGID_KEXDH_REPLY has
@@ -11981,7 +14617,12 @@ static int SignH(WOLFSSH* ssh, byte* sig, word32* sigSz,
  * MSGID_KEXECDH_REPLY has K_S, the server'e ephemeral public key (Q_S),
  * and the signature of H. This also applies to the GEX version of this.
  * H is calculated the same for KEXDH and KEXECDH, and has some exceptions
- * for GEXDH. */
+ * for GEXDH.
+ *
+ * When the CTX has a signature offload callback, the key exchange hands
+ * the signing of H to the application's worker and returns WS_WANT_CRYPTO.
+ * The reply's state is kept in the handshake, and the call made after the
+ * worker is done picks up from the signature. */
 int SendKexDhReply(WOLFSSH* ssh)
 {
     int ret = WS_SUCCESS;
@@ -12000,15 +14641,13 @@ int SendKexDhReply(WOLFSSH* ssh)
     enum wc_HashType hashId = WC_HASH_TYPE_NONE;
     wc_HashAlg* hash = NULL;
     struct wolfSSH_sigKeyBlockFull *sigKeyBlock_ptr = NULL;
-#ifndef WOLFSSH_SMALL_STACK
-    byte f_s[KEX_F_SIZE];
-    byte sig_s[KEX_SIG_SIZE];
-#endif
+    WOLFSSH_KEX_REPLY* reply = NULL;
     byte msgId = 0;
     byte useDh = 0;
     byte useEcc = 0;
     byte useCurve25519 = 0;
     byte useEccMlKem = 0;
+    byte resumed = 0;
 
     WLOG(WS_LOG_DEBUG, "Entering SendKexDhReply()");
 
@@ -12022,27 +14661,38 @@ int SendKexDhReply(WOLFSSH* ssh)
         heap = ssh->ctx->heap;
     }
 
-#ifdef WOLFSSH_SMALL_STACK
-    f_ptr = (byte*)WMALLOC(KEX_F_SIZE, heap, DYNTYPE_BUFFER);
-    sig_ptr = (byte*)WMALLOC(KEX_SIG_SIZE, heap, DYNTYPE_BUFFER);
-    if (f_ptr == NULL || sig_ptr == NULL)
-        ret = WS_MEMORY_E;
-#else
-    f_ptr = f_s;
-    sig_ptr = sig_s;
-#endif
+    if (ret == WS_SUCCESS && ssh->handshake->kexReply != NULL) {
+        reply = ssh->handshake->kexReply;
+        if (KexReplyGetState(reply) == KEX_SIGN_PENDING) {
+            WLOG(WS_LOG_DEBUG, "Signature of H is still pending");
+            return WS_WANT_CRYPTO;
+        }
 
-    sigKeyBlock_ptr = (struct wolfSSH_sigKeyBlockFull*)WMALLOC(
-            sizeof(struct wolfSSH_sigKeyBlockFull), heap, DYNTYPE_PRIVKEY);
-    if (sigKeyBlock_ptr == NULL)
-        ret = WS_MEMORY_E;
+        /* The worker is done, restore the reply and finish it. */
+        ssh->handshake->kexReply = NULL;
+        fSz = reply->fSz;
+        sigSz = reply->sigSz;
+        keyIdx = reply->keyIdx;
+        fPad = reply->fPad;
+        msgId = reply->msgId;
+        hashId = (enum wc_HashType)reply->hashId;
+        useEccMlKem = reply->useEccMlKem;
+        ret = reply->signRet;
+        resumed = 1;
+    }
+    else if (ret == WS_SUCCESS) {
+        reply = KexReplyNew(heap);
+        if (reply == NULL)
+            ret = WS_MEMORY_E;
+    }
 
-    if (ret == WS_SUCCESS) {
-        WMEMSET(sigKeyBlock_ptr, 0, sizeof(struct wolfSSH_sigKeyBlockFull));
-        sigKeyBlock_ptr->pubKeyId = ID_NONE;
+    if (reply != NULL) {
+        f_ptr = reply->f;
+        sig_ptr = reply->sig;
+        sigKeyBlock_ptr = &reply->sigKeyBlock;
     }
 
-    if (ret == WS_SUCCESS) {
+    if (ret == WS_SUCCESS && !resumed) {
         sigKeyBlock_ptr->pubKeyId = ssh->handshake->pubKeyId;
         sigKeyBlock_ptr->pubKeyName =
             IdToName(SigTypeForId(sigKeyBlock_ptr->pubKeyId));
@@ -12125,7 +14775,7 @@ int SendKexDhReply(WOLFSSH* ssh)
         }
     }
 
-    if (ret == WS_SUCCESS) {
+    if (ret == WS_SUCCESS && !resumed) {
         hash = &ssh->handshake->kexHash;
         hashId = (enum wc_HashType)ssh->handshake->kexHashId;
 
@@ -12143,11 +14793,12 @@ int SendKexDhReply(WOLFSSH* ssh)
     /* At this point, the exchange hash, H, includes items V_C, V_S, I_C,
      * and I_S. Next add K_S, the server's public host key. K_S will
      * either be RSA or ECDSA public key blob. */
-    if (ret == WS_SUCCESS) {
+    if (ret == WS_SUCCESS && !resumed) {
+        sigKeyBlock_ptr->rng = ssh->rng;
         ret = SendKexGetSigningKey(ssh, sigKeyBlock_ptr, hashId, hash, keyIdx);
     }
 
-    if (ret == WS_SUCCESS) {
+    if (ret == WS_SUCCESS && !resumed) {
         /* reset size here because a previous shared secret could potentially be
          * smaller by a byte than usual and cause buffer issues with re-key */
         ssh->kSz = MAX_KEX_KEY_SZ;
@@ -12225,31 +14876,43 @@ int SendKexDhReply(WOLFSSH* ssh)
         }
     }
 
-    /* Sign h with the server's private key. */
-    if (ret == WS_SUCCESS) {
-        ret = SignH(ssh, sig_ptr, &sigSz, sigKeyBlock_ptr);
-    }
-
-    if (sigKeyBlock_ptr != NULL) {
-        if (sigKeyBlock_ptr->pubKeyFmtId == ID_SSH_RSA) {
-#ifndef WOLFSSH_NO_RSA
-            wc_FreeRsaKey(&sigKeyBlock_ptr->sk.rsa.key);
-#endif
-        }
-        else if (sigKeyBlock_ptr->pubKeyFmtId == ID_ECDSA_SHA2_NISTP256
-                || sigKeyBlock_ptr->pubKeyFmtId == ID_ECDSA_SHA2_NISTP384
-                || sigKeyBlock_ptr->pubKeyFmtId == ID_ECDSA_SHA2_NISTP521) {
-#ifndef WOLFSSH_NO_ECDSA
-            wc_ecc_free(&sigKeyBlock_ptr->sk.ecc.key);
-#endif
-        }
-        else if (sigKeyBlock_ptr->pubKeyId == ID_ED25519) {
-#if !defined(WOLFSSH_NO_ED25519)
-            wc_ed25519_free(&sigKeyBlock_ptr->sk.ed.key);
-#endif
+    /* Sign h with the server's private key. The worker gets an RNG of its
+     * own, the session's keeps being used by this thread. */
+    if (ret == WS_SUCCESS && !resumed) {
+        if (ssh->ctx->signOffloadCb != NULL && !reply->rngInit
+                && wc_InitRng_ex(&reply->rng, heap, ssh->devId) == 0) {
+            reply->rngInit = 1;
+        }
+        if (reply->rngInit) {
+            reply->fSz = fSz;
+            reply->keyIdx = keyIdx;
+            reply->fPad = fPad;
+            reply->msgId = msgId;
+            reply->hashId = (byte)hashId;
+            reply->useEccMlKem = useEccMlKem;
+            sigKeyBlock_ptr->rng = &reply->rng;
+            KexReplySetState(reply, KEX_SIGN_PENDING);
+            ssh->handshake->kexReply = reply;
+
+            if (ssh->ctx->signOffloadCb(ssh, ssh->signOffloadCtx)
+                    == WS_SUCCESS) {
+                WLOG(WS_LOG_DEBUG, "Offloaded the signature of H");
+                ret = WS_WANT_CRYPTO;
+            }
+            else {
+                WLOG(WS_LOG_DEBUG, "Offload declined, signing H in line");
+                ssh->handshake->kexReply = NULL;
+                sigKeyBlock_ptr->rng = ssh->rng;
+                KexReplySetState(reply, KEX_SIGN_NONE);
+            }
         }
+        if (ret == WS_SUCCESS)
+            ret = SignH(ssh, sig_ptr, &sigSz, sigKeyBlock_ptr);
     }
 
+    if (sigKeyBlock_ptr != NULL && ret != WS_WANT_CRYPTO)
+        SigKeyBlockFree(sigKeyBlock_ptr);
+
     if (ret == WS_SUCCESS) {
         /* If we aren't using ECC with ML-KEM, use padding. */
         ret = GenerateKeys(ssh, hashId, !useEccMlKem);
@@ -12386,18 +15049,13 @@ int SendKexDhReply(WOLFSSH* ssh)
         ret = SendExtInfo(ssh);
     }
 
-    if (ret != WS_WANT_WRITE && ret != WS_SUCCESS)
+    if (ret != WS_WANT_WRITE && ret != WS_SUCCESS && ret != WS_WANT_CRYPTO)
         PurgePacket(ssh);
 
     WLOG(WS_LOG_DEBUG, "Leaving SendKexDhReply(), ret = %d", ret);
-    if (sigKeyBlock_ptr)
-        WFREE(sigKeyBlock_ptr, heap, DYNTYPE_PRIVKEY);
-#ifdef WOLFSSH_SMALL_STACK
-    if (f_ptr)
-        WFREE(f_ptr, heap, DYNTYPE_BUFFER);
-    if (sig_ptr)
-        WFREE(sig_ptr, heap, DYNTYPE_BUFFER);
-#endif
+    /* A pending reply belongs to the handshake until the worker is done. */
+    if (reply != NULL && ret != WS_WANT_CRYPTO)
+        KexReplyDelete(reply, heap);
     WOLFSSH_UNUSED(heap);
     return ret;
 }
@@ -12433,6 +15091,7 @@ int SendNewKeys(WOLFSSH* ssh)
         ssh->macSz = ssh->handshake->macSz;
         ssh->macId = ssh->handshake->macId;
         ssh->aeadMode = ssh->handshake->aeadMode;
+        ssh->etmMode = ssh->handshake->etmMode;
         WMEMCPY(&ssh->keys, &ssh->handshake->keys, sizeof(Keys));
 
         switch (ssh->encryptId) {
@@ -12445,9 +15104,12 @@ int SendNewKeys(WOLFSSH* ssh)
             case ID_AES192_CBC:
             case ID_AES256_CBC:
                 WLOG(WS_LOG_DEBUG, "SNK: using cipher aes-cbc");
-                ret = wc_AesSetKey(&ssh->encryptCipher.aes,
-                                  ssh->keys.encKey, ssh->keys.encKeySz,
-                                  ssh->keys.iv, AES_ENCRYPTION);
+                ret = InitCipherAes(&ssh->encryptCipher.aes, ssh->ctx->heap,
+                        ssh->devId);
+                if (ret == 0)
+                    ret = wc_AesSetKey(&ssh->encryptCipher.aes,
+                            ssh->keys.encKey, ssh->keys.encKeySz,
+                            ssh->keys.iv, AES_ENCRYPTION);
                 break;
 #endif
 
@@ -12456,9 +15118,12 @@ int SendNewKeys(WOLFSSH* ssh)
             case ID_AES192_CTR:
             case ID_AES256_CTR:
                 WLOG(WS_LOG_DEBUG, "SNK: using cipher aes-ctr");
-                ret = wc_AesSetKey(&ssh->encryptCipher.aes,
-                                  ssh->keys.encKey, ssh->keys.encKeySz,
-                                  ssh->keys.iv, AES_ENCRYPTION);
+                ret = InitCipherAes(&ssh->encryptCipher.aes, ssh->ctx->heap,
+                        ssh->devId);
+                if (ret == 0)
+                    ret = wc_AesSetKey(&ssh->encryptCipher.aes,
+                            ssh->keys.encKey, ssh->keys.encKeySz,
+                            ssh->keys.iv, AES_ENCRYPTION);
                 break;
 #endif
 
@@ -12467,8 +15132,24 @@ int SendNewKeys(WOLFSSH* ssh)
             case ID_AES192_GCM:
             case ID_AES256_GCM:
                 WLOG(WS_LOG_DEBUG, "SNK: using cipher aes-gcm");
-                ret = wc_AesGcmSetKey(&ssh->encryptCipher.aes,
-                                     ssh->keys.encKey, ssh->keys.encKeySz);
+                ret = InitCipherAes(&ssh->encryptCipher.aes, ssh->ctx->heap,
+                        ssh->devId);
+                if (ret == 0)
+                    ret = wc_AesGcmSetKey(&ssh->encryptCipher.aes,
+                            ssh->keys.encKey, ssh->keys.encKeySz);
+                break;
+#endif
+
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+            case ID_CHACHA20_POLY1305:
+                WLOG(WS_LOG_DEBUG, "SNK: using cipher chacha20-poly1305");
+                ret = wc_Chacha_SetKey(&ssh->encryptCipher.chacha,
+                                       ssh->keys.encKey, CHACHA_MAX_KEY_SZ);
+                if (ret == 0)
+                    ret = wc_Chacha_SetKey(&ssh->encryptCipher.chachaHeader,
+                                           ssh->keys.encKey
+                                               + CHACHA_MAX_KEY_SZ,
+                                           CHACHA_MAX_KEY_SZ);
                 break;
 #endif
 
@@ -12478,8 +15159,17 @@ int SendNewKeys(WOLFSSH* ssh)
         }
     }
 
+    if (ret == WS_SUCCESS) {
+        ret = SetMacKey(&ssh->encryptCipher.hmac, ssh->macId,
+                ssh->keys.macKey, ssh->keys.macKeySz, ssh->ctx->heap,
+                ssh->devId);
+        if (ret != 0)
+            ret = WS_CRYPTO_FAILED;
+    }
+
     if (ret == WS_SUCCESS) {
         ssh->txCount = 0;
+        ssh->txPacketCount = 0;
     }
 
     if (ret == WS_SUCCESS)
@@ -12723,7 +15413,7 @@ int SendKexDhInit(WOLFSSH* ssh)
 #ifndef WOLFSSH_NO_DH
             DhKey* privKey = &ssh->handshake->privKey.dh;
 
-            ret = wc_InitDhKey(privKey);
+            ret = wc_InitDhKey_ex(privKey, ssh->ctx->heap, ssh->devId);
             if (ret == 0)
                 ret = wc_DhSetKey(privKey, primeGroup, primeGroupSz,
                                   generator, generatorSz);
@@ -12739,7 +15429,7 @@ int SendKexDhInit(WOLFSSH* ssh)
             curve25519_key* privKey = &ssh->handshake->privKey.curve25519;
             if (ret == 0)
                 ret = wc_curve25519_init_ex(privKey, ssh->ctx->heap,
-                                            INVALID_DEVID);
+                                            ssh->devId);
             if (ret == 0)
                 ret = wc_curve25519_make_key(ssh->rng, CURVE25519_KEYSIZE,
                                              privKey);
@@ -12765,7 +15455,7 @@ int SendKexDhInit(WOLFSSH* ssh)
 
             if (ret == 0)
                 ret = wc_ecc_init_ex(privKey, ssh->ctx->heap,
-                                     INVALID_DEVID);
+                                     ssh->devId);
 #ifdef HAVE_WC_ECC_SET_RNG
             if (ret == 0)
                 ret = wc_ecc_set_rng(privKey, ssh->rng);
@@ -12796,7 +15486,7 @@ int SendKexDhInit(WOLFSSH* ssh)
 
             if (ret == 0) {
                 ret = wc_MlKemKey_Init(&kem, WC_ML_KEM_768, ssh->ctx->heap,
-                                       INVALID_DEVID);
+                                       ssh->devId);
             }
 
             if (ret == 0) {
@@ -12956,8 +15646,11 @@ int SendDisconnect(WOLFSSH* ssh, word32 reason)
         ret = BundlePacket(ssh);
     }
 
-    if (ret == WS_SUCCESS)
+    if (ret == WS_SUCCESS) {
+        /* Nothing may follow a disconnect, write out anything held. */
+        ssh->isCorked = 0;
         ret = wolfSSH_SendPacket(ssh);
+    }
 
     return ret;
 }
@@ -13094,6 +15787,24 @@ int SendDebug(WOLFSSH* ssh, byte alwaysDisplay, const char* msg)
 }
 
 
+#ifdef WOLFSSH_AGENT
+/* Creates the client's agent context before its first userauth request. */
+void ClientAgentNew(WOLFSSH* ssh)
+{
+    if (ssh->agentEnabled && ssh->agent == NULL) {
+        ssh->agent = wolfSSH_AGENT_new(ssh->ctx->heap);
+        if (ssh->agent == NULL) {
+            ssh->agentEnabled = 0;
+            WLOG(WS_LOG_INFO, "Unable to create agent. Disabling.");
+        }
+        else {
+            ssh->agent->devId = ssh->devId;
+        }
+    }
+}
+#endif /* WOLFSSH_AGENT */
+
+
 int SendServiceRequest(WOLFSSH* ssh, byte serviceId)
 {
     const char* serviceName;
@@ -13522,7 +16233,7 @@ static int PrepareUserAuthRequestRsa(WOLFSSH* ssh, word32* payloadSz,
         ret = WS_BAD_ARGUMENT;
 
     if (ret == WS_SUCCESS)
-        ret = wc_InitRsaKey(&keySig->ks.rsa.key, NULL);
+        ret = wc_InitRsaKey_ex(&keySig->ks.rsa.key, NULL, ssh->devId);
 
     if (ret == WS_SUCCESS) {
         word32 idx = 0;
@@ -13643,7 +16354,8 @@ static int BuildUserAuthRequestRsa(WOLFSSH* ssh,
     {
         if (ret == WS_SUCCESS) {
             WMEMSET(digest, 0, sizeof(digest));
-            ret = wc_HashInit(&hash, hashId);
+            ret = wc_HashInit_ex(&hash, hashId, ssh->ctx->heap,
+                    ssh->devId);
             if (ret == WS_SUCCESS)
                 ret = HashUpdate(&hash, hashId, checkData, checkDataSz);
             if (ret == WS_SUCCESS)
@@ -13765,7 +16477,7 @@ static int PrepareUserAuthRequestRsaCert(WOLFSSH* ssh, word32* payloadSz,
         ret = WS_BAD_ARGUMENT;
 
     if (ret == WS_SUCCESS)
-        ret = wc_InitRsaKey(&keySig->ks.rsa.key, NULL);
+        ret = wc_InitRsaKey_ex(&keySig->ks.rsa.key, NULL, ssh->devId);
 
     if (ret == WS_SUCCESS) {
         word32 idx = 0;
@@ -13877,7 +16589,8 @@ static int BuildUserAuthRequestRsaCert(WOLFSSH* ssh,
             int encDigestSz;
 
             WMEMSET(digest, 0, sizeof(digest));
-            ret = wc_HashInit(&hash, hashId);
+            ret = wc_HashInit_ex(&hash, hashId, ssh->ctx->heap,
+                    ssh->devId);
             if (ret == WS_SUCCESS)
                 ret = HashUpdate(&hash, hashId, checkData, checkDataSz);
             if (ret == WS_SUCCESS)
@@ -13948,7 +16661,8 @@ static int PrepareUserAuthRequestEcc(WOLFSSH* ssh, word32* payloadSz,
         ret = WS_BAD_ARGUMENT;
 
     if (ret == WS_SUCCESS)
-        ret = wc_ecc_init(&keySig->ks.ecc.key);
+        ret = wc_ecc_init_ex(&keySig->ks.ecc.key, ssh->ctx->heap,
+                ssh->devId);
 
     if (ret == 0) {
         word32 idx = 0;
@@ -14087,7 +16801,8 @@ static int BuildUserAuthRequestEcc(WOLFSSH* ssh,
     {
         if (ret == WS_SUCCESS) {
             WLOG(WS_LOG_INFO, "Signing hash with ECDSA.");
-            ret = wc_HashInit(&hash, hashId);
+            ret = wc_HashInit_ex(&hash, hashId, ssh->ctx->heap,
+                    ssh->devId);
             if (ret == WS_SUCCESS)
                 ret = HashUpdate(&hash, hashId, checkData, checkDataSz);
             if (ret == WS_SUCCESS)
@@ -14205,7 +16920,8 @@ static int PrepareUserAuthRequestEccCert(WOLFSSH* ssh, word32* payloadSz,
         ret = WS_BAD_ARGUMENT;
 
     if (ret == WS_SUCCESS)
-        ret = wc_ecc_init(&keySig->ks.ecc.key);
+        ret = wc_ecc_init_ex(&keySig->ks.ecc.key, ssh->ctx->heap,
+                ssh->devId);
 
     if (ret == WS_SUCCESS) {
         word32 idx = 0;
@@ -14327,7 +17043,8 @@ static int BuildUserAuthRequestEccCert(WOLFSSH* ssh,
     {
         if (ret == WS_SUCCESS) {
             WLOG(WS_LOG_INFO, "Signing hash with ECDSA cert.");
-            ret = wc_HashInit(&hash, hashId);
+            ret = wc_HashInit_ex(&hash, hashId, ssh->ctx->heap,
+                    ssh->devId);
             if (ret == WS_SUCCESS)
                 ret = HashUpdate(&hash, hashId, checkData, checkDataSz);
             if (ret == WS_SUCCESS)
@@ -14460,7 +17177,7 @@ static int PrepareUserAuthRequestEd25519(WOLFSSH* ssh, word32* payloadSz,
 
     if (ret == WS_SUCCESS)
         ret = wc_ed25519_init_ex(&keySig->ks.ed25519.key,
-                keySig->heap, INVALID_DEVID);
+                keySig->heap, ssh->devId);
 
     if (ret == 0) {
         word32 idx = 0;
@@ -14643,9 +17360,21 @@ static int PrepareUserAuthRequestPublicKey(WOLFSSH* ssh, word32* payloadSz,
             algoId[algoIdSz++] = keyId;
         }
 
-        /* Is that in the peerSigId list? */
-        matchId = MatchIdLists(WOLFSSH_ENDPOINT_CLIENT, algoId, algoIdSz,
-                ssh->peerSigId, ssh->peerSigIdSz);
+        /* Is that in the peerSigId list? Without the server's EXT_INFO,
+         * as when the request is pipelined behind NEWKEYS, there is no
+         * list yet, so go with the key type's default: rsa-sha2-256 for
+         * RSA keys (RFC 8332), else the key's own algorithm. */
+        if (ssh->peerSigId == NULL) {
+            matchId = (algoIdSz > 0) ? algoId[0] : ID_UNKNOWN;
+        #ifndef WOLFSSH_NO_RSA_SHA2_256
+            if (keyId == ID_SSH_RSA)
+                matchId = ID_RSA_SHA2_256;
+        #endif
+        }
+        else {
+            matchId = MatchIdLists(WOLFSSH_ENDPOINT_CLIENT, algoId, algoIdSz,
+                    ssh->peerSigId, ssh->peerSigIdSz);
+        }
         if (matchId == ID_UNKNOWN) {
             ret = WS_MATCH_KEY_ALGO_E;
         }
@@ -15562,83 +18291,246 @@ int SendChannelOpenConf(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel)
         output[idx++] = MSGID_CHANNEL_OPEN_CONF;
         c32toa(channel->peerChannel, output + idx);
         idx += UINT32_SZ;
-        c32toa(channel->channel, output + idx);
-        idx += UINT32_SZ;
-        c32toa(channel->windowSz, output + idx);
-        idx += UINT32_SZ;
-        c32toa(channel->maxPacketSz, output + idx);
-        idx += UINT32_SZ;
+        c32toa(channel->channel, output + idx);
+        idx += UINT32_SZ;
+        c32toa(channel->windowSz, output + idx);
+        idx += UINT32_SZ;
+        c32toa(channel->maxPacketSz, output + idx);
+        idx += UINT32_SZ;
+
+        ssh->outputBuffer.length = idx;
+
+        ret = BundlePacket(ssh);
+    }
+
+    if (ret == WS_SUCCESS)
+        ret = wolfSSH_SendPacket(ssh);
+
+    WLOG(WS_LOG_DEBUG, "Leaving SendChannelOpenConf(), ret = %d", ret);
+    return ret;
+}
+
+int SendChannelOpenFail(WOLFSSH* ssh, word32 channel, word32 reason,
+        const char* description, const char* language)
+{
+    byte* output;
+    word32 idx;
+    word32 descriptionSz = (word32)WSTRLEN(description);
+    word32 languageSz = (word32)WSTRLEN(language);
+    int ret = WS_SUCCESS;
+
+    WLOG(WS_LOG_DEBUG, "Entering SendChannelOpenFail()");
+
+    if (ssh == NULL)
+        ret = WS_BAD_ARGUMENT;
+
+    if (ret == WS_SUCCESS) {
+        WLOG(WS_LOG_INFO, "  channelId = %u", channel);
+        WLOG(WS_LOG_INFO, "  reason = %u", reason);
+        WLOG(WS_LOG_INFO, "  description = %s", description);
+        WLOG(WS_LOG_INFO, "  language = %s", language);
+    }
+
+    if (ret == WS_SUCCESS) {
+        ret = PreparePacket(ssh, MSG_ID_SZ + UINT32_SZ + UINT32_SZ
+                + LENGTH_SZ + descriptionSz + LENGTH_SZ + languageSz);
+    }
+
+    if (ret == WS_SUCCESS) {
+        output = ssh->outputBuffer.buffer;
+        idx = ssh->outputBuffer.length;
+
+        output[idx++] = MSGID_CHANNEL_OPEN_FAIL;
+        c32toa(channel, output + idx);
+        idx += UINT32_SZ;
+        c32toa(reason, output + idx);
+        idx += UINT32_SZ;
+        c32toa(descriptionSz, output + idx);
+        idx += LENGTH_SZ;
+        WMEMCPY(output + idx, description, descriptionSz);
+        idx += descriptionSz;
+        c32toa(languageSz, output + idx);
+        idx += LENGTH_SZ;
+        WMEMCPY(output + idx, language, languageSz);
+        idx += languageSz;
+
+        ssh->outputBuffer.length = idx;
+
+        ret = BundlePacket(ssh);
+    }
+
+    if (ret == WS_SUCCESS)
+        ret = wolfSSH_SendPacket(ssh);
+
+    WLOG(WS_LOG_DEBUG, "Leaving SendChannelOpenFail(), ret = %d", ret);
+    return ret;
+}
+
+
+/* Seals dataSz bytes from the front of the channel's txQueue into a
+ * CHANNEL_DATA packet. */
+static int ChannelTxPacket(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel,
+        word32 dataSz)
+{
+    WOLFSSH_BUFFER* queue = &channel->txQueue;
+    byte* output;
+    word32 idx;
+    int ret;
+
+    ret = PreparePacket(ssh, MSG_ID_SZ + UINT32_SZ + LENGTH_SZ + dataSz);
+
+    if (ret == WS_SUCCESS) {
+        output = ssh->outputBuffer.buffer;
+        idx = ssh->outputBuffer.length;
+
+        output[idx++] = MSGID_CHANNEL_DATA;
+        c32toa(channel->peerChannel, output + idx);
+        idx += UINT32_SZ;
+        c32toa(dataSz, output + idx);
+        idx += LENGTH_SZ;
+        WMEMCPY(output + idx, queue->buffer + queue->idx, dataSz);
+        idx += dataSz;
 
         ssh->outputBuffer.length = idx;
 
         ret = BundlePacket(ssh);
     }
 
-    if (ret == WS_SUCCESS)
-        ret = wolfSSH_SendPacket(ssh);
+    if (ret == WS_SUCCESS) {
+        queue->idx += dataSz;
+        ssh->schedQueuedSz -= dataSz;
+        if (queue->idx == queue->length)
+            ShrinkBuffer(queue, 1);
+    }
 
-    WLOG(WS_LOG_DEBUG, "Leaving SendChannelOpenConf(), ret = %d", ret);
     return ret;
 }
 
-int SendChannelOpenFail(WOLFSSH* ssh, word32 channel, word32 reason,
-        const char* description, const char* language)
+
+/* Adds a message carrying dataSz bytes of channel data for the peer to the
+ * rekey queue. Each entry is the length of the message payload followed by
+ * the payload, so it can be sealed later with the new keys. */
+static int RekeyQueueAdd(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel,
+        byte msgId, const byte* data, word32 dataSz)
 {
-    byte* output;
+    WOLFSSH_BUFFER* queue = &ssh->rekeyQueue;
+    word32 headerSz = MSG_ID_SZ + UINT32_SZ + LENGTH_SZ;
     word32 idx;
-    word32 descriptionSz = (word32)WSTRLEN(description);
-    word32 languageSz = (word32)WSTRLEN(language);
+    int ret;
+
+    if (msgId == MSGID_CHANNEL_EXTENDED_DATA)
+        headerSz += UINT32_SZ;
+
+    ret = GrowBuffer(queue, LENGTH_SZ + headerSz + dataSz);
+    if (ret != WS_SUCCESS)
+        return ret;
+
+    idx = queue->length;
+    c32toa(headerSz + dataSz, queue->buffer + idx);
+    idx += LENGTH_SZ;
+    queue->buffer[idx++] = msgId;
+    c32toa(channel->peerChannel, queue->buffer + idx);
+    idx += UINT32_SZ;
+    if (msgId == MSGID_CHANNEL_EXTENDED_DATA) {
+        c32toa(CHANNEL_EXTENDED_DATA_STDERR, queue->buffer + idx);
+        idx += UINT32_SZ;
+    }
+    c32toa(dataSz, queue->buffer + idx);
+    idx += LENGTH_SZ;
+    WMEMCPY(queue->buffer + idx, data, dataSz);
+    idx += dataSz;
+    queue->length = idx;
+
+    return WS_SUCCESS;
+}
+
+
+/* Seals all the data the channel has waiting for the scheduler, for the
+ * messages that have to follow it, like EOF and CLOSE. While keying that
+ * data can't be sealed, so it moves to the rekey queue, where those
+ * messages queue behind it. Either way the channel's data then has one
+ * queue, in order. */
+static int ChannelTxFlush(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel)
+{
+    WOLFSSH_BUFFER* queue = &channel->txQueue;
+    word32 dataSz;
     int ret = WS_SUCCESS;
 
-    WLOG(WS_LOG_DEBUG, "Entering SendChannelOpenFail()");
+    if (!channel->schedLinked)
+        return WS_SUCCESS;
 
-    if (ssh == NULL)
-        ret = WS_BAD_ARGUMENT;
+    while (ret == WS_SUCCESS && queue->idx < queue->length) {
+        dataSz = min(queue->length - queue->idx, channel->peerMaxPacketSz);
+        if (!ssh->isKeying) {
+            ret = ChannelTxPacket(ssh, channel, dataSz);
+            continue;
+        }
 
-    if (ret == WS_SUCCESS) {
-        WLOG(WS_LOG_INFO, "  channelId = %u", channel);
-        WLOG(WS_LOG_INFO, "  reason = %u", reason);
-        WLOG(WS_LOG_INFO, "  description = %s", description);
-        WLOG(WS_LOG_INFO, "  language = %s", language);
+        ret = RekeyQueueAdd(ssh, channel, MSGID_CHANNEL_DATA,
+                queue->buffer + queue->idx, dataSz);
+        if (ret == WS_SUCCESS) {
+            WLOG(WS_LOG_DEBUG, "Channel data is waiting for the new keys");
+            queue->idx += dataSz;
+            ssh->schedQueuedSz -= dataSz;
+        }
     }
 
     if (ret == WS_SUCCESS) {
-        ret = PreparePacket(ssh, MSG_ID_SZ + UINT32_SZ + UINT32_SZ
-                + LENGTH_SZ + descriptionSz + LENGTH_SZ + languageSz);
+        ShrinkBuffer(queue, 1);
+        ChannelSchedUnlink(ssh, channel);
+    }
+
+    return ret;
+}
+
+
+/* Starts a channel message. While keying, it goes in the rekey queue
+ * behind the channel data held there, so the peer gets them in order once
+ * the new keys are in use. Otherwise it goes in the output buffer like any
+ * packet. The payload is written at the end of *buf. */
+static int ChannelMsgPrepare(WOLFSSH* ssh, word32 payloadSz,
+        WOLFSSH_BUFFER** buf)
+{
+    int ret;
+
+    if (!ssh->isKeying) {
+        *buf = &ssh->outputBuffer;
+        return PreparePacket(ssh, payloadSz);
     }
 
+    *buf = &ssh->rekeyQueue;
+    ret = GrowBuffer(*buf, LENGTH_SZ + payloadSz);
     if (ret == WS_SUCCESS) {
-        output = ssh->outputBuffer.buffer;
-        idx = ssh->outputBuffer.length;
+        c32toa(payloadSz, (*buf)->buffer + (*buf)->length);
+        (*buf)->length += LENGTH_SZ;
+    }
 
-        output[idx++] = MSGID_CHANNEL_OPEN_FAIL;
-        c32toa(channel, output + idx);
-        idx += UINT32_SZ;
-        c32toa(reason, output + idx);
-        idx += UINT32_SZ;
-        c32toa(descriptionSz, output + idx);
-        idx += LENGTH_SZ;
-        WMEMCPY(output + idx, description, descriptionSz);
-        idx += descriptionSz;
-        c32toa(languageSz, output + idx);
-        idx += LENGTH_SZ;
-        WMEMCPY(output + idx, language, languageSz);
-        idx += languageSz;
+    return ret;
+}
 
-        ssh->outputBuffer.length = idx;
 
-        ret = BundlePacket(ssh);
+/* Sends a channel message started with ChannelMsgPrepare(). A queued one
+ * is sent by SendQueuedChannelData(). */
+static int ChannelMsgSend(WOLFSSH* ssh, WOLFSSH_BUFFER* buf)
+{
+    int ret;
+
+    if (buf == &ssh->rekeyQueue) {
+        WLOG(WS_LOG_DEBUG, "Channel message is waiting for the new keys");
+        return WS_SUCCESS;
     }
 
+    ret = BundlePacket(ssh);
     if (ret == WS_SUCCESS)
         ret = wolfSSH_SendPacket(ssh);
 
-    WLOG(WS_LOG_DEBUG, "Leaving SendChannelOpenFail(), ret = %d", ret);
     return ret;
 }
 
+
 int SendChannelEof(WOLFSSH* ssh, word32 peerChannelId)
 {
+    WOLFSSH_BUFFER* buf = NULL;
     byte* output;
     word32 idx;
     int ret = WS_SUCCESS;
@@ -15664,24 +18556,24 @@ int SendChannelEof(WOLFSSH* ssh, word32 peerChannelId)
     }
 
     if (ret == WS_SUCCESS)
-        ret = PreparePacket(ssh, MSG_ID_SZ + UINT32_SZ);
+        ret = ChannelTxFlush(ssh, channel);
+
+    if (ret == WS_SUCCESS)
+        ret = ChannelMsgPrepare(ssh, MSG_ID_SZ + UINT32_SZ, &buf);
 
     if (ret == WS_SUCCESS) {
-        output = ssh->outputBuffer.buffer;
-        idx = ssh->outputBuffer.length;
+        output = buf->buffer;
+        idx = buf->length;
 
         output[idx++] = MSGID_CHANNEL_EOF;
         c32toa(channel->peerChannel, output + idx);
         idx += UINT32_SZ;
 
-        ssh->outputBuffer.length = idx;
+        buf->length = idx;
 
-        ret = BundlePacket(ssh);
+        ret = ChannelMsgSend(ssh, buf);
     }
 
-    if (ret == WS_SUCCESS)
-        ret = wolfSSH_SendPacket(ssh);
-
     if (ret == WS_SUCCESS)
         channel->eofTxd = 1;
 
@@ -15692,6 +18584,7 @@ int SendChannelEof(WOLFSSH* ssh, word32 peerChannelId)
 
 int SendChannelEow(WOLFSSH* ssh, word32 peerChannelId)
 {
+    WOLFSSH_BUFFER* buf = NULL;
     byte* output;
     const char* str = "eow@openssh.com";
     word32 idx;
@@ -15715,15 +18608,18 @@ int SendChannelEow(WOLFSSH* ssh, word32 peerChannelId)
             ret = WS_INVALID_CHANID;
     }
 
+    if (ret == WS_SUCCESS)
+        ret = ChannelTxFlush(ssh, channel);
+
     if (ret == WS_SUCCESS) {
         strSz = (word32)WSTRLEN(str);
-        ret = PreparePacket(ssh, MSG_ID_SZ + UINT32_SZ + LENGTH_SZ + strSz +
-                            BOOLEAN_SZ);
+        ret = ChannelMsgPrepare(ssh, MSG_ID_SZ + UINT32_SZ + LENGTH_SZ +
+                strSz + BOOLEAN_SZ, &buf);
     }
 
     if (ret == WS_SUCCESS) {
-        output = ssh->outputBuffer.buffer;
-        idx = ssh->outputBuffer.length;
+        output = buf->buffer;
+        idx = buf->length;
 
         output[idx++] = MSGID_CHANNEL_REQUEST;
         c32toa(channel->peerChannel, output + idx);
@@ -15734,14 +18630,11 @@ int SendChannelEow(WOLFSSH* ssh, word32 peerChannelId)
         idx += strSz;
         output[idx++] = 0;
 
-        ssh->outputBuffer.length = idx;
+        buf->length = idx;
 
-        ret = BundlePacket(ssh);
+        ret = ChannelMsgSend(ssh, buf);
     }
 
-    if (ret == WS_SUCCESS)
-        ret = wolfSSH_SendPacket(ssh);
-
     WLOG(WS_LOG_DEBUG, "Leaving SendChannelEow(), ret = %d", ret);
     return ret;
 }
@@ -15749,6 +18642,7 @@ int SendChannelEow(WOLFSSH* ssh, word32 peerChannelId)
 
 int SendChannelExit(WOLFSSH* ssh, word32 peerChannelId, int status)
 {
+    WOLFSSH_BUFFER* buf = NULL;
     byte* output;
     const char* str = "exit-status";
     word32 idx;
@@ -15767,15 +18661,18 @@ int SendChannelExit(WOLFSSH* ssh, word32 peerChannelId, int status)
             ret = WS_INVALID_CHANID;
     }
 
+    if (ret == WS_SUCCESS)
+        ret = ChannelTxFlush(ssh, channel);
+
     if (ret == WS_SUCCESS) {
         strSz = (word32)WSTRLEN(str);
-        ret = PreparePacket(ssh, MSG_ID_SZ + UINT32_SZ + LENGTH_SZ + strSz +
-                            BOOLEAN_SZ + UINT32_SZ);
+        ret = ChannelMsgPrepare(ssh, MSG_ID_SZ + UINT32_SZ + LENGTH_SZ +
+                strSz + BOOLEAN_SZ + UINT32_SZ, &buf);
     }
 
     if (ret == WS_SUCCESS) {
-        output = ssh->outputBuffer.buffer;
-        idx = ssh->outputBuffer.length;
+        output = buf->buffer;
+        idx = buf->length;
 
         output[idx++] = MSGID_CHANNEL_REQUEST;
         c32toa(channel->peerChannel, output + idx);
@@ -15788,14 +18685,11 @@ int SendChannelExit(WOLFSSH* ssh, word32 peerChannelId, int status)
         c32toa(status, output + idx);
         idx += UINT32_SZ;
 
-        ssh->outputBuffer.length = idx;
+        buf->length = idx;
 
-        ret = BundlePacket(ssh);
+        ret = ChannelMsgSend(ssh, buf);
     }
 
-    if (ret == WS_SUCCESS)
-        ret = wolfSSH_SendPacket(ssh);
-
     WLOG(WS_LOG_DEBUG, "Leaving SendChannelExit(), ret = %d", ret);
     return ret;
 }
@@ -15803,6 +18697,7 @@ int SendChannelExit(WOLFSSH* ssh, word32 peerChannelId, int status)
 
 int SendChannelClose(WOLFSSH* ssh, word32 peerChannelId)
 {
+    WOLFSSH_BUFFER* buf = NULL;
     byte* output;
     word32 idx;
     int ret = WS_SUCCESS;
@@ -15824,27 +18719,255 @@ int SendChannelClose(WOLFSSH* ssh, word32 peerChannelId)
     }
 
     if (ret == WS_SUCCESS)
-        ret = PreparePacket(ssh, MSG_ID_SZ + UINT32_SZ);
+        ret = ChannelTxFlush(ssh, channel);
+
+    if (ret == WS_SUCCESS)
+        ret = ChannelMsgPrepare(ssh, MSG_ID_SZ + UINT32_SZ, &buf);
 
     if (ret == WS_SUCCESS) {
-        output = ssh->outputBuffer.buffer;
-        idx = ssh->outputBuffer.length;
+        output = buf->buffer;
+        idx = buf->length;
 
         output[idx++] = MSGID_CHANNEL_CLOSE;
         c32toa(channel->peerChannel, output + idx);
         idx += UINT32_SZ;
 
-        ssh->outputBuffer.length = idx;
+        buf->length = idx;
 
-        ret = BundlePacket(ssh);
+        ret = ChannelMsgSend(ssh, buf);
+        channel->closeTxd = 1;
+    }
+
+    WLOG(WS_LOG_DEBUG, "Leaving SendChannelClose(), ret = %d", ret);
+    return ret;
+}
+
+
+/*
+ * Holds channel data sent while keying in ssh->rekeyQueue, to be sealed
+ * with the new keys. The data is taken from the channel's window now.
+ * Returns the number of bytes taken, WS_WINDOW_FULL when the peer's window
+ * is, or WS_REKEYING when the queue is full.
+ */
+static int QueueChannelData(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel,
+        byte msgId, byte* data, word32 dataSz)
+{
+    WOLFSSH_BUFFER* queue = &ssh->rekeyQueue;
+    word32 headerSz = MSG_ID_SZ + UINT32_SZ + LENGTH_SZ;
+    word32 queuedSz = queue->length - queue->idx;
+    word32 bound;
+    int ret;
+
+    if (msgId == MSGID_CHANNEL_EXTENDED_DATA)
+        headerSz += UINT32_SZ;
+
+    /* A full window waits for the peer, not for the key exchange. */
+    if (channel->peerWindowSz == 0) {
+        WLOG(WS_LOG_DEBUG, "channel window is full");
+        ssh->error = WS_WINDOW_FULL;
+        return WS_WINDOW_FULL;
+    }
+
+    bound = min(channel->peerWindowSz, channel->peerMaxPacketSz);
+    if (queuedSz + LENGTH_SZ + headerSz < DEFAULT_REKEY_QUEUE_SZ)
+        bound = min(bound,
+                DEFAULT_REKEY_QUEUE_SZ - queuedSz - LENGTH_SZ - headerSz);
+    else
+        bound = 0;
+
+    if (bound == 0) {
+        WLOG(WS_LOG_DEBUG, "Rekey queue is full");
+        ssh->error = WS_REKEYING;
+        return WS_REKEYING;
+    }
+    if (dataSz > bound)
+        dataSz = bound;
+
+    ret = RekeyQueueAdd(ssh, channel, msgId, data, dataSz);
+    if (ret != WS_SUCCESS)
+        return ret;
+
+    channel->peerWindowSz -= dataSz;
+    WLOG(WS_LOG_INFO, "  queued dataSz = %u", dataSz);
+
+    return (int)dataSz;
+}
+
+
+/*
+ * Seals the channel data queued during the key exchange with the new keys
+ * and sends it. A WS_WANT_WRITE leaves the packets in the output buffer
+ * for the next send, like any other packet.
+ */
+int SendQueuedChannelData(WOLFSSH* ssh)
+{
+    WOLFSSH_BUFFER* queue;
+    word32 payloadSz = 0;
+    int ret = WS_SUCCESS;
+
+    if (ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    queue = &ssh->rekeyQueue;
+    if (queue->length == queue->idx)
+        return WS_SUCCESS;
+
+    WLOG(WS_LOG_DEBUG, "Entering SendQueuedChannelData()");
+
+    while (ret == WS_SUCCESS && queue->idx < queue->length) {
+        ato32(queue->buffer + queue->idx, &payloadSz);
+
+        ret = PreparePacket(ssh, payloadSz);
+        if (ret == WS_SUCCESS) {
+            WMEMCPY(ssh->outputBuffer.buffer + ssh->outputBuffer.length,
+                    queue->buffer + queue->idx + LENGTH_SZ, payloadSz);
+            ssh->outputBuffer.length += payloadSz;
+            ret = BundlePacket(ssh);
+        }
+        if (ret == WS_SUCCESS)
+            queue->idx += LENGTH_SZ + payloadSz;
     }
 
     if (ret == WS_SUCCESS) {
+        ShrinkBuffer(queue, 1);
         ret = wolfSSH_SendPacket(ssh);
-        channel->closeTxd = 1;
+        if (ret == WS_WANT_WRITE)
+            ret = WS_SUCCESS;
     }
 
-    WLOG(WS_LOG_DEBUG, "Leaving SendChannelClose(), ret = %d", ret);
+    WLOG(WS_LOG_DEBUG, "Leaving SendQueuedChannelData(), ret = %d", ret);
+    return ret;
+}
+
+
+/*
+ * Holds channel data in the channel's txQueue until the scheduler picks
+ * it. The data comes out of the peer's window now. A channel holds at most
+ * WOLFSSH_CHANNEL_TXQ_SZ bytes, after that the sends get WS_WANT_WRITE.
+ */
+static int ChannelTxEnqueue(WOLFSSH* ssh, WOLFSSH_CHANNEL* channel,
+        const byte* data, word32 dataSz)
+{
+    WOLFSSH_BUFFER* queue = &channel->txQueue;
+    word32 queuedSz = queue->length - queue->idx;
+    word32 bound = 0;
+    int ret;
+
+    if (queuedSz < WOLFSSH_CHANNEL_TXQ_SZ)
+        bound = min(channel->peerWindowSz, WOLFSSH_CHANNEL_TXQ_SZ - queuedSz);
+
+    if (bound == 0) {
+        WLOG(WS_LOG_DEBUG, "Channel send queue is full");
+        ssh->error = WS_WANT_WRITE;
+        return WS_WANT_WRITE;
+    }
+    if (dataSz > bound)
+        dataSz = bound;
+
+    ret = GrowBuffer(queue, dataSz);
+    if (ret != WS_SUCCESS)
+        return ret;
+
+    WMEMCPY(queue->buffer + queue->length, data, dataSz);
+    queue->length += dataSz;
+    ssh->schedQueuedSz += dataSz;
+    channel->peerWindowSz -= dataSz;
+    ChannelSchedLink(ssh, channel);
+    WLOG(WS_LOG_INFO, "  scheduled dataSz = %u", dataSz);
+
+    return (int)dataSz;
+}
+
+
+/*
+ * Sends the channel data waiting in the channels' txQueue. Each round
+ * seals up to WOLFSSH_SCHED_BURST bytes and writes them. The latency
+ * class channels go first, taking turns a packet at a time. While bulk
+ * data waits they stop at WOLFSSH_SCHED_LATENCY_BURST, so a busy
+ * interactive channel cannot starve the bulk class. The bulk
+ * class channels share the rest by deficit round robin: on its turn a
+ * channel may send WOLFSSH_SCHED_QUANTUM bytes per unit of weight, and
+ * what a packet could not use carries over to its next turn. A round only
+ * starts once the output buffer is empty, so no channel gets more than a
+ * burst ahead of the others. A WS_WANT_WRITE leaves the rest waiting for
+ * the next call.
+ */
+int SendScheduledChannelData(WOLFSSH* ssh)
+{
+    WOLFSSH_CHANNEL* channel;
+    word32 burstSz;
+    word32 latencySz;
+    word32 dataSz;
+    int ret = WS_SUCCESS;
+
+    if (ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    if (ssh->schedQueuedSz == 0 || ssh->isKeying)
+        return WS_SUCCESS;
+
+    WLOG(WS_LOG_DEBUG, "Entering SendScheduledChannelData()");
+
+    if (ssh->outputBuffer.length > ssh->outputBuffer.idx)
+        ret = wolfSSH_SendPacket(ssh);
+
+    /* Sending may start a key exchange, the rest waits for the new keys. */
+    while (ret == WS_SUCCESS && ssh->schedQueuedSz > 0 && !ssh->isKeying) {
+        burstSz = 0;
+        latencySz = (ssh->schedBulk != NULL) ?
+                WOLFSSH_SCHED_LATENCY_BURST : WOLFSSH_SCHED_BURST;
+
+        while (ret == WS_SUCCESS && ssh->schedLatency != NULL &&
+                burstSz < latencySz) {
+            channel = ssh->schedLatency->schedNext;
+            dataSz = min(channel->txQueue.length - channel->txQueue.idx,
+                    channel->peerMaxPacketSz);
+            dataSz = min(dataSz, latencySz - burstSz);
+            ret = ChannelTxPacket(ssh, channel, dataSz);
+            if (ret == WS_SUCCESS) {
+                burstSz += dataSz;
+                if (channel->txQueue.idx == channel->txQueue.length)
+                    ChannelSchedUnlink(ssh, channel);
+                else
+                    ssh->schedLatency = channel;
+            }
+        }
+
+        while (ret == WS_SUCCESS && ssh->schedBulk != NULL &&
+                burstSz < WOLFSSH_SCHED_BURST) {
+            channel = ssh->schedBulk->schedNext;
+            if (!channel->schedTurn) {
+                channel->schedDeficit += WOLFSSH_SCHED_QUANTUM *
+                        (channel->schedWeight ? channel->schedWeight : 1);
+                channel->schedTurn = 1;
+            }
+
+            dataSz = min(channel->txQueue.length - channel->txQueue.idx,
+                    channel->peerMaxPacketSz);
+            if (dataSz > channel->schedDeficit) {
+                /* End of its turn, to the back of the ring. */
+                channel->schedTurn = 0;
+                ssh->schedBulk = channel;
+                continue;
+            }
+
+            ret = ChannelTxPacket(ssh, channel, dataSz);
+            if (ret == WS_SUCCESS) {
+                burstSz += dataSz;
+                channel->schedDeficit -= dataSz;
+                if (channel->txQueue.idx == channel->txQueue.length)
+                    ChannelSchedUnlink(ssh, channel);
+            }
+        }
+
+        if (ret == WS_SUCCESS)
+            ret = wolfSSH_SendPacket(ssh);
+    }
+
+    if (ret == WS_WANT_WRITE)
+        ret = WS_SUCCESS;
+
+    WLOG(WS_LOG_DEBUG, "Leaving SendScheduledChannelData(), ret = %d", ret);
     return ret;
 }
 
@@ -15862,14 +18985,10 @@ int SendChannelData(WOLFSSH* ssh, word32 channelId,
     if (ssh == NULL)
         ret = WS_BAD_ARGUMENT;
 
-    if (ret == WS_SUCCESS) {
-        if (ssh->isKeying)
-            ret = WS_REKEYING;
-    }
-
     /* if already having data pending try to flush it first and do not continue
-     * to que more on fail */
-    if (ret == WS_SUCCESS && ssh->outputBuffer.plainSz > 0) {
+     * to que more on fail. The scheduler queues the data instead. */
+    if (ret == WS_SUCCESS && !ssh->isKeying && !ssh->channelSched &&
+            ssh->outputBuffer.plainSz > 0) {
         WLOG(WS_LOG_DEBUG, "Flushing out want write data");
         ret = wolfSSH_SendPacket(ssh);
         if (ret != WS_SUCCESS) {
@@ -15879,7 +18998,7 @@ int SendChannelData(WOLFSSH* ssh, word32 channelId,
 
     }
 
-    if (ret == WS_SUCCESS) {
+    if (ret == WS_SUCCESS && !ssh->isKeying && !ssh->channelSched) {
         if (ssh->outputBuffer.length != 0)
             ret = wolfSSH_SendPacket(ssh);
     }
@@ -15900,9 +19019,52 @@ int SendChannelData(WOLFSSH* ssh, word32 channelId,
         }
     }
 
+    /* Over the send limits, the data waits like for a full window. */
+    if (ret == WS_SUCCESS) {
+        word32 avail = RateAvail(&ssh->txRate, &channel->txRate);
+
+        channel->txRateHeld = (avail == 0);
+        if (avail == 0) {
+            WLOG(WS_LOG_DEBUG, "channel send rate limited");
+            ssh->error = WS_WINDOW_FULL;
+            ret = WS_WINDOW_FULL;
+        }
+        else if (dataSz > avail)
+            dataSz = avail;
+    }
+
+    /* With the scheduler, the data waits its turn whenever it cannot go
+     * out right away, including while keying. Once any data is waiting,
+     * everything after it waits too, so a channel's data stays in order. */
+    if (ret == WS_SUCCESS && (ssh->schedQueuedSz > 0 || (ssh->channelSched &&
+            (ssh->isKeying ||
+             ssh->outputBuffer.length > ssh->outputBuffer.idx)))) {
+        ret = ChannelTxEnqueue(ssh, channel, data, dataSz);
+        if (ret > 0) {
+            int sendRet;
+
+            RateTake(&ssh->txRate, &channel->txRate, (word32)ret);
+            sendRet = SendScheduledChannelData(ssh);
+            if (sendRet != WS_SUCCESS)
+                ret = sendRet;
+        }
+        WLOG(WS_LOG_DEBUG, "Leaving SendChannelData(), ret = %d", ret);
+        return ret;
+    }
+
+    /* While keying, hold the data until the new keys are in use. */
+    if (ret == WS_SUCCESS && ssh->isKeying) {
+        ret = QueueChannelData(ssh, channel, MSGID_CHANNEL_DATA, data, dataSz);
+        if (ret > 0)
+            RateTake(&ssh->txRate, &channel->txRate, (word32)ret);
+        WLOG(WS_LOG_DEBUG, "Leaving SendChannelData(), ret = %d", ret);
+        return ret;
+    }
+
     if (ret == WS_SUCCESS) {
+        /* The peer's maximum packet size is the only limit, our own
+         * maxPacketSz is what we accept. */
         word32 bound = min(channel->peerWindowSz, channel->peerMaxPacketSz);
-        bound = min(bound, channel->maxPacketSz);
 
         if (dataSz > bound) {
             WLOG(WS_LOG_DEBUG,
@@ -15937,6 +19099,7 @@ int SendChannelData(WOLFSSH* ssh, word32 channelId,
         WLOG(WS_LOG_INFO, "  peerWindowSz = %u", channel->peerWindowSz);
         channel->peerWindowSz -= dataSz;
         WLOG(WS_LOG_INFO, "  update peerWindowSz = %u", channel->peerWindowSz);
+        RateTake(&ssh->txRate, &channel->txRate, dataSz);
     }
 
     /* at this point the data has been loaded into WOLFSSH structure and is
@@ -15968,14 +19131,9 @@ int SendChannelExtendedData(WOLFSSH* ssh, word32 channelId,
     if (ssh == NULL)
         ret = WS_BAD_ARGUMENT;
 
-    if (ret == WS_SUCCESS) {
-        if (ssh->isKeying)
-            ret = WS_REKEYING;
-    }
-
     /* if already having data pending try to flush it first and do not continue
      * to que more on fail */
-    if (ret == WS_SUCCESS && ssh->outputBuffer.plainSz > 0) {
+    if (ret == WS_SUCCESS && !ssh->isKeying && ssh->outputBuffer.plainSz > 0) {
         WLOG(WS_LOG_DEBUG, "Flushing out want write data");
         ret = wolfSSH_SendPacket(ssh);
         if (ret != WS_SUCCESS) {
@@ -15985,7 +19143,7 @@ int SendChannelExtendedData(WOLFSSH* ssh, word32 channelId,
 
     }
 
-    if (ret == WS_SUCCESS) {
+    if (ret == WS_SUCCESS && !ssh->isKeying) {
         if (ssh->outputBuffer.length != 0)
             ret = wolfSSH_SendPacket(ssh);
     }
@@ -16006,9 +19164,34 @@ int SendChannelExtendedData(WOLFSSH* ssh, word32 channelId,
         }
     }
 
+    /* Over the send limits, the data waits like for a full window. */
+    if (ret == WS_SUCCESS) {
+        word32 avail = RateAvail(&ssh->txRate, &channel->txRate);
+
+        channel->txRateHeld = (avail == 0);
+        if (avail == 0) {
+            WLOG(WS_LOG_DEBUG, "channel send rate limited");
+            ssh->error = WS_WINDOW_FULL;
+            ret = WS_WINDOW_FULL;
+        }
+        else if (dataSz > avail)
+            dataSz = avail;
+    }
+
+    /* While keying, hold the data until the new keys are in use. */
+    if (ret == WS_SUCCESS && ssh->isKeying) {
+        ret = QueueChannelData(ssh, channel, MSGID_CHANNEL_EXTENDED_DATA,
+                data, dataSz);
+        if (ret > 0)
+            RateTake(&ssh->txRate, &channel->txRate, (word32)ret);
+        WLOG(WS_LOG_DEBUG, "Leaving SendChannelData(), ret = %d", ret);
+        return ret;
+    }
+
     if (ret == WS_SUCCESS) {
+        /* The peer's maximum packet size is the only limit, our own
+         * maxPacketSz is what we accept. */
         word32 bound = min(channel->peerWindowSz, channel->peerMaxPacketSz);
-        bound = min(bound, channel->maxPacketSz);
 
         if (dataSz > bound) {
             WLOG(WS_LOG_DEBUG,
@@ -16046,6 +19229,7 @@ int SendChannelExtendedData(WOLFSSH* ssh, word32 channelId,
         WLOG(WS_LOG_INFO, "  peerWindowSz = %u", channel->peerWindowSz);
         channel->peerWindowSz -= dataSz;
         WLOG(WS_LOG_INFO, "  update peerWindowSz = %u", channel->peerWindowSz);
+        RateTake(&ssh->txRate, &channel->txRate, dataSz);
     }
 
     /* at this point the data has been loaded into WOLFSSH structure and is
@@ -16189,6 +19373,8 @@ int SendChannelRequest(WOLFSSH* ssh, byte* name, word32 nameSz)
         }
 
         ssh->outputBuffer.length = idx;
+        ChannelSetCommand(channel, (byte)ssh->connectChannelId,
+                (const char*)name, nameSz);
 
         WLOG(WS_LOG_INFO, "Sending Channel Request: ");
         WLOG(WS_LOG_INFO, "  channelId = %u", channel->peerChannel);
@@ -68,6 +68,7 @@ int wolfSSH_Init(void)
     WLOG(WS_LOG_DEBUG, "Entering wolfSSH_Init()");
     if (wolfCrypt_Init() != 0)
         ret = WS_CRYPTO_FAILED;
+    NameIdIndexInit();
 
 #ifdef HAVE_FIPS
     wolfCrypt_SetCb_fips(myFipsCb);
@@ -260,8 +261,11 @@ word32 wolfSSH_GetHighwater(WOLFSSH* ssh)
 {
     WLOG(WS_LOG_DEBUG, "Entering wolfSSH_GetHighwater()");
 
-    if (ssh)
-        return ssh->highwaterMark;
+    if (ssh) {
+        if (ssh->highwaterMark > 0xFFFFFFFF)
+            return 0xFFFFFFFF;
+        return (word32)ssh->highwaterMark;
+    }
 
     return 0;
 }
@@ -298,6 +302,436 @@ void* wolfSSH_GetHighwaterCtx(WOLFSSH* ssh)
     return NULL;
 }
 
+
+/* Sets the limits on the use of one set of keys. When either direction
+ * goes past the byte or packet limit, or the keys are older than the
+ * lifetime, the high water callback is called, and the default callback
+ * starts a key exchange. The bytes limit is the high water mark. Keys
+ * for AES-CBC and AES-CTR are also held to the RFC 4344 limit of 2^32
+ * blocks, and every cipher to DEFAULT_REKEY_PACKETS packets when packets
+ * is 0. The lifetime is checked as packets are sent and received, which
+ * costs a WTIME() call per packet; with seconds at 0 the clock isn't read. */
+int wolfSSH_CTX_SetRekeyPolicy(WOLFSSH_CTX* ctx, const WS_RekeyPolicy* policy)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetRekeyPolicy()");
+
+    if (ctx == NULL || policy == NULL)
+        return WS_BAD_ARGUMENT;
+
+    ctx->highwaterMark = policy->bytes;
+    ctx->rekeyPackets = policy->packets;
+    ctx->rekeySeconds = policy->seconds;
+
+    return WS_SUCCESS;
+}
+
+
+int wolfSSH_SetRekeyPolicy(WOLFSSH* ssh, const WS_RekeyPolicy* policy)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_SetRekeyPolicy()");
+
+    if (ssh == NULL || policy == NULL)
+        return WS_BAD_ARGUMENT;
+
+    ssh->highwaterMark = policy->bytes;
+    ssh->rekeyPackets = policy->packets;
+    ssh->rekeySeconds = policy->seconds;
+
+    return WS_SUCCESS;
+}
+
+
+int wolfSSH_GetRekeyPolicy(WOLFSSH* ssh, WS_RekeyPolicy* policy)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_GetRekeyPolicy()");
+
+    if (ssh == NULL || policy == NULL)
+        return WS_BAD_ARGUMENT;
+
+    policy->bytes = ssh->highwaterMark;
+    policy->packets = ssh->rekeyPackets;
+    policy->seconds = ssh->rekeySeconds;
+
+    return WS_SUCCESS;
+}
+
+
+/* Sets how many bytes the receive path may ask the I/O callback for beyond
+ * what the current packet needs. The extra data is kept in the input buffer
+ * and later packets are served from it. Since buffered packets are not
+ * visible to select() on the socket, an application enabling read-ahead
+ * should keep calling wolfSSH_worker() until it returns WS_WANT_READ, or
+ * use wolfSSH_worker_ex() which drains the buffered packets itself. */
+int wolfSSH_CTX_SetReadAhead(WOLFSSH_CTX* ctx, word32 readAheadSz)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetReadAhead()");
+
+    if (ctx == NULL || readAheadSz > MAX_READ_AHEAD_SZ)
+        return WS_BAD_ARGUMENT;
+
+    ctx->readAheadSz = readAheadSz;
+
+    return WS_SUCCESS;
+}
+
+
+int wolfSSH_SetReadAhead(WOLFSSH* ssh, word32 readAheadSz)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_SetReadAhead()");
+
+    if (ssh == NULL || readAheadSz > MAX_READ_AHEAD_SZ)
+        return WS_BAD_ARGUMENT;
+
+    ssh->readAheadSz = readAheadSz;
+
+    return WS_SUCCESS;
+}
+
+
+word32 wolfSSH_GetReadAhead(WOLFSSH* ssh)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_GetReadAhead()");
+
+    if (ssh)
+        return ssh->readAheadSz;
+
+    return 0;
+}
+
+
+/* Corks the session. Sealed packets, such as channel data, window adjusts
+ * and SFTP replies, collect in the output buffer and are written together
+ * once corkSz bytes are pending or the session is uncorked. Key exchange
+ * messages and disconnects are always written right away. Meant for
+ * established sessions; don't cork during user authentication. */
+int wolfSSH_Cork(WOLFSSH* ssh)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_Cork()");
+
+    if (ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    ssh->isCorked = 1;
+
+    return WS_SUCCESS;
+}
+
+
+/* Uncorks the session and writes out any held packets. Returns WS_SUCCESS
+ * once everything is written, or WS_WANT_WRITE if the rest should be
+ * flushed later with wolfSSH_worker(). */
+int wolfSSH_Uncork(WOLFSSH* ssh)
+{
+    int ret = WS_SUCCESS;
+
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_Uncork()");
+
+    if (ssh == NULL)
+        ret = WS_BAD_ARGUMENT;
+
+    if (ret == WS_SUCCESS) {
+        ssh->isCorked = 0;
+        if (ssh->outputBuffer.length > ssh->outputBuffer.idx)
+            ret = wolfSSH_SendPacket(ssh);
+    }
+
+    WLOG(WS_LOG_DEBUG, "Leaving wolfSSH_Uncork(), ret = %d", ret);
+    return ret;
+}
+
+
+/* Sets how many bytes may be held while corked before they are written.
+ * 0 restores the default. */
+int wolfSSH_SetCorkSize(WOLFSSH* ssh, word32 corkSz)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_SetCorkSize()");
+
+    if (ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    ssh->corkSz = (corkSz == 0) ? DEFAULT_CORK_SZ : corkSz;
+
+    return WS_SUCCESS;
+}
+
+
+/* Sets how many pre-generated ephemeral key pairs the server keeps for each
+ * of the CTX's key exchange algorithms. 0 disables the pool and releases
+ * any pooled keys. */
+int wolfSSH_CTX_SetKexKeyPool(WOLFSSH_CTX* ctx, word32 count)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetKexKeyPool()");
+
+    if (ctx == NULL || ctx->side != WOLFSSH_ENDPOINT_SERVER
+            || count > MAX_KEX_KEY_POOL_SZ)
+        return WS_BAD_ARGUMENT;
+
+    return CtxKexKeyPoolSetSize(ctx, count);
+}
+
+
+/* Tops up the KEX key pool. Call it from the application's idle time or
+ * a background thread; it is safe to call while handshakes are running
+ * on other threads. */
+int wolfSSH_CTX_FillKexKeyPool(WOLFSSH_CTX* ctx)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_FillKexKeyPool()");
+
+    if (ctx == NULL || ctx->side != WOLFSSH_ENDPOINT_SERVER)
+        return WS_BAD_ARGUMENT;
+
+    return CtxKexKeyPoolFill(ctx);
+}
+
+
+/* Sets the callback used to move the server's host key signature off the
+ * thread driving the session, for the initial key exchange and re-keys. */
+void wolfSSH_CTX_SetSignOffloadCb(WOLFSSH_CTX* ctx, WS_CallbackSignOffload cb)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetSignOffloadCb()");
+
+    if (ctx)
+        ctx->signOffloadCb = cb;
+}
+
+
+void wolfSSH_SetSignOffloadCtx(WOLFSSH* ssh, void* ctx)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_SetSignOffloadCtx()");
+
+    if (ssh)
+        ssh->signOffloadCtx = ctx;
+}
+
+
+void* wolfSSH_GetSignOffloadCtx(WOLFSSH* ssh)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_GetSignOffloadCtx()");
+
+    if (ssh)
+        return ssh->signOffloadCtx;
+
+    return NULL;
+}
+
+
+/* Signs the exchange hash for a session whose signature was offloaded.
+ * The worker thread calls it once per offload, then tells the thread
+ * driving the session to call it again. Until this returns, that thread
+ * may only poll the call that returned WS_WANT_CRYPTO, and the session
+ * must not be freed. */
+int wolfSSH_SignOffload(WOLFSSH* ssh)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_SignOffload()");
+
+    if (ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    return KexReplySign(ssh);
+}
+
+
+/* Routes the CTX's crypto to the wolfCrypt device devId, usually one
+ * registered with wc_CryptoCb_RegisterDevice(). New sessions, the host key
+ * cache, and the KEX key pool use it. */
+int wolfSSH_CTX_SetDevId(WOLFSSH_CTX* ctx, int devId)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetDevId()");
+
+    if (ctx == NULL)
+        return WS_BAD_ARGUMENT;
+
+    CtxSetDevId(ctx, devId);
+
+    return WS_SUCCESS;
+}
+
+
+/* Overrides the CTX's device for one session. It applies to crypto set up
+ * after the call, so set it before wolfSSH_accept() or wolfSSH_connect().
+ * The session's RNG stays on the CTX's device. */
+int wolfSSH_SetDevId(WOLFSSH* ssh, int devId)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_SetDevId()");
+
+    if (ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    ssh->devId = devId;
+
+    return WS_SUCCESS;
+}
+
+
+int wolfSSH_GetDevId(WOLFSSH* ssh)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_GetDevId()");
+
+    if (ssh == NULL)
+        return INVALID_DEVID;
+
+    return ssh->devId;
+}
+
+
+/* When enabled, the client sends the KEX init for its first choice KEX
+ * algorithm right after its KEXINIT instead of waiting for the server's.
+ * The server answers it if both sides list the same KEX and host key
+ * algorithms first, otherwise it is dropped and sent again. */
+int wolfSSH_CTX_SetKexGuess(WOLFSSH_CTX* ctx, byte enable)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetKexGuess()");
+
+    if (ctx == NULL)
+        return WS_BAD_ARGUMENT;
+
+    ctx->kexGuess = (enable != 0);
+
+    return WS_SUCCESS;
+}
+
+
+int wolfSSH_SetKexGuess(WOLFSSH* ssh, byte enable)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_SetKexGuess()");
+
+    if (ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    ssh->kexGuess = (enable != 0);
+
+    return WS_SUCCESS;
+}
+
+
+static int IsPipelineAuth(byte authType)
+{
+    return authType == 0 || authType == WOLFSSH_USERAUTH_NONE
+        || authType == WOLFSSH_USERAUTH_PASSWORD
+        || authType == WOLFSSH_USERAUTH_PUBLICKEY;
+}
+
+
+/* When set, wolfSSH_connect() sends the userauth service request and the
+ * first userauth request right behind the client's NEWKEYS instead of
+ * waiting for the server's SERVICE_ACCEPT. authType picks the first
+ * request: WOLFSSH_USERAUTH_NONE asks for the server's methods, like the
+ * lock-step connect, and WOLFSSH_USERAUTH_PUBLICKEY or
+ * WOLFSSH_USERAUTH_PASSWORD gets the credential from the userauth
+ * callback and tries it right away. 0 turns pipelining off. */
+int wolfSSH_CTX_SetConnectPipeline(WOLFSSH_CTX* ctx, byte authType)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetConnectPipeline()");
+
+    if (ctx == NULL || !IsPipelineAuth(authType))
+        return WS_BAD_ARGUMENT;
+
+    ctx->connectPipeline = authType;
+
+    return WS_SUCCESS;
+}
+
+
+int wolfSSH_SetConnectPipeline(WOLFSSH* ssh, byte authType)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_SetConnectPipeline()");
+
+    if (ssh == NULL || !IsPipelineAuth(authType))
+        return WS_BAD_ARGUMENT;
+
+    ssh->connectPipeline = authType;
+
+    return WS_SUCCESS;
+}
+
+
+int wolfSSH_CTX_SetChannelScheduler(WOLFSSH_CTX* ctx, byte enable)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetChannelScheduler()");
+
+    if (ctx == NULL)
+        return WS_BAD_ARGUMENT;
+
+    ctx->channelSched = (enable != 0);
+
+    return WS_SUCCESS;
+}
+
+
+/* Turning the scheduler off still lets the data already waiting go out
+ * first. */
+int wolfSSH_SetChannelScheduler(WOLFSSH* ssh, byte enable)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_SetChannelScheduler()");
+
+    if (ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    ssh->channelSched = (enable != 0);
+
+    return WS_SUCCESS;
+}
+
+
+static int IsRateLimit(const WS_RateLimit* limit)
+{
+    return limit != NULL && (limit->txRate != 0 || limit->rxRate != 0);
+}
+
+
+int wolfSSH_CTX_SetRateLimit(WOLFSSH_CTX* ctx, const WS_RateLimit* session,
+        const WS_RateLimit* channel)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetRateLimit()");
+
+    if (ctx == NULL)
+        return WS_BAD_ARGUMENT;
+
+    WMEMSET(&ctx->sessionRate, 0, sizeof(WS_RateLimit));
+    WMEMSET(&ctx->channelRate, 0, sizeof(WS_RateLimit));
+    if (session != NULL)
+        ctx->sessionRate = *session;
+    if (channel != NULL)
+        ctx->channelRate = *channel;
+
+    return WS_SUCCESS;
+}
+
+
+/* Restarts the session's buckets full. The channel limit applies to the
+ * channels opened from now on, see wolfSSH_ChannelSetRateLimit() for the
+ * open ones. */
+int wolfSSH_SetRateLimit(WOLFSSH* ssh, const WS_RateLimit* session,
+        const WS_RateLimit* channel)
+{
+    WS_RateLimit none;
+
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_SetRateLimit()");
+
+    if (ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    WMEMSET(&none, 0, sizeof(none));
+    RateLimitInit(&ssh->txRate, &ssh->rxRate,
+            (session != NULL) ? session : &none);
+    ssh->channelRate = (channel != NULL) ? *channel : none;
+    if (IsRateLimit(session) || IsRateLimit(channel))
+        ssh->rateLimited = 1;
+
+    return WS_SUCCESS;
+}
+
+
+word32 wolfSSH_GetRateLimitWait(WOLFSSH* ssh)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_GetRateLimitWait()");
+
+    if (ssh == NULL)
+        return WOLFSSH_RATE_NO_WAIT;
+
+    return RateLimitWait(ssh);
+}
+
 void wolfSSH_SetGlobalReq(WOLFSSH_CTX *ctx, WS_CallbackGlobalReq cb)
 {
     if (ctx)
@@ -464,7 +898,8 @@ int wolfSSH_accept(WOLFSSH* ssh)
         return WS_BAD_ARGUMENT;
 
     /* clear want read/writes for retry */
-    if (ssh->error == WS_WANT_READ || ssh->error == WS_WANT_WRITE || ssh->error == WS_AUTH_PENDING)
+    if (ssh->error == WS_WANT_READ || ssh->error == WS_WANT_WRITE ||
+            ssh->error == WS_AUTH_PENDING || ssh->error == WS_WANT_CRYPTO)
         ssh->error = 0;
 
     if (ssh->error != 0) {
@@ -493,11 +928,12 @@ int wolfSSH_accept(WOLFSSH* ssh)
                 WLOG(WS_LOG_DEBUG, "PR3: peerMacSz = %u", ssh->peerMacSz);
                 ssh->inputBuffer.idx += ssh->peerMacSz;
                 WLOG(WS_LOG_DEBUG, "PR4: Shrinking input buffer");
-                ShrinkBuffer(&ssh->inputBuffer, 1);
+                ShrinkBuffer(&ssh->inputBuffer, 0);
                 ssh->processReplyState = PROCESS_INIT;
 
-                WLOG(WS_LOG_DEBUG, "PR5: txCount = %u, rxCount = %u",
-                    ssh->txCount, ssh->rxCount);
+                WLOG(WS_LOG_DEBUG, "PR5: txCount = 0x%08x%08x, "
+                        "rxCount = 0x%08x%08x",
+                        WLOG_W64(ssh->txCount), WLOG_W64(ssh->rxCount));
             }
         }
         else {
@@ -650,6 +1086,7 @@ int wolfSSH_accept(WOLFSSH* ssh)
                             "SERVER_USERAUTH_ACCEPT_DONE", ssh->error);
                         return WS_ERROR;
                     }
+                    newAgent->devId = ssh->devId;
 
                     newChannel = ChannelNew(ssh, ID_CHANTYPE_AUTH_AGENT,
                             ssh->ctx->windowSz, ssh->ctx->maxPacketSz);
@@ -749,11 +1186,12 @@ int wolfSSH_connect(WOLFSSH* ssh)
                 WLOG(WS_LOG_DEBUG, "PR3: peerMacSz = %u", ssh->peerMacSz);
                 ssh->inputBuffer.idx += ssh->peerMacSz;
                 WLOG(WS_LOG_DEBUG, "PR4: Shrinking input buffer");
-                ShrinkBuffer(&ssh->inputBuffer, 1);
+                ShrinkBuffer(&ssh->inputBuffer, 0);
                 ssh->processReplyState = PROCESS_INIT;
 
-                WLOG(WS_LOG_DEBUG, "PR5: txCount = %u, rxCount = %u",
-                    ssh->txCount, ssh->rxCount);
+                WLOG(WS_LOG_DEBUG, "PR5: txCount = 0x%08x%08x, "
+                        "rxCount = 0x%08x%08x",
+                        WLOG_W64(ssh->txCount), WLOG_W64(ssh->rxCount));
             }
         }
         else {
@@ -811,7 +1249,11 @@ int wolfSSH_connect(WOLFSSH* ssh)
                 return WS_FATAL_ERROR;
             }
 
-            if (ssh->handshake->kexId == ID_DH_GEX_SHA256) {
+            if (ssh->handshake->kexGuess) {
+                /* The KEX init guessed with our KEXINIT was right. */
+                ssh->error = WS_SUCCESS;
+            }
+            else if (ssh->handshake->kexId == ID_DH_GEX_SHA256) {
 #if !defined(WOLFSSH_NO_DH) && !defined(WOLFSSH_NO_DH_GEX_SHA256)
                 ssh->error = SendKexDhGexRequest(ssh);
 #endif
@@ -840,8 +1282,10 @@ int wolfSSH_connect(WOLFSSH* ssh)
             FALL_THROUGH;
 
         case CONNECT_KEYED:
-            if ( (ssh->error = SendServiceRequest(ssh, ID_SERVICE_USERAUTH)) <
-                                                                  WS_SUCCESS) {
+            /* A pipelined connect sent it along with the NEWKEYS. */
+            if (!ssh->connectPipelined && (ssh->error =
+                    SendServiceRequest(ssh, ID_SERVICE_USERAUTH))
+                                                            < WS_SUCCESS) {
                 WLOG(WS_LOG_DEBUG, connectError, "KEYED", ssh->error);
                 return WS_FATAL_ERROR;
             }
@@ -863,17 +1307,12 @@ int wolfSSH_connect(WOLFSSH* ssh)
 
         case CONNECT_SERVER_USERAUTH_REQUEST_DONE:
             #ifdef WOLFSSH_AGENT
-                if (ssh->agentEnabled) {
-                    ssh->agent = wolfSSH_AGENT_new(ssh->ctx->heap);
-                    if (ssh->agent == NULL) {
-                        ssh->agentEnabled = 0;
-                        WLOG(WS_LOG_INFO, "Unable to create agent. Disabling.");
-                    }
-                }
+                ClientAgentNew(ssh);
             #endif
 
-            if ( (ssh->error = SendUserAuthRequest(ssh, ID_NONE, 0)) <
-                                                                  WS_SUCCESS) {
+            /* A pipelined connect sent it along with the NEWKEYS. */
+            if (!ssh->connectPipelined && (ssh->error =
+                    SendUserAuthRequest(ssh, ID_NONE, 0)) < WS_SUCCESS) {
                 WLOG(WS_LOG_DEBUG, connectError,
                      "SERVER_USERAUTH_REQUEST_DONE", ssh->error);
                 return WS_FATAL_ERROR;
@@ -1089,10 +1528,6 @@ int wolfSSH_stream_peek(WOLFSSH* ssh, byte* buf, word32 bufSz)
     if (ssh == NULL || ssh->channelList == NULL)
         return WS_BAD_ARGUMENT;
 
-    if (ssh->isKeying) {
-        ssh->error = WS_REKEYING;
-        return WS_REKEYING;
-    }
     if (ssh->channelList->eofRxd) {
         ssh->error = WS_EOF;
         return WS_ERROR;
@@ -1145,7 +1580,11 @@ int wolfSSH_stream_read(WOLFSSH* ssh, byte* buf, word32 bufSz)
             WLOG(WS_LOG_DEBUG,
                     "Starting to recieve data at current index of %u",
                     inputBuffer->idx);
-            ret = DoReceive(ssh);
+            /* The peer may be waiting on window the receive limits held
+             * back to send what this read waits for. */
+            ret = ChannelRateRelease(ssh);
+            if (ret == WS_SUCCESS)
+                ret = DoReceive(ssh);
             if (ssh->channelList == NULL || ssh->channelList->eofRxd)
                 ret = WS_EOF;
             if (ret < 0 && ret != WS_CHAN_RXD) {
@@ -1194,10 +1633,6 @@ int wolfSSH_stream_send(WOLFSSH* ssh, byte* buf, word32 bufSz)
     if (ssh == NULL || buf == NULL || ssh->channelList == NULL)
         return WS_BAD_ARGUMENT;
 
-    if (ssh->isKeying) {
-        ssh->error = WS_REKEYING;
-        return WS_REKEYING;
-    }
 
     bytesTxd = SendChannelData(ssh, ssh->channelList->channel, buf, bufSz);
 
@@ -1287,10 +1722,6 @@ int wolfSSH_extended_data_send(WOLFSSH* ssh, byte* buf, word32 bufSz)
     if (ssh == NULL || buf == NULL || ssh->channelList == NULL)
         return WS_BAD_ARGUMENT;
 
-    if (ssh->isKeying) {
-        ssh->error = WS_REKEYING;
-        return WS_REKEYING;
-    }
 
     bytesTxd = SendChannelExtendedData(ssh, ssh->channelList->channel, buf, bufSz);
 
@@ -2100,6 +2531,7 @@ int wolfSSH_CTX_SetAlgoListKex(WOLFSSH_CTX* ctx, const char* list)
 
     if (ctx) {
         ctx->algoListKex = list;
+        CtxKexInitRefresh(ctx);
         ret = WS_SUCCESS;
     }
 
@@ -2150,6 +2582,7 @@ int wolfSSH_CTX_SetAlgoListKey(WOLFSSH_CTX* ctx, const char* list)
 
     if (ctx) {
         ctx->algoListKey = list;
+        CtxKexInitRefresh(ctx);
         ret = WS_SUCCESS;
     }
 
@@ -2200,6 +2633,7 @@ int wolfSSH_CTX_SetAlgoListCipher(WOLFSSH_CTX* ctx, const char* list)
 
     if (ctx) {
         ctx->algoListCipher = list;
+        CtxKexInitRefresh(ctx);
         ret = WS_SUCCESS;
     }
 
@@ -2250,6 +2684,7 @@ int wolfSSH_CTX_SetAlgoListMac(WOLFSSH_CTX* ctx, const char* list)
 
     if (ctx) {
         ctx->algoListMac = list;
+        CtxKexInitRefresh(ctx);
         ret = WS_SUCCESS;
     }
 
@@ -2474,7 +2909,7 @@ int wolfSSH_CTX_SetWindowPacketSize(WOLFSSH_CTX* ctx,
 {
     WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetWindowPacketSize()");
 
-    if (ctx == NULL)
+    if (ctx == NULL || maxPacketSz > MAX_CHANNEL_PACKET_SZ)
         return WS_BAD_ARGUMENT;
 
     if (windowSz == 0)
@@ -2489,6 +2924,61 @@ int wolfSSH_CTX_SetWindowPacketSize(WOLFSSH_CTX* ctx,
 }
 
 
+/* Enables receive window auto-tuning. A channel's window and input buffer
+ * start at the context's window size and double, up to maxWindowSz, while
+ * the peer keeps running the window dry and the application keeps reading.
+ * The growth across all of a session's channels is held to
+ * MAX_SESSION_WINDOW_SZ, and across all of the context's sessions to its
+ * window budget. 0 disables auto-tuning. */
+int wolfSSH_CTX_SetWindowAutoTune(WOLFSSH_CTX* ctx, word32 maxWindowSz)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetWindowAutoTune()");
+
+    if (ctx == NULL || maxWindowSz > MAX_WINDOW_SZ)
+        return WS_BAD_ARGUMENT;
+
+    ctx->maxWindowSz = maxWindowSz;
+
+    return WS_SUCCESS;
+}
+
+
+/* Sets the total the auto-tuning may add to channel windows across all of
+ * the context's sessions. Growth already held isn't taken back. */
+int wolfSSH_CTX_SetWindowBudget(WOLFSSH_CTX* ctx, word32 budgetSz)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetWindowBudget()");
+
+    if (ctx == NULL)
+        return WS_BAD_ARGUMENT;
+
+    return CtxWindowSetBudget(ctx, budgetSz);
+}
+
+
+/* Returns how much of the context's window budget its sessions hold. */
+word32 wolfSSH_CTX_GetWindowGrown(WOLFSSH_CTX* ctx)
+{
+    if (ctx == NULL)
+        return 0;
+
+    return CtxWindowGrown(ctx);
+}
+
+
+int wolfSSH_CTX_SetBufferRetain(WOLFSSH_CTX* ctx, word32 retainSz)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_CTX_SetBufferRetain()");
+
+    if (ctx == NULL)
+        return WS_BAD_ARGUMENT;
+
+    ctx->bufferRetainSz = retainSz;
+
+    return WS_SUCCESS;
+}
+
+
 void wolfSSH_GetStats(WOLFSSH* ssh, word32* txCount, word32* rxCount,
                       word32* seq, word32* peerSeq)
 {
@@ -2498,8 +2988,11 @@ void wolfSSH_GetStats(WOLFSSH* ssh, word32* txCount, word32* rxCount,
     word32 rPeerSeq = 0;
 
     if (ssh != NULL) {
-        rTxCount = ssh->txCount;
-        rRxCount = ssh->rxCount;
+        /* The byte counts stop at the largest word32. */
+        rTxCount = (ssh->txCount > 0xFFFFFFFF) ?
+                0xFFFFFFFF : (word32)ssh->txCount;
+        rRxCount = (ssh->rxCount > 0xFFFFFFFF) ?
+                0xFFFFFFFF : (word32)ssh->rxCount;
         rSeq = ssh->seq;
         rPeerSeq = ssh->peerSeq;
     }
@@ -2515,6 +3008,33 @@ void wolfSSH_GetStats(WOLFSSH* ssh, word32* txCount, word32* rxCount,
 }
 
 
+/* Gets the bytes and packets sent and received with the current keys. */
+void wolfSSH_GetStats_ex(WOLFSSH* ssh, word64* txCount, word64* rxCount,
+                         word64* txPacketCount, word64* rxPacketCount)
+{
+    word64 rTxCount = 0;
+    word64 rRxCount = 0;
+    word64 rTxPacketCount = 0;
+    word64 rRxPacketCount = 0;
+
+    if (ssh != NULL) {
+        rTxCount = ssh->txCount;
+        rRxCount = ssh->rxCount;
+        rTxPacketCount = ssh->txPacketCount;
+        rRxPacketCount = ssh->rxPacketCount;
+    }
+
+    if (txCount != NULL)
+        *txCount = rTxCount;
+    if (rxCount != NULL)
+        *rxCount = rRxCount;
+    if (txPacketCount != NULL)
+        *txPacketCount = rTxPacketCount;
+    if (rxPacketCount != NULL)
+        *rxPacketCount = rRxPacketCount;
+}
+
+
 int wolfSSH_KDF(byte hashId, byte keyId,
                 byte* key, word32 keySz,
                 const byte* k, word32 kSz,
@@ -2559,12 +3079,19 @@ int wolfSSH_worker(WOLFSSH* ssh, word32* channelId)
     if (ssh == NULL)
         ret = WS_BAD_ARGUMENT;
 
-    /* Attempt to send any data pending in the outputBuffer. */
+    /* Attempt to send any data pending in the outputBuffer, then the
+     * channel data waiting for the scheduler. */
     if (ret == WS_SUCCESS) {
         if (ssh->outputBuffer.length != 0)
             ret = wolfSSH_SendPacket(ssh);
     }
 
+    if (ret == WS_SUCCESS)
+        ret = SendScheduledChannelData(ssh);
+
+    if (ret == WS_SUCCESS)
+        ret = ChannelRateRelease(ssh);
+
     /* Attempt to receive data from the peer. */
     if (ret == WS_SUCCESS) {
         ret = DoReceive(ssh);
@@ -2592,6 +3119,94 @@ int wolfSSH_worker(WOLFSSH* ssh, word32* channelId)
 }
 
 
+/* Like wolfSSH_worker(), but keeps processing packets as long as complete
+ * ones are waiting in the input buffer, so a burst of packets takes one
+ * call instead of one per packet. Channel data is left in the channels'
+ * input buffers. The IDs of the channels that received data are stored,
+ * once each, in channelIds; on input channelIdsSz is the number of entries
+ * channelIds can hold, on output the number stored. Processing stops early
+ * when that list is full, or when any event other than plain channel data
+ * needs the application (extended data, channel close, rekeying, errors),
+ * and that status is returned. Otherwise returns WS_CHAN_RXD when any
+ * channel got data, or WS_SUCCESS. */
+int wolfSSH_worker_ex(WOLFSSH* ssh, word32* channelIds, word32* channelIdsSz)
+{
+    int ret = WS_SUCCESS;
+    word32 idCount = 0;
+    word32 idMax = 0;
+    word32 i;
+
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_worker_ex()");
+
+    if (ssh == NULL || channelIds == NULL || channelIdsSz == NULL
+            || *channelIdsSz == 0)
+        ret = WS_BAD_ARGUMENT;
+
+    if (ret == WS_SUCCESS) {
+        idMax = *channelIdsSz;
+
+        /* Attempt to send any data pending in the outputBuffer, then the
+         * channel data waiting for the scheduler. */
+        if (ssh->outputBuffer.length != 0)
+            ret = wolfSSH_SendPacket(ssh);
+        if (ret == WS_SUCCESS)
+            ret = SendScheduledChannelData(ssh);
+        if (ret == WS_SUCCESS)
+            ret = ChannelRateRelease(ssh);
+    }
+
+    /* The first pass may read from the peer, the rest only drain what is
+     * already buffered. */
+    while (ret == WS_SUCCESS) {
+        ret = DoReceive(ssh);
+
+        if (ret == WS_CHAN_RXD) {
+            for (i = 0; i < idCount; i++) {
+                if (channelIds[i] == ssh->lastRxId)
+                    break;
+            }
+            if (i == idCount)
+                channelIds[idCount++] = ssh->lastRxId;
+            ret = WS_SUCCESS;
+
+            if (idCount == idMax)
+                break;
+        }
+
+        if (ret == WS_SUCCESS && ssh->isKeying) {
+            ssh->error = WS_REKEYING;
+            ret = WS_REKEYING;
+        }
+
+        if (ret == WS_SUCCESS) {
+            ret = HaveInputPacket(ssh);
+            if (ret == 0)
+                break;
+            if (ret > 0)
+                ret = WS_SUCCESS;
+        }
+    }
+
+    /* A partial packet after some channel data isn't an error for the
+     * caller, the rest of it is read next time. */
+    if (ret == WS_WANT_READ || (ret == WS_FATAL_ERROR
+                && ssh->error == WS_WANT_READ)) {
+        if (idCount > 0)
+            ret = WS_SUCCESS;
+    }
+
+    if (ret == WS_SUCCESS && idCount > 0)
+        ret = WS_CHAN_RXD;
+
+    if (channelIdsSz != NULL)
+        *channelIdsSz = idCount;
+
+    WLOG(WS_LOG_DEBUG, "Leaving wolfSSH_worker_ex(), ret = %d, channels = %u",
+            ret, idCount);
+    return ret;
+}
+
+
 int wolfSSH_GetLastRxId(WOLFSSH* ssh, word32* channelId)
 {
     int ret = WS_SUCCESS;
@@ -2822,11 +3437,15 @@ static int _UpdateChannelWindow(WOLFSSH_CHANNEL* channel)
 
     inputBuffer = &channel->inputBuffer;
 
-    if ((inputBuffer->length > inputBuffer->bufferSz / 2) ||
+    if ((inputBuffer->length > channel->windowFullSz / 2) ||
          (channel->windowSz == 0)) {
 
         word32 usedSz = inputBuffer->length - inputBuffer->idx;
         word32 bytesToAdd = inputBuffer->idx;
+        word32 maxWindowSz = channel->ssh->ctx->maxWindowSz;
+        word32 oldSz = channel->windowFullSz;
+        word32 sessionRoom = MAX_SESSION_WINDOW_SZ -
+                min(channel->ssh->windowGrownSz, MAX_SESSION_WINDOW_SZ);
 
         WLOG(WS_LOG_DEBUG, "Making more room: %u", usedSz);
         if (usedSz) {
@@ -2834,17 +3453,46 @@ static int _UpdateChannelWindow(WOLFSSH_CHANNEL* channel)
             WMEMMOVE(inputBuffer->buffer,
                      inputBuffer->buffer + bytesToAdd, usedSz);
         }
+        inputBuffer->length = usedSz;
+        inputBuffer->idx = 0;
 
-        sendResult = SendChannelWindowAdjust(channel->ssh, channel->channel,
-                                             bytesToAdd);
+        /* A drained channel keeps a buffer of the first allocation's size
+         * for the next round; a larger one goes back, and is grown again
+         * when the peer sends more. */
+        if (usedSz == 0)
+            ShrinkBuffer(inputBuffer, 0);
+
+        /* Auto-tune: the application is keeping up but the peer has
+         * nearly used up the window before this adjust could reach it,
+         * so the window, not the reader, limits the transfer. Double the
+         * window up to the context's ceiling, as far as the session's
+         * total and the context's budget allow. */
+        if (oldSz < maxWindowSz && sessionRoom > 0 &&
+                channel->windowSz < oldSz / 4 && usedSz < oldSz / 4) {
+            word32 newSz = (oldSz > maxWindowSz / 2) ? maxWindowSz : oldSz * 2;
+
+            if (newSz - oldSz > sessionRoom)
+                newSz = oldSz + sessionRoom;
+            if (ChannelGrowWindow(channel, newSz) == WS_SUCCESS) {
+                bytesToAdd += channel->windowFullSz - oldSz;
+            }
+        }
 
-        WLOG(WS_LOG_INFO, "  bytesToAdd = %u", bytesToAdd);
-        WLOG(WS_LOG_INFO, "  windowSz = %u", channel->windowSz);
-        channel->windowSz += bytesToAdd;
-        WLOG(WS_LOG_INFO, "  update windowSz = %u", channel->windowSz);
+        /* The receive limits may hold some of it back, it is given with a
+         * later adjust. */
+        channel->windowConsumed += bytesToAdd;
+        bytesToAdd = ChannelRateGrant(channel, channel->windowConsumed);
+        channel->windowConsumed -= bytesToAdd;
 
-        inputBuffer->length = usedSz;
-        inputBuffer->idx = 0;
+        if (bytesToAdd > 0) {
+            sendResult = SendChannelWindowAdjust(channel->ssh,
+                    channel->channel, bytesToAdd);
+
+            WLOG(WS_LOG_INFO, "  bytesToAdd = %u", bytesToAdd);
+            WLOG(WS_LOG_INFO, "  windowSz = %u", channel->windowSz);
+            channel->windowSz += bytesToAdd;
+            WLOG(WS_LOG_INFO, "  update windowSz = %u", channel->windowSz);
+        }
     }
 
     return sendResult;
@@ -3067,6 +3715,9 @@ static const char* CipherNameForId(byte id)
 
         case ID_AES256_GCM:
             return "AES-256 GCM";
+
+        case ID_CHACHA20_POLY1305:
+            return "ChaCha20-Poly1305";
     }
 
     return "";
@@ -3087,6 +3738,12 @@ static const char* MacNameForId(byte macid, byte cipherid)
 
             case ID_HMAC_SHA2_512:
                 return "HMAC-SHA-512";
+
+            case ID_HMAC_SHA2_256_ETM:
+                return "HMAC-SHA-256 (in ETM mode)";
+
+            case ID_HMAC_SHA2_512_ETM:
+                return "HMAC-SHA-512 (in ETM mode)";
         }
     }
     else {
@@ -3099,6 +3756,9 @@ static const char* MacNameForId(byte macid, byte cipherid)
 
             case ID_AES256_GCM:
                 return "AES256 GCM (in ETM mode)";
+
+            case ID_CHACHA20_POLY1305:
+                return "Poly1305 (in ETM mode)";
         }
     }
 
@@ -3247,6 +3907,47 @@ const char* wolfSSH_ChannelGetSessionCommand(const WOLFSSH_CHANNEL* channel)
 }
 
 
+/* Sets the channel's output class for the scheduler, and for the bulk
+ * class its weight, 0 for the default of 1. A new class applies the next
+ * time the channel has data waiting. */
+int wolfSSH_ChannelSetPriority(WOLFSSH_CHANNEL* channel, byte prio,
+        word32 weight)
+{
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_ChannelSetPriority()");
+
+    if (channel == NULL || prio > WOLFSSH_CHANNEL_PRIO_LATENCY
+            || weight > WOLFSSH_SCHED_MAX_WEIGHT)
+        return WS_BAD_ARGUMENT;
+
+    channel->schedPrio = prio;
+    channel->schedWeight = weight;
+
+    return WS_SUCCESS;
+}
+
+
+/* Sets the channel's own limit, NULL for none. The session's limit still
+ * applies on top of it. */
+int wolfSSH_ChannelSetRateLimit(WOLFSSH_CHANNEL* channel,
+        const WS_RateLimit* limit)
+{
+    WS_RateLimit none;
+
+    WLOG(WS_LOG_DEBUG, "Entering wolfSSH_ChannelSetRateLimit()");
+
+    if (channel == NULL || channel->ssh == NULL)
+        return WS_BAD_ARGUMENT;
+
+    WMEMSET(&none, 0, sizeof(none));
+    RateLimitInit(&channel->txRate, &channel->rxRate,
+            (limit != NULL) ? limit : &none);
+    if (IsRateLimit(limit))
+        channel->ssh->rateLimited = 1;
+
+    return WS_SUCCESS;
+}
+
+
 int wolfSSH_CTX_SetChannelOpenCb(WOLFSSH_CTX* ctx, WS_CallbackChannelOpen cb)
 {
     int ret = WS_SSH_CTX_NULL_E;
@@ -3443,6 +4144,47 @@ void* wolfSSH_GetChannelCloseCtx(WOLFSSH* ssh)
 }
 
 
+/* Sets the callback that gets channel data straight from the decrypted
+ * packet. Channels whose data wolfSSH reads itself, SFTP and SCP sessions
+ * and agent channels, keep using the channel's input buffer. */
+int wolfSSH_CTX_SetChannelDataCb(WOLFSSH_CTX* ctx, WS_CallbackChannelData cb)
+{
+    int ret = WS_SSH_CTX_NULL_E;
+
+    if (ctx != NULL) {
+        ctx->channelDataCb = cb;
+        ret = WS_SUCCESS;
+    }
+
+    return ret;
+}
+
+
+int wolfSSH_SetChannelDataCtx(WOLFSSH* ssh, void* ctx)
+{
+    int ret = WS_SSH_NULL_E;
+
+    if (ssh != NULL) {
+        ssh->channelDataCtx = ctx;
+        ret = WS_SUCCESS;
+    }
+
+    return ret;
+}
+
+
+void* wolfSSH_GetChannelDataCtx(WOLFSSH* ssh)
+{
+    void* ctx = NULL;
+
+    if (ssh != NULL) {
+        ctx = ssh->channelDataCtx;
+    }
+
+    return ctx;
+}
+
+
 #if (defined(WOLFSSH_SFTP) || defined(WOLFSSH_SCP)) && \
     !defined(NO_WOLFSSH_SERVER)
 
@@ -602,8 +602,15 @@ int DoScpSource(WOLFSSH* ssh)
                                           ssh->scpBufferedSz);
                 if (ret == WS_WINDOW_FULL || ret == WS_REKEYING) {
                     ret = wolfSSH_worker(ssh, NULL);
-                    if (ret == WS_SUCCESS || ssh->error == WS_WANT_READ)
+                    if (ret == WS_SUCCESS)
                         continue;
+                    if (ssh->error == WS_WANT_READ) {
+                        /* Nothing from the peer yet, or the rate limits
+                         * hold the send back; let the caller wait instead
+                         * of spinning here. The state is kept. */
+                        ret = WS_WANT_READ;
+                        break;
+                    }
                 }
                 if (ret == WS_EXTDATA) {
                     _DumpExtendedData(ssh);
@@ -28,6 +28,9 @@
     #include <wolfssl/options.h>
 #endif
 #include <wolfssl/wolfcrypt/wc_port.h>
+#ifdef WOLF_CRYPTO_CB
+    #include <wolfssl/wolfcrypt/cryptocb.h>
+#endif
 #include <wolfssh/port.h>
 
 #include <stdio.h>
@@ -226,6 +229,141 @@ static void test_wolfSSH_set_fd(void)
 }
 
 
+static void test_wolfSSH_SetReadAhead(void)
+{
+    WOLFSSH_CTX* ctx;
+    WOLFSSH* ssh;
+
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_SERVER, NULL));
+
+    AssertIntNE(WS_SUCCESS, wolfSSH_CTX_SetReadAhead(NULL, 64 * 1024));
+    AssertIntNE(WS_SUCCESS,
+            wolfSSH_CTX_SetReadAhead(ctx, (1024 * 1024) + 1));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetReadAhead(ctx, 64 * 1024));
+
+    /* The session picks up the context's setting and can override it. */
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+    AssertIntEQ(64 * 1024, wolfSSH_GetReadAhead(ssh));
+    AssertIntNE(WS_SUCCESS, wolfSSH_SetReadAhead(NULL, 0));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetReadAhead(ssh, 256 * 1024));
+    AssertIntEQ(256 * 1024, wolfSSH_GetReadAhead(ssh));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetReadAhead(ssh, 0));
+    AssertIntEQ(0, wolfSSH_GetReadAhead(ssh));
+    AssertIntEQ(0, wolfSSH_GetReadAhead(NULL));
+
+    wolfSSH_free(ssh);
+    wolfSSH_CTX_free(ctx);
+}
+
+
+static void test_wolfSSH_worker_ex(void)
+{
+    WOLFSSH_CTX* ctx;
+    WOLFSSH* ssh;
+    word32 ids[4];
+    word32 idsSz;
+
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_SERVER, NULL));
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+
+    idsSz = sizeof(ids) / sizeof(ids[0]);
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_worker_ex(NULL, ids, &idsSz));
+    AssertIntEQ(0, idsSz);
+    idsSz = sizeof(ids) / sizeof(ids[0]);
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_worker_ex(ssh, NULL, &idsSz));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_worker_ex(ssh, ids, NULL));
+    idsSz = 0;
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_worker_ex(ssh, ids, &idsSz));
+
+    wolfSSH_free(ssh);
+    wolfSSH_CTX_free(ctx);
+}
+
+
+static void test_wolfSSH_Cork(void)
+{
+    WOLFSSH_CTX* ctx;
+    WOLFSSH* ssh;
+
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_CLIENT, NULL));
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_Cork(NULL));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_Uncork(NULL));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_SetCorkSize(NULL, 1024));
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetCorkSize(ssh, 1024));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetCorkSize(ssh, 0));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_Cork(ssh));
+    /* Nothing is pending, so uncorking doesn't touch the I/O callback. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_Uncork(ssh));
+
+    wolfSSH_free(ssh);
+    wolfSSH_CTX_free(ctx);
+}
+
+
+static void test_wolfSSH_KexKeyPool(void)
+{
+    WOLFSSH_CTX* ctx;
+
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetKexKeyPool(NULL, 1));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_FillKexKeyPool(NULL));
+
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_CLIENT, NULL));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetKexKeyPool(ctx, 1));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_FillKexKeyPool(ctx));
+    wolfSSH_CTX_free(ctx);
+
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_SERVER, NULL));
+    /* An empty pool fills as a no-op. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_FillKexKeyPool(ctx));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetKexKeyPool(ctx, 0xFFFFFFFF));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetKexKeyPool(ctx, 1));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_FillKexKeyPool(ctx));
+    /* Already full, nothing more to generate. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_FillKexKeyPool(ctx));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetKexKeyPool(ctx, 0));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetKexKeyPool(ctx, 1));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_FillKexKeyPool(ctx));
+    /* Pooled keys are released with the CTX. */
+    wolfSSH_CTX_free(ctx);
+}
+
+
+static int test_SignOffloadCb(WOLFSSH* ssh, void* ctx)
+{
+    (void)ssh;
+    (void)ctx;
+
+    return WS_SUCCESS;
+}
+
+
+static void test_wolfSSH_SignOffload(void)
+{
+    WOLFSSH_CTX* ctx;
+    WOLFSSH* ssh;
+    int offloadCtx = 0;
+
+    wolfSSH_CTX_SetSignOffloadCb(NULL, test_SignOffloadCb);
+    wolfSSH_SetSignOffloadCtx(NULL, &offloadCtx);
+    AssertNull(wolfSSH_GetSignOffloadCtx(NULL));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_SignOffload(NULL));
+
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_SERVER, NULL));
+    wolfSSH_CTX_SetSignOffloadCb(ctx, test_SignOffloadCb);
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+    AssertNull(wolfSSH_GetSignOffloadCtx(ssh));
+    wolfSSH_SetSignOffloadCtx(ssh, &offloadCtx);
+    AssertPtrEq(wolfSSH_GetSignOffloadCtx(ssh), &offloadCtx);
+    /* Nothing has been offloaded yet. */
+    AssertIntEQ(WS_INVALID_STATE_E, wolfSSH_SignOffload(ssh));
+    wolfSSH_free(ssh);
+    wolfSSH_CTX_free(ctx);
+}
+
+
 static void test_wolfSSH_SetUsername(void)
 {
 #ifndef WOLFSSH_NO_CLIENT
@@ -381,6 +519,7 @@ static void test_wolfSSH_CTX_UsePrivateKey_buffer(void)
     AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_SERVER, NULL));
     for (i = 0; i < WOLFSSH_MAX_PVT_KEYS; i++) {
         AssertNull(ctx->privateKey[i].key);
+        AssertNull(ctx->privateKey[i].hostKeys);
         AssertIntEQ(0, ctx->privateKey[i].keySz);
         AssertIntEQ(ID_NONE, ctx->privateKey[i].publicKeyFmt);
     }
@@ -434,114 +573,2194 @@ static void test_wolfSSH_CTX_UsePrivateKey_buffer(void)
     lastKey = ctx->privateKey[ctx->privateKeyCount].key;
     lastKeySz = ctx->privateKey[ctx->privateKeyCount].keySz;
 
-    AssertIntEQ(WS_SUCCESS,
-        wolfSSH_CTX_UsePrivateKey_buffer(ctx, eccKey, eccKeySz,
-                                         TEST_GOOD_FORMAT_ASN1));
-    AssertIntEQ(1, ctx->privateKeyCount);
-    AssertNotNull(ctx->privateKey[0].key);
-    AssertIntNE(0, ctx->privateKey[0].keySz);
-    AssertIntEQ(serverKeyEccCurveId, ctx->privateKey[0].publicKeyFmt);
+    AssertIntEQ(WS_SUCCESS,
+        wolfSSH_CTX_UsePrivateKey_buffer(ctx, eccKey, eccKeySz,
+                                         TEST_GOOD_FORMAT_ASN1));
+    AssertIntEQ(1, ctx->privateKeyCount);
+    AssertNotNull(ctx->privateKey[0].key);
+    AssertIntNE(0, ctx->privateKey[0].keySz);
+    AssertIntEQ(serverKeyEccCurveId, ctx->privateKey[0].publicKeyFmt);
+#ifndef WOLFSSH_NO_HOST_KEY_CACHE
+    AssertNotNull(ctx->privateKey[0].hostKeys);
+#endif
+
+    AssertIntEQ(0, (lastKey == ctx->privateKey[0].key));
+    AssertIntNE(lastKeySz, ctx->privateKey[0].keySz);
+#endif
+
+#ifndef WOLFSSH_NO_SSH_RSA_SHA1
+    lastKey = ctx->privateKey[ctx->privateKeyCount].key;
+    lastKeySz = ctx->privateKey[ctx->privateKeyCount].keySz;
+
+    AssertIntEQ(WS_SUCCESS,
+        wolfSSH_CTX_UsePrivateKey_buffer(ctx, rsaKey, rsaKeySz,
+                                         TEST_GOOD_FORMAT_ASN1));
+    AssertIntNE(0, ctx->privateKeyCount);
+    AssertNotNull(ctx->privateKey[0].key);
+    AssertIntNE(0, ctx->privateKey[0].keySz);
+#ifndef WOLFSSH_NO_HOST_KEY_CACHE
+    AssertNotNull(ctx->privateKey[ctx->privateKeyCount - 1].hostKeys);
+#endif
+
+    AssertIntEQ(0, (lastKey == ctx->privateKey[0].key));
+    AssertIntNE(lastKeySz, ctx->privateKey[0].keySz);
+#endif
+
+    /* Add the same keys again. This should succeed. */
+#if !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP256) || \
+    !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP384) || \
+    !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP521)
+    AssertIntEQ(WS_SUCCESS,
+        wolfSSH_CTX_UsePrivateKey_buffer(ctx, eccKey, eccKeySz,
+                                         TEST_GOOD_FORMAT_ASN1));
+#endif
+#ifndef WOLFSSH_NO_SSH_RSA_SHA1
+    AssertIntEQ(WS_SUCCESS,
+        wolfSSH_CTX_UsePrivateKey_buffer(ctx, rsaKey, rsaKeySz,
+                                         TEST_GOOD_FORMAT_ASN1));
+#endif
+
+    wolfSSH_CTX_free(ctx);
+#if !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP256) || \
+    !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP384) || \
+    !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP521)
+    FreeBins(eccKey, NULL, NULL, NULL);
+#endif
+#ifndef WOLFSSH_NO_RSA
+    FreeBins(rsaKey, NULL, NULL, NULL);
+#endif
+#endif /* WOLFSSH_NO_SERVER */
+}
+
+
+#ifdef WOLFSSH_CERTS
+static int load_file(const char* filename, byte** buf, word32* bufSz)
+{
+    FILE* f = NULL;
+    int ret = 0;
+
+    if (filename == NULL || buf == NULL || bufSz == NULL)
+        ret = -1;
+
+    if (ret == 0) {
+        f = fopen(filename, "rb");
+        if (f == NULL)
+            ret = -2;
+    }
+
+    if (ret == 0) {
+        ret = fseek(f, 0, XSEEK_END);
+        if (ret < 0)
+            ret = -3;
+    }
+
+    if (ret == 0) {
+        long sz = ftell(f);
+        if (sz < 0)
+            ret = -4;
+        else
+            *bufSz = (word32)sz;
+    }
+
+    if (ret == 0) {
+        rewind(f);
+        *buf = (byte*)malloc(*bufSz);
+        if (*buf == NULL)
+            ret = -5;
+    }
+
+    if (ret == 0) {
+        size_t readSz;
+        readSz = fread(*buf, 1, *bufSz, f);
+        if (readSz < *bufSz)
+            ret = -6;
+    }
+
+    if (f != NULL) {
+        ret = fclose(f);
+        if (ret < 0)
+            ret = -7;
+    }
+
+    return ret;
+}
+#endif
+
+
+#if !defined(NO_WOLFSSH_SERVER) && !defined(NO_WOLFSSH_CLIENT) && \
+    !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP256)
+
+#define TEST_PIPE_HANDSHAKE
+#define TEST_PIPE_SZ (64 * 1024)
+
+typedef struct TestPipe {
+    byte buf[TEST_PIPE_SZ];
+    word32 sz;
+    word32 reads;  /* receive callback calls that returned data */
+    word32 writes; /* send callback calls that took data */
+} TestPipe;
+
+typedef struct TestLink {
+    TestPipe* in;
+    TestPipe* out;
+} TestLink;
+
+static TestPipe testClientToServer;
+static TestPipe testServerToClient;
+
+
+static int test_PipeRecv(WOLFSSH* ssh, void* data, word32 sz, void* ctx)
+{
+    TestPipe* pipe = ((TestLink*)ctx)->in;
+
+    (void)ssh;
+
+    if (pipe->sz == 0)
+        return WS_CBIO_ERR_WANT_READ;
+    if (sz > pipe->sz)
+        sz = pipe->sz;
+    WMEMCPY(data, pipe->buf, sz);
+    pipe->sz -= sz;
+    WMEMMOVE(pipe->buf, pipe->buf + sz, pipe->sz);
+    pipe->reads++;
+
+    return (int)sz;
+}
+
+
+static int test_PipeSend(WOLFSSH* ssh, void* data, word32 sz, void* ctx)
+{
+    TestPipe* pipe = ((TestLink*)ctx)->out;
+
+    (void)ssh;
+
+    if (pipe->sz == TEST_PIPE_SZ)
+        return WS_CBIO_ERR_WANT_WRITE;
+    if (sz > TEST_PIPE_SZ - pipe->sz)
+        sz = TEST_PIPE_SZ - pipe->sz;
+    WMEMCPY(pipe->buf + pipe->sz, data, sz);
+    pipe->sz += sz;
+    pipe->writes++;
+
+    return (int)sz;
+}
+
+
+static int test_PipeUserAuth(byte authType, WS_UserAuthData* authData,
+        void* ctx)
+{
+    static char password[] = "upthehill";
+
+    (void)ctx;
+
+    if (authType != WOLFSSH_USERAUTH_PASSWORD)
+        return WOLFSSH_USERAUTH_INVALID_AUTHTYPE;
+    if (authData->sf.password.password == NULL) {
+        authData->sf.password.password = (byte*)password;
+        authData->sf.password.passwordSz = (word32)WSTRLEN(password);
+    }
+
+    return WOLFSSH_USERAUTH_SUCCESS;
+}
+
+
+static TestLink testServerLink = { &testClientToServer, &testServerToClient };
+static TestLink testClientLink = { &testServerToClient, &testClientToServer };
+
+
+/* Creates a server CTX with the ECC test host key and a client CTX, both
+ * set up to talk over the memory pipes. */
+static void test_PipeCtxNew(WOLFSSH_CTX** serverCtx, WOLFSSH_CTX** clientCtx)
+{
+    byte* key;
+    word32 keySz;
+
+    AssertIntEQ(0,
+            ConvertHexToBin(serverKeyEccDer, &key, &keySz,
+                    NULL, NULL, NULL,
+                    NULL, NULL, NULL,
+                    NULL, NULL, NULL));
+
+    AssertNotNull(*serverCtx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_SERVER, NULL));
+    AssertNotNull(*clientCtx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_CLIENT, NULL));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_UsePrivateKey_buffer(*serverCtx,
+                key, keySz, WOLFSSH_FORMAT_ASN1));
+    FreeBins(key, NULL, NULL, NULL);
+
+    wolfSSH_SetIORecv(*serverCtx, test_PipeRecv);
+    wolfSSH_SetIOSend(*serverCtx, test_PipeSend);
+    wolfSSH_SetIORecv(*clientCtx, test_PipeRecv);
+    wolfSSH_SetIOSend(*clientCtx, test_PipeSend);
+    wolfSSH_SetUserAuth(*serverCtx, test_PipeUserAuth);
+    wolfSSH_SetUserAuth(*clientCtx, test_PipeUserAuth);
+}
+
+
+static void test_PipeCtxFree(WOLFSSH_CTX* serverCtx, WOLFSSH_CTX* clientCtx)
+{
+    wolfSSH_CTX_free(clientCtx);
+    wolfSSH_CTX_free(serverCtx);
+}
+
+
+/* Connects the two sessions over memory. */
+static int test_PipeConnect(WOLFSSH* server, WOLFSSH* client)
+{
+    int serverRet = WS_FATAL_ERROR;
+    int clientRet = WS_FATAL_ERROR;
+    int err;
+    int rounds = 0;
+    int ret = WS_SUCCESS;
+
+    testClientToServer.sz = 0;
+    testServerToClient.sz = 0;
+
+    wolfSSH_SetIOReadCtx(server, &testServerLink);
+    wolfSSH_SetIOWriteCtx(server, &testServerLink);
+    wolfSSH_SetIOReadCtx(client, &testClientLink);
+    wolfSSH_SetIOWriteCtx(client, &testClientLink);
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetUsername(client, "jill"));
+
+    while (ret == WS_SUCCESS
+            && (serverRet != WS_SUCCESS || clientRet != WS_SUCCESS)) {
+        if (clientRet != WS_SUCCESS) {
+            clientRet = wolfSSH_connect(client);
+            err = wolfSSH_get_error(client);
+            if (clientRet != WS_SUCCESS
+                    && err != WS_WANT_READ && err != WS_WANT_WRITE)
+                ret = err;
+        }
+        if (ret == WS_SUCCESS && serverRet != WS_SUCCESS) {
+            serverRet = wolfSSH_accept(server);
+            err = wolfSSH_get_error(server);
+            if (serverRet != WS_SUCCESS
+                    && err != WS_WANT_READ && err != WS_WANT_WRITE)
+                ret = err;
+        }
+        if (++rounds > 1000)
+            ret = WS_FATAL_ERROR;
+    }
+
+    return ret;
+}
+
+
+/* Runs a handshake between the two CTXs over memory. The server session
+ * uses devId. */
+static int test_PipeHandshake(WOLFSSH_CTX* serverCtx, WOLFSSH_CTX* clientCtx,
+        int devId)
+{
+    WOLFSSH* server;
+    WOLFSSH* client;
+    int ret;
+
+    AssertNotNull(server = wolfSSH_new(serverCtx));
+    AssertNotNull(client = wolfSSH_new(clientCtx));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetDevId(server, devId));
+
+    ret = test_PipeConnect(server, client);
+
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+
+    return ret;
+}
+
+
+typedef void (*TestPipeSetup)(WOLFSSH_CTX* serverCtx, WOLFSSH_CTX* clientCtx);
+typedef void (*TestPipeBody)(WOLFSSH* server, WOLFSSH* client);
+
+/* Makes a pair of pipe CTXs, lets setup configure them, connects a server
+ * and a client session, and runs body on the connected sessions. Either
+ * callback may be NULL. */
+static void test_PipeRun(TestPipeSetup setup, TestPipeBody body)
+{
+    WOLFSSH_CTX* serverCtx;
+    WOLFSSH_CTX* clientCtx;
+    WOLFSSH* server;
+    WOLFSSH* client;
+
+    test_PipeCtxNew(&serverCtx, &clientCtx);
+    if (setup != NULL)
+        setup(serverCtx, clientCtx);
+    AssertNotNull(server = wolfSSH_new(serverCtx));
+    AssertNotNull(client = wolfSSH_new(clientCtx));
+    AssertIntEQ(WS_SUCCESS, test_PipeConnect(server, client));
+
+    if (body != NULL)
+        body(server, client);
+
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+    test_PipeCtxFree(serverCtx, clientCtx);
+}
+
+#endif /* TEST_PIPE_HANDSHAKE */
+
+
+#if defined(WOLF_CRYPTO_CB) && defined(TEST_PIPE_HANDSHAKE)
+
+#define TEST_DEVID 7
+
+typedef struct TestCryptoCbCounts {
+    int pk;
+    int hash;
+    int hmac;
+    int cipher;
+} TestCryptoCbCounts;
+
+
+/* Counts what wolfCrypt offers the device, then lets it fall back to
+ * software. */
+static int test_CryptoCb(int devId, wc_CryptoInfo* info, void* ctx)
+{
+    TestCryptoCbCounts* counts = (TestCryptoCbCounts*)ctx;
+
+    (void)devId;
+
+    switch (info->algo_type) {
+        case WC_ALGO_TYPE_PK:
+            counts->pk++;
+            break;
+        case WC_ALGO_TYPE_HASH:
+            counts->hash++;
+            break;
+        case WC_ALGO_TYPE_HMAC:
+            counts->hmac++;
+            break;
+        case WC_ALGO_TYPE_CIPHER:
+            counts->cipher++;
+            break;
+        default:
+            break;
+    }
+
+    return CRYPTOCB_UNAVAILABLE;
+}
+
+
+/* Set after the key is loaded, the cached host key is moved over. */
+static void test_DevIdSetup(WOLFSSH_CTX* serverCtx, WOLFSSH_CTX* clientCtx)
+{
+    (void)clientCtx;
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetDevId(serverCtx, TEST_DEVID));
+}
+
+
+static void test_wolfSSH_DevId_CryptoCb(void)
+{
+    TestCryptoCbCounts counts;
+
+    WMEMSET(&counts, 0, sizeof(counts));
+    AssertIntEQ(0, wc_CryptoCb_RegisterDevice(TEST_DEVID,
+                test_CryptoCb, &counts));
+
+    /* Sessions on the software device offload nothing. */
+    test_PipeRun(NULL, NULL);
+    AssertIntEQ(0, counts.pk + counts.hash + counts.hmac + counts.cipher);
+
+    /* The server's KEX, signature, exchange hash, and transport reach the
+     * device. The client stays in software. */
+    test_PipeRun(test_DevIdSetup, NULL);
+    AssertIntGT(counts.pk, 0);
+    AssertIntGT(counts.hash, 0);
+    AssertIntGT(counts.hmac + counts.cipher, 0);
+
+    wc_CryptoCb_UnRegisterDevice(TEST_DEVID);
+}
+
+#endif /* WOLF_CRYPTO_CB */
+
+
+static void test_wolfSSH_DevId(void)
+{
+    WOLFSSH_CTX* ctx;
+    WOLFSSH* ssh;
+
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetDevId(NULL, 1));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_SetDevId(NULL, 1));
+    AssertIntEQ(INVALID_DEVID, wolfSSH_GetDevId(NULL));
+
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_SERVER, NULL));
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+    AssertIntEQ(INVALID_DEVID, wolfSSH_GetDevId(ssh));
+    wolfSSH_free(ssh);
+
+    /* Sessions start on the CTX's device and may override it. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetDevId(ctx, 1));
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+    AssertIntEQ(1, wolfSSH_GetDevId(ssh));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetDevId(ssh, INVALID_DEVID));
+    AssertIntEQ(INVALID_DEVID, wolfSSH_GetDevId(ssh));
+    wolfSSH_free(ssh);
+    wolfSSH_CTX_free(ctx);
+}
+
+
+#if defined(TEST_PIPE_HANDSHAKE) && \
+    !defined(WOLFSSH_NO_ECDH_SHA2_NISTP256) && \
+    !defined(WOLFSSH_NO_ECDH_SHA2_NISTP384)
+/* Runs a handshake with the client's guess on or off and returns the
+ * number of packets the client sent. */
+static word32 test_KexGuessPackets(WOLFSSH_CTX* serverCtx,
+        WOLFSSH_CTX* clientCtx, byte guess)
+{
+    WOLFSSH* server;
+    WOLFSSH* client;
+    word32 packets;
+
+    AssertNotNull(server = wolfSSH_new(serverCtx));
+    AssertNotNull(client = wolfSSH_new(clientCtx));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetKexGuess(client, guess));
+    AssertIntEQ(WS_SUCCESS, test_PipeConnect(server, client));
+    packets = client->seq;
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+
+    return packets;
+}
+
+
+/* A guess that matches is used, the client sends the KEX init only once.
+ * One that doesn't is dropped by the server, and the client sends the KEX
+ * init again, one packet more than without guessing. */
+static void test_wolfSSH_KexGuess_Handshake(void)
+{
+    WOLFSSH_CTX* serverCtx;
+    WOLFSSH_CTX* clientCtx;
+    word32 plain;
+
+    test_PipeCtxNew(&serverCtx, &clientCtx);
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetAlgoListKex(serverCtx,
+                "ecdh-sha2-nistp256,ecdh-sha2-nistp384"));
+
+    /* Both sides prefer the same algorithms, the guess is answered. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetAlgoListKex(clientCtx,
+                "ecdh-sha2-nistp256,ecdh-sha2-nistp384"));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetAlgoListKey(clientCtx,
+                "ecdsa-sha2-nistp256"));
+    plain = test_KexGuessPackets(serverCtx, clientCtx, 0);
+    AssertIntGT(plain, 0);
+    AssertIntEQ(plain, test_KexGuessPackets(serverCtx, clientCtx, 1));
+
+    /* The client's first KEX algorithm is negotiated, but it isn't the
+     * server's first, so the server drops the guess and the client sends
+     * it again. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetAlgoListKex(clientCtx,
+                "ecdh-sha2-nistp384,ecdh-sha2-nistp256"));
+    plain = test_KexGuessPackets(serverCtx, clientCtx, 0);
+    AssertIntEQ(plain + 1, test_KexGuessPackets(serverCtx, clientCtx, 1));
+
+    /* Same KEX algorithm first, different host key algorithm first. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetAlgoListKex(clientCtx,
+                "ecdh-sha2-nistp256,ecdh-sha2-nistp384"));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetAlgoListKey(clientCtx,
+                "rsa-sha2-256,ecdsa-sha2-nistp256"));
+    plain = test_KexGuessPackets(serverCtx, clientCtx, 0);
+    AssertIntEQ(plain + 1, test_KexGuessPackets(serverCtx, clientCtx, 1));
+
+    test_PipeCtxFree(serverCtx, clientCtx);
+}
+#endif
+
+
+static void test_wolfSSH_KexGuess(void)
+{
+    WOLFSSH_CTX* ctx;
+    WOLFSSH* ssh;
+
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetKexGuess(NULL, 1));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_SetKexGuess(NULL, 1));
+
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_CLIENT, NULL));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetKexGuess(ctx, 1));
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+    AssertIntEQ(1, ssh->kexGuess);
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetKexGuess(ssh, 0));
+    AssertIntEQ(0, ssh->kexGuess);
+    wolfSSH_free(ssh);
+    wolfSSH_CTX_free(ctx);
+
+#if defined(TEST_PIPE_HANDSHAKE) && \
+    !defined(WOLFSSH_NO_ECDH_SHA2_NISTP256) && \
+    !defined(WOLFSSH_NO_ECDH_SHA2_NISTP384)
+    test_wolfSSH_KexGuess_Handshake();
+#endif
+}
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+static void test_wolfSSH_ConnectPipeline_PublicKey(void);
+
+
+static void test_wolfSSH_ConnectPipeline_Handshake(void)
+{
+    WOLFSSH_CTX* serverCtx;
+    WOLFSSH_CTX* clientCtx;
+
+    test_PipeCtxNew(&serverCtx, &clientCtx);
+
+    /* The pipelined "none" request is rejected, then password is tried. */
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_CTX_SetConnectPipeline(clientCtx, WOLFSSH_USERAUTH_NONE));
+    AssertIntEQ(WS_SUCCESS,
+            test_PipeHandshake(serverCtx, clientCtx, INVALID_DEVID));
+
+    /* The pipelined password request is accepted directly. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetConnectPipeline(clientCtx,
+                WOLFSSH_USERAUTH_PASSWORD));
+    AssertIntEQ(WS_SUCCESS,
+            test_PipeHandshake(serverCtx, clientCtx, INVALID_DEVID));
+
+    /* Pipelining together with a guessed first KEX packet. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetKexGuess(clientCtx, 1));
+    AssertIntEQ(WS_SUCCESS,
+            test_PipeHandshake(serverCtx, clientCtx, INVALID_DEVID));
+
+    test_PipeCtxFree(serverCtx, clientCtx);
+
+    /* The pipelined public key request is accepted directly. */
+    test_wolfSSH_ConnectPipeline_PublicKey();
+}
+#endif
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+/* Channel data sent while a rekey is running is accepted and delivered
+ * once the new keys are in use. */
+static void test_RekeyQueueRun(WOLFSSH* server, WOLFSSH* client)
+{
+    byte msg[] = "sent during the rekey";
+    byte extMsg[] = "stderr during the rekey";
+    byte rx[sizeof(msg)];
+    byte extRx[sizeof(extMsg)];
+    word32 channelId;
+    int ret = WS_SUCCESS;
+    int rounds;
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_TriggerKeyExchange(client));
+    AssertIntEQ(1, client->isKeying);
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    AssertIntEQ((int)sizeof(extMsg),
+            wolfSSH_extended_data_send(client, extMsg,
+                    (word32)sizeof(extMsg)));
+    AssertIntGT(client->rekeyQueue.length, 0);
+
+    for (rounds = 0; ret != WS_CHAN_RXD && rounds < 100; rounds++) {
+        wolfSSH_worker(client, NULL);
+        ret = wolfSSH_worker(server, &channelId);
+    }
+    AssertIntEQ(WS_CHAN_RXD, ret);
+    AssertIntEQ(0, client->isKeying);
+    AssertIntEQ(0, server->isKeying);
+    AssertIntEQ(0, client->rekeyQueue.length);
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_read(server, rx, (word32)sizeof(rx)));
+    AssertIntEQ(0, WMEMCMP(rx, msg, sizeof(msg)));
+
+    for (rounds = 0; ret != WS_EXTDATA && rounds < 100; rounds++)
+        ret = wolfSSH_worker(server, &channelId);
+    AssertIntEQ(WS_EXTDATA, ret);
+    AssertIntEQ((int)sizeof(extMsg),
+            wolfSSH_extended_data_read(server, extRx, (word32)sizeof(extRx)));
+    AssertIntEQ(0, WMEMCMP(extRx, extMsg, sizeof(extMsg)));
+}
+
+
+static void test_wolfSSH_RekeyQueue(void)
+{
+    test_PipeRun(NULL, test_RekeyQueueRun);
+}
+#endif
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+/* The exit status, EOF and CLOSE sent during a rekey wait behind the
+ * channel data sent before them, and all arrive in order. A full window
+ * while keying is still reported as a full window. With the scheduler on,
+ * the data waiting in the channel moves to the rekey queue ahead of them. */
+static void test_RekeyQueueClose(WOLFSSH* server, WOLFSSH* client,
+        byte sched)
+{
+    byte msg[] = "sent before the exit";
+    byte rx[sizeof(msg)];
+    word32 channelId;
+    word32 windowSz;
+    int ret = WS_SUCCESS;
+    int rounds;
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetChannelScheduler(server, sched));
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_TriggerKeyExchange(server));
+    AssertIntEQ(1, server->isKeying);
+
+    windowSz = server->channelList->peerWindowSz;
+    server->channelList->peerWindowSz = 0;
+    AssertIntEQ(WS_WINDOW_FULL,
+            wolfSSH_stream_send(server, msg, (word32)sizeof(msg)));
+    server->channelList->peerWindowSz = windowSz;
+
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_send(server, msg, (word32)sizeof(msg)));
+    if (sched) {
+        AssertIntEQ(sizeof(msg), server->schedQueuedSz);
+        AssertIntEQ(0, server->rekeyQueue.length);
+    }
+    AssertIntEQ(WS_SUCCESS, wolfSSH_stream_exit(server, 3));
+    AssertIntEQ(1, server->channelList->closeTxd);
+    AssertIntGT(server->rekeyQueue.length, 0);
+    AssertIntEQ(0, server->schedQueuedSz);
+    AssertNull(server->schedLatency);
+    AssertNull(server->schedBulk);
+
+    for (rounds = 0; ret != WS_CHAN_RXD && rounds < 100; rounds++) {
+        wolfSSH_worker(server, NULL);
+        ret = wolfSSH_worker(client, &channelId);
+    }
+    AssertIntEQ(WS_CHAN_RXD, ret);
+    AssertIntEQ(0, server->isKeying);
+    AssertIntEQ(0, server->rekeyQueue.length);
+    AssertIntEQ(0, client->channelList->eofRxd);
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_read(client, rx, (word32)sizeof(rx)));
+    AssertIntEQ(0, WMEMCMP(rx, msg, sizeof(msg)));
+
+    for (rounds = 0; client->channelList != NULL
+            && !client->channelList->eofRxd && rounds < 100; rounds++)
+        wolfSSH_worker(client, NULL);
+    AssertIntEQ(3, wolfSSH_GetExitStatus(client));
+    AssertTrue(client->channelList == NULL || client->channelList->eofRxd);
+}
+
+
+static void test_RekeyQueueCloseRun(WOLFSSH* server, WOLFSSH* client)
+{
+    test_RekeyQueueClose(server, client, 0);
+}
+
+
+static void test_RekeyQueueCloseSchedRun(WOLFSSH* server, WOLFSSH* client)
+{
+    test_RekeyQueueClose(server, client, 1);
+}
+
+
+static void test_wolfSSH_RekeyQueue_Close(void)
+{
+    test_PipeRun(NULL, test_RekeyQueueCloseRun);
+    test_PipeRun(NULL, test_RekeyQueueCloseSchedRun);
+}
+#endif
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+#define TEST_DRAIN_MSGS 4
+#define TEST_DRAIN_HOLD 8
+
+static const char* testDrainCipher;
+static const char* testDrainMac;
+
+static void test_WorkerExDrainSetup(WOLFSSH_CTX* serverCtx,
+        WOLFSSH_CTX* clientCtx)
+{
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetReadAhead(serverCtx, TEST_PIPE_SZ));
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_CTX_SetAlgoListCipher(clientCtx, testDrainCipher));
+    if (testDrainMac != NULL)
+        AssertIntEQ(WS_SUCCESS,
+                wolfSSH_CTX_SetAlgoListMac(clientCtx, testDrainMac));
+}
+
+
+/* Sends a few channel data packets, holding back the end of the last one.
+ * One wolfSSH_worker_ex() call with read-ahead drains the complete packets
+ * from a single read and stops at the partial one without reading again. */
+static void test_WorkerExDrainRun(WOLFSSH* server, WOLFSSH* client)
+{
+    byte msg[] = "one of several packets";
+    byte rx[sizeof(msg) * TEST_DRAIN_MSGS];
+    byte held[TEST_DRAIN_HOLD];
+    word32 ids[4];
+    word32 idsSz;
+    int i;
+
+    for (i = 0; i < TEST_DRAIN_MSGS; i++) {
+        AssertIntEQ((int)sizeof(msg),
+                wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    }
+    testClientToServer.sz -= TEST_DRAIN_HOLD;
+    WMEMCPY(held, testClientToServer.buf + testClientToServer.sz,
+            TEST_DRAIN_HOLD);
+    testClientToServer.reads = 0;
+
+    idsSz = sizeof(ids) / sizeof(ids[0]);
+    AssertIntEQ(WS_CHAN_RXD, wolfSSH_worker_ex(server, ids, &idsSz));
+    AssertIntEQ(1, idsSz);
+    AssertIntEQ(1, testClientToServer.reads);
+    AssertIntEQ(0, testClientToServer.sz);
+    AssertIntEQ((int)sizeof(msg) * (TEST_DRAIN_MSGS - 1),
+            wolfSSH_stream_read(server, rx, (word32)sizeof(rx)));
+
+    /* The rest of the last packet arrives and finishes it. */
+    WMEMCPY(testClientToServer.buf, held, TEST_DRAIN_HOLD);
+    testClientToServer.sz = TEST_DRAIN_HOLD;
+    idsSz = sizeof(ids) / sizeof(ids[0]);
+    AssertIntEQ(WS_CHAN_RXD, wolfSSH_worker_ex(server, ids, &idsSz));
+    AssertIntEQ(1, idsSz);
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_read(server, rx, (word32)sizeof(rx)));
+    AssertIntEQ(0, WMEMCMP(rx, msg, sizeof(msg)));
+}
+
+
+/* Runs the drain over the given cipher, the length is decrypted
+ * differently for each kind. */
+static void test_WorkerExDrain(const char* cipher, const char* mac)
+{
+    testDrainCipher = cipher;
+    testDrainMac = mac;
+    test_PipeRun(test_WorkerExDrainSetup, test_WorkerExDrainRun);
+}
+
+
+static void test_wolfSSH_worker_ex_Drain(void)
+{
+#if !defined(WOLFSSH_NO_AES_CTR) && !defined(WOLFSSH_NO_HMAC_SHA2_256)
+    /* The length is encrypted with the first block. */
+    test_WorkerExDrain("aes256-ctr", "hmac-sha2-256");
+    test_WorkerExDrain("aes256-ctr", "hmac-sha2-256-etm@openssh.com");
+#endif
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+    test_WorkerExDrain("chacha20-poly1305@openssh.com", NULL);
+#endif
+#ifndef WOLFSSH_NO_AES_GCM
+    test_WorkerExDrain("aes256-gcm@openssh.com", NULL);
+#endif
+}
+#endif
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+#define TEST_RETAIN_MSG_SZ (8 * 1024)
+#define TEST_RETAIN_ROUNDS 4
+#define TEST_RETAIN_SZ 256
+
+/* Sends one message from the client and reads all of it on the server. */
+static void test_RetainRound(WOLFSSH* server, WOLFSSH* client)
+{
+    static byte msg[TEST_RETAIN_MSG_SZ];
+    static byte rx[TEST_RETAIN_MSG_SZ];
+    word32 rxSz = 0;
+    word32 channelId;
+    int ret;
+    int rounds;
+
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    for (rounds = 0; rxSz < sizeof(rx) && rounds < 100; rounds++) {
+        ret = wolfSSH_worker(server, &channelId);
+        if (ret == WS_CHAN_RXD) {
+            ret = wolfSSH_stream_read(server, rx + rxSz,
+                    (word32)sizeof(rx) - rxSz);
+            AssertIntGT(ret, 0);
+            rxSz += (word32)ret;
+        }
+    }
+    AssertIntEQ(sizeof(rx), rxSz);
+}
+
+
+/* By default the transport buffers are reused for every packet. */
+static void test_RetainKeep(WOLFSSH* server, WOLFSSH* client)
+{
+    byte* inBuf;
+    byte* outBuf;
+    int i;
+
+    test_RetainRound(server, client);
+    AssertIntGE(server->inputBuffer.bufferSz, TEST_RETAIN_MSG_SZ);
+    AssertIntGE(client->outputBuffer.bufferSz, TEST_RETAIN_MSG_SZ);
+    inBuf = server->inputBuffer.buffer;
+    outBuf = client->outputBuffer.buffer;
+
+    for (i = 1; i < TEST_RETAIN_ROUNDS; i++) {
+        test_RetainRound(server, client);
+        AssertPtrEq(server->inputBuffer.buffer, inBuf);
+        AssertPtrEq(client->outputBuffer.buffer, outBuf);
+    }
+}
+
+
+static void test_RetainSetup(WOLFSSH_CTX* serverCtx, WOLFSSH_CTX* clientCtx)
+{
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_CTX_SetBufferRetain(serverCtx, TEST_RETAIN_SZ));
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_CTX_SetBufferRetain(clientCtx, TEST_RETAIN_SZ));
+}
+
+
+/* With a small retain size, the buffers are released once drained. */
+static void test_RetainRelease(WOLFSSH* server, WOLFSSH* client)
+{
+    test_RetainRound(server, client);
+    AssertIntEQ(0, server->inputBuffer.dynamicFlag);
+    AssertIntEQ(0, client->outputBuffer.dynamicFlag);
+}
+
+
+static void test_wolfSSH_BufferRetain(void)
+{
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetBufferRetain(NULL, 0));
+
+    test_PipeRun(NULL, test_RetainKeep);
+    test_PipeRun(test_RetainSetup, test_RetainRelease);
+}
+#endif
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+#define TEST_CORK_MSGS 8
+
+/* Packets sent while corked are held and go out in one write on uncork. */
+static void test_CorkRun(WOLFSSH* server, WOLFSSH* client)
+{
+    byte msg[] = "corked";
+    byte rx[sizeof(msg) * TEST_CORK_MSGS];
+    word32 rxSz = 0;
+    word32 channelId;
+    int ret;
+    int rounds;
+    int i;
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_Cork(client));
+    testClientToServer.writes = 0;
+    for (i = 0; i < TEST_CORK_MSGS; i++) {
+        AssertIntEQ((int)sizeof(msg),
+                wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    }
+    AssertIntEQ(0, testClientToServer.writes);
+    AssertIntEQ(0, testClientToServer.sz);
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_Uncork(client));
+    AssertIntEQ(1, testClientToServer.writes);
+
+    for (rounds = 0; rxSz < sizeof(rx) && rounds < 100; rounds++) {
+        ret = wolfSSH_worker(server, &channelId);
+        if (ret == WS_CHAN_RXD) {
+            ret = wolfSSH_stream_read(server, rx + rxSz,
+                    (word32)sizeof(rx) - rxSz);
+            AssertIntGT(ret, 0);
+            rxSz += (word32)ret;
+        }
+    }
+    AssertIntEQ(sizeof(rx), rxSz);
+
+    /* Reaching the cork size writes without waiting for the uncork. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetCorkSize(client, 1));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_Cork(client));
+    testClientToServer.writes = 0;
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    AssertIntEQ(1, testClientToServer.writes);
+}
+
+
+static void test_wolfSSH_Cork_Pipe(void)
+{
+    test_PipeRun(NULL, test_CorkRun);
+}
+#endif
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+typedef struct TestDataCb {
+    byte buf[64];
+    word32 sz;
+    word32 take; /* bytes to take per call */
+} TestDataCb;
+
+
+static int test_ChannelDataCb(WOLFSSH_CHANNEL* channel, const byte* data,
+        word32 dataSz, void* ctx)
+{
+    TestDataCb* got = (TestDataCb*)ctx;
+
+    (void)channel;
+
+    if (dataSz > got->take)
+        dataSz = got->take;
+    if (dataSz > sizeof(got->buf) - got->sz)
+        dataSz = (word32)sizeof(got->buf) - got->sz;
+    WMEMCPY(got->buf + got->sz, data, dataSz);
+    got->sz += dataSz;
+
+    return (int)dataSz;
+}
+
+
+static void test_ChannelDataCbSetup(WOLFSSH_CTX* serverCtx,
+        WOLFSSH_CTX* clientCtx)
+{
+    (void)clientCtx;
+
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_CTX_SetChannelDataCb(serverCtx, test_ChannelDataCb));
+}
+
+
+/* Channel data goes to the callback, anything it leaves is read as usual,
+ * and channels wolfSSH reads itself bypass it. */
+static void test_ChannelDataCbRun(WOLFSSH* server, WOLFSSH* client)
+{
+    TestDataCb got;
+    byte msg[] = "straight from the packet";
+    byte rx[sizeof(msg)];
+    word32 channelId;
+    int ret = WS_SUCCESS;
+    int rounds;
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetChannelDataCtx(server, &got));
+    AssertTrue(wolfSSH_GetChannelDataCtx(server) == &got);
+
+    /* The callback takes all of it, nothing is left to read. */
+    WMEMSET(&got, 0, sizeof(got));
+    got.take = sizeof(msg);
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    for (rounds = 0; got.sz == 0 && rounds < 100; rounds++)
+        ret = wolfSSH_worker(server, &channelId);
+    AssertIntEQ(WS_SUCCESS, ret);
+    AssertIntEQ(sizeof(msg), got.sz);
+    AssertIntEQ(0, WMEMCMP(got.buf, msg, sizeof(msg)));
+    AssertIntEQ(sizeof(msg), server->channelList->windowConsumed);
+
+    /* The callback takes part of it, the rest is buffered. */
+    WMEMSET(&got, 0, sizeof(got));
+    got.take = 5;
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    for (rounds = 0; ret != WS_CHAN_RXD && rounds < 100; rounds++)
+        ret = wolfSSH_worker(server, &channelId);
+    AssertIntEQ(WS_CHAN_RXD, ret);
+    AssertIntEQ(5, got.sz);
+    AssertIntEQ((int)sizeof(msg) - 5,
+            wolfSSH_stream_read(server, rx, (word32)sizeof(rx)));
+    AssertIntEQ(0, WMEMCMP(rx, msg + 5, sizeof(msg) - 5));
+
+    /* A channel wolfSSH reads itself, marked as an SFTP or SCP request
+     * marks it, doesn't use it. */
+    server->channelList->internalData = 1;
+    WMEMSET(&got, 0, sizeof(got));
+    got.take = sizeof(msg);
+    ret = WS_SUCCESS;
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    for (rounds = 0; ret != WS_CHAN_RXD && rounds < 100; rounds++)
+        ret = wolfSSH_worker(server, &channelId);
+    AssertIntEQ(WS_CHAN_RXD, ret);
+    AssertIntEQ(0, got.sz);
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_read(server, rx, (word32)sizeof(rx)));
+}
+
+
+static void test_wolfSSH_ChannelDataCb(void)
+{
+    TestDataCb got;
+
+    AssertIntEQ(WS_SSH_CTX_NULL_E,
+            wolfSSH_CTX_SetChannelDataCb(NULL, test_ChannelDataCb));
+    AssertIntEQ(WS_SSH_NULL_E, wolfSSH_SetChannelDataCtx(NULL, &got));
+    AssertNull(wolfSSH_GetChannelDataCtx(NULL));
+
+    test_PipeRun(test_ChannelDataCbSetup, test_ChannelDataCbRun);
+}
+#endif
+
+
+#if defined(WOLFSSH_FWD) && defined(TEST_PIPE_HANDSHAKE)
+#define TEST_CHANNEL_COUNT 100
+
+/* Opens enough channels to grow the channel tables a few times, frees
+ * every other one, and checks lookups and iteration. */
+static void test_ChannelTableRun(WOLFSSH* server, WOLFSSH* client)
+{
+    WOLFSSH_CHANNEL* channels[TEST_CHANNEL_COUNT];
+    WOLFSSH_CHANNEL* session;
+    WOLFSSH_CHANNEL* cur;
+    word32 id;
+    word32 count;
+    int i;
+
+    (void)server;
+
+    /* The session channel is open, so it is found by the peer's ID. */
+    AssertNotNull(session = wolfSSH_ChannelNext(client, NULL));
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_ChannelGetId(session, &id, WS_CHANNEL_ID_PEER));
+    AssertTrue(wolfSSH_ChannelFind(client, id, WS_CHANNEL_ID_PEER)
+            == session);
+
+    for (i = 0; i < TEST_CHANNEL_COUNT; i++) {
+        testServerToClient.sz = 0;
+        testClientToServer.sz = 0;
+        AssertNotNull(channels[i] = wolfSSH_ChannelFwdNewLocal(client,
+                    "localhost", 22, "localhost", 2222));
+    }
+
+    for (i = 0; i < TEST_CHANNEL_COUNT; i++) {
+        AssertIntEQ(WS_SUCCESS,
+                wolfSSH_ChannelGetId(channels[i], &id, WS_CHANNEL_ID_SELF));
+        AssertTrue(wolfSSH_ChannelFind(client, id, WS_CHANNEL_ID_SELF)
+                == channels[i]);
+    }
+
+    for (i = 0; i < TEST_CHANNEL_COUNT; i += 2) {
+        AssertIntEQ(WS_SUCCESS,
+                wolfSSH_ChannelGetId(channels[i], &id, WS_CHANNEL_ID_SELF));
+        AssertIntEQ(WS_SUCCESS, wolfSSH_ChannelFree(channels[i]));
+        AssertNull(wolfSSH_ChannelFind(client, id, WS_CHANNEL_ID_SELF));
+        channels[i] = NULL;
+    }
+
+    /* Iteration keeps the order the channels were added in. */
+    AssertTrue(wolfSSH_ChannelNext(client, NULL) == session);
+    cur = session;
+    count = 0;
+    for (i = 1; i < TEST_CHANNEL_COUNT; i += 2) {
+        cur = wolfSSH_ChannelNext(client, cur);
+        AssertTrue(cur == channels[i]);
+        count++;
+    }
+    AssertNull(wolfSSH_ChannelNext(client, cur));
+    AssertIntEQ(TEST_CHANNEL_COUNT / 2, count);
+}
+
+
+static void test_wolfSSH_ChannelTable(void)
+{
+    test_PipeRun(NULL, test_ChannelTableRun);
+}
+#endif
+
+
+#if defined(WOLFSSH_FWD) && defined(TEST_PIPE_HANDSHAKE) && \
+    defined(USE_WOLFSSL_MEMORY) && !defined(WOLFSSL_STATIC_MEMORY) && \
+    !defined(WOLFSSL_DEBUG_MEMORY) && !defined(WMALLOC_USER)
+#define TEST_MEM_ENTRIES 4096
+#define TEST_MEM_CHANNELS 64
+
+typedef struct TestMemEntry {
+    void* ptr;
+    size_t sz;
+} TestMemEntry;
+
+static TestMemEntry testMem[TEST_MEM_ENTRIES];
+static word32 testMemCount;
+static size_t testMemInUse;
+
+
+static void test_MemAdd(void* ptr, size_t sz)
+{
+    if (ptr != NULL && testMemCount < TEST_MEM_ENTRIES) {
+        testMem[testMemCount].ptr = ptr;
+        testMem[testMemCount].sz = sz;
+        testMemCount++;
+        testMemInUse += sz;
+    }
+}
+
+
+static void test_MemForget(void* ptr)
+{
+    word32 i;
+
+    for (i = 0; i < testMemCount; i++) {
+        if (testMem[i].ptr == ptr) {
+            testMemInUse -= testMem[i].sz;
+            testMem[i] = testMem[--testMemCount];
+            break;
+        }
+    }
+}
+
+
+static void* test_MemMalloc(size_t sz)
+{
+    void* ptr = malloc(sz);
+
+    test_MemAdd(ptr, sz);
+    return ptr;
+}
+
+
+static void test_MemFree(void* ptr)
+{
+    if (ptr != NULL) {
+        test_MemForget(ptr);
+        free(ptr);
+    }
+}
+
+
+static void* test_MemRealloc(void* ptr, size_t sz)
+{
+    void* newPtr = realloc(ptr, sz);
+
+    if (newPtr != NULL) {
+        if (ptr != NULL)
+            test_MemForget(ptr);
+        test_MemAdd(newPtr, sz);
+    }
+    return newPtr;
+}
+
+
+/* Checks the heap held per idle channel. Channels get their input
+ * buffers when data arrives, so an idle one is little more than its
+ * struct. */
+static void test_ChannelMemoryRun(WOLFSSH* server, WOLFSSH* client)
+{
+    WOLFSSH_CHANNEL* channels[TEST_MEM_CHANNELS];
+    size_t perChannel;
+    int i;
+
+    (void)server;
+
+    /* Let the output buffer reach its working size first. */
+    AssertNotNull(wolfSSH_ChannelFwdNewLocal(client,
+                "localhost", 22, "localhost", 2222));
+
+    testMemCount = 0;
+    testMemInUse = 0;
+    AssertIntEQ(0, wolfSSH_SetAllocators(test_MemMalloc, test_MemFree,
+                test_MemRealloc));
+
+    for (i = 0; i < TEST_MEM_CHANNELS; i++) {
+        testServerToClient.sz = 0;
+        testClientToServer.sz = 0;
+        AssertNotNull(channels[i] = wolfSSH_ChannelFwdNewLocal(client,
+                    "localhost", 22, "localhost", 2222));
+    }
+
+    perChannel = testMemInUse / TEST_MEM_CHANNELS;
+    AssertTrue(perChannel < DEFAULT_WINDOW_SZ / 16);
+
+    for (i = 0; i < TEST_MEM_CHANNELS; i++)
+        AssertIntEQ(WS_SUCCESS, wolfSSH_ChannelFree(channels[i]));
+
+    AssertIntEQ(0, wolfSSH_SetAllocators(NULL, NULL, NULL));
+}
+
+
+static void test_wolfSSH_ChannelMemory(void)
+{
+    test_PipeRun(NULL, test_ChannelMemoryRun);
+}
+#endif
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+#define TEST_TUNE_WINDOW_SZ (16 * 1024)
+#define TEST_TUNE_MAX_SZ (32 * 1024)
+
+/* The client fills the server's window, then the server takes in all of
+ * it before the application reads it in one go, so every adjust finds the
+ * window run dry. */
+static void test_WindowTuneRounds(WOLFSSH* server, WOLFSSH* client,
+        int rounds)
+{
+    static byte rx[TEST_TUNE_MAX_SZ];
+    byte msg[4096];
+    word32 channelId;
+    int ret;
+
+    WMEMSET(msg, 'w', sizeof(msg));
+    for (; rounds > 0; rounds--) {
+        while (testServerToClient.sz > 0)
+            wolfSSH_worker(client, NULL);
+        do {
+            ret = wolfSSH_stream_send(client, msg, (word32)sizeof(msg));
+        } while (ret > 0);
+        AssertIntEQ(WS_WINDOW_FULL, ret);
+
+        while (testClientToServer.sz > 0)
+            wolfSSH_worker(server, &channelId);
+        do {
+            ret = wolfSSH_stream_read(server, rx, (word32)sizeof(rx));
+        } while (ret > 0);
+    }
+}
+
+
+static void test_WindowAutoTuneSetup(WOLFSSH_CTX* serverCtx,
+        WOLFSSH_CTX* clientCtx)
+{
+    (void)clientCtx;
+
+    AssertIntEQ(WS_BAD_ARGUMENT,
+            wolfSSH_CTX_SetWindowAutoTune(serverCtx, MAX_WINDOW_SZ + 1));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetWindowPacketSize(serverCtx,
+                TEST_TUNE_WINDOW_SZ, 4096));
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_CTX_SetWindowAutoTune(serverCtx, TEST_TUNE_MAX_SZ));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetWindowBudget(serverCtx, 0));
+}
+
+
+/* A channel's window grows past its starting size while the application
+ * keeps up, no further than the context's ceiling, and only as far as the
+ * context's budget has room. */
+static void test_WindowAutoTuneRun(WOLFSSH* server, WOLFSSH* client)
+{
+    WOLFSSH_CTX* ctx = server->ctx;
+    WOLFSSH_CHANNEL* channel;
+
+    AssertNotNull(channel = server->channelList);
+    AssertIntEQ(TEST_TUNE_WINDOW_SZ, channel->windowFullSz);
+
+    /* Without a budget, the window stays put. */
+    test_WindowTuneRounds(server, client, 4);
+    AssertIntEQ(TEST_TUNE_WINDOW_SZ, channel->windowFullSz);
+    AssertIntEQ(0, wolfSSH_CTX_GetWindowGrown(ctx));
+
+    /* It grows by what the budget has left. */
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_CTX_SetWindowBudget(ctx, TEST_TUNE_WINDOW_SZ / 2));
+    test_WindowTuneRounds(server, client, 2);
+    AssertIntEQ(TEST_TUNE_WINDOW_SZ + TEST_TUNE_WINDOW_SZ / 2,
+            channel->windowFullSz);
+    AssertIntEQ(TEST_TUNE_WINDOW_SZ / 2, wolfSSH_CTX_GetWindowGrown(ctx));
+
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_CTX_SetWindowBudget(ctx, DEFAULT_WINDOW_BUDGET_SZ));
+    test_WindowTuneRounds(server, client, 4);
+    AssertIntEQ(TEST_TUNE_MAX_SZ, channel->windowFullSz);
+    AssertIntEQ(TEST_TUNE_MAX_SZ - TEST_TUNE_WINDOW_SZ,
+            wolfSSH_CTX_GetWindowGrown(ctx));
+    AssertIntLE(channel->inputBuffer.bufferSz, TEST_TUNE_MAX_SZ);
+
+    /* Closing the channel gives its growth back. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_ChannelFree(channel));
+    AssertIntEQ(0, wolfSSH_CTX_GetWindowGrown(ctx));
+}
+
+
+static void test_wolfSSH_WindowAutoTune(void)
+{
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetWindowAutoTune(NULL, 0));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetWindowBudget(NULL, 0));
+    AssertIntEQ(0, wolfSSH_CTX_GetWindowGrown(NULL));
+
+    test_PipeRun(test_WindowAutoTuneSetup, test_WindowAutoTuneRun);
+}
+
+
+static void test_ChannelBufferSetup(WOLFSSH_CTX* serverCtx,
+        WOLFSSH_CTX* clientCtx)
+{
+    (void)clientCtx;
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetWindowPacketSize(serverCtx,
+                TEST_TUNE_WINDOW_SZ, 4096));
+}
+
+
+/* The client fills the server's window and the server takes all of it in
+ * without the application reading it. */
+static void test_ChannelBufferFill(WOLFSSH* server, WOLFSSH* client)
+{
+    byte msg[4096];
+    word32 channelId;
+    int ret;
+
+    WMEMSET(msg, 'b', sizeof(msg));
+    while (testServerToClient.sz > 0)
+        wolfSSH_worker(client, NULL);
+    do {
+        ret = wolfSSH_stream_send(client, msg, (word32)sizeof(msg));
+    } while (ret > 0);
+    AssertIntEQ(WS_WINDOW_FULL, ret);
+    while (testClientToServer.sz > 0)
+        wolfSSH_worker(server, &channelId);
+}
+
+
+/* A channel's input buffer starts out empty, grows as data arrives up to
+ * the window, is released once the application drains it, and otherwise
+ * goes when the channel does. */
+static void test_ChannelBufferRun(WOLFSSH* server, WOLFSSH* client)
+{
+    static byte rx[TEST_TUNE_WINDOW_SZ];
+    WOLFSSH_CHANNEL* channel;
+    int ret;
+#ifdef TEST_MEM_ENTRIES
+    size_t inUse;
+#endif
+
+    AssertNotNull(channel = server->channelList);
+    AssertIntEQ(0, channel->inputBuffer.dynamicFlag);
+
+    test_ChannelBufferFill(server, client);
+    AssertIntEQ(1, channel->inputBuffer.dynamicFlag);
+    AssertIntEQ(TEST_TUNE_WINDOW_SZ, channel->inputBuffer.bufferSz);
+
+    do {
+        ret = wolfSSH_stream_read(server, rx, (word32)sizeof(rx));
+    } while (ret > 0);
+    AssertIntEQ(0, channel->inputBuffer.dynamicFlag);
+    AssertIntEQ(0, channel->inputBuffer.length);
+
+#ifdef TEST_MEM_ENTRIES
+    testMemCount = 0;
+    testMemInUse = 0;
+    AssertIntEQ(0, wolfSSH_SetAllocators(test_MemMalloc, test_MemFree,
+                test_MemRealloc));
+    test_ChannelBufferFill(server, client);
+    AssertIntEQ(TEST_TUNE_WINDOW_SZ, channel->inputBuffer.bufferSz);
+    inUse = testMemInUse;
+    AssertIntEQ(WS_SUCCESS, wolfSSH_ChannelFree(channel));
+    AssertTrue(inUse - testMemInUse >= TEST_TUNE_WINDOW_SZ);
+    AssertIntEQ(0, wolfSSH_SetAllocators(NULL, NULL, NULL));
+#endif
+}
+
+
+static void test_wolfSSH_ChannelBuffer(void)
+{
+    test_PipeRun(test_ChannelBufferSetup, test_ChannelBufferRun);
+}
+#endif
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+#define TEST_LARGE_PACKET_SZ (48 * 1024)
+
+static void test_LargePacketSetup(WOLFSSH_CTX* serverCtx,
+        WOLFSSH_CTX* clientCtx)
+{
+    (void)clientCtx;
+
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetWindowPacketSize(serverCtx,
+                0, MAX_CHANNEL_PACKET_SZ + 1));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetWindowPacketSize(serverCtx,
+                0, TEST_LARGE_PACKET_SZ));
+}
+
+
+/* Channel data packets are sized by the peer's maximum packet size only.
+ * Only the server takes packets above the default 32768 bytes, so the
+ * client's go out whole and the server's are held to the default. */
+static void test_LargePacketRun(WOLFSSH* server, WOLFSSH* client)
+{
+    static byte msg[TEST_LARGE_PACKET_SZ];
+    static byte rx[TEST_LARGE_PACKET_SZ];
+    word32 channelId;
+
+    WMEMSET(msg, 'L', sizeof(msg));
+    AssertIntEQ(DEFAULT_MAX_PACKET_SZ, client->channelList->maxPacketSz);
+    AssertIntEQ(TEST_LARGE_PACKET_SZ, client->channelList->peerMaxPacketSz);
+
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    AssertIntEQ(WS_CHAN_RXD, wolfSSH_worker(server, &channelId));
+    AssertIntEQ(0, testClientToServer.sz);
+    AssertIntEQ((int)sizeof(rx),
+            wolfSSH_stream_read(server, rx, (word32)sizeof(rx)));
+    AssertIntEQ(0, WMEMCMP(msg, rx, sizeof(rx)));
+
+    AssertIntEQ(DEFAULT_MAX_PACKET_SZ,
+            wolfSSH_stream_send(server, msg, (word32)sizeof(msg)));
+}
+
+
+static void test_wolfSSH_LargePacket(void)
+{
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetWindowPacketSize(NULL, 0, 0));
+
+    test_PipeRun(test_LargePacketSetup, test_LargePacketRun);
+}
+#endif
+
+
+#if defined(TEST_PIPE_HANDSHAKE) && !defined(WOLFSSH_NO_HOST_KEY_CACHE)
+/* A handshake signs with a decoded copy of the host key of its own and
+ * gives it back, so the next handshake reuses it. */
+static void test_wolfSSH_HostKeyCopies(void)
+{
+    WOLFSSH_CTX* serverCtx;
+    WOLFSSH_CTX* clientCtx;
+    WOLFSSH* server;
+    WOLFSSH* client;
+    WOLFSSH_HOST_KEY* hostKey;
+    word32 gen;
+
+    test_PipeCtxNew(&serverCtx, &clientCtx);
+    AssertNotNull(hostKey = serverCtx->privateKey[0].hostKeys);
+    AssertNull(hostKey->next);
+    gen = serverCtx->privateKey[0].hostKeyGen;
+
+    AssertNotNull(server = wolfSSH_new(serverCtx));
+    AssertNotNull(client = wolfSSH_new(clientCtx));
+    AssertIntEQ(WS_SUCCESS, test_PipeConnect(server, client));
+    AssertTrue(serverCtx->privateKey[0].hostKeys == hostKey);
+    AssertNull(hostKey->next);
+    AssertIntEQ(gen, hostKey->gen);
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+
+    AssertNotNull(server = wolfSSH_new(serverCtx));
+    AssertNotNull(client = wolfSSH_new(clientCtx));
+    AssertIntEQ(WS_SUCCESS, test_PipeConnect(server, client));
+    AssertTrue(serverCtx->privateKey[0].hostKeys == hostKey);
+    AssertNull(hostKey->next);
+
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+    test_PipeCtxFree(serverCtx, clientCtx);
+}
+#endif
+
+
+#if defined(TEST_PIPE_HANDSHAKE) && !defined(WOLFSSH_NO_ECDH_SHA2_NISTP256)
+static word32 test_KexKeyPoolCount(WOLFSSH_CTX* ctx)
+{
+    WOLFSSH_KEX_KEY* entry;
+    word32 count = 0;
+
+    for (entry = ctx->kexKeyPool; entry != NULL; entry = entry->next)
+        count++;
+
+    return count;
+}
+
+
+/* A handshake takes its ephemeral key from the pool, and a fill puts a
+ * new one in its place. */
+static void test_wolfSSH_KexKeyPool_Pipe(void)
+{
+    WOLFSSH_CTX* serverCtx;
+    WOLFSSH_CTX* clientCtx;
+    WOLFSSH* server;
+    WOLFSSH* client;
+
+    test_PipeCtxNew(&serverCtx, &clientCtx);
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_CTX_SetAlgoListKex(serverCtx, "ecdh-sha2-nistp256"));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetKexKeyPool(serverCtx, 1));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_FillKexKeyPool(serverCtx));
+    AssertIntEQ(1, test_KexKeyPoolCount(serverCtx));
+
+    AssertNotNull(server = wolfSSH_new(serverCtx));
+    AssertNotNull(client = wolfSSH_new(clientCtx));
+    AssertIntEQ(WS_SUCCESS, test_PipeConnect(server, client));
+    AssertIntEQ(0, test_KexKeyPoolCount(serverCtx));
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_FillKexKeyPool(serverCtx));
+    AssertIntEQ(1, test_KexKeyPoolCount(serverCtx));
+    AssertIntEQ(ID_ECDH_SHA2_NISTP256, serverCtx->kexKeyPool->kexId);
+
+    /* Sizing the pool to 0 empties it, and handshakes generate their
+     * own keys. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetKexKeyPool(serverCtx, 0));
+    AssertIntEQ(0, test_KexKeyPoolCount(serverCtx));
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+    AssertNotNull(server = wolfSSH_new(serverCtx));
+    AssertNotNull(client = wolfSSH_new(clientCtx));
+    AssertIntEQ(WS_SUCCESS, test_PipeConnect(server, client));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_FillKexKeyPool(serverCtx));
+    AssertIntEQ(0, test_KexKeyPoolCount(serverCtx));
+
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+    test_PipeCtxFree(serverCtx, clientCtx);
+}
+#endif
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+static int test_SignOffloadPipeCb(WOLFSSH* ssh, void* ctx)
+{
+    (void)ssh;
+    (*(int*)ctx)++;
+
+    return WS_SUCCESS;
+}
+
+
+/* The server plays its own worker thread. The handshake and a re-key
+ * both wait on the offloaded signature, polling the same call, and go
+ * on once it is made. */
+static void test_wolfSSH_SignOffload_Pipe(void)
+{
+    WOLFSSH_CTX* serverCtx;
+    WOLFSSH_CTX* clientCtx;
+    WOLFSSH* server;
+    WOLFSSH* client;
+    int offloads = 0;
+    int serverRet = WS_FATAL_ERROR;
+    int clientRet = WS_FATAL_ERROR;
+    int pending = 0;
+    int rounds;
+    int ret;
+
+    test_PipeCtxNew(&serverCtx, &clientCtx);
+    wolfSSH_CTX_SetSignOffloadCb(serverCtx, test_SignOffloadPipeCb);
+    AssertNotNull(server = wolfSSH_new(serverCtx));
+    AssertNotNull(client = wolfSSH_new(clientCtx));
+    wolfSSH_SetSignOffloadCtx(server, &offloads);
+
+    testClientToServer.sz = 0;
+    testServerToClient.sz = 0;
+    wolfSSH_SetIOReadCtx(server, &testServerLink);
+    wolfSSH_SetIOWriteCtx(server, &testServerLink);
+    wolfSSH_SetIOReadCtx(client, &testClientLink);
+    wolfSSH_SetIOWriteCtx(client, &testClientLink);
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetUsername(client, "jill"));
+
+    for (rounds = 0; rounds < 1000
+            && (serverRet != WS_SUCCESS || clientRet != WS_SUCCESS);
+            rounds++) {
+        if (clientRet != WS_SUCCESS)
+            clientRet = wolfSSH_connect(client);
+        if (serverRet != WS_SUCCESS) {
+            serverRet = wolfSSH_accept(server);
+            if (serverRet != WS_SUCCESS
+                    && wolfSSH_get_error(server) == WS_WANT_CRYPTO) {
+                AssertIntEQ(1, offloads);
+                /* Polling again before the signature is made waits. */
+                AssertIntEQ(WS_FATAL_ERROR, wolfSSH_accept(server));
+                AssertIntEQ(WS_WANT_CRYPTO, wolfSSH_get_error(server));
+                AssertIntEQ(WS_SUCCESS, wolfSSH_SignOffload(server));
+                pending++;
+            }
+        }
+    }
+    AssertIntEQ(WS_SUCCESS, clientRet);
+    AssertIntEQ(WS_SUCCESS, serverRet);
+    AssertIntEQ(1, pending);
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_TriggerKeyExchange(client));
+    for (rounds = 0; rounds < 100
+            && (pending < 2 || client->isKeying || server->isKeying);
+            rounds++) {
+        wolfSSH_worker(client, NULL);
+        ret = wolfSSH_worker(server, NULL);
+        if (ret == WS_WANT_CRYPTO) {
+            AssertIntEQ(2, offloads);
+            AssertIntEQ(WS_WANT_CRYPTO, wolfSSH_worker(server, NULL));
+            AssertIntEQ(WS_SUCCESS, wolfSSH_SignOffload(server));
+            pending++;
+        }
+    }
+    AssertIntEQ(2, pending);
+    AssertIntEQ(0, client->isKeying);
+    AssertIntEQ(0, server->isKeying);
+
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+    test_PipeCtxFree(serverCtx, clientCtx);
+}
+#endif
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+static void test_ChannelSchedulerSetup(WOLFSSH_CTX* serverCtx,
+        WOLFSSH_CTX* clientCtx)
+{
+    (void)serverCtx;
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetChannelScheduler(clientCtx, 1));
+}
+
+
+/* With the scheduler on, data sent while keying waits in the channel and
+ * goes out in order once the new keys are in use. */
+static void test_ChannelSchedulerRun(WOLFSSH* server, WOLFSSH* client)
+{
+    byte first[] = "first, ";
+    byte second[] = "then second";
+    byte rx[sizeof(first) + sizeof(second)];
+    word32 rxSz = 0;
+    word32 channelId;
+    int ret;
+    int rounds;
+
+    AssertIntEQ(1, client->channelSched);
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_ChannelSetPriority(client->channelList,
+                WOLFSSH_CHANNEL_PRIO_LATENCY + 1, 0));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_ChannelSetPriority(client->channelList,
+                WOLFSSH_CHANNEL_PRIO_BULK, WOLFSSH_SCHED_MAX_WEIGHT + 1));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_ChannelSetPriority(client->channelList,
+                WOLFSSH_CHANNEL_PRIO_LATENCY, 0));
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_TriggerKeyExchange(client));
+    AssertIntEQ((int)sizeof(first) - 1,
+            wolfSSH_stream_send(client, first, (word32)sizeof(first) - 1));
+    AssertIntEQ((int)sizeof(second),
+            wolfSSH_stream_send(client, second, (word32)sizeof(second)));
+    AssertIntEQ(0, client->rekeyQueue.length);
+    AssertIntEQ(sizeof(first) - 1 + sizeof(second), client->schedQueuedSz);
+    AssertTrue(client->schedLatency == client->channelList);
+    AssertNull(client->schedBulk);
+
+    for (rounds = 0; rxSz < sizeof(rx) - 1 && rounds < 100; rounds++) {
+        wolfSSH_worker(client, NULL);
+        ret = wolfSSH_worker(server, &channelId);
+        if (ret == WS_CHAN_RXD) {
+            ret = wolfSSH_stream_read(server, rx + rxSz,
+                    (word32)sizeof(rx) - rxSz);
+            AssertIntGT(ret, 0);
+            rxSz += (word32)ret;
+        }
+    }
+    AssertIntEQ(sizeof(rx) - 1, rxSz);
+    AssertIntEQ(0, WMEMCMP(rx, "first, then second", rxSz));
+    AssertIntEQ(0, client->schedQueuedSz);
+    AssertNull(client->schedLatency);
+}
+
+
+static void test_wolfSSH_ChannelScheduler_Pipe(void)
+{
+    test_PipeRun(test_ChannelSchedulerSetup, test_ChannelSchedulerRun);
+}
+#endif
+
+
+#if defined(WOLFSSH_FWD) && defined(TEST_PIPE_HANDSHAKE)
+#define TEST_DRR_BULK 3
+#define TEST_DRR_ROUNDS 14
+#define TEST_DRR_PACKET_SZ 1024
+
+/* Keeps the channel's txQueue full and returns how much was added. */
+static word32 test_DrrTopUp(WOLFSSH_CHANNEL* channel)
+{
+    static byte msg[WOLFSSH_CHANNEL_TXQ_SZ];
+    word32 sz;
+
+    sz = WOLFSSH_CHANNEL_TXQ_SZ -
+            (channel->txQueue.length - channel->txQueue.idx);
+    if (sz > 0) {
+        AssertIntEQ((int)sz, wolfSSH_ChannelSend(channel, msg, sz));
+    }
+
+    return sz;
+}
+
+
+/* With every channel backlogged, each round gives the latency class no
+ * more than its part of the burst and the bulk class the rest, shared by
+ * weight. The pipe takes about one round per worker call. */
+static void test_ChannelSchedulerShareRun(WOLFSSH* server, WOLFSSH* client)
+{
+    WOLFSSH_CHANNEL* latency;
+    WOLFSSH_CHANNEL* bulk[TEST_DRR_BULK];
+    word32 weight[TEST_DRR_BULK] = { 1, 2, 4 };
+    word32 sent[TEST_DRR_BULK];
+    word32 latencySent;
+    word32 bulkSent = 0;
+    word32 weightSum = 0;
+    word32 share;
+    int i;
+    int round;
+
+    (void)server;
+
+    AssertNotNull(latency = client->channelList);
+    AssertIntEQ(WS_SUCCESS, wolfSSH_ChannelSetPriority(latency,
+                WOLFSSH_CHANNEL_PRIO_LATENCY, 0));
+    for (i = 0; i < TEST_DRR_BULK; i++) {
+        testClientToServer.sz = 0;
+        AssertNotNull(bulk[i] = wolfSSH_ChannelFwdNewLocal(client,
+                    "localhost", 22, "localhost", 2222));
+        AssertIntEQ(WS_SUCCESS, wolfSSH_ChannelSetPriority(bulk[i],
+                    WOLFSSH_CHANNEL_PRIO_BULK, weight[i]));
+        /* The server never sees this data, so the channels only need to
+         * look open on the client. */
+        bulk[i]->openConfirmed = 1;
+    }
+
+    /* Small packets, and windows that never run out. */
+    latency->peerMaxPacketSz = TEST_DRR_PACKET_SZ;
+    latency->peerWindowSz = 0x7FFFFFFF;
+    for (i = 0; i < TEST_DRR_BULK; i++) {
+        bulk[i]->peerMaxPacketSz = TEST_DRR_PACKET_SZ;
+        bulk[i]->peerWindowSz = 0x7FFFFFFF;
+    }
+
+    /* Nothing is waiting yet, so hold the first fill as if keying. */
+    client->isKeying = 1;
+    latencySent = test_DrrTopUp(latency);
+    for (i = 0; i < TEST_DRR_BULK; i++)
+        sent[i] = test_DrrTopUp(bulk[i]);
+    client->isKeying = 0;
+
+    for (round = 0; round < TEST_DRR_ROUNDS; round++) {
+        testClientToServer.sz = 0;
+        wolfSSH_worker(client, NULL);
+        AssertIntEQ(TEST_PIPE_SZ, testClientToServer.sz);
+
+        latencySent += test_DrrTopUp(latency);
+        for (i = 0; i < TEST_DRR_BULK; i++)
+            sent[i] += test_DrrTopUp(bulk[i]);
+    }
+
+    latencySent -= WOLFSSH_CHANNEL_TXQ_SZ;
+    for (i = 0; i < TEST_DRR_BULK; i++) {
+        sent[i] -= WOLFSSH_CHANNEL_TXQ_SZ;
+        bulkSent += sent[i];
+        weightSum += weight[i];
+    }
+
+    /* The latency class stops at its part of each burst. */
+    AssertIntEQ(TEST_DRR_ROUNDS * WOLFSSH_SCHED_LATENCY_BURST, latencySent);
+    AssertIntEQ(TEST_DRR_ROUNDS *
+            (WOLFSSH_SCHED_BURST - WOLFSSH_SCHED_LATENCY_BURST), bulkSent);
+
+    /* Each bulk channel is within a turn of its weighted share. */
+    for (i = 0; i < TEST_DRR_BULK; i++) {
+        share = bulkSent / weightSum * weight[i];
+        AssertIntLE(sent[i], share + WOLFSSH_SCHED_QUANTUM * weight[i]);
+        AssertIntGE(sent[i] + WOLFSSH_SCHED_QUANTUM * weight[i], share);
+        if (i > 0)
+            AssertIntGT(sent[i], sent[i - 1]);
+    }
+}
+
+
+static void test_wolfSSH_ChannelScheduler_Share(void)
+{
+    test_PipeRun(test_ChannelSchedulerSetup, test_ChannelSchedulerShareRun);
+}
+#endif
+
+
+static void test_wolfSSH_ChannelScheduler(void)
+{
+    WOLFSSH_CTX* ctx;
+    WOLFSSH* ssh;
+
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetChannelScheduler(NULL, 1));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_SetChannelScheduler(NULL, 1));
+    AssertIntEQ(WS_BAD_ARGUMENT,
+            wolfSSH_ChannelSetPriority(NULL, WOLFSSH_CHANNEL_PRIO_BULK, 1));
+
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_SERVER, NULL));
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+    AssertIntEQ(0, ssh->channelSched);
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetChannelScheduler(ssh, 1));
+    AssertIntEQ(1, ssh->channelSched);
+    wolfSSH_free(ssh);
+    wolfSSH_CTX_free(ctx);
+
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_ChannelScheduler_Pipe();
+#endif
+#if defined(WOLFSSH_FWD) && defined(TEST_PIPE_HANDSHAKE)
+    test_wolfSSH_ChannelScheduler_Share();
+#endif
+}
+
+
+#ifdef TEST_PIPE_HANDSHAKE
+/* A channel sends no more than its bucket holds, then gets WS_WINDOW_FULL
+ * until the bucket refills, and is told how long that takes. */
+static void test_RateLimitRun(WOLFSSH* server, WOLFSSH* client)
+{
+    WS_RateLimit limit;
+    byte msg[300];
+    byte rx[sizeof(msg)];
+    word32 channelId;
+    word32 wait;
+    int ret = WS_SUCCESS;
+    int rounds;
+
+    /* A slow refill, a byte a second. */
+    WMEMSET(&limit, 0, sizeof(limit));
+    limit.txRate = 1;
+    limit.burst = 100;
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_ChannelSetRateLimit(client->channelList, &limit));
+    AssertIntEQ(1, client->rateLimited);
+    AssertIntEQ(WOLFSSH_RATE_NO_WAIT, wolfSSH_GetRateLimitWait(client));
+
+    WMEMSET(msg, 'r', sizeof(msg));
+    AssertIntEQ(100, wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    client->channelList->txRate.last = WTIME_MS();
+    ret = wolfSSH_stream_send(client, msg, (word32)sizeof(msg));
+    AssertIntEQ(WS_WINDOW_FULL, ret);
+    wait = wolfSSH_GetRateLimitWait(client);
+    AssertIntGT(wait, 0);
+    AssertIntLE(wait, 1000);
+
+    for (rounds = 0; ret != WS_CHAN_RXD && rounds < 100; rounds++)
+        ret = wolfSSH_worker(server, &channelId);
+    AssertIntEQ(WS_CHAN_RXD, ret);
+    AssertIntEQ(100, wolfSSH_stream_read(server, rx, (word32)sizeof(rx)));
+
+    /* A second later the wait is over, reported once, and a byte goes. */
+    client->channelList->txRate.last -= 1000;
+    AssertIntEQ(0, wolfSSH_GetRateLimitWait(client));
+    AssertIntEQ(WOLFSSH_RATE_NO_WAIT, wolfSSH_GetRateLimitWait(client));
+    AssertIntEQ(1, wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+
+    /* Without the limit the whole message goes. */
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_ChannelSetRateLimit(client->channelList, NULL));
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+}
+
+
+static void test_wolfSSH_RateLimit_Pipe(void)
+{
+    test_PipeRun(NULL, test_RateLimitRun);
+}
+
+
+#define TEST_RATE_WINDOW_SZ (16 * 1024)
+#define TEST_RATE_RX 1000
+#define TEST_RATE_MSG_SZ 4096
+
+static void test_RateLimitReceiveSetup(WOLFSSH_CTX* serverCtx,
+        WOLFSSH_CTX* clientCtx)
+{
+    (void)clientCtx;
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetWindowPacketSize(serverCtx,
+                TEST_RATE_WINDOW_SZ, TEST_RATE_MSG_SZ));
+}
+
+
+/* Received data over the limit holds back the window adjust. The window
+ * the peer is waiting on is given back by the worker as the bucket
+ * refills, without the application reading any more. */
+static void test_RateLimitReceiveRun(WOLFSSH* server, WOLFSSH* client)
+{
+    WOLFSSH_CHANNEL* channel;
+    WS_RateLimit limit;
+    static byte rx[TEST_RATE_WINDOW_SZ];
+    byte msg[TEST_RATE_MSG_SZ];
+    word32 channelId;
+    int ret;
+
+    AssertNotNull(channel = server->channelList);
+
+    WMEMSET(&limit, 0, sizeof(limit));
+    limit.rxRate = TEST_RATE_RX;
+    AssertIntEQ(WS_SUCCESS, wolfSSH_ChannelSetRateLimit(channel, &limit));
+    AssertIntEQ(WOLFSSH_RATE_NO_WAIT, wolfSSH_GetRateLimitWait(server));
+
+    /* The client fills the window and the server reads all of it. Only
+     * the burst's worth goes back to the client. */
+    WMEMSET(msg, 'u', sizeof(msg));
+    do {
+        ret = wolfSSH_stream_send(client, msg, (word32)sizeof(msg));
+    } while (ret > 0);
+    AssertIntEQ(WS_WINDOW_FULL, ret);
+    while (testClientToServer.sz > 0)
+        wolfSSH_worker(server, &channelId);
+    do {
+        ret = wolfSSH_stream_read(server, rx, (word32)sizeof(rx));
+    } while (ret > 0);
+    AssertIntEQ(TEST_RATE_WINDOW_SZ - TEST_RATE_RX, channel->windowConsumed);
+    while (testServerToClient.sz > 0)
+        wolfSSH_worker(client, NULL);
+    AssertIntEQ(TEST_RATE_RX, client->channelList->peerWindowSz);
+
+    /* The client is stalled on the held back window until a byte is due,
+     * a millisecond at this rate. */
+    AssertIntLE(wolfSSH_GetRateLimitWait(server), 1);
+
+    /* A second later the worker gives back another burst. */
+    channel->rxRate.last -= 1000;
+    AssertIntEQ(0, wolfSSH_GetRateLimitWait(server));
+    wolfSSH_worker(server, NULL);
+    AssertIntEQ(TEST_RATE_WINDOW_SZ - TEST_RATE_RX * 2,
+            channel->windowConsumed);
+    while (testServerToClient.sz > 0)
+        wolfSSH_worker(client, NULL);
+    AssertIntEQ(TEST_RATE_RX * 2, client->channelList->peerWindowSz);
+}
+
 
-    AssertIntEQ(0, (lastKey == ctx->privateKey[0].key));
-    AssertIntNE(lastKeySz, ctx->privateKey[0].keySz);
+static void test_wolfSSH_RateLimit_Receive(void)
+{
+    test_PipeRun(test_RateLimitReceiveSetup, test_RateLimitReceiveRun);
+}
 #endif
 
-#ifndef WOLFSSH_NO_SSH_RSA_SHA1
-    lastKey = ctx->privateKey[ctx->privateKeyCount].key;
-    lastKeySz = ctx->privateKey[ctx->privateKeyCount].keySz;
 
-    AssertIntEQ(WS_SUCCESS,
-        wolfSSH_CTX_UsePrivateKey_buffer(ctx, rsaKey, rsaKeySz,
-                                         TEST_GOOD_FORMAT_ASN1));
-    AssertIntNE(0, ctx->privateKeyCount);
-    AssertNotNull(ctx->privateKey[0].key);
-    AssertIntNE(0, ctx->privateKey[0].keySz);
+static void test_wolfSSH_RateLimit(void)
+{
+    WOLFSSH_CTX* ctx;
+    WOLFSSH* ssh;
+    WS_RateLimit session;
+    WS_RateLimit channel;
 
-    AssertIntEQ(0, (lastKey == ctx->privateKey[0].key));
-    AssertIntNE(lastKeySz, ctx->privateKey[0].keySz);
-#endif
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetRateLimit(NULL, NULL, NULL));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_SetRateLimit(NULL, NULL, NULL));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_ChannelSetRateLimit(NULL, NULL));
 
-    /* Add the same keys again. This should succeed. */
-#if !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP256) || \
-    !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP384) || \
-    !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP521)
-    AssertIntEQ(WS_SUCCESS,
-        wolfSSH_CTX_UsePrivateKey_buffer(ctx, eccKey, eccKeySz,
-                                         TEST_GOOD_FORMAT_ASN1));
-#endif
-#ifndef WOLFSSH_NO_SSH_RSA_SHA1
-    AssertIntEQ(WS_SUCCESS,
-        wolfSSH_CTX_UsePrivateKey_buffer(ctx, rsaKey, rsaKeySz,
-                                         TEST_GOOD_FORMAT_ASN1));
-#endif
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_SERVER, NULL));
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+    AssertIntEQ(0, ssh->rateLimited);
+    AssertIntEQ(0, ssh->txRate.rate);
+    wolfSSH_free(ssh);
 
+    /* Sessions start with the CTX's limits, the burst defaults to a
+     * second's worth. */
+    WMEMSET(&session, 0, sizeof(session));
+    session.txRate = 1000;
+    session.rxRate = 2000;
+    WMEMSET(&channel, 0, sizeof(channel));
+    channel.txRate = 500;
+    channel.burst = 4096;
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetRateLimit(ctx, &session, &channel));
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+    AssertIntEQ(1, ssh->rateLimited);
+    AssertIntEQ(1000, ssh->txRate.rate);
+    AssertIntEQ(1000, ssh->txRate.burst);
+    AssertIntEQ(1000, ssh->txRate.tokens);
+    AssertIntEQ(2000, ssh->rxRate.burst);
+    AssertIntEQ(500, ssh->channelRate.txRate);
+
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetRateLimit(ssh, NULL, NULL));
+    AssertIntEQ(0, ssh->txRate.rate);
+    AssertIntEQ(0, ssh->rxRate.rate);
+    AssertIntEQ(0, ssh->channelRate.txRate);
+    wolfSSH_free(ssh);
     wolfSSH_CTX_free(ctx);
-#if !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP256) || \
-    !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP384) || \
-    !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP521)
-    FreeBins(eccKey, NULL, NULL, NULL);
-#endif
-#ifndef WOLFSSH_NO_RSA
-    FreeBins(rsaKey, NULL, NULL, NULL);
+
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_RateLimit_Pipe();
+    test_wolfSSH_RateLimit_Receive();
 #endif
-#endif /* WOLFSSH_NO_SERVER */
 }
 
 
-#ifdef WOLFSSH_CERTS
-static int load_file(const char* filename, byte** buf, word32* bufSz)
+static void test_wolfSSH_RekeyPolicy(void)
 {
-    FILE* f = NULL;
-    int ret = 0;
+    WOLFSSH_CTX* ctx;
+    WOLFSSH* ssh;
+    WS_RekeyPolicy policy;
+    WS_RekeyPolicy got;
+    word64 txCount = 1, rxCount = 1, txPackets = 1, rxPackets = 1;
 
-    if (filename == NULL || buf == NULL || bufSz == NULL)
-        ret = -1;
+    WMEMSET(&policy, 0, sizeof(policy));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetRekeyPolicy(NULL, &policy));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_SetRekeyPolicy(NULL, &policy));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_GetRekeyPolicy(NULL, &got));
 
-    if (ret == 0) {
-        f = fopen(filename, "rb");
-        if (f == NULL)
-            ret = -2;
-    }
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_CLIENT, NULL));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetRekeyPolicy(ctx, NULL));
 
-    if (ret == 0) {
-        ret = fseek(f, 0, XSEEK_END);
-        if (ret < 0)
-            ret = -3;
-    }
+    /* Byte limits past 4GB are kept, the word32 getter saturates. */
+    policy.bytes = (word64)8 * 1024 * 1024 * 1024;
+    policy.packets = 1000;
+    policy.seconds = 3600;
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetRekeyPolicy(ctx, &policy));
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_GetRekeyPolicy(ssh, NULL));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_GetRekeyPolicy(ssh, &got));
+    AssertTrue(got.bytes == policy.bytes);
+    AssertTrue(got.packets == policy.packets);
+    AssertIntEQ(policy.seconds, got.seconds);
+    AssertTrue(wolfSSH_GetHighwater(ssh) == 0xFFFFFFFF);
+
+    /* The old setter still sets the byte limit. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetHighwater(ssh, 4096));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_GetRekeyPolicy(ssh, &got));
+    AssertTrue(got.bytes == 4096);
+
+    policy.bytes = 0;
+    policy.packets = 0;
+    policy.seconds = 0;
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetRekeyPolicy(ssh, &policy));
+    AssertIntEQ(0, wolfSSH_GetHighwater(ssh));
+
+    wolfSSH_GetStats_ex(ssh, &txCount, &rxCount, &txPackets, &rxPackets);
+    AssertTrue(txCount == 0 && rxCount == 0);
+    AssertTrue(txPackets == 0 && rxPackets == 0);
 
-    if (ret == 0) {
-        long sz = ftell(f);
-        if (sz < 0)
-            ret = -4;
-        else
-            *bufSz = (word32)sz;
-    }
+    wolfSSH_free(ssh);
+    wolfSSH_CTX_free(ctx);
+}
 
-    if (ret == 0) {
-        rewind(f);
-        *buf = (byte*)malloc(*bufSz);
-        if (*buf == NULL)
-            ret = -5;
-    }
 
-    if (ret == 0) {
-        size_t readSz;
-        readSz = fread(*buf, 1, *bufSz, f);
-        if (readSz < *bufSz)
-            ret = -6;
-    }
+#ifdef TEST_PIPE_HANDSHAKE
+typedef struct TestHighwater {
+    WOLFSSH* ssh;
+    int count;
+} TestHighwater;
 
-    if (f != NULL) {
-        ret = fclose(f);
-        if (ret < 0)
-            ret = -7;
+
+/* Counts the limits reached, then starts the key exchange like the
+ * default callback. */
+static int test_HighwaterCb(byte dir, void* ctx)
+{
+    TestHighwater* hw = (TestHighwater*)ctx;
+
+    (void)dir;
+    hw->count++;
+
+    return wolfSSH_TriggerKeyExchange(hw->ssh);
+}
+
+
+/* Sends sz bytes from the client and reads them on the server, then lets
+ * a key exchange the send started finish. */
+static void test_RekeyPolicySend(WOLFSSH* server, WOLFSSH* client,
+        byte* msg, word32 sz)
+{
+    byte rx[1024];
+    word32 channelId;
+    int ret = WS_SUCCESS;
+    int rounds;
+
+    AssertIntEQ((int)sz, wolfSSH_stream_send(client, msg, sz));
+    for (rounds = 0; ret != WS_CHAN_RXD && rounds < 100; rounds++) {
+        wolfSSH_worker(client, NULL);
+        ret = wolfSSH_worker(server, &channelId);
     }
+    AssertIntEQ(WS_CHAN_RXD, ret);
+    AssertIntEQ((int)sz, wolfSSH_stream_read(server, rx, sizeof(rx)));
+    AssertIntEQ(0, WMEMCMP(rx, msg, sz));
+
+    for (rounds = 0; (client->isKeying || server->isKeying) && rounds < 100;
+            rounds++) {
+        wolfSSH_worker(client, NULL);
+        wolfSSH_worker(server, NULL);
+    }
+    AssertIntEQ(0, client->isKeying);
+    AssertIntEQ(0, server->isKeying);
+}
 
-    return ret;
+
+static void test_RekeyPolicySetup(WOLFSSH_CTX* serverCtx,
+        WOLFSSH_CTX* clientCtx)
+{
+    (void)serverCtx;
+    wolfSSH_SetHighwaterCb(clientCtx, 0, test_HighwaterCb);
+}
+
+
+/* Small packet and byte limits make the client rekey during the session,
+ * and the counters start over with the new keys. */
+static void test_RekeyPolicyRun(WOLFSSH* server, WOLFSSH* client)
+{
+    WS_RekeyPolicy policy;
+    TestHighwater hw;
+    byte msg[1000];
+    int i;
+
+    WMEMSET(msg, 0x5a, sizeof(msg));
+    WMEMSET(&hw, 0, sizeof(hw));
+    hw.ssh = client;
+    wolfSSH_SetHighwaterCtx(client, &hw);
+
+    WMEMSET(&policy, 0, sizeof(policy));
+    policy.packets = 8;
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetRekeyPolicy(client, &policy));
+    for (i = 0; i < 20; i++)
+        test_RekeyPolicySend(server, client, msg, 1);
+    AssertIntGT(hw.count, 0);
+    AssertTrue(client->txPacketCount < policy.packets);
+
+    hw.count = 0;
+    policy.packets = 0;
+    policy.bytes = 4096;
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetRekeyPolicy(client, &policy));
+    for (i = 0; i < 10; i++)
+        test_RekeyPolicySend(server, client, msg, (word32)sizeof(msg));
+    AssertIntGT(hw.count, 0);
+    AssertTrue(client->txCount < policy.bytes);
+}
+
+
+static void test_wolfSSH_RekeyPolicy_Pipe(void)
+{
+    test_PipeRun(test_RekeyPolicySetup, test_RekeyPolicyRun);
+}
+#endif
+
+
+#if defined(TEST_PIPE_HANDSHAKE) && WOLFSSH_PAD_POOL_SZ > 0
+/* Each packet takes its padding from the pool in order, and one that needs
+ * more than is left refills the whole pool from the RNG. */
+static void test_wolfSSH_PadPool(void)
+{
+    WOLFSSH_CTX* serverCtx;
+    WOLFSSH_CTX* clientCtx;
+    WOLFSSH* server;
+    WOLFSSH* client;
+    byte pool[WOLFSSH_PAD_POOL_SZ];
+    byte msg[] = "x";
+
+    test_PipeCtxNew(&serverCtx, &clientCtx);
+    AssertNotNull(server = wolfSSH_new(serverCtx));
+    AssertNotNull(client = wolfSSH_new(clientCtx));
+
+    /* The pool starts empty and the first packet fills it. */
+    AssertIntEQ(WOLFSSH_PAD_POOL_SZ, client->padPoolIdx);
+    AssertIntEQ(WS_SUCCESS, test_PipeConnect(server, client));
+    AssertIntLT(client->padPoolIdx, WOLFSSH_PAD_POOL_SZ);
+
+    client->padPoolIdx = 0;
+    WMEMCPY(pool, client->padPool, sizeof(pool));
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    AssertIntGE(client->padPoolIdx, MIN_PAD_LENGTH);
+    AssertIntLE(client->padPoolIdx, 255);
+    AssertIntEQ(0, WMEMCMP(pool, client->padPool, sizeof(pool)));
+
+    client->padPoolIdx = WOLFSSH_PAD_POOL_SZ - 1;
+    AssertIntEQ((int)sizeof(msg),
+            wolfSSH_stream_send(client, msg, (word32)sizeof(msg)));
+    AssertIntGE(client->padPoolIdx, MIN_PAD_LENGTH);
+    AssertIntLE(client->padPoolIdx, 255);
+    AssertIntNE(0, WMEMCMP(pool, client->padPool, sizeof(pool)));
+
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+    test_PipeCtxFree(serverCtx, clientCtx);
 }
 #endif
 
 
+static void test_wolfSSH_ConnectPipeline(void)
+{
+    WOLFSSH_CTX* ctx;
+    WOLFSSH* ssh;
+
+    AssertIntEQ(WS_BAD_ARGUMENT,
+            wolfSSH_CTX_SetConnectPipeline(NULL, WOLFSSH_USERAUTH_NONE));
+    AssertIntEQ(WS_BAD_ARGUMENT,
+            wolfSSH_SetConnectPipeline(NULL, WOLFSSH_USERAUTH_NONE));
+
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_CLIENT, NULL));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetConnectPipeline(ctx,
+                WOLFSSH_USERAUTH_KEYBOARD));
+    AssertIntEQ(WS_BAD_ARGUMENT, wolfSSH_CTX_SetConnectPipeline(ctx,
+                WOLFSSH_USERAUTH_PASSWORD | WOLFSSH_USERAUTH_PUBLICKEY));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetConnectPipeline(ctx,
+                WOLFSSH_USERAUTH_PUBLICKEY));
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+    AssertIntEQ(WOLFSSH_USERAUTH_PUBLICKEY, ssh->connectPipeline);
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetConnectPipeline(ssh, 0));
+    AssertIntEQ(0, ssh->connectPipeline);
+    wolfSSH_free(ssh);
+    wolfSSH_CTX_free(ctx);
+
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_ConnectPipeline_Handshake();
+#endif
+}
+
+
 static void test_wolfSSH_CTX_UseCert_buffer(void)
 {
 #ifdef WOLFSSH_CERTS
@@ -817,6 +3036,93 @@ static void test_wolfSSH_ReadKey(void)
 }
 
 
+#if defined(TEST_PIPE_HANDSHAKE) && !defined(WOLFSSH_NO_ECDSA_SHA2_NISTP256)
+typedef struct TestUserKey {
+    byte* pub;
+    word32 pubSz;
+    const byte* pubType;
+    word32 pubTypeSz;
+    byte* priv;
+    word32 privSz;
+    int verified;
+} TestUserKey;
+
+
+/* The client offers the user key, the server takes it when it is the same
+ * key and counts the signed requests. */
+static int test_PipePublicKeyAuth(byte authType, WS_UserAuthData* authData,
+        void* ctx)
+{
+    TestUserKey* userKey = (TestUserKey*)ctx;
+    WS_UserAuthData_PublicKey* pk = &authData->sf.publicKey;
+
+    if (authType != WOLFSSH_USERAUTH_PUBLICKEY)
+        return WOLFSSH_USERAUTH_INVALID_AUTHTYPE;
+
+    if (pk->publicKey == NULL) {
+        pk->publicKeyType = userKey->pubType;
+        pk->publicKeyTypeSz = userKey->pubTypeSz;
+        pk->publicKey = userKey->pub;
+        pk->publicKeySz = userKey->pubSz;
+        pk->privateKey = userKey->priv;
+        pk->privateKeySz = userKey->privSz;
+        return WOLFSSH_USERAUTH_SUCCESS;
+    }
+
+    if (pk->publicKeySz != userKey->pubSz
+            || WMEMCMP(pk->publicKey, userKey->pub, userKey->pubSz) != 0)
+        return WOLFSSH_USERAUTH_INVALID_PUBLICKEY;
+    if (pk->hasSignature)
+        userKey->verified++;
+
+    return WOLFSSH_USERAUTH_SUCCESS;
+}
+
+
+/* A pipelined public key request goes out before the server's EXT_INFO,
+ * so it is signed with the key type's default algorithm. */
+static void test_wolfSSH_ConnectPipeline_PublicKey(void)
+{
+    WOLFSSH_CTX* serverCtx;
+    WOLFSSH_CTX* clientCtx;
+    WOLFSSH* server;
+    WOLFSSH* client;
+    TestUserKey userKey;
+    const byte* privType = NULL;
+    word32 privTypeSz = 0;
+
+    WMEMSET(&userKey, 0, sizeof(userKey));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_ReadKey_buffer((const byte*)id_ecdsa_pub,
+                (word32)WSTRLEN(id_ecdsa_pub), WOLFSSH_FORMAT_SSH,
+                &userKey.pub, &userKey.pubSz,
+                &userKey.pubType, &userKey.pubTypeSz, NULL));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_ReadKey_buffer((const byte*)id_ecdsa,
+                (word32)WSTRLEN(id_ecdsa), WOLFSSH_FORMAT_OPENSSH,
+                &userKey.priv, &userKey.privSz, &privType, &privTypeSz,
+                NULL));
+
+    test_PipeCtxNew(&serverCtx, &clientCtx);
+    wolfSSH_SetUserAuth(serverCtx, test_PipePublicKeyAuth);
+    wolfSSH_SetUserAuth(clientCtx, test_PipePublicKeyAuth);
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetConnectPipeline(clientCtx,
+                WOLFSSH_USERAUTH_PUBLICKEY));
+
+    AssertNotNull(server = wolfSSH_new(serverCtx));
+    AssertNotNull(client = wolfSSH_new(clientCtx));
+    wolfSSH_SetUserAuthCtx(server, &userKey);
+    wolfSSH_SetUserAuthCtx(client, &userKey);
+    AssertIntEQ(WS_SUCCESS, test_PipeConnect(server, client));
+    AssertIntGT(userKey.verified, 0);
+
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+    test_PipeCtxFree(serverCtx, clientCtx);
+    WFREE(userKey.priv, NULL, DYNTYPE_FILE);
+    WFREE(userKey.pub, NULL, DYNTYPE_FILE);
+}
+#endif
+
+
 #ifdef WOLFSSH_SCP
 
 static int my_ScpRecv(WOLFSSH* ssh, int state, const char* basePath,
@@ -869,6 +3175,153 @@ static void test_wolfSSH_SCP_CB(void)
     wolfSSH_CTX_free(ctx);
 }
 
+#ifdef TEST_PIPE_HANDSHAKE
+#define TEST_SCP_UPLOAD_SZ (32 * 1024)
+
+/* Serves a file of TEST_SCP_UPLOAD_SZ bytes, each the low byte of its
+ * offset. */
+static int test_ScpUploadSend(WOLFSSH* ssh, int state,
+        const char* peerRequest, char* fileName, word32 fileNameSz,
+        word64* mTime, word64* aTime, int* fileMode, word32 fileOffset,
+        word32* totalFileSz, byte* buf, word32 bufSz, void* ctx)
+{
+    word32 sz;
+    word32 i;
+
+    (void)ssh;
+    (void)peerRequest;
+    (void)ctx;
+
+    switch (state) {
+        case WOLFSSH_SCP_NEW_REQUEST:
+            return WS_SUCCESS;
+
+        case WOLFSSH_SCP_SINGLE_FILE_REQUEST:
+            WSTRNCPY(fileName, "upload", fileNameSz);
+            *mTime = 0;
+            *aTime = 0;
+            *fileMode = 0644;
+            *totalFileSz = TEST_SCP_UPLOAD_SZ;
+            FALL_THROUGH;
+
+        case WOLFSSH_SCP_CONTINUE_FILE_TRANSFER:
+            sz = TEST_SCP_UPLOAD_SZ - fileOffset;
+            if (sz > bufSz)
+                sz = bufSz;
+            for (i = 0; i < sz; i++)
+                buf[i] = (byte)(fileOffset + i);
+            return (int)sz;
+    }
+
+    return WS_SCP_ABORT;
+}
+
+
+/* Counts the bytes of the upload that arrive in order. */
+static int test_ScpUploadRecv(WOLFSSH* ssh, int state, const char* basePath,
+    const char* fileName, int fileMode, word64 mTime, word64 aTime,
+    word32 totalFileSz, byte* buf, word32 bufSz, word32 fileOffset,
+    void* ctx)
+{
+    word32* rxSz = (word32*)ctx;
+    word32 i;
+
+    (void)ssh;
+    (void)basePath;
+    (void)fileName;
+    (void)fileMode;
+    (void)mTime;
+    (void)aTime;
+    (void)totalFileSz;
+
+    if (state == WOLFSSH_SCP_FILE_PART) {
+        for (i = 0; i < bufSz; i++) {
+            if (buf[i] != (byte)(fileOffset + i))
+                return WS_SCP_ABORT;
+        }
+        *rxSz += bufSz;
+    }
+
+    return WS_SCP_CONTINUE;
+}
+
+
+/* An SCP upload to a server with a receive limit, run the way wolfsshd
+ * runs it: when both sides wait on each other, the server waits out
+ * wolfSSH_GetRateLimitWait() and calls wolfSSH_accept() again, which gives
+ * back the window the limit held. */
+static void test_wolfSSH_SCP_RateLimit(void)
+{
+    WOLFSSH_CTX* serverCtx;
+    WOLFSSH_CTX* clientCtx;
+    WOLFSSH* server;
+    WOLFSSH* client;
+    WS_RateLimit limit;
+    word32 rxSz = 0;
+    int serverRet;
+    int clientRet;
+    int waits = 0;
+    int rounds = 0;
+
+    test_PipeCtxNew(&serverCtx, &clientCtx);
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetWindowPacketSize(serverCtx,
+                TEST_RATE_WINDOW_SZ, 4096));
+    WMEMSET(&limit, 0, sizeof(limit));
+    limit.rxRate = TEST_RATE_RX;
+    AssertIntEQ(WS_SUCCESS,
+            wolfSSH_CTX_SetRateLimit(serverCtx, &limit, NULL));
+    wolfSSH_SetScpRecv(serverCtx, test_ScpUploadRecv);
+    wolfSSH_SetScpSend(clientCtx, test_ScpUploadSend);
+
+    AssertNotNull(server = wolfSSH_new(serverCtx));
+    AssertNotNull(client = wolfSSH_new(clientCtx));
+    wolfSSH_SetScpRecvCtx(server, &rxSz);
+
+    testClientToServer.sz = 0;
+    testServerToClient.sz = 0;
+    wolfSSH_SetIOReadCtx(server, &testServerLink);
+    wolfSSH_SetIOWriteCtx(server, &testServerLink);
+    wolfSSH_SetIOReadCtx(client, &testClientLink);
+    wolfSSH_SetIOWriteCtx(client, &testClientLink);
+    AssertIntEQ(WS_SUCCESS, wolfSSH_SetUsername(client, "jill"));
+
+    /* The client is done once the server confirmed the whole file. */
+    for (;;) {
+        clientRet = wolfSSH_SCP_to(client, "upload", ".");
+        if (clientRet == WS_SUCCESS)
+            break;
+        clientRet = wolfSSH_get_error(client);
+        AssertTrue(clientRet == WS_WANT_READ || clientRet == WS_WANT_WRITE);
+
+        serverRet = wolfSSH_accept(server);
+        if (serverRet != WS_SCP_INIT)
+            serverRet = wolfSSH_get_error(server);
+        AssertTrue(serverRet == WS_SCP_INIT || serverRet == WS_WANT_READ
+                || serverRet == WS_WANT_WRITE);
+
+        /* Nothing in flight: the client waits on window the server holds
+         * back, which is due once the server's bucket refills. */
+        if (clientRet == WS_WANT_READ && serverRet == WS_WANT_READ
+                && testClientToServer.sz == 0
+                && testServerToClient.sz == 0) {
+            AssertIntNE(WOLFSSH_RATE_NO_WAIT,
+                    wolfSSH_GetRateLimitWait(server));
+            server->rxRate.last -= 1000;
+            AssertIntEQ(0, wolfSSH_GetRateLimitWait(server));
+            waits++;
+        }
+        AssertIntLT(++rounds, 1000);
+    }
+
+    AssertIntEQ(TEST_SCP_UPLOAD_SZ, rxSz);
+    AssertIntGT(waits, 0);
+
+    wolfSSH_free(client);
+    wolfSSH_free(server);
+    test_PipeCtxFree(serverCtx, clientCtx);
+}
+#endif /* TEST_PIPE_HANDSHAKE */
+
 #else /* WOLFSSH_SCP */
 static void test_wolfSSH_SCP_CB(void) { ; }
 #endif /* WOLFSSH_SCP */
@@ -1525,6 +3978,110 @@ static void test_wolfSSH_SetAlgoList(void)
 }
 
 
+typedef struct TestKexInit {
+    byte out[4096];
+    word32 outSz;
+    word32 inIdx;
+} TestKexInit;
+
+
+static int test_KexInitRecv(WOLFSSH* ssh, void* data, word32 sz, void* ctx)
+{
+    static const char version[] = "SSH-2.0-Test\r\n";
+    TestKexInit* kexInit = (TestKexInit*)ctx;
+    word32 left = (word32)sizeof(version) - 1 - kexInit->inIdx;
+
+    (void)ssh;
+
+    if (left == 0)
+        return WS_CBIO_ERR_WANT_READ;
+    if (sz > left)
+        sz = left;
+    WMEMCPY(data, version + kexInit->inIdx, sz);
+    kexInit->inIdx += sz;
+
+    return (int)sz;
+}
+
+
+static int test_KexInitSend(WOLFSSH* ssh, void* data, word32 sz, void* ctx)
+{
+    TestKexInit* kexInit = (TestKexInit*)ctx;
+
+    (void)ssh;
+
+    if (sz > sizeof(kexInit->out) - kexInit->outSz)
+        return WS_CBIO_ERR_GENERAL;
+    WMEMCPY(kexInit->out + kexInit->outSz, data, sz);
+    kexInit->outSz += sz;
+
+    return (int)sz;
+}
+
+
+/* Starts a client session on ctx and returns the KEX algorithm list from
+ * the KEXINIT it sends. If kexList isn't NULL, the session uses it. */
+static void test_KexInitKexList(WOLFSSH_CTX* ctx, const char* kexList,
+        char* list, word32 listSz)
+{
+    TestKexInit kexInit;
+    WOLFSSH* ssh;
+    byte* p;
+    word32 sz;
+
+    WMEMSET(&kexInit, 0, sizeof(kexInit));
+    AssertNotNull(ssh = wolfSSH_new(ctx));
+    if (kexList != NULL)
+        AssertIntEQ(WS_SUCCESS, wolfSSH_SetAlgoListKex(ssh, kexList));
+    wolfSSH_SetIOReadCtx(ssh, &kexInit);
+    wolfSSH_SetIOWriteCtx(ssh, &kexInit);
+    AssertIntEQ(WS_FATAL_ERROR, wolfSSH_connect(ssh));
+    AssertIntEQ(WS_WANT_READ, wolfSSH_get_error(ssh));
+    wolfSSH_free(ssh);
+
+    /* Skip the version line, packet length, and padding length. */
+    p = (byte*)WSTRSTR((char*)kexInit.out, "\r\n");
+    AssertNotNull(p);
+    p += 2 + 4 + 1;
+    AssertIntEQ(MSGID_KEXINIT, *p);
+    p += 1 + COOKIE_SZ;
+    sz = ((word32)p[0] << 24) | ((word32)p[1] << 16)
+        | ((word32)p[2] << 8) | (word32)p[3];
+    AssertTrue(sz < listSz);
+    WMEMCPY(list, p + 4, sz);
+    list[sz] = '\0';
+}
+
+
+static void test_wolfSSH_KexInitCache(void)
+{
+    const char* newKexList = "ecdh-sha2-nistp256";
+    const char* sessionKexList = "ecdh-sha2-nistp384";
+    WOLFSSH_CTX* ctx;
+    char list[1024];
+
+    AssertNotNull(ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_CLIENT, NULL));
+    AssertNotNull(ctx->kexInitBody);
+    wolfSSH_SetIORecv(ctx, test_KexInitRecv);
+    wolfSSH_SetIOSend(ctx, test_KexInitSend);
+
+    test_KexInitKexList(ctx, NULL, list, sizeof(list));
+    AssertIntEQ(0, WSTRCMP(list + WSTRLEN(list) - WSTRLEN(",ext-info-c"),
+                ",ext-info-c"));
+
+    /* Changing the CTX's list rebuilds the cached message. */
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CTX_SetAlgoListKex(ctx, newKexList));
+    test_KexInitKexList(ctx, NULL, list, sizeof(list));
+    AssertIntEQ(0, WSTRCMP(list, "ecdh-sha2-nistp256,ext-info-c"));
+
+    /* A session with its own list doesn't use the cache. */
+    test_KexInitKexList(ctx, sessionKexList, list, sizeof(list));
+    AssertIntEQ(0, WSTRCMP(list, "ecdh-sha2-nistp384,ext-info-c"));
+
+    wolfSSH_CTX_free(ctx);
+}
+
+
 static void test_wolfSSH_QueryAlgoList(void)
 {
     const char* name;
@@ -1578,6 +4135,26 @@ static void test_wolfSSH_QueryAlgoList(void)
 
     k = wolfSSH_CheckAlgoName("not-an-algo@wolfssl.com");
     AssertIntEQ(WS_INVALID_ALGO_ID, k);
+
+    /* Every listed name is found by the sorted lookup, and names one
+     * character off either end are not. */
+    i = 0;
+    while ((name = wolfSSH_QueryKex(&i)) != NULL)
+        AssertIntEQ(WS_SUCCESS, wolfSSH_CheckAlgoName(name));
+    i = 0;
+    while ((name = wolfSSH_QueryKey(&i)) != NULL)
+        AssertIntEQ(WS_SUCCESS, wolfSSH_CheckAlgoName(name));
+    i = 0;
+    while ((name = wolfSSH_QueryCipher(&i)) != NULL)
+        AssertIntEQ(WS_SUCCESS, wolfSSH_CheckAlgoName(name));
+    i = 0;
+    while ((name = wolfSSH_QueryMac(&i)) != NULL)
+        AssertIntEQ(WS_SUCCESS, wolfSSH_CheckAlgoName(name));
+    AssertIntEQ(WS_SUCCESS, wolfSSH_CheckAlgoName("none"));
+    AssertIntEQ(WS_INVALID_ALGO_ID, wolfSSH_CheckAlgoName("ssh-rs"));
+    AssertIntEQ(WS_INVALID_ALGO_ID, wolfSSH_CheckAlgoName("ssh-rsaa"));
+    AssertIntEQ(WS_INVALID_ALGO_ID, wolfSSH_CheckAlgoName("a"));
+    AssertIntEQ(WS_INVALID_ALGO_ID, wolfSSH_CheckAlgoName("zzzz"));
 }
 
 #ifdef WOLFSSH_KEYBOARD_INTERACTIVE
@@ -1764,20 +4341,82 @@ int wolfSSH_ApiTest(int argc, char** argv)
     test_server_wolfSSH_new();
     test_client_wolfSSH_new();
     test_wolfSSH_set_fd();
+    test_wolfSSH_SetReadAhead();
+    test_wolfSSH_worker_ex();
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_BufferRetain();
+#endif
+    test_wolfSSH_Cork();
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_Cork_Pipe();
+#endif
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_ChannelDataCb();
+#endif
+    test_wolfSSH_KexKeyPool();
+#if defined(TEST_PIPE_HANDSHAKE) && !defined(WOLFSSH_NO_ECDH_SHA2_NISTP256)
+    test_wolfSSH_KexKeyPool_Pipe();
+#endif
+#if defined(TEST_PIPE_HANDSHAKE) && !defined(WOLFSSH_NO_HOST_KEY_CACHE)
+    test_wolfSSH_HostKeyCopies();
+#endif
+    test_wolfSSH_SignOffload();
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_SignOffload_Pipe();
+#endif
     test_wolfSSH_SetUsername();
     test_wolfSSH_ConvertConsole();
     test_wolfSSH_CTX_UsePrivateKey_buffer();
+    test_wolfSSH_DevId();
+#if defined(WOLF_CRYPTO_CB) && defined(TEST_PIPE_HANDSHAKE)
+    test_wolfSSH_DevId_CryptoCb();
+#endif
+    test_wolfSSH_KexGuess();
+    test_wolfSSH_ConnectPipeline();
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_RekeyQueue();
+    test_wolfSSH_RekeyQueue_Close();
+#endif
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_worker_ex_Drain();
+#endif
+    test_wolfSSH_RekeyPolicy();
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_RekeyPolicy_Pipe();
+#endif
+#if defined(TEST_PIPE_HANDSHAKE) && WOLFSSH_PAD_POOL_SZ > 0
+    test_wolfSSH_PadPool();
+#endif
+#if defined(WOLFSSH_FWD) && defined(TEST_PIPE_HANDSHAKE)
+    test_wolfSSH_ChannelTable();
+#endif
+#ifdef TEST_MEM_ENTRIES
+    test_wolfSSH_ChannelMemory();
+#endif
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_WindowAutoTune();
+    test_wolfSSH_ChannelBuffer();
+#endif
+#ifdef TEST_PIPE_HANDSHAKE
+    test_wolfSSH_LargePacket();
+#endif
+    test_wolfSSH_ChannelScheduler();
+    test_wolfSSH_RateLimit();
     test_wolfSSH_CTX_UseCert_buffer();
     test_wolfSSH_CertMan();
     test_wolfSSH_ReadKey();
     test_wolfSSH_QueryAlgoList();
     test_wolfSSH_SetAlgoList();
+    test_wolfSSH_KexInitCache();
 #ifdef WOLFSSH_KEYBOARD_INTERACTIVE
     test_wolfSSH_KeyboardInteractive();
 #endif
 
     /* SCP tests */
     test_wolfSSH_SCP_CB();
+#if defined(WOLFSSH_SCP) && defined(TEST_PIPE_HANDSHAKE)
+    test_wolfSSH_SCP_RateLimit();
+#endif
 
     /* SFTP tests */
     test_wolfSSH_SFTP_SendReadPacket();
@@ -139,7 +139,10 @@
 
 #if !defined(NO_WOLFSSH_SERVER) && !defined(NO_WOLFSSH_CLIENT) && \
     !defined(SINGLE_THREADED) && !defined(WOLFSSH_TEST_BLOCK) && \
-    !defined(WOLFSSH_NO_DH_GROUP16_SHA512) && !defined(WOLFSSH_NO_HMAC_SHA2_512)
+    ((!defined(WOLFSSH_NO_DH_GROUP16_SHA512) && \
+      !defined(WOLFSSH_NO_HMAC_SHA2_512)) || \
+     !defined(WOLFSSH_NO_CHACHA20_POLY1305) || \
+     (!defined(WOLFSSH_NO_HMAC_SHA2_256) && !defined(WOLFSSH_NO_AES_CTR)))
 
 static int tsClientUserAuth(byte authType, WS_UserAuthData* authData, void* ctx)
 {
@@ -209,7 +212,13 @@ static int tsClientUserAuth(byte authType, WS_UserAuthData* authData, void* ctx)
 } while (0)
 
 
-static int wolfSSH_wolfSSH_Group16_512(void)
+/*
+ * Runs the echoserver and client against each other with the server
+ * restricted to the given algorithms. Any of kex, mac, or cipher may be
+ * NULL to leave that list at its default. Returns EXIT_SUCCESS when both
+ * sides finished without error.
+ */
+static int wolfSSH_KexRun(const char* kex, const char* mac, const char* cipher)
 {
     tcp_ready ready;
     THREAD_TYPE serverThread;
@@ -256,12 +265,18 @@ static int wolfSSH_wolfSSH_Group16_512(void)
         ADD_ARG(serverArgv, serverArgc, "-p");
         ADD_ARG(serverArgv, serverArgc, "-0");
     #endif
-    ADD_ARG(serverArgv, serverArgc, "-x");
-    ADD_ARG(serverArgv, serverArgc, "diffie-hellman-group16-sha512");
-    ADD_ARG(serverArgv, serverArgc, "-m");
-    ADD_ARG(serverArgv, serverArgc, "hmac-sha2-512");
-    ADD_ARG(serverArgv, serverArgc, "-c");
-    ADD_ARG(serverArgv, serverArgc, "aes256-cbc");
+    if (kex != NULL) {
+        ADD_ARG(serverArgv, serverArgc, "-x");
+        ADD_ARG(serverArgv, serverArgc, kex);
+    }
+    if (mac != NULL) {
+        ADD_ARG(serverArgv, serverArgc, "-m");
+        ADD_ARG(serverArgv, serverArgc, mac);
+    }
+    if (cipher != NULL) {
+        ADD_ARG(serverArgv, serverArgc, "-c");
+        ADD_ARG(serverArgv, serverArgc, cipher);
+    }
 
     serverArgs.argc = serverArgc;
     serverArgs.argv = serverArgv;
@@ -274,8 +289,10 @@ static int wolfSSH_wolfSSH_Group16_512(void)
     ADD_ARG(clientArgv, clientArgc, "client");
     ADD_ARG(clientArgv, clientArgc, "-u");
     ADD_ARG(clientArgv, clientArgc, "jill");
-    ADD_ARG(clientArgv, clientArgc, "-C");
-    ADD_ARG(clientArgv, clientArgc, "aes256-cbc");
+    if (cipher != NULL) {
+        ADD_ARG(clientArgv, clientArgc, "-C");
+        ADD_ARG(clientArgv, clientArgc, cipher);
+    }
     #if !defined(USE_WINDOWS_API) && !defined(WOLFSSH_ZEPHYR)
         ADD_ARG(clientArgv, clientArgc, "-p");
         ADD_ARG_INT(clientArgv, clientArgc, ready.port);
@@ -309,15 +326,44 @@ static int wolfSSH_wolfSSH_Group16_512(void)
         serverArgs.return_code = WS_SUCCESS;
     }
 #endif
-    /* Socket error may printf, but this is fine */
-    AssertIntEQ(WS_SUCCESS, clientArgs.return_code);
-    AssertIntEQ(WS_SUCCESS, serverArgs.return_code);
-
     FreeTcpReady(&ready);
 
+    /* Socket error may printf, but this is fine */
+    if (clientArgs.return_code != WS_SUCCESS ||
+            serverArgs.return_code != WS_SUCCESS) {
+        printf("KEX run failed, client %d, server %d\n",
+                clientArgs.return_code, serverArgs.return_code);
+        return EXIT_FAILURE;
+    }
+
     return EXIT_SUCCESS;
 }
 
+
+#if !defined(WOLFSSH_NO_DH_GROUP16_SHA512) && !defined(WOLFSSH_NO_HMAC_SHA2_512)
+static int wolfSSH_wolfSSH_Group16_512(void)
+{
+    return wolfSSH_KexRun("diffie-hellman-group16-sha512",
+            "hmac-sha2-512", "aes256-cbc");
+}
+#endif
+
+
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+static int wolfSSH_wolfSSH_ChaCha20Poly1305(void)
+{
+    return wolfSSH_KexRun(NULL, NULL, "chacha20-poly1305@openssh.com");
+}
+#endif
+
+
+#if !defined(WOLFSSH_NO_HMAC_SHA2_256) && !defined(WOLFSSH_NO_AES_CTR)
+static int wolfSSH_wolfSSH_EtmSha256(void)
+{
+    return wolfSSH_KexRun(NULL, "hmac-sha2-256-etm@openssh.com", "aes256-ctr");
+}
+#endif
+
 #endif
 
 int wolfSSH_KexTest(int argc, char** argv)
@@ -342,7 +388,13 @@ int wolfSSH_KexTest(int argc, char** argv)
     #endif /* HAVE_FIPS */
 
 #if !defined(WOLFSSH_NO_DH_GROUP16_SHA512) && !defined(WOLFSSH_NO_HMAC_SHA2_512)
-    wolfSSH_wolfSSH_Group16_512();
+    AssertIntEQ(EXIT_SUCCESS, wolfSSH_wolfSSH_Group16_512());
+#endif
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+    AssertIntEQ(EXIT_SUCCESS, wolfSSH_wolfSSH_ChaCha20Poly1305());
+#endif
+#if !defined(WOLFSSH_NO_HMAC_SHA2_256) && !defined(WOLFSSH_NO_AES_CTR)
+    AssertIntEQ(EXIT_SUCCESS, wolfSSH_wolfSSH_EtmSha256());
 #endif
 
     AssertIntEQ(wolfSSH_Cleanup(), WS_SUCCESS);
@@ -137,6 +137,7 @@ struct WOLFSSH_AGENT_CTX {
     WOLFSSH_AGENT_ID* idList;
     word32 idListSz;
     int error;
+    int devId;
     enum AgentStates state;
     int requestSuccess;
     int requestFailure;
@@ -136,8 +136,9 @@ enum WS_ErrorCodes {
     WS_ED25519_E            = -1095, /* Ed25519 failure */
     WS_AUTH_PENDING         = -1096, /* User authentication still pending */
     WS_KDF_E                = -1097, /* KDF error*/
+    WS_WANT_CRYPTO          = -1098, /* Offloaded crypto still pending */
 
-    WS_LAST_E               = WS_KDF_E  /* Update this to indicate last error */
+    WS_LAST_E               = WS_WANT_CRYPTO  /* Update this to indicate last error */
 };
 
 
@@ -32,8 +32,11 @@
 #include <wolfssh/wolfsftp.h>
 
 #include <wolfssl/wolfcrypt/hash.h>
+#include <wolfssl/wolfcrypt/hmac.h>
 #include <wolfssl/wolfcrypt/random.h>
 #include <wolfssl/wolfcrypt/aes.h>
+#include <wolfssl/wolfcrypt/chacha.h>
+#include <wolfssl/wolfcrypt/poly1305.h>
 #include <wolfssl/wolfcrypt/dh.h>
 #include <wolfssl/wolfcrypt/ecc.h>
 #include <wolfssl/wolfcrypt/rsa.h>
@@ -274,6 +277,8 @@ extern "C" {
 #ifdef WOLFSSH_NO_AEAD
     #undef WOLFSSH_NO_AES_GCM
     #define WOLFSSH_NO_AES_GCM
+    #undef WOLFSSH_NO_CHACHA20_POLY1305
+    #define WOLFSSH_NO_CHACHA20_POLY1305
 #endif
 
 #if defined(NO_AES) || !defined(HAVE_AES_CBC)
@@ -288,14 +293,20 @@ extern "C" {
     #undef WOLFSSH_NO_AES_GCM
     #define WOLFSSH_NO_AES_GCM
 #endif
+#if !defined(HAVE_CHACHA) || !defined(HAVE_POLY1305)
+    #undef WOLFSSH_NO_CHACHA20_POLY1305
+    #define WOLFSSH_NO_CHACHA20_POLY1305
+#endif
 
 #if defined(WOLFSSH_NO_AES_CBC) && \
     defined(WOLFSSH_NO_AES_CTR) && \
-    defined(WOLFSSH_NO_AES_GCM)
+    defined(WOLFSSH_NO_AES_GCM) && \
+    defined(WOLFSSH_NO_CHACHA20_POLY1305)
     #error "You need at least one encryption algorithm."
 #endif
 
-#if defined(WOLFSSH_NO_AES_GCM)
+#if defined(WOLFSSH_NO_AES_GCM) && \
+    defined(WOLFSSH_NO_CHACHA20_POLY1305)
     #undef WOLFSSH_NO_AEAD
     #define WOLFSSH_NO_AEAD
 #endif
@@ -324,12 +335,15 @@ enum {
     ID_AES128_GCM,
     ID_AES192_GCM,
     ID_AES256_GCM,
+    ID_CHACHA20_POLY1305,
 
     /* Integrity IDs */
     ID_HMAC_SHA1,
     ID_HMAC_SHA1_96,
     ID_HMAC_SHA2_256,
     ID_HMAC_SHA2_512,
+    ID_HMAC_SHA2_256_ETM,
+    ID_HMAC_SHA2_512_ETM,
 
     /* Key Exchange IDs */
     ID_DH_GROUP1_SHA1,
@@ -425,12 +439,41 @@ enum NameIdType {
 #define AEAD_IMP_IV_SZ 4
 #define AEAD_EXP_IV_SZ 8
 #define AEAD_NONCE_SZ (AEAD_IMP_IV_SZ+AEAD_EXP_IV_SZ)
+#define CHACHA_POLY_KEY_SZ 64 /* K_2 followed by K_1 */
+#define CHACHA_POLY_TAG_SZ 16
+#define CHACHA_POLY_BLOCK_SZ 8
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+    #define MAX_ENC_KEY_SZ CHACHA_POLY_KEY_SZ
+#else
+    #define MAX_ENC_KEY_SZ AES_256_KEY_SIZE
+#endif
 #ifndef DEFAULT_HIGHWATER_MARK
     #define DEFAULT_HIGHWATER_MARK ((1024 * 1024 * 1024) - (32 * 1024))
 #endif
+#ifndef DEFAULT_REKEY_PACKETS
+    /* RFC 4344 section 3.1, rekey well before the sequence number wraps. */
+    #define DEFAULT_REKEY_PACKETS ((word64)1 << 31)
+#endif
+/* A word64 as the two word32 halves for "0x%08x%08x" in a log message,
+ * there is no portable printf format for it. */
+#define WLOG_W64(x) (word32)((word64)(x) >> 32), (word32)(x)
 #ifndef DEFAULT_WINDOW_SZ
     #define DEFAULT_WINDOW_SZ (128 * 1024)
 #endif
+#ifndef MAX_WINDOW_SZ
+    /* Ceiling for window auto-tuning. */
+    #define MAX_WINDOW_SZ (64 * 1024 * 1024)
+#endif
+#ifndef MAX_SESSION_WINDOW_SZ
+    /* Ceiling for the window auto-tuning adds across a session's channels,
+     * on top of their starting windows. */
+    #define MAX_SESSION_WINDOW_SZ (128 * 1024 * 1024)
+#endif
+#ifndef DEFAULT_WINDOW_BUDGET_SZ
+    /* Ceiling for the window auto-tuning adds across all of a context's
+     * sessions, see wolfSSH_CTX_SetWindowBudget(). */
+    #define DEFAULT_WINDOW_BUDGET_SZ (1024 * 1024 * 1024)
+#endif
 #ifndef DEFAULT_MAX_PACKET_SZ
     /* This is from RFC 4253 section 6.1. */
     #define DEFAULT_MAX_PACKET_SZ 32768
@@ -438,10 +481,76 @@ enum NameIdType {
 #ifndef DEFAULT_NEXT_CHANNEL
     #define DEFAULT_NEXT_CHANNEL 0
 #endif
+#ifndef WOLFSSH_CHANNEL_BUFFER_MIN
+    /* First allocation for a channel's input buffer, which then doubles
+     * as needed up to the channel's window. A drained buffer larger than
+     * this is released. */
+    #define WOLFSSH_CHANNEL_BUFFER_MIN 4096
+#endif
+#ifndef WOLFSSH_CHANNEL_HASH_SZ
+    /* Initial buckets in each channel ID table, a power of two. */
+    #define WOLFSSH_CHANNEL_HASH_SZ 16
+#endif
+#ifndef DEFAULT_READ_AHEAD_SZ
+    /* 0 reads only the bytes needed for the current packet. */
+    #define DEFAULT_READ_AHEAD_SZ 0
+#endif
+#ifndef MAX_READ_AHEAD_SZ
+    #define MAX_READ_AHEAD_SZ (1024 * 1024)
+#endif
+#ifndef DEFAULT_CORK_SZ
+    #define DEFAULT_CORK_SZ (64 * 1024)
+#endif
+#ifndef WOLFSSH_BUFFER_RETAIN_SZ
+    #define WOLFSSH_BUFFER_RETAIN_SZ (64 * 1024)
+#endif
+#ifndef DEFAULT_REKEY_QUEUE_SZ
+    /* Channel data accepted while rekeying, before the sends block. */
+    #define DEFAULT_REKEY_QUEUE_SZ (256 * 1024)
+#endif
+#ifndef WOLFSSH_CHANNEL_TXQ_SZ
+    /* Channel data one channel may have waiting for the scheduler. */
+    #define WOLFSSH_CHANNEL_TXQ_SZ (64 * 1024)
+#endif
+#ifndef WOLFSSH_SCHED_QUANTUM
+    /* Bytes a bulk channel may send per round, per unit of weight. */
+    #define WOLFSSH_SCHED_QUANTUM 16384
+#endif
+#ifndef WOLFSSH_SCHED_MAX_WEIGHT
+    #define WOLFSSH_SCHED_MAX_WEIGHT 256
+#endif
+#ifndef WOLFSSH_SCHED_BURST
+    /* Bytes the scheduler seals before each write attempt. */
+    #define WOLFSSH_SCHED_BURST (64 * 1024)
+#endif
+#ifndef WOLFSSH_SCHED_LATENCY_BURST
+    /* Bytes of a burst the latency class may take while bulk data waits. */
+    #define WOLFSSH_SCHED_LATENCY_BURST (WOLFSSH_SCHED_BURST / 2)
+#endif
+#if WOLFSSH_SCHED_LATENCY_BURST == 0 || \
+    WOLFSSH_SCHED_LATENCY_BURST >= WOLFSSH_SCHED_BURST
+    #error WOLFSSH_SCHED_LATENCY_BURST must leave the bulk class some burst
+#endif
+#ifndef WOLFSSH_PAD_POOL_SZ
+    /* Random bytes drawn at once for packet padding, 0 for none. */
+    #define WOLFSSH_PAD_POOL_SZ 1024
+#endif
+#if WOLFSSH_PAD_POOL_SZ != 0 && WOLFSSH_PAD_POOL_SZ < 256
+    #error WOLFSSH_PAD_POOL_SZ must be 0 or hold the largest padding, 255 bytes
+#endif
+#ifndef MAX_KEX_KEY_POOL_SZ
+    #define MAX_KEX_KEY_POOL_SZ 64
+#endif
 #ifndef MAX_PACKET_SZ
     /* This is from RFC 4253 section 6.1. */
     #define MAX_PACKET_SZ 35000
 #endif
+/* Room for the message header, padding, and MAC around a channel packet
+ * of maxPacketSz bytes. Same slack RFC 4253 gives 32768 byte payloads. */
+#define PACKET_OVERHEAD_SZ 2232
+#ifndef MAX_CHANNEL_PACKET_SZ
+    #define MAX_CHANNEL_PACKET_SZ (1024 * 1024)
+#endif
 #ifndef WOLFSSH_DEFAULT_GEXDH_MIN
     #define WOLFSSH_DEFAULT_GEXDH_MIN 1024
 #endif
@@ -474,6 +583,7 @@ enum NameIdType {
 #endif
 
 
+WOLFSSH_LOCAL void NameIdIndexInit(void);
 WOLFSSH_LOCAL byte NameToId(const char* name, word32 nameSz);
 WOLFSSH_LOCAL const char* IdToName(byte id);
 WOLFSSH_LOCAL const char* NameByIndexType(byte type, word32* idx);
@@ -499,6 +609,7 @@ typedef struct WOLFSSH_BUFFER {
     word32 bufferSz;  /* current buffer size */
     ALIGN16 byte staticBuffer[STATIC_BUFFER_LEN];
     byte dynamicFlag; /* dynamic memory currently in use */
+    word32 retainSz;  /* drained buffer larger than this is released, 0 keeps */
 } WOLFSSH_BUFFER;
 
 WOLFSSH_LOCAL int BufferInit(WOLFSSH_BUFFER* buffer, word32 size, void* heap);
@@ -506,9 +617,39 @@ WOLFSSH_LOCAL int GrowBuffer(WOLFSSH_BUFFER* buf, word32 sz);
 WOLFSSH_LOCAL void ShrinkBuffer(WOLFSSH_BUFFER* buf, int forcedFree);
 
 
+/* Host private key decoded from its DER, ready to sign. wolfCrypt keeps
+ * per-operation state in its key objects, so a handshake takes a copy for
+ * itself and gives it back when done. The CTX keeps the copies not in use
+ * for the next handshakes. */
+typedef struct WOLFSSH_HOST_KEY {
+    union {
+#ifndef WOLFSSH_NO_RSA
+        RsaKey rsa;
+#endif
+#ifndef WOLFSSH_NO_ECDSA
+        ecc_key ecc;
+#endif
+#ifndef WOLFSSH_NO_ED25519
+        ed25519_key ed;
+#endif
+        byte none;
+    } sk;
+    struct WOLFSSH_CTX* ctx;       /* owner, the copy goes back there */
+    struct WOLFSSH_HOST_KEY* next; /* list of copies not in use */
+    word32 keyIdx;                 /* in ctx->privateKey */
+    word32 gen;                    /* the key's hostKeyGen when decoded */
+    int devId;
+    byte keyId;
+} WOLFSSH_HOST_KEY;
+
+
 typedef struct WOLFSSH_PVT_KEY {
     byte* key;
         /* List of pointers to raw private keys. Owned by CTX. */
+    WOLFSSH_HOST_KEY* hostKeys;
+        /* Decoded copies of key not in use by a handshake. Owned by CTX. */
+    word32 hostKeyGen;
+        /* Counts changes to key, copies of an older key are dropped. */
     word32 keySz;
 #ifdef WOLFSSH_CERTS
     byte* cert;
@@ -521,6 +662,18 @@ typedef struct WOLFSSH_PVT_KEY {
 } WOLFSSH_PVT_KEY;
 
 
+/* Pre-generated single-use ephemeral key pair for the server side of a
+ * key exchange. Owned by the CTX's pool until taken by a handshake. */
+typedef struct WOLFSSH_KEX_KEY {
+    struct WOLFSSH_KEX_KEY* next;
+    byte priv[MAX_KEX_KEY_SZ];
+    byte pub[MAX_KEX_KEY_SZ];
+    word32 privSz;
+    word32 pubSz;
+    byte kexId;
+} WOLFSSH_KEX_KEY;
+
+
 /* our wolfSSH Context */
 struct WOLFSSH_CTX {
     void* heap;                       /* heap hint */
@@ -541,6 +694,7 @@ struct WOLFSSH_CTX {
     WS_CallbackChannelReq channelReqSubsysCb; /* Channel Request "Subsystem" */
     WS_CallbackChannelEof channelEofCb; /* Channel Eof Callback */
     WS_CallbackChannelClose channelCloseCb; /* Channel Close Callback */
+    WS_CallbackChannelData channelDataCb; /* Channel Data Callback */
 #ifdef WOLFSSH_SCP
     WS_CallbackScpRecv scpRecvCb;     /* SCP receive callback */
     WS_CallbackScpSend scpSendCb;     /* SCP send callback */
@@ -558,11 +712,24 @@ struct WOLFSSH_CTX {
 #endif /* WOLFSSH_CERTS */
     WS_CallbackPublicKeyCheck publicKeyCheckCb;
         /* Check server's public key callback */
+    WS_CallbackSignOffload signOffloadCb; /* Host key signature offload */
     WOLFSSH_PVT_KEY privateKey[WOLFSSH_MAX_PVT_KEYS];
     word32 privateKeyCount;
+    WOLFSSH_KEX_KEY* kexKeyPool;      /* pre-generated ephemeral keys */
+    word32 kexKeyPoolSz;              /* target pool depth per KEX algo */
+#ifndef SINGLE_THREADED
+    wolfSSL_Mutex kexKeyPoolMutex;
+    wolfSSL_Mutex hostKeyMutex;       /* guards privateKey[].hostKeys */
+    wolfSSL_Mutex windowMutex;        /* guards windowGrownSz */
+#endif
     byte publicKeyAlgo[WOLFSSH_MAX_PUB_KEY_ALGO];
     word32 publicKeyAlgoCount;
-    word32 highwaterMark;
+    word64 highwaterMark;
+    word64 rekeyPackets;              /* rekey policy, 0 for the default */
+    word32 rekeySeconds;              /* rekey policy, 0 for no limit */
+    byte channelSched;                /* schedule channel output */
+    WS_RateLimit sessionRate;         /* each session's limit */
+    WS_RateLimit channelRate;         /* each channel's limit */
     const char* banner;
     const char* sshProtoIdStr;
     const char* algoListKex;
@@ -570,11 +737,21 @@ struct WOLFSSH_CTX {
     const char* algoListCipher;
     const char* algoListMac;
     const char* algoListKeyAccepted;
+    byte* kexInitBody;                /* KEXINIT after the cookie */
+    word32 kexInitBodySz;
     word32 bannerSz;
     word32 windowSz;
     word32 maxPacketSz;
+    word32 maxWindowSz;               /* window auto-tune ceiling */
+    word32 windowBudgetSz;            /* auto-tune total for all sessions */
+    word32 windowGrownSz;             /* auto-tuning held by all sessions */
+    word32 readAheadSz;               /* max bytes to read ahead */
+    word32 bufferRetainSz;            /* transport buffer retain size */
+    int devId;                        /* wolfCrypt device for crypto CBs */
     byte side;                        /* client or server */
     byte showBanner;
+    byte kexGuess;                    /* client sends a guessed KEX init */
+    byte connectPipeline;             /* first userauth to pipeline, or 0 */
 #ifdef WOLFSSH_AGENT
     byte agentEnabled;
 #endif /* WOLFSSH_AGENT */
@@ -588,28 +765,49 @@ struct WOLFSSH_CTX {
 
 typedef struct Ciphers {
     Aes aes;
+#ifndef WOLFSSH_NO_CHACHA20_POLY1305
+    ChaCha chacha;       /* K_2, payload and Poly1305 key */
+    ChaCha chachaHeader; /* K_1, packet length */
+#endif
+    Hmac hmac; /* Keyed once at NEWKEYS, reused for every packet. */
 } Ciphers;
 
 
 typedef struct Keys {
     byte iv[AES_BLOCK_SIZE];
     byte ivSz;
-    byte encKey[AES_256_KEY_SIZE];
+    byte encKey[MAX_ENC_KEY_SZ];
     byte encKeySz;
     byte macKey[MAX_HMAC_SZ];
     byte macKeySz;
 } Keys;
 
 
+/* Token bucket, refilled by the millisecond from WTIME_MS(). */
+typedef struct TokenBucket {
+    word64 last;   /* WTIME_MS() of the last refill */
+    word32 rate;   /* bytes per second, 0 for no limit */
+    word32 burst;  /* most bytes held */
+    word32 tokens; /* bytes that may pass now */
+} TokenBucket;
+
+
+/* Server's KEXDH reply held while the signature of H is offloaded. */
+typedef struct WOLFSSH_KEX_REPLY WOLFSSH_KEX_REPLY;
+
+
 typedef struct HandshakeInfo {
     byte kexId;
-    byte kexIdGuess;
     byte kexHashId;
     byte pubKeyId;
     byte encryptId;
     byte macId;
     byte kexPacketFollows;
+    byte kexPacketSkip;   /* drop the peer's wrongly guessed KEX packet */
+    byte kexGuess;        /* our KEX init was sent with the KEXINIT */
+    byte kexGuessMatch;   /* both sides prefer the same KEX and key algo */
     byte aeadMode;
+    byte etmMode;
 
     byte blockSz;
     byte macSz;
@@ -707,9 +905,17 @@ struct WOLFSSH {
     void* ioWriteCtx;      /* I/O Write Context handle */
     int rflags;            /* optional read  flags */
     int wflags;            /* optional write flags */
-    word32 txCount;
-    word32 rxCount;
-    word32 highwaterMark;
+    word64 txCount;        /* bytes sent with the current keys */
+    word64 rxCount;        /* bytes received with the current keys */
+    word64 txPacketCount;  /* packets sent with the current keys */
+    word64 rxPacketCount;  /* packets received with the current keys */
+    word64 highwaterMark;
+    word64 rekeyPackets;   /* packet limit per key, 0 for the default */
+    word32 rekeySeconds;   /* key lifetime, 0 for no limit */
+    word64 keyTime;        /* when the current keys went into use */
+    word32 readAheadSz;    /* max bytes to read ahead of the current packet */
+    word32 corkSz;         /* when corked, pending bytes that force a write */
+    int devId;             /* wolfCrypt device, defaults to the CTX's */
     byte highwaterFlag;    /* Set when highwater CB called */
     void* highwaterCtx;    /* Highwater CB context */
     void* globalReqCtx;    /* Global Request CB context */
@@ -719,6 +925,7 @@ struct WOLFSSH {
     void* channelReqCtx;   /* Channel Request CB context */
     void* channelEofCtx;   /* Channel EOF CB context */
     void* channelCloseCtx; /* Channel Close CB context */
+    void* channelDataCtx;  /* Channel Data CB context */
     void* fs;              /* File system handle */
     word32 curSz;
     word32 seq;
@@ -735,6 +942,13 @@ struct WOLFSSH {
     byte serverState;
     byte processReplyState;
     byte isKeying;
+    byte isCorked;         /* hold sealed packets in outputBuffer */
+    byte kexGuess;         /* send a guessed KEX init with the KEXINIT */
+    byte connectPipeline;  /* first userauth to send behind NEWKEYS, or 0 */
+    byte connectPipelined; /* service and userauth requests already sent */
+    byte isQueueing;       /* hold every packet, even KEX, in outputBuffer */
+    byte channelSched;     /* channel data waits for the scheduler */
+    byte rateLimited;      /* a rate limit was set on the session */
     byte authId;           /* if using public key or password */
     byte supportedAuth[4]; /* supported auth IDs public key , password */
 
@@ -787,11 +1001,13 @@ struct WOLFSSH {
     byte macId;
     byte macSz;
     byte aeadMode;
+    byte etmMode;
     byte peerBlockSz;
     byte peerEncryptId;
     byte peerMacId;
     byte peerMacSz;
     byte peerAeadMode;
+    byte peerEtmMode;
 #ifndef WOLFSSH_NO_DH
     word32 primeGroupSz;
 #endif
@@ -801,7 +1017,11 @@ struct WOLFSSH {
 
     word32 nextChannel;
     WOLFSSH_CHANNEL* channelList;
+    WOLFSSH_CHANNEL* channelListTail;
     word32 channelListSz;
+    word32 windowGrownSz;         /* auto-tuning added to channel windows */
+    WOLFSSH_CHANNEL** channelHash; /* buckets by self ID, then by peer ID */
+    word32 channelHashSz;          /* buckets in each of the two tables */
     word32 defaultPeerChannelId;
     word32 connectChannelId;
     byte channelName[WOLFSSH_MAX_CHN_NAMESZ];
@@ -811,7 +1031,18 @@ struct WOLFSSH {
     WOLFSSH_BUFFER inputBuffer;
     WOLFSSH_BUFFER outputBuffer;
     WOLFSSH_BUFFER extDataBuffer; /* extended data ready to be read */
+    WOLFSSH_BUFFER rekeyQueue;    /* channel data payloads held during KEX */
+    WOLFSSH_CHANNEL* schedLatency; /* ring of latency channels with data */
+    WOLFSSH_CHANNEL* schedBulk;   /* ring of bulk channels with data */
+    word32 schedQueuedSz;         /* bytes in all the channels' txQueue */
+    TokenBucket txRate;           /* session's send limit */
+    TokenBucket rxRate;           /* session's receive limit */
+    WS_RateLimit channelRate;     /* limit for new channels */
     WC_RNG* rng;
+#if WOLFSSH_PAD_POOL_SZ > 0
+    byte padPool[WOLFSSH_PAD_POOL_SZ]; /* random bytes for packet padding */
+    word32 padPoolIdx;            /* next unused byte in padPool */
+#endif
 
     byte h[WC_MAX_DIGEST_SIZE];
     word32 hSz;
@@ -826,6 +1057,7 @@ struct WOLFSSH {
 
     void* userAuthCtx;
     void* userAuthResultCtx;
+    void* signOffloadCtx;
 #ifdef WOLFSSH_KEYBOARD_INTERACTIVE
     void* keyboardAuthCtx;
 #endif
@@ -933,12 +1165,26 @@ struct WOLFSSH_CHANNEL {
     byte eofRxd : 1;
     byte eofTxd : 1;
     byte openConfirmed : 1;
+    byte inList : 1;       /* in the session's channel list and tables */
+    byte peerHashed : 1;   /* in the table by peer ID */
+    byte schedLinked : 1;  /* in one of the session's scheduler rings */
+    byte schedTurn : 1;    /* got its quantum for the current DRR turn */
+    byte internalData : 1; /* data is read by wolfSSH's SFTP or SCP code */
+    byte schedPrio;        /* WOLFSSH_CHANNEL_PRIO_* */
+    word32 schedWeight;    /* bulk class share, in quanta per round */
+    word32 schedDeficit;   /* DRR bytes left for the current turn */
     word32 channel;
     word32 windowSz;
+    word32 windowFullSz;   /* window with no data buffered, inputBuffer max */
+    word32 windowGrownSz;  /* added to windowFullSz by auto-tuning */
     word32 maxPacketSz;
     word32 peerChannel;
     word32 peerWindowSz;
     word32 peerMaxPacketSz;
+    word32 windowConsumed; /* taken by the application, not yet adjusted */
+    TokenBucket txRate;
+    TokenBucket rxRate;
+    byte txRateHeld;       /* the last send found no send credit */
 #ifdef WOLFSSH_FWD
     char* host;
     word32 hostPort;
@@ -948,14 +1194,29 @@ struct WOLFSSH_CHANNEL {
     int isDirect;
 #endif /* WOLFSSH_FWD */
     WOLFSSH_BUFFER inputBuffer;
+    WOLFSSH_BUFFER txQueue; /* data waiting for the scheduler */
     char* command;
     struct WOLFSSH* ssh;
     struct WOLFSSH_CHANNEL* next;
+    struct WOLFSSH_CHANNEL* prev;
+    struct WOLFSSH_CHANNEL* selfHashNext; /* bucket chain by self ID */
+    struct WOLFSSH_CHANNEL* peerHashNext; /* bucket chain by peer ID */
+    struct WOLFSSH_CHANNEL* schedNext;    /* scheduler ring */
 };
 
 
 WOLFSSH_LOCAL WOLFSSH_CTX* CtxInit(WOLFSSH_CTX*, byte, void*);
 WOLFSSH_LOCAL void CtxResourceFree(WOLFSSH_CTX*);
+WOLFSSH_LOCAL int CtxKexKeyPoolFill(WOLFSSH_CTX*);
+WOLFSSH_LOCAL int CtxKexKeyPoolSetSize(WOLFSSH_CTX*, word32);
+WOLFSSH_LOCAL void CtxKexKeyPoolFree(WOLFSSH_CTX*);
+WOLFSSH_LOCAL int CtxWindowSetBudget(WOLFSSH_CTX*, word32);
+WOLFSSH_LOCAL word32 CtxWindowGrown(WOLFSSH_CTX*);
+WOLFSSH_LOCAL void HostKeyFree(WOLFSSH_HOST_KEY*, void*);
+WOLFSSH_LOCAL void CtxSetDevId(WOLFSSH_CTX*, int);
+WOLFSSH_LOCAL int CtxKexInitRefresh(WOLFSSH_CTX*);
+WOLFSSH_LOCAL int KexReplySign(WOLFSSH*);
+WOLFSSH_LOCAL void KexReplyFree(WOLFSSH_KEX_REPLY*, void*);
 WOLFSSH_LOCAL WOLFSSH* SshInit(WOLFSSH*, WOLFSSH_CTX*);
 WOLFSSH_LOCAL void SshResourceFree(WOLFSSH*, void*);
 
@@ -968,6 +1229,9 @@ WOLFSSH_LOCAL void ChannelDelete(WOLFSSH_CHANNEL*, void*);
 WOLFSSH_LOCAL WOLFSSH_CHANNEL* ChannelFind(WOLFSSH*, word32, byte);
 WOLFSSH_LOCAL int ChannelRemove(WOLFSSH*, word32, byte);
 WOLFSSH_LOCAL int ChannelPutData(WOLFSSH_CHANNEL*, byte*, word32);
+WOLFSSH_LOCAL void ChannelSetCommand(WOLFSSH_CHANNEL*, byte,
+        const char*, word32);
+WOLFSSH_LOCAL int ChannelGrowWindow(WOLFSSH_CHANNEL*, word32);
 WOLFSSH_LOCAL int wolfSSH_ProcessBuffer(WOLFSSH_CTX*,
                                         const byte*, word32,
                                         int, int);
@@ -1040,6 +1304,7 @@ enum ChannelOpenFailReasons {
 };
 
 WOLFSSH_LOCAL int DoReceive(WOLFSSH*);
+WOLFSSH_LOCAL int HaveInputPacket(WOLFSSH*);
 WOLFSSH_LOCAL int DoProtoId(WOLFSSH*);
 WOLFSSH_LOCAL int wolfSSH_SendPacket(WOLFSSH*);
 WOLFSSH_LOCAL int SendProtoId(WOLFSSH*);
@@ -1056,6 +1321,9 @@ WOLFSSH_LOCAL int SendGlobalRequestFwdSuccess(WOLFSSH *, int, word32);
 WOLFSSH_LOCAL int SendGlobalRequest(WOLFSSH *, const unsigned char *, word32, int);
 WOLFSSH_LOCAL int SendDebug(WOLFSSH*, byte, const char*);
 WOLFSSH_LOCAL int SendServiceRequest(WOLFSSH*, byte);
+#ifdef WOLFSSH_AGENT
+WOLFSSH_LOCAL void ClientAgentNew(WOLFSSH*);
+#endif
 WOLFSSH_LOCAL int SendServiceAccept(WOLFSSH*, byte);
 WOLFSSH_LOCAL int SendExtInfo(WOLFSSH* ssh);
 WOLFSSH_LOCAL int SendUserAuthRequest(WOLFSSH*, byte, int);
@@ -1080,6 +1348,13 @@ WOLFSSH_LOCAL int SendChannelClose(WOLFSSH*, word32);
 WOLFSSH_LOCAL int SendChannelExit(WOLFSSH*, word32, int);
 WOLFSSH_LOCAL int SendChannelData(WOLFSSH*, word32, byte*, word32);
 WOLFSSH_LOCAL int SendChannelExtendedData(WOLFSSH*, word32, byte*, word32);
+WOLFSSH_LOCAL int SendQueuedChannelData(WOLFSSH*);
+WOLFSSH_LOCAL int SendScheduledChannelData(WOLFSSH*);
+WOLFSSH_LOCAL void RateLimitInit(TokenBucket*, TokenBucket*,
+        const WS_RateLimit*);
+WOLFSSH_LOCAL word32 ChannelRateGrant(WOLFSSH_CHANNEL*, word32);
+WOLFSSH_LOCAL int ChannelRateRelease(WOLFSSH*);
+WOLFSSH_LOCAL word32 RateLimitWait(WOLFSSH*);
 WOLFSSH_LOCAL int SendChannelWindowAdjust(WOLFSSH*, word32, word32);
 WOLFSSH_LOCAL int SendChannelRequest(WOLFSSH*, byte*, word32);
 WOLFSSH_LOCAL int SendChannelTerminalResize(WOLFSSH*, word32, word32, word32,
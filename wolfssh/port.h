@@ -616,6 +616,29 @@ extern "C" {
     #define WLOCALTIME(c,r) (localtime_r((c),(r))!=NULL)
 #endif
 
+/* milliseconds from a clock that does not jump, for the rate limits. Define
+ * WTIME_MS to the platform's own clock; without one it counts WTIME()
+ * seconds. */
+#ifndef WTIME_MS
+    #if defined(USE_WINDOWS_API)
+        #define WTIME_MS() ((word64)GetTickCount64())
+    #elif defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)
+        #include <time.h>
+        static inline word64 wTimeMs(void)
+        {
+            struct timespec ts;
+
+            if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+                return (word64)WTIME(NULL) * 1000;
+
+            return (word64)ts.tv_sec * 1000 + (word64)ts.tv_nsec / 1000000;
+        }
+        #define WTIME_MS() wTimeMs()
+    #else
+        #define WTIME_MS() ((word64)WTIME(NULL) * 1000)
+    #endif
+#endif
+
 #ifndef WOLFSSH_SFTP_DELIM
     /* Delimiter's used between two SFTP peers should be the same regardless of
      * operating system. WS_DELIM defined elsewhere is OS specific delimiter. */
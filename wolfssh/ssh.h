@@ -69,6 +69,7 @@ WOLFSSH_API WOLFSSH* wolfSSH_new(WOLFSSH_CTX*);
 WOLFSSH_API void wolfSSH_free(WOLFSSH*);
 
 WOLFSSH_API int wolfSSH_worker(WOLFSSH*, word32*);
+WOLFSSH_API int wolfSSH_worker_ex(WOLFSSH*, word32*, word32*);
 WOLFSSH_API int wolfSSH_GetLastRxId(WOLFSSH*, word32*);
 
 WOLFSSH_API int wolfSSH_set_fd(WOLFSSH*, WS_SOCKET_T);
@@ -87,6 +88,93 @@ WOLFSSH_API void wolfSSH_SetHighwaterCb(WOLFSSH_CTX*, word32,
 WOLFSSH_API void wolfSSH_SetHighwaterCtx(WOLFSSH*, void*);
 WOLFSSH_API void* wolfSSH_GetHighwaterCtx(WOLFSSH*);
 
+/* rekey policy, reaching any limit calls the high water callback */
+typedef struct WS_RekeyPolicy {
+    word64 bytes;   /* bytes either way per key, 0 for no limit */
+    word64 packets; /* packets either way per key, 0 for 2^31 */
+    word32 seconds; /* key lifetime, 0 for no limit */
+} WS_RekeyPolicy;
+
+WOLFSSH_API int wolfSSH_CTX_SetRekeyPolicy(WOLFSSH_CTX*,
+                                           const WS_RekeyPolicy*);
+WOLFSSH_API int wolfSSH_SetRekeyPolicy(WOLFSSH*, const WS_RekeyPolicy*);
+WOLFSSH_API int wolfSSH_GetRekeyPolicy(WOLFSSH*, WS_RekeyPolicy*);
+
+/* receive read-ahead functions, 0 disables read-ahead */
+WOLFSSH_API int wolfSSH_CTX_SetReadAhead(WOLFSSH_CTX*, word32);
+WOLFSSH_API int wolfSSH_SetReadAhead(WOLFSSH*, word32);
+WOLFSSH_API word32 wolfSSH_GetReadAhead(WOLFSSH*);
+
+/* batched send functions */
+WOLFSSH_API int wolfSSH_Cork(WOLFSSH*);
+WOLFSSH_API int wolfSSH_Uncork(WOLFSSH*);
+WOLFSSH_API int wolfSSH_SetCorkSize(WOLFSSH*, word32);
+
+/* server ephemeral KEX key pool functions, 0 disables the pool */
+WOLFSSH_API int wolfSSH_CTX_SetKexKeyPool(WOLFSSH_CTX*, word32);
+WOLFSSH_API int wolfSSH_CTX_FillKexKeyPool(WOLFSSH_CTX*);
+
+/* server host key signature offload functions. The callback hands the
+ * session to a worker thread, which calls wolfSSH_SignOffload(), and returns
+ * WS_SUCCESS; anything else signs in line. Until the worker is done,
+ * wolfSSH_accept(), or during a re-key wolfSSH_worker() and the stream
+ * functions, fail with the error WS_WANT_CRYPTO. The session's thread may
+ * keep calling them meanwhile, they only check whether the worker is done;
+ * nothing else may use or free the session. */
+typedef int (*WS_CallbackSignOffload)(WOLFSSH*, void*);
+WOLFSSH_API void wolfSSH_CTX_SetSignOffloadCb(WOLFSSH_CTX*,
+                                              WS_CallbackSignOffload);
+WOLFSSH_API void wolfSSH_SetSignOffloadCtx(WOLFSSH*, void*);
+WOLFSSH_API void* wolfSSH_GetSignOffloadCtx(WOLFSSH*);
+WOLFSSH_API int wolfSSH_SignOffload(WOLFSSH*);
+
+/* wolfCrypt device ID functions, INVALID_DEVID keeps crypto in software */
+WOLFSSH_API int wolfSSH_CTX_SetDevId(WOLFSSH_CTX*, int);
+WOLFSSH_API int wolfSSH_SetDevId(WOLFSSH*, int);
+WOLFSSH_API int wolfSSH_GetDevId(WOLFSSH*);
+
+/* client guessed KEX init functions, saves a round trip when the server
+ * prefers the same KEX and host key algorithms */
+WOLFSSH_API int wolfSSH_CTX_SetKexGuess(WOLFSSH_CTX*, byte);
+WOLFSSH_API int wolfSSH_SetKexGuess(WOLFSSH*, byte);
+
+/* client pipelined connect functions, takes the first userauth type to send
+ * with the NEWKEYS, WOLFSSH_USERAUTH_NONE, _PASSWORD, or _PUBLICKEY, or 0
+ * to turn pipelining off */
+WOLFSSH_API int wolfSSH_CTX_SetConnectPipeline(WOLFSSH_CTX*, byte);
+WOLFSSH_API int wolfSSH_SetConnectPipeline(WOLFSSH*, byte);
+
+/* channel output scheduler functions. When on, channel data that cannot go
+ * out right away waits in its channel, and the session sends the latency
+ * class channels first, up to part of each burst while bulk data waits,
+ * and shares the rest among the bulk channels by deficit round robin,
+ * weighted with wolfSSH_ChannelSetPriority(). */
+WOLFSSH_API int wolfSSH_CTX_SetChannelScheduler(WOLFSSH_CTX*, byte);
+WOLFSSH_API int wolfSSH_SetChannelScheduler(WOLFSSH*, byte);
+
+/* bandwidth shaping, token buckets in bytes per second of channel data,
+ * 0 for no limit. Sends over the limit get WS_WINDOW_FULL, received data
+ * over the limit is held back by delaying the window adjusts. */
+typedef struct WS_RateLimit {
+    word32 txRate; /* channel data sent */
+    word32 rxRate; /* channel data received */
+    word32 burst;  /* bucket depth, 0 for a second at the rate */
+} WS_RateLimit;
+
+/* Takes the limit for the whole session and the one for each of its new
+ * channels, NULL for no limit. */
+WOLFSSH_API int wolfSSH_CTX_SetRateLimit(WOLFSSH_CTX*,
+        const WS_RateLimit*, const WS_RateLimit*);
+WOLFSSH_API int wolfSSH_SetRateLimit(WOLFSSH*,
+        const WS_RateLimit*, const WS_RateLimit*);
+
+/* Milliseconds until the limits let held back data move, for the timeout
+ * of the application's select() or poll(); call wolfSSH_worker(), or retry
+ * the read or send, then. WOLFSSH_RATE_NO_WAIT when nothing is held
+ * back. */
+#define WOLFSSH_RATE_NO_WAIT 0xFFFFFFFFU
+WOLFSSH_API word32 wolfSSH_GetRateLimitWait(WOLFSSH*);
+
 WOLFSSH_API int wolfSSH_ReadKey_buffer_ex(const byte* in, word32 inSz, int format,
         byte** out, word32* outSz, const byte** outType, word32* outTypeSz,
         int isPrivate, void* heap);
@@ -181,6 +269,14 @@ typedef enum {
     WOLFSSH_SESSION_TERMINAL,
 } WS_SessionType;
 
+/* Channel output classes. AUTO puts shell and terminal sessions in the
+ * latency class and everything else in the bulk class. */
+enum WS_ChannelPriority {
+    WOLFSSH_CHANNEL_PRIO_AUTO = 0,
+    WOLFSSH_CHANNEL_PRIO_BULK,
+    WOLFSSH_CHANNEL_PRIO_LATENCY,
+};
+
 
 typedef enum WS_FwdCbAction {
     WOLFSSH_FWD_LOCAL_SETUP,
@@ -233,6 +329,9 @@ WOLFSSH_API WS_SessionType wolfSSH_ChannelGetSessionType(
         const WOLFSSH_CHANNEL* channel);
 WOLFSSH_API const char* wolfSSH_ChannelGetSessionCommand(
         const WOLFSSH_CHANNEL* channel);
+WOLFSSH_API int wolfSSH_ChannelSetPriority(WOLFSSH_CHANNEL*, byte, word32);
+WOLFSSH_API int wolfSSH_ChannelSetRateLimit(WOLFSSH_CHANNEL*,
+        const WS_RateLimit*);
 
 /* Channel callbacks */
 typedef int (*WS_CallbackChannelOpen)(WOLFSSH_CHANNEL* channel, void* ctx);
@@ -265,6 +364,13 @@ WOLFSSH_API int wolfSSH_CTX_SetChannelCloseCb(WOLFSSH_CTX* ctx,
 WOLFSSH_API int wolfSSH_SetChannelCloseCtx(WOLFSSH* ssh, void* ctx);
 WOLFSSH_API void* wolfSSH_GetChannelCloseCtx(WOLFSSH* ssh);
 
+typedef int (*WS_CallbackChannelData)(WOLFSSH_CHANNEL* channel,
+        const byte* data, word32 dataSz, void* ctx);
+WOLFSSH_API int wolfSSH_CTX_SetChannelDataCb(WOLFSSH_CTX* ctx,
+        WS_CallbackChannelData cb);
+WOLFSSH_API int wolfSSH_SetChannelDataCtx(WOLFSSH* ssh, void* ctx);
+WOLFSSH_API void* wolfSSH_GetChannelDataCtx(WOLFSSH* ssh);
+
 WOLFSSH_API int wolfSSH_get_error(const WOLFSSH*);
 WOLFSSH_API const char* wolfSSH_get_error_name(const WOLFSSH*);
 WOLFSSH_API const char* wolfSSH_ErrorToName(int);
@@ -398,6 +504,11 @@ WOLFSSH_API int wolfSSH_CTX_UsePrivateKey_buffer(WOLFSSH_CTX*,
             const byte* cert, word32 certSz, int format);
 #endif /* WOLFSSH_CERTS */
 WOLFSSH_API int wolfSSH_CTX_SetWindowPacketSize(WOLFSSH_CTX*, word32, word32);
+WOLFSSH_API int wolfSSH_CTX_SetWindowAutoTune(WOLFSSH_CTX*, word32);
+WOLFSSH_API int wolfSSH_CTX_SetWindowBudget(WOLFSSH_CTX*, word32);
+WOLFSSH_API word32 wolfSSH_CTX_GetWindowGrown(WOLFSSH_CTX*);
+/* Drained transport buffers larger than this are released, 0 keeps them. */
+WOLFSSH_API int wolfSSH_CTX_SetBufferRetain(WOLFSSH_CTX*, word32);
 
 WOLFSSH_API int wolfSSH_accept(WOLFSSH*);
 WOLFSSH_API int wolfSSH_connect(WOLFSSH*);
@@ -417,6 +528,8 @@ WOLFSSH_API int wolfSSH_ChannelIdSend(WOLFSSH*, word32, byte*, word32);
 
 WOLFSSH_API void wolfSSH_GetStats(WOLFSSH*,
                                   word32*, word32*, word32*, word32*);
+WOLFSSH_API void wolfSSH_GetStats_ex(WOLFSSH*,
+                                     word64*, word64*, word64*, word64*);
 
 WOLFSSH_API int wolfSSH_KDF(byte, byte, byte*, word32, const byte*, word32,
                             const byte*, word32, const byte*, word32);
@@ -750,13 +750,19 @@ static INLINE int wSelect(int nfds, WFD_SET_TYPE* recvfds,
 #endif
 }
 
-static INLINE int tcp_select(SOCKET_T socketfd, int to_sec)
+/* Like tcp_select(), with the timeout in milliseconds. */
+static INLINE int tcp_select_ms(SOCKET_T socketfd, int to_ms)
 {
     WFD_SET_TYPE recvfds, errfds;
     int nfds = (int)socketfd + 1;
-    struct timeval timeout = {(to_sec > 0) ? to_sec : 0, 100};
+    struct timeval timeout;
     int result;
 
+    if (to_ms < 0)
+        to_ms = 0;
+    timeout.tv_sec = to_ms / 1000;
+    timeout.tv_usec = (to_ms % 1000) * 1000 + 100;
+
     WFD_ZERO(&recvfds);
     WFD_SET(socketfd, &recvfds);
     WFD_ZERO(&errfds);
@@ -776,6 +782,11 @@ static INLINE int tcp_select(SOCKET_T socketfd, int to_sec)
     return WS_SELECT_FAIL;
 }
 
+static INLINE int tcp_select(SOCKET_T socketfd, int to_sec)
+{
+    return tcp_select_ms(socketfd, (to_sec > 0) ? to_sec * 1000 : 0);
+}
+
 #endif /* WOLFSSH_TEST_SERVER || WOLFSSH_TEST_CLIENT */
 
 